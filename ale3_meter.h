@@ -15,6 +15,8 @@
 #include <condition_variable>
 #include <configuration.h>
 #include <simulator.h>
+#include <vector>
+#include <string>
 
 namespace powermeter {
 
@@ -27,19 +29,74 @@ protected:
 
 	// the connection
 	modbus_t		*_mb;
+	void	connect();
+	void	disconnect();
+	virtual void	reconnect();
 
 	// reimplement the integration method
 	virtual message	integrate();
+	virtual void	finalize(message& result, float factor);
 public:
 	ale3_meter(const configuration& config, messagequeue& queue);
 	~ale3_meter();
+	static std::vector<std::string>	fieldnames(
+		const configuration& config);
 private:
 	simulator	sim;
 	void	read(unsigned short *registers);
+	void	replayregisters(unsigned short *registers);
 public:
 	static bool	simulate;
 };
 
 } // namespace powermeter
 
+// register map of the ALE3 meter
+#define	ALE3_FIRMWARE_VERSION		1
+#define	ALE3_NUMBER_OF_REGISTERS	2
+#define	ALE3_NUMBER_OF_FLAGS		3
+#define	ALE3_BAUDRATE_HIGH		4
+#define	ALE3_BAUDRATE_LOW		5
+#define	ALE3_ASN1			7
+#define	ALE3_ASN2			8
+#define	ALE3_ASN3			9
+#define	ALE3_ASN4			10
+#define	ALE3_ASN5			11
+#define	ALE3_ASN6			12
+#define	ALE3_ASN7			13
+#define	ALE3_ASN8			14
+#define	ALE3_HW_VERSION			15
+#define	ALE3_SERIAL_LOW			16
+#define	ALE3_SERIAL_HIGH		17
+#define	ALE3_STATUS			22
+#define	ALE3_RESPONSE_TIMEOUT		23
+#define	ALE3_MODBUS_ADDRESS		24
+#define	ALE3_ERROR			25
+#define	ALE3_TARIFF			27
+#define	ALE3_TOTAL_TARIFF1_HIGH		28
+#define	ALE3_TOTAL_TARIFF1_LOW		29
+#define	ALE3_PARTIAL_TARIFF1_HIGH	30
+#define	ALE3_PARTIAL_TARIFF1_LOW	31
+#define	ALE3_TOTAL_TARIFF2_HIGH		32
+#define	ALE3_TOTAL_TARIFF2_LOW		33
+#define	ALE3_PARTIAL_TARIFF2_HIGH	34
+#define	ALE3_PARTIAL_TARIFF2_LOW	35
+#define	ALE3_URMS_PHASE1		36
+#define	ALE3_IRMS_PHASE1		37
+#define	ALE3_PRMS_PHASE1		38
+#define	ALE3_QRMS_PHASE1		39
+#define	ALE3_COSPHI_PHASE1		40
+#define	ALE3_URMS_PHASE2		41
+#define	ALE3_IRMS_PHASE2		42
+#define	ALE3_PRMS_PHASE2		43
+#define	ALE3_QRMS_PHASE2		44
+#define	ALE3_COSPHI_PHASE2		45
+#define	ALE3_URMS_PHASE3		46
+#define	ALE3_IRMS_PHASE3		47
+#define	ALE3_PRMS_PHASE3		48
+#define	ALE3_QRMS_PHASE3		49
+#define	ALE3_COSPHI_PHASE3		50
+#define	ALE3_PRMS_TOTAL			51
+#define	ALE3_QRMS_TOTAL			52
+
 #endif /* _ale3_meter_h */
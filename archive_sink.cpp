@@ -0,0 +1,203 @@
+//
+// archive_sink.cpp
+//
+// Format of the name record:   'N', index (2), length (1), name
+// Format of the message record: 'M', timekey (8), count (2),
+//                               count times (index (2), value (4))
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <archive_sink.h>
+#include <debug.h>
+#include <format.h>
+#include <stdexcept>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace powermeter {
+
+static const char	magic[8] = { 'P', 'M', 'A', 'R', 'C', '0', '1', '\n' };
+
+static void	put(std::vector<unsigned char>& b, uint64_t value, int bytes) {
+	for (int i = 0; i < bytes; i++) {
+		b.push_back(value & 0xff);
+		value >>= 8;
+	}
+}
+
+static uint64_t	get(const unsigned char *p, int bytes) {
+	uint64_t	result = 0;
+	for (int i = bytes - 1; i >= 0; i--) {
+		result = (result << 8) | p[i];
+	}
+	return result;
+}
+
+/**
+ * \brief Open the archive for appending
+ *
+ * \param config	the configuration, the file name is in archivefile
+ */
+archive_sink::archive_sink(const configuration& config)
+	: sink("archive"),
+	  _filename(config.stringvalue("archivefile", "powermeter.pma")) {
+	_fd = open(_filename.c_str(), O_CREAT | O_RDWR, 0666);
+	if (_fd < 0) {
+		std::string	msg = stringprintf("cannot open archive %s: %s",
+			_filename.c_str(), strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	try {
+		scan();
+	} catch (...) {
+		close(_fd);
+		throw;
+	}
+}
+
+/**
+ * \brief Close the archive
+ */
+archive_sink::~archive_sink() {
+	close(_fd);
+}
+
+/**
+ * \brief Read the names already defined in the archive
+ *
+ * An empty file gets the magic string. A truncated record at the end
+ * of an existing archive, left by a crash, is cut off so that new
+ * records are appended after the last complete one.
+ */
+void	archive_sink::scan() {
+	struct stat	sb;
+	if (fstat(_fd, &sb) < 0) {
+		throw std::runtime_error("cannot stat archive");
+	}
+	if (sb.st_size == 0) {
+		if (write(_fd, magic, sizeof(magic)) != sizeof(magic)) {
+			std::string	msg = stringprintf("cannot write archive "
+				"header: %s", strerror(errno));
+			debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+			throw std::runtime_error(msg);
+		}
+		return;
+	}
+
+	// read the complete archive
+	std::vector<unsigned char>	data(sb.st_size);
+	if (pread(_fd, data.data(), data.size(), 0) != (ssize_t)data.size()) {
+		throw std::runtime_error("cannot read archive");
+	}
+	if ((data.size() < sizeof(magic))
+		|| (0 != memcmp(data.data(), magic, sizeof(magic)))) {
+		std::string	msg = stringprintf("%s is not an archive",
+			_filename.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+
+	// go through the records
+	size_t	offset = sizeof(magic);
+	while (offset < data.size()) {
+		const unsigned char	*p = data.data() + offset;
+		size_t	remaining = data.size() - offset;
+		size_t	length = 0;
+		if ((p[0] == 'N') && (remaining >= 4)) {
+			length = 4 + p[3];
+			if (length <= remaining) {
+				_names[std::string((const char *)p + 4, p[3])]
+					= get(p + 1, 2);
+			}
+		} else if ((p[0] == 'M') && (remaining >= 11)) {
+			length = 11 + 6 * get(p + 9, 2);
+		} else if ((p[0] != 'N') && (p[0] != 'M')) {
+			std::string	msg = stringprintf("bad record in %s "
+				"at offset %lu", _filename.c_str(), offset);
+			debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+			throw std::runtime_error(msg);
+		}
+		if ((length == 0) || (length > remaining)) {
+			break;
+		}
+		offset += length;
+	}
+	if (offset < data.size()) {
+		debug(LOG_WARNING, DEBUG_LOG, 0, "truncating incomplete record "
+			"at offset %lu in %s", offset, _filename.c_str());
+		if (ftruncate(_fd, offset) < 0) {
+			throw std::runtime_error("cannot truncate archive");
+		}
+	}
+	lseek(_fd, offset, SEEK_SET);
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "archive %s has %lu names",
+		_filename.c_str(), _names.size());
+}
+
+/**
+ * \brief Append a message to the archive
+ *
+ * Name records for new names and the message record are written with
+ * a single write call.
+ *
+ * \param m	the message to append
+ */
+void	archive_sink::store(const message& m) {
+	std::vector<unsigned char>	buffer;
+	std::vector<unsigned short>	indices;
+	std::map<std::string, unsigned short>	added;
+	for (auto i = m.begin(); i != m.end(); i++) {
+		auto	n = _names.find(i->first);
+		if (n != _names.end()) {
+			indices.push_back(n->second);
+			continue;
+		}
+		unsigned short	index = _names.size() + added.size();
+		if ((i->first.size() > 255) || (index == 0xffff)) {
+			throw std::runtime_error("cannot archive name");
+		}
+		buffer.push_back('N');
+		put(buffer, index, 2);
+		put(buffer, i->first.size(), 1);
+		buffer.insert(buffer.end(), i->first.begin(), i->first.end());
+		added[i->first] = index;
+		indices.push_back(index);
+	}
+	long long	timekey = std::chrono::duration_cast<std::chrono::seconds>(
+		m.when().time_since_epoch()).count();
+	buffer.push_back('M');
+	put(buffer, timekey, 8);
+	put(buffer, m.size(), 2);
+	size_t	j = 0;
+	for (auto i = m.begin(); i != m.end(); i++, j++) {
+		uint32_t	bits;
+		memcpy(&bits, &i->second, sizeof(bits));
+		put(buffer, indices[j], 2);
+		put(buffer, bits, 4);
+	}
+	off_t	offset = lseek(_fd, 0, SEEK_CUR);
+	ssize_t	written = write(_fd, buffer.data(), buffer.size());
+	if (written != (ssize_t)buffer.size()) {
+		std::string	msg = stringprintf("cannot write to %s: %s",
+			_filename.c_str(), (written < 0) ? strerror(errno)
+				: "short write");
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		// remove the partial record, so that a retry appends cleanly
+		if ((written > 0) && (ftruncate(_fd, offset) < 0)) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "cannot truncate %s: %s",
+				_filename.c_str(), strerror(errno));
+		}
+		lseek(_fd, offset, SEEK_SET);
+		throw std::runtime_error(msg);
+	}
+
+	// the names are only known once they are in the file
+	_names.insert(added.begin(), added.end());
+}
+
+} // namespace powermeter
@@ -0,0 +1,38 @@
+//
+// archive_sink.h -- sink writing messages to a compact binary file
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _archive_sink_h
+#define _archive_sink_h
+
+#include <sink.h>
+#include <configuration.h>
+#include <map>
+#include <string>
+
+namespace powermeter {
+
+/**
+ * \brief Sink appending messages to a binary archive
+ *
+ * The archive starts with an 8 byte magic string. A name record ('N')
+ * assigns a 16 bit index to a value name the first time the name is
+ * used, a message record ('M') contains the time key and the values as
+ * (index, float) pairs, so a value takes 6 bytes instead of a text line.
+ * All integers and floats are stored in little endian byte order.
+ */
+class archive_sink : public sink {
+	std::string	_filename;
+	int	_fd;
+	std::map<std::string, unsigned short>	_names;
+	void	scan();
+public:
+	archive_sink(const configuration& config);
+	~archive_sink();
+	virtual void	store(const message& m);
+};
+
+} // namespace powermeter
+
+#endif /* _archive_sink_h */
@@ -0,0 +1,262 @@
+//
+// asyncdb_sink.cpp
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <asyncdb_sink.h>
+#include <debug.h>
+#include <format.h>
+#include <stdexcept>
+#include <cmath>
+#include <map>
+#include <set>
+
+namespace powermeter {
+
+/**
+ * \brief Create the sink, the ids are read by start
+ *
+ * \param config	the configuration with the database parameters
+ */
+asyncdb_sink::asyncdb_sink(const configuration& config)
+	: sink("asyncmysql"),
+	  _stationname(config.stringvalue("stationname")),
+	  _idcache(config.stringvalue("idcachefile", "")),
+	  _idsread(false), _keychecked(false), _unique(false),
+	  _pool(config) {
+	// the station name goes into the query, so it must not contain quotes
+	if (_stationname.find_first_of("'\\") != std::string::npos) {
+		std::string	msg = stringprintf("bad station name: %s",
+			_stationname.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "%d connections to the database",
+		(int)_pool.size());
+
+	// use the cached ids until the database has been reached
+	if ((_idcache.size() > 0) && _ids.load(_idcache)) {
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "ids read from %s",
+			_idcache.c_str());
+	}
+}
+
+/**
+ * \brief Read the ids and look up the key in the thread of the sink queue
+ *
+ * If the database is not reachable, the next batch will retry.
+ */
+void	asyncdb_sink::start() {
+	try {
+		readids();
+		checkkey();
+	} catch (const sinkunavailable& x) {
+		debug(LOG_WARNING, DEBUG_LOG, 0, "database not available yet: "
+			"%s", x.what());
+	}
+}
+
+/**
+ * \brief Read the sensor and field ids of the station
+ *
+ * If the ids cannot be read but cached ids are available, the cached
+ * ids are kept and the ids are read again before the next batch.
+ *
+ * \return	whether the ids were read from the database
+ */
+bool	asyncdb_sink::readids() {
+	idmap	ids;
+	try {
+		std::vector<std::vector<std::string> >	rows = _pool.select(
+			stringprintf("select se.name, se.id "
+				"from station st, sensor se "
+				"where se.stationid = st.id "
+				"  and st.name = '%s'", _stationname.c_str()));
+		for (auto r = rows.begin(); r != rows.end(); r++) {
+			ids.addsensor((*r)[0], std::stoi((*r)[1]));
+		}
+		rows = _pool.select("select name, id from mfield");
+		for (auto r = rows.begin(); r != rows.end(); r++) {
+			ids.addfield((*r)[0], std::stoi((*r)[1]));
+		}
+	} catch (const std::exception& x) {
+		if (!_ids.empty()) {
+			debug(LOG_WARNING, DEBUG_LOG, 0, "using the cached ids: "
+				"%s", x.what());
+			return false;
+		}
+		if (_pool.unavailable(0)) {
+			throw sinkunavailable(x.what());
+		}
+		throw;
+	}
+
+	// keep the id cache up to date
+	if ((_idcache.size() > 0) && (ids != _ids)) {
+		try {
+			ids.save(_idcache);
+		} catch (const std::exception& x) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "id cache not updated: %s",
+				x.what());
+		}
+	}
+	_ids = ids;
+	_idsread = true;
+	return true;
+}
+
+/**
+ * \brief Find out whether sdata has a unique key on the slot
+ */
+void	asyncdb_sink::checkkey() {
+	std::vector<std::vector<std::string> >	rows;
+	try {
+		rows = _pool.select("show index from sdata");
+	} catch (const std::exception& x) {
+		if (_pool.unavailable(0)) {
+			throw sinkunavailable(x.what());
+		}
+		throw;
+	}
+	// columns of the unique keys by key name
+	std::map<std::string, std::set<std::string> >	keys;
+	for (auto r = rows.begin(); r != rows.end(); r++) {
+		if ((r->size() > 4) && ((*r)[1] == "0")) {
+			keys[(*r)[2]].insert((*r)[4]);
+		}
+	}
+	std::set<std::string>	wanted = { "timekey", "sensorid", "fieldid" };
+	_unique = false;
+	for (auto k = keys.begin(); k != keys.end(); k++) {
+		if (k->second == wanted) {
+			_unique = true;
+		}
+	}
+	if (!_unique) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "sdata has no unique key on the "
+			"timekey, sensor and field, using one connection");
+	}
+	_keychecked = true;
+}
+
+/**
+ * \brief Store a single message
+ *
+ * \param m	the message to store
+ */
+void	asyncdb_sink::store(const message& m) {
+	insert(std::vector<const message*>(1, &m));
+}
+
+/**
+ * \brief Store a batch of messages
+ *
+ * \param messages	the messages to store
+ */
+void	asyncdb_sink::storebatch(const std::vector<message_ptr>& messages) {
+	std::vector<const message*>	batch;
+	for (auto m = messages.begin(); m != messages.end(); m++) {
+		batch.push_back(m->get());
+	}
+	insert(batch);
+}
+
+/**
+ * \brief Write the rows of the messages over all connections
+ *
+ * Since every row is an upsert on the unique key, a batch that failed
+ * on only some of the connections can be retried as a whole. Without
+ * the key the batch goes to one connection, so it is stored completely
+ * or not at all.
+ *
+ * \param messages	the messages to write
+ */
+void	asyncdb_sink::insert(const std::vector<const message*>& messages) {
+	if (!_idsread) {
+		readids();
+	}
+	if (!_keychecked) {
+		checkkey();
+	}
+
+	// names that do not resolve may have been added to the database
+	bool	unknown = false;
+	for (auto m = messages.begin(); (m != messages.end()) && (!unknown);
+		m++) {
+		for (auto i = (*m)->begin(); i != (*m)->end(); i++) {
+			if (!_ids.has(i->first)) {
+				debug(LOG_INFO, DEBUG_LOG, 0, "%s does not resolve, "
+					"reading the ids again", i->first.c_str());
+				unknown = true;
+				break;
+			}
+		}
+	}
+	if (unknown && (!readids()) && _pool.unavailable(0)) {
+		throw sinkunavailable("cannot read the ids");
+	}
+
+	// format the rows
+	std::vector<std::string>	rows;
+	for (auto m = messages.begin(); m != messages.end(); m++) {
+		long long	timekey = std::chrono::duration_cast<
+			std::chrono::seconds>((*m)->when().time_since_epoch())
+				.count();
+		for (auto i = (*m)->begin(); i != (*m)->end(); i++) {
+			if (!std::isfinite(i->second)) {
+				debug(LOG_WARNING, DEBUG_LOG, 0, "skipping %s = %f",
+					i->first.c_str(), i->second);
+				continue;
+			}
+			rows.push_back(stringprintf("(%lld,%d,%d,%.9g)", timekey,
+				_ids.sensorid(i->first), _ids.fieldid(i->first),
+				i->second));
+		}
+	}
+	if (rows.size() == 0) {
+		return;
+	}
+
+	// one transaction with a multi row upsert for each connection
+	size_t	n = (_unique) ? std::min(_pool.size(), rows.size()) : 1;
+	std::vector<std::vector<std::string> >	work;
+	for (size_t c = 0; c < n; c++) {
+		std::string	query("insert into sdata(timekey, sensorid, "
+			"fieldid, value) values ");
+		for (size_t r = c * rows.size() / n;
+			r < (c + 1) * rows.size() / n; r++) {
+			if (query[query.size() - 1] == ')') {
+				query += ",";
+			}
+			query += rows[r];
+		}
+		query += " on duplicate key update value = values(value)";
+		std::vector<std::string>	queries;
+		queries.push_back("start transaction");
+		queries.push_back(query);
+		queries.push_back("commit");
+		work.push_back(queries);
+	}
+	std::vector<std::string>	errors = _pool.execute(work);
+	std::string	error;
+	bool	unavailable = false;
+	for (size_t c = 0; c < errors.size(); c++) {
+		if (errors[c].size() > 0) {
+			error = errors[c];
+			unavailable = unavailable || _pool.unavailable(c);
+		}
+	}
+	if (error.size() > 0) {
+		std::string	msg = stringprintf("cannot store %lu rows: %s",
+			rows.size(), error.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		if (unavailable) {
+			throw sinkunavailable(msg);
+		}
+		throw std::runtime_error(msg);
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "%lu rows stored over %lu connections",
+		rows.size(), n);
+}
+
+} // namespace powermeter
@@ -0,0 +1,64 @@
+//
+// asyncdb_sink.h -- sink writing to MySQL through non-blocking connections
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _asyncdb_sink_h
+#define _asyncdb_sink_h
+
+#include <sink.h>
+#include <idmap.h>
+#include <asyncmysql.h>
+#include <configuration.h>
+#include <string>
+
+namespace powermeter {
+
+/**
+ * \brief Sink writing messages into sdata without ever blocking
+ *
+ * The rows of a batch are split across the connections of an asyncpool
+ * and written as multi row upserts, one transaction per connection,
+ * all of them in flight at the same time. If the database stalls, the
+ * dbtimeout (default 10 seconds) of the operation expires, the batch
+ * fails and is retried by the sink queue, while the meters and the
+ * other sinks keep running. Splitting a batch is only safe if sdata
+ * has a unique key on (timekey, sensorid, fieldid), because a retry of
+ * a batch that failed on some of the connections stores its rows again.
+ * The key is looked up when the sink starts. Until it has been found,
+ * each batch is written by a single connection in a single transaction.
+ *
+ * The sensor and field ids are read in the thread of the sink queue
+ * when it starts, and again before every batch until they have been
+ * read from the database once. They are also read again when a batch
+ * contains a name that does not resolve. If idcachefile is set, the ids
+ * cached there are used until they have been read, and the file is
+ * rewritten when the ids in the database differ from it.
+ *
+ * Connection failures, lost connections and timeouts throw
+ * sinkunavailable, so the sink queue keeps the messages until the
+ * database is back.
+ */
+class asyncdb_sink : public sink {
+	std::string	_stationname;
+	idmap	_ids;
+	std::string	_idcache;
+	// whether the ids have been read from the database
+	bool	_idsread;
+	// whether the key was looked up and the upserts can be split
+	bool	_keychecked;
+	bool	_unique;
+	asyncpool	_pool;
+	bool	readids();
+	void	checkkey();
+	void	insert(const std::vector<const message*>& messages);
+public:
+	asyncdb_sink(const configuration& config);
+	virtual void	start();
+	virtual void	store(const message& m);
+	virtual void	storebatch(const std::vector<message_ptr>& messages);
+};
+
+} // namespace powermeter
+
+#endif /* _asyncdb_sink_h */
@@ -0,0 +1,449 @@
+//
+// asyncmysql.cpp
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <asyncmysql.h>
+#include <debug.h>
+#include <format.h>
+#include <stdexcept>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <errmsg.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+namespace powermeter {
+
+//////////////////////////////////////////////////////////////////////
+// asyncconnection implementation
+//////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Create an unconnected connection
+ *
+ * \param config	configuration with the database parameters and the
+ *			operation timeout dbtimeout (seconds, default 10)
+ */
+asyncconnection::asyncconnection(const configuration& config)
+	: _hostname(config.stringvalue("dbhostname")),
+	  _dbname(config.stringvalue("dbname")),
+	  _dbuser(config.stringvalue("dbuser")),
+	  _dbpassword(config.stringvalue("dbpassword")),
+	  _dbport(config.intvalue("dbport", 3307)),
+	  _mysql(NULL), _state(closed), _status(0),
+	  _librarydeadline(time_point::max()),
+	  _timeout(config.floatvalue("dbtimeout", 10)), _unavailable(false) {
+}
+
+asyncconnection::~asyncconnection() {
+	close();
+}
+
+/**
+ * \brief Whether the connection still has work to do
+ */
+bool	asyncconnection::busy() const {
+	return (_state == connecting) || (_state == querying)
+		|| (_state == storing) || (_queries.size() > 0);
+}
+
+int	asyncconnection::socket() const {
+	return (_mysql) ? mysql_get_socket(_mysql) : -1;
+}
+
+/**
+ * \brief The poll events the connection is waiting for
+ */
+int	asyncconnection::events() const {
+	int	result = 0;
+	if (_status & MYSQL_WAIT_READ) {
+		result |= POLLIN;
+	}
+	if (_status & MYSQL_WAIT_WRITE) {
+		result |= POLLOUT;
+	}
+	if (_status & MYSQL_WAIT_EXCEPT) {
+		result |= POLLPRI;
+	}
+	return result;
+}
+
+/**
+ * \brief Whether a query failed because the connection is gone
+ *
+ * \param mysql	the connection the query failed on
+ */
+static bool	connectionlost(MYSQL *mysql) {
+	switch (mysql_errno(mysql)) {
+	case CR_CONNECTION_ERROR:
+	case CR_CONN_HOST_ERROR:
+	case CR_SERVER_GONE_ERROR:
+	case CR_SERVER_LOST:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/**
+ * \brief Close the connection after an error, dropping all queries
+ *
+ * \param error	the error message
+ * \param unavailable	whether the server could not be reached
+ */
+void	asyncconnection::fail(const std::string& error, bool unavailable) {
+	debug(LOG_ERR, DEBUG_LOG, 0, "database connection fails: %s",
+		error.c_str());
+	_error = error;
+	_unavailable = unavailable;
+	close();
+	_queries.clear();
+}
+
+/**
+ * \brief Close the connection
+ *
+ * The socket is shut down first, so that closing cannot block on a
+ * server that does not respond.
+ */
+void	asyncconnection::close() {
+	if (_mysql) {
+		int	fd = mysql_get_socket(_mysql);
+		if ((fd >= 0) && (_state != idle)) {
+			shutdown(fd, SHUT_RDWR);
+		}
+		mysql_close(_mysql);
+		_mysql = NULL;
+	}
+	_state = closed;
+	_status = 0;
+}
+
+/**
+ * \brief Remember what a _start or _cont function waits for
+ *
+ * \param status	the return value of the function
+ */
+void	asyncconnection::started(int status) {
+	_status = status;
+	_librarydeadline = time_point::max();
+	if (status & MYSQL_WAIT_TIMEOUT) {
+		_librarydeadline = std::chrono::steady_clock::now()
+			+ std::chrono::milliseconds(
+				mysql_get_timeout_value_ms(_mysql));
+	}
+}
+
+/**
+ * \brief Start connecting to the database
+ */
+void	asyncconnection::connect() {
+	close();
+	_error.clear();
+	_unavailable = false;
+	_mysql = mysql_init(NULL);
+	if (NULL == _mysql) {
+		fail("cannot initialize connection", false);
+		return;
+	}
+	mysql_options(_mysql, MYSQL_OPT_NONBLOCK, 0);
+	_state = connecting;
+	_deadline = std::chrono::steady_clock::now()
+		+ std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			_timeout);
+	MYSQL	*result = NULL;
+	int	status = mysql_real_connect_start(&result, _mysql,
+		_hostname.c_str(), _dbuser.c_str(), _dbpassword.c_str(),
+		_dbname.c_str(), _dbport, NULL, 0);
+	started(status);
+	if (status == 0) {
+		if (NULL == result) {
+			fail(stringprintf("cannot connect: %s",
+				mysql_error(_mysql)), true);
+			return;
+		}
+		completed();
+	}
+}
+
+/**
+ * \brief Queue queries for execution
+ *
+ * The queries are executed in order, the rows of the last query that
+ * returns a result set are available from rows when the connection is
+ * no longer busy. If the connection is closed, it is connected first.
+ *
+ * \param queries	the queries to execute
+ */
+void	asyncconnection::submit(const std::vector<std::string>& queries) {
+	_queries.insert(_queries.end(), queries.begin(), queries.end());
+	_rows.clear();
+	_error.clear();
+	_unavailable = false;
+	if (_state == closed) {
+		connect();
+		return;
+	}
+	if (_state == idle) {
+		next();
+	}
+}
+
+/**
+ * \brief Start the next query
+ */
+void	asyncconnection::next() {
+	if (_queries.size() == 0) {
+		_state = idle;
+		_status = 0;
+		return;
+	}
+	_state = querying;
+	_deadline = std::chrono::steady_clock::now()
+		+ std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+			_timeout);
+	const std::string&	query = _queries.front();
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "starting query '%.60s'", query.c_str());
+	int	err = 0;
+	int	status = mysql_real_query_start(&err, _mysql, query.c_str(),
+		query.size());
+	started(status);
+	if (status == 0) {
+		if (err) {
+			fail(stringprintf("query failed: %s",
+				mysql_error(_mysql)), connectionlost(_mysql));
+			return;
+		}
+		completed();
+	}
+}
+
+/**
+ * \brief Move on after the current operation has completed
+ */
+void	asyncconnection::completed() {
+	switch (_state) {
+	case connecting:
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "database connection established");
+		next();
+		return;
+	case querying: {
+		_state = storing;
+		MYSQL_RES	*result = NULL;
+		int	status = mysql_store_result_start(&result, _mysql);
+		started(status);
+		if (status != 0) {
+			return;
+		}
+		stored(result);
+		return;
+		}
+	default:
+		return;
+	}
+}
+
+/**
+ * \brief Keep the rows of a result and start the next query
+ *
+ * \param result	the result of the query, NULL if it returned no rows
+ */
+void	asyncconnection::stored(MYSQL_RES *result) {
+	if (result) {
+		MYSQL_ROW	row;
+		unsigned int	n = mysql_num_fields(result);
+		_rows.clear();
+		while (NULL != (row = mysql_fetch_row(result))) {
+			std::vector<std::string>	r;
+			for (unsigned int i = 0; i < n; i++) {
+				r.push_back((row[i]) ? row[i] : "");
+			}
+			_rows.push_back(r);
+		}
+		mysql_free_result(result);
+	}
+	_queries.pop_front();
+	next();
+}
+
+/**
+ * \brief Continue the current operation
+ *
+ * \param events	the poll events that happened, 0 if poll timed out
+ */
+void	asyncconnection::step(int revents) {
+	if (!busy() || (_state == idle)) {
+		return;
+	}
+	int	status = 0;
+	if (revents == 0) {
+		// poll timed out, find out whose timeout expired
+		time_point	now = std::chrono::steady_clock::now();
+		if (now >= _deadline) {
+			fail("operation timed out", true);
+			return;
+		}
+		if (now < _librarydeadline) {
+			return;
+		}
+		status |= MYSQL_WAIT_TIMEOUT;
+	}
+	if (revents & (POLLIN | POLLERR | POLLHUP)) {
+		status |= MYSQL_WAIT_READ;
+	}
+	if (revents & POLLOUT) {
+		status |= MYSQL_WAIT_WRITE;
+	}
+	if (revents & POLLPRI) {
+		status |= MYSQL_WAIT_EXCEPT;
+	}
+	switch (_state) {
+	case connecting: {
+		MYSQL	*result = NULL;
+		status = mysql_real_connect_cont(&result, _mysql, status);
+		started(status);
+		if (status == 0) {
+			if (NULL == result) {
+				fail(stringprintf("cannot connect: %s",
+					mysql_error(_mysql)), true);
+				return;
+			}
+			completed();
+		}
+		}
+		break;
+	case querying: {
+		int	err = 0;
+		status = mysql_real_query_cont(&err, _mysql, status);
+		started(status);
+		if (status == 0) {
+			if (err) {
+				fail(stringprintf("query failed: %s",
+					mysql_error(_mysql)),
+					connectionlost(_mysql));
+				return;
+			}
+			completed();
+		}
+		}
+		break;
+	case storing: {
+		MYSQL_RES	*result = NULL;
+		status = mysql_store_result_cont(&result, _mysql, status);
+		started(status);
+		if (status == 0) {
+			stored(result);
+		}
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+//////////////////////////////////////////////////////////////////////
+// asyncpool implementation
+//////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Create the connections, they connect when first used
+ *
+ * \param config	the configuration with the database parameters
+ */
+asyncpool::asyncpool(const configuration& config) {
+	int	n = std::max(1, config.intvalue("dbconnections", 2));
+	for (int i = 0; i < n; i++) {
+		_connections.push_back(std::shared_ptr<asyncconnection>(
+			new asyncconnection(config)));
+	}
+}
+
+/**
+ * \brief Poll all busy connections until they are done
+ */
+void	asyncpool::poll() {
+	while (1) {
+		std::vector<struct pollfd>	fds;
+		std::vector<asyncconnection*>	owners;
+		asyncconnection::time_point	deadline
+			= asyncconnection::time_point::max();
+		for (auto c = _connections.begin(); c != _connections.end();
+			c++) {
+			if (!(*c)->busy()) {
+				continue;
+			}
+			struct pollfd	p;
+			p.fd = (*c)->socket();
+			p.events = (*c)->events();
+			p.revents = 0;
+			fds.push_back(p);
+			owners.push_back(c->get());
+			deadline = std::min(deadline, (*c)->deadline());
+		}
+		if (fds.size() == 0) {
+			return;
+		}
+		auto	remaining = std::chrono::duration_cast<
+			std::chrono::milliseconds>(deadline
+				- std::chrono::steady_clock::now()).count();
+		int	rc = ::poll(fds.data(), fds.size(),
+			std::max((long long)remaining, 0LL));
+		if ((rc < 0) && (errno != EINTR)) {
+			std::string	msg = stringprintf("poll failed: %s",
+				strerror(errno));
+			debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+			throw std::runtime_error(msg);
+		}
+		for (size_t i = 0; i < fds.size(); i++) {
+			owners[i]->step((rc > 0) ? fds[i].revents : 0);
+		}
+	}
+}
+
+/**
+ * \brief Execute lists of queries concurrently
+ *
+ * List i goes to connection i, so there must not be more lists than
+ * connections.
+ *
+ * \param work	the lists of queries
+ * \return	the error message for each list, empty if it succeeded
+ */
+std::vector<std::string>	asyncpool::execute(
+		const std::vector<std::vector<std::string> >& work) {
+	if (work.size() > _connections.size()) {
+		throw std::runtime_error("more query lists than connections");
+	}
+	for (size_t i = 0; i < work.size(); i++) {
+		_connections[i]->submit(work[i]);
+	}
+	poll();
+	std::vector<std::string>	errors;
+	for (size_t i = 0; i < work.size(); i++) {
+		errors.push_back(_connections[i]->error());
+	}
+	return errors;
+}
+
+/**
+ * \brief Execute a single query and return its rows
+ *
+ * \param query	the query to execute
+ */
+std::vector<std::vector<std::string> >	asyncpool::select(
+		const std::string& query) {
+	std::vector<std::vector<std::string> >	work;
+	work.push_back(std::vector<std::string>(1, query));
+	std::vector<std::string>	errors = execute(work);
+	if (errors[0].size() > 0) {
+		std::string	msg = stringprintf("query '%s' failed: %s",
+			query.c_str(), errors[0].c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	return _connections[0]->rows();
+}
+
+} // namespace powermeter
@@ -0,0 +1,106 @@
+//
+// asyncmysql.h -- MySQL connections driven by the non-blocking API
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _asyncmysql_h
+#define _asyncmysql_h
+
+#include <configuration.h>
+#include <mysql.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <chrono>
+#include <algorithm>
+
+namespace powermeter {
+
+/**
+ * \brief A connection executing a sequence of queries without blocking
+ *
+ * The connection uses the MariaDB non-blocking API. Each call to a
+ * _start or _cont function returns the events the client library
+ * waits for, the owner polls the socket for these events and calls
+ * step when one of them happened. Every operation has to complete
+ * within the timeout, otherwise the connection is closed. After a
+ * failure, unavailable tells whether the server could not be reached,
+ * the connection was lost or the operation timed out, as opposed to a
+ * query the server rejected.
+ */
+class asyncconnection {
+public:
+	typedef enum { closed, connecting, idle, querying, storing } state_t;
+	typedef std::chrono::steady_clock::time_point	time_point;
+private:
+	std::string	_hostname;
+	std::string	_dbname;
+	std::string	_dbuser;
+	std::string	_dbpassword;
+	int	_dbport;
+	MYSQL	*_mysql;
+	state_t	_state;
+	int	_status;
+	time_point	_deadline;
+	time_point	_librarydeadline;
+	std::chrono::duration<float>	_timeout;
+	std::deque<std::string>	_queries;
+	std::vector<std::vector<std::string> >	_rows;
+	std::string	_error;
+	bool	_unavailable;
+	void	fail(const std::string& error, bool unavailable);
+	void	started(int status);
+	void	next();
+	void	completed();
+	void	stored(MYSQL_RES *result);
+public:
+	asyncconnection(const configuration& config);
+	~asyncconnection();
+	asyncconnection(const asyncconnection& other) = delete;
+	asyncconnection&	operator=(const asyncconnection& other) = delete;
+	state_t	state() const { return _state; }
+	bool	busy() const;
+	const std::string&	error() const { return _error; }
+	bool	unavailable() const { return _unavailable; }
+	const std::vector<std::vector<std::string> >&	rows() const {
+		return _rows;
+	}
+	void	connect();
+	void	submit(const std::vector<std::string>& queries);
+	void	close();
+	int	socket() const;
+	int	events() const;
+	time_point	deadline() const {
+		return std::min(_deadline, _librarydeadline);
+	}
+	void	step(int events);
+};
+
+/**
+ * \brief A small pool of non-blocking connections with a poll loop
+ *
+ * The pool keeps dbconnections (default 2) connections. execute hands
+ * one list of queries to each connection and polls all of them until
+ * every list is done, so that the lists are in flight concurrently.
+ * A connection that fails or times out is closed and connected again
+ * the next time it is needed.
+ */
+class asyncpool {
+	std::vector<std::shared_ptr<asyncconnection> >	_connections;
+	void	poll();
+public:
+	asyncpool(const configuration& config);
+	size_t	size() const { return _connections.size(); }
+	bool	unavailable(size_t i) const {
+		return _connections[i]->unavailable();
+	}
+	std::vector<std::string>	execute(
+		const std::vector<std::vector<std::string> >& work);
+	std::vector<std::vector<std::string> >	select(
+		const std::string& query);
+};
+
+} // namespace powermeter
+
+#endif /* _asyncmysql_h */
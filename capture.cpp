@@ -0,0 +1,279 @@
+//
+// capture.cpp -- raw capture of meter traffic and replay of captures
+//
+// The capture file starts with an 8 byte magic string, followed by the
+// records. Each record has a 19 byte header consisting of the type (1 byte),
+// the payload length (2 bytes), the monotonic time stamp in nanoseconds
+// (8 bytes) and the system clock time stamp in nanoseconds (8 bytes),
+// all integers in little endian byte order, followed by the payload.
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <capture.h>
+#include <debug.h>
+#include <format.h>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace powermeter {
+
+static const char	magic[8] = { 'P', 'M', 'C', 'A', 'P', '0', '1', '\n' };
+static const size_t	headersize = 19;
+
+static void	put(unsigned char *p, uint64_t value, int bytes) {
+	for (int i = 0; i < bytes; i++) {
+		p[i] = value & 0xff;
+		value >>= 8;
+	}
+}
+
+static uint64_t	get(const unsigned char *p, int bytes) {
+	uint64_t	result = 0;
+	for (int i = bytes - 1; i >= 0; i--) {
+		result = (result << 8) | p[i];
+	}
+	return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+// capture_record implementation
+//////////////////////////////////////////////////////////////////////
+
+unsigned short	capture_record::unit() const {
+	return get(data.data(), 2);
+}
+
+unsigned short	capture_record::address() const {
+	return get(data.data() + 2, 2);
+}
+
+unsigned short	capture_record::count() const {
+	return get(data.data() + 4, 2);
+}
+
+unsigned short	capture_record::registerat(unsigned short i) const {
+	return get(data.data() + 6 + 2 * i, 2);
+}
+
+//////////////////////////////////////////////////////////////////////
+// capture implementation
+//////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Open a capture file for appending
+ *
+ * \param filename	the name of the capture file
+ */
+capture::capture(const std::string& filename) {
+	_fd = open(filename.c_str(), O_CREAT | O_WRONLY | O_APPEND, 0666);
+	if (_fd < 0) {
+		std::string	msg = stringprintf("cannot open capture file "
+			"%s: %s", filename.c_str(), strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	struct stat	sb;
+	if ((0 == fstat(_fd, &sb)) && (0 == sb.st_size)) {
+		if (write(_fd, magic, sizeof(magic)) != sizeof(magic)) {
+			std::string	msg = stringprintf("cannot write capture "
+				"header: %s", strerror(errno));
+			debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+			close(_fd);
+			throw std::runtime_error(msg);
+		}
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "capturing to %s", filename.c_str());
+}
+
+/**
+ * \brief Close the capture file
+ */
+capture::~capture() {
+	close(_fd);
+}
+
+/**
+ * \brief Append a record to the capture file
+ *
+ * The record is written with a single write call, so that a crash
+ * leaves at most a truncated last record in the file.
+ *
+ * \param type		the record type
+ * \param when		the system clock time point of the record
+ * \param data		the payload
+ * \param length	the length of the payload
+ */
+void	capture::record(capture_type type,
+		const std::chrono::system_clock::time_point& when,
+		const void *data, size_t length) {
+	if (length > 0xffff) {
+		throw std::runtime_error("capture record too large");
+	}
+	std::chrono::nanoseconds	monotonic
+		= std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now().time_since_epoch());
+	std::chrono::nanoseconds	realtime
+		= std::chrono::duration_cast<std::chrono::nanoseconds>(
+			when.time_since_epoch());
+	unsigned char	buffer[headersize + length];
+	put(buffer, type, 1);
+	put(buffer + 1, length, 2);
+	put(buffer + 3, monotonic.count(), 8);
+	put(buffer + 11, realtime.count(), 8);
+	if (length > 0) {
+		memcpy(buffer + headersize, data, length);
+	}
+	std::unique_lock<std::mutex>	lock(_mutex);
+	if (write(_fd, buffer, sizeof(buffer)) != (ssize_t)sizeof(buffer)) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "cannot write capture record: %s",
+			strerror(errno));
+	}
+}
+
+/**
+ * \brief Append a block of modbus registers to the capture file
+ *
+ * \param unit		the unit id the registers were read from
+ * \param address	the address of the first register
+ * \param count		the number of registers
+ * \param registers	the register values
+ */
+void	capture::modbus(unsigned short unit, unsigned short address,
+		unsigned short count, const unsigned short *registers) {
+	unsigned char	buffer[6 + 2 * count];
+	put(buffer, unit, 2);
+	put(buffer + 2, address, 2);
+	put(buffer + 4, count, 2);
+	for (int i = 0; i < count; i++) {
+		put(buffer + 6 + 2 * i, registers[i], 2);
+	}
+	record(capture_modbus, std::chrono::system_clock::now(),
+		buffer, sizeof(buffer));
+}
+
+//////////////////////////////////////////////////////////////////////
+// replay implementation
+//////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Open a capture file for replay
+ *
+ * \param filename	the name of the capture file
+ * \param paced		whether to deliver records at the original pace
+ */
+replay::replay(const std::string& filename, bool paced)
+	: _paced(paced), _havenext(false), _lastmonotonic(0) {
+	_fd = open(filename.c_str(), O_RDONLY);
+	if (_fd < 0) {
+		std::string	msg = stringprintf("cannot open capture file "
+			"%s: %s", filename.c_str(), strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	char	buffer[sizeof(magic)];
+	if ((read(_fd, buffer, sizeof(buffer)) != sizeof(buffer))
+		|| (0 != memcmp(buffer, magic, sizeof(magic)))) {
+		close(_fd);
+		std::string	msg = stringprintf("%s is not a capture file",
+			filename.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "replaying %s%s", filename.c_str(),
+		(_paced) ? " at original pace" : "");
+}
+
+/**
+ * \brief Close the capture file
+ */
+replay::~replay() {
+	close(_fd);
+}
+
+/**
+ * \brief Read the next record from the file
+ *
+ * A truncated record at the end of the file is treated like the end
+ * of the file.
+ *
+ * \param r	the record to fill in
+ */
+bool	replay::readrecord(capture_record& r) {
+	unsigned char	header[headersize];
+	if (read(_fd, header, headersize) != (ssize_t)headersize) {
+		return false;
+	}
+	r.type = (capture_type)header[0];
+	size_t	length = get(header + 1, 2);
+	r.monotonic = std::chrono::nanoseconds((int64_t)get(header + 3, 8));
+	r.when = std::chrono::system_clock::time_point(
+		std::chrono::duration_cast<std::chrono::system_clock::duration>(
+			std::chrono::nanoseconds((int64_t)get(header + 11, 8))));
+	r.data.resize(length);
+	if (length == 0) {
+		return true;
+	}
+	return (read(_fd, r.data.data(), length) == (ssize_t)length);
+}
+
+/**
+ * \brief Look at the next record without consuming it
+ *
+ * \return	NULL at the end of the capture
+ */
+const capture_record	*replay::peek() {
+	if (!_havenext) {
+		_havenext = readrecord(_next);
+	}
+	return (_havenext) ? &_next : NULL;
+}
+
+/**
+ * \brief Consume the next record
+ */
+capture_record	replay::next() {
+	if (NULL == peek()) {
+		throw std::runtime_error("end of capture");
+	}
+	_havenext = false;
+	_lastmonotonic = _next.monotonic;
+	_laststeady = std::chrono::steady_clock::now();
+	return _next;
+}
+
+/**
+ * \brief Consume the next record and make sure it has the right type
+ *
+ * \param type	the expected record type
+ */
+capture_record	replay::next(capture_type type) {
+	capture_record	r = next();
+	if (r.type != type) {
+		std::string	msg = stringprintf("capture out of sequence: "
+			"expected record type %d, found %d", type, r.type);
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	return r;
+}
+
+/**
+ * \brief Time to wait before the next record is due
+ *
+ * This is always zero unless the replay is paced.
+ */
+std::chrono::nanoseconds	replay::delay() {
+	if ((!_paced) || (_lastmonotonic.count() == 0) || (NULL == peek())) {
+		return std::chrono::nanoseconds(0);
+	}
+	std::chrono::nanoseconds	d = (_next.monotonic - _lastmonotonic)
+		- std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - _laststeady);
+	return (d.count() > 0) ? d : std::chrono::nanoseconds(0);
+}
+
+} // namespace powermeter
@@ -0,0 +1,92 @@
+//
+// capture.h -- raw capture of meter traffic and replay of captures
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _capture_h
+#define _capture_h
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include <cstdint>
+
+namespace powermeter {
+
+/**
+ * \brief Record types found in a capture file
+ *
+ * Each record carries a monotonic and a system clock time stamp. The
+ * window record marks the start of an integration interval, the sample
+ * record carries the time point a sample was integrated with, the discard
+ * record marks an integration interval that was abandoned. The solivia
+ * and modbus records contain the raw bytes received from the meter.
+ */
+typedef enum {
+	capture_window = 1,
+	capture_sample = 2,
+	capture_discard = 3,
+	capture_solivia = 16,
+	capture_modbus = 17
+} capture_type;
+
+class capture_record {
+public:
+	capture_type	type;
+	std::chrono::nanoseconds	monotonic;
+	std::chrono::system_clock::time_point	when;
+	std::vector<unsigned char>	data;
+	capture_record() : type(capture_window), monotonic(0) { }
+	// modbus register blocks
+	unsigned short	unit() const;
+	unsigned short	address() const;
+	unsigned short	count() const;
+	unsigned short	registerat(unsigned short i) const;
+};
+
+/**
+ * \brief Append-only journal of raw meter traffic
+ */
+class capture {
+	int		_fd;
+	std::mutex	_mutex;
+public:
+	capture(const std::string& filename);
+	capture(const capture& other) = delete;
+	~capture();
+	void	record(capture_type type,
+			const std::chrono::system_clock::time_point& when,
+			const void *data = NULL, size_t length = 0);
+	void	modbus(unsigned short unit, unsigned short address,
+			unsigned short count, const unsigned short *registers);
+};
+
+/**
+ * \brief Reader for capture files
+ *
+ * In paced mode, the reader sleeps between records so that the records
+ * are delivered with the same spacing as they were recorded.
+ */
+class replay {
+	int		_fd;
+	bool		_paced;
+	bool		_havenext;
+	capture_record	_next;
+	std::chrono::nanoseconds	_lastmonotonic;
+	std::chrono::steady_clock::time_point	_laststeady;
+	bool	readrecord(capture_record& r);
+public:
+	replay(const std::string& filename, bool paced = false);
+	replay(const replay& other) = delete;
+	~replay();
+	bool	paced() const { return _paced; }
+	const capture_record	*peek();
+	capture_record	next();
+	capture_record	next(capture_type type);
+	std::chrono::nanoseconds	delay();
+};
+
+} // namespace powermeter
+
+#endif /* _capture_h */
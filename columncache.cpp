@@ -0,0 +1,347 @@
+//
+// columncache.cpp -- local column files for the time series of a station
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <columncache.h>
+#include <debug.h>
+#include <format.h>
+#include <stdexcept>
+#include <algorithm>
+#include <thread>
+#include <fstream>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace powermeter {
+
+//////////////////////////////////////////////////////////////////////
+// mappedseries implementation
+//////////////////////////////////////////////////////////////////////
+
+static const void	*mapfile(const std::string& filename, size_t& length) {
+	int	fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		std::string	msg = stringprintf("cannot open %s: %s",
+			filename.c_str(), strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	struct stat	sb;
+	if (fstat(fd, &sb) < 0) {
+		close(fd);
+		throw std::runtime_error("cannot stat column file");
+	}
+	length = sb.st_size;
+	if (length == 0) {
+		close(fd);
+		return NULL;
+	}
+	void	*p = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		std::string	msg = stringprintf("cannot map %s: %s",
+			filename.c_str(), strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	return p;
+}
+
+/**
+ * \brief Map the column files of a series
+ *
+ * If the files have different lengths because a pull was interrupted,
+ * only the points present in both files are used.
+ *
+ * \param basename	path of the series without the .t/.v suffix
+ */
+mappedseries::mappedseries(const std::string& basename) : _values(NULL),
+	_valueslength(0) {
+	_times = (const int64_t *)mapfile(basename + ".t", _timeslength);
+	try {
+		_values = (const float *)mapfile(basename + ".v", _valueslength);
+	} catch (...) {
+		if (_times) {
+			munmap((void *)_times, _timeslength);
+		}
+		throw;
+	}
+	_size = std::min(_timeslength / sizeof(int64_t),
+		_valueslength / sizeof(float));
+}
+
+mappedseries::~mappedseries() {
+	if (_times) {
+		munmap((void *)_times, _timeslength);
+	}
+	if (_values) {
+		munmap((void *)_values, _valueslength);
+	}
+}
+
+/**
+ * \brief Index of the first point not before a time key
+ *
+ * \param timekey	the time key to look for
+ */
+size_t	mappedseries::lower(int64_t timekey) const {
+	return std::lower_bound(_times, _times + _size, timekey) - _times;
+}
+
+//////////////////////////////////////////////////////////////////////
+// bucket implementation
+//////////////////////////////////////////////////////////////////////
+
+void	bucket::add(float value) {
+	if (count == 0) {
+		min = max = value;
+	} else {
+		min = std::min(min, value);
+		max = std::max(max, value);
+	}
+	sum += value;
+	count++;
+}
+
+void	bucket::add(const bucket& other) {
+	if (other.count == 0) {
+		return;
+	}
+	if (count == 0) {
+		min = other.min;
+		max = other.max;
+	} else {
+		min = std::min(min, other.min);
+		max = std::max(max, other.max);
+	}
+	sum += other.sum;
+	count += other.count;
+}
+
+//////////////////////////////////////////////////////////////////////
+// columncache implementation
+//////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Open a cache directory, creating it if necessary
+ *
+ * \param directory	the directory containing the column files
+ */
+columncache::columncache(const std::string& directory)
+	: _directory(directory) {
+	if ((mkdir(_directory.c_str(), 0777) < 0) && (errno != EEXIST)) {
+		std::string	msg = stringprintf("cannot create %s: %s",
+			_directory.c_str(), strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+}
+
+columncache::~columncache() {
+	close();
+}
+
+std::string	columncache::path(const std::string& name) const {
+	return _directory + "/" + name;
+}
+
+/**
+ * \brief The largest time key pulled so far, 0 for an empty cache
+ */
+int64_t	columncache::watermark() const {
+	std::ifstream	in(path("watermark").c_str());
+	long long	timekey = 0;
+	in >> timekey;
+	return timekey;
+}
+
+/**
+ * \brief Record a new watermark
+ *
+ * The watermark file is replaced atomically, so a crash leaves either
+ * the old or the new watermark.
+ *
+ * \param timekey	the new watermark
+ */
+void	columncache::watermark(int64_t timekey) {
+	std::string	tmp = path("watermark.tmp");
+	{
+		std::ofstream	out(tmp.c_str());
+		out << (long long)timekey << std::endl;
+		if (!out) {
+			throw std::runtime_error("cannot write watermark");
+		}
+	}
+	if (rename(tmp.c_str(), path("watermark").c_str()) < 0) {
+		throw std::runtime_error("cannot replace watermark");
+	}
+}
+
+/**
+ * \brief All series in the cache
+ */
+std::vector<std::string>	columncache::names() const {
+	std::vector<std::string>	result;
+	DIR	*dir = opendir(_directory.c_str());
+	if (NULL == dir) {
+		return result;
+	}
+	struct dirent	*d;
+	while (NULL != (d = readdir(dir))) {
+		std::string	name(d->d_name);
+		if ((name.size() > 2)
+			&& (name.substr(name.size() - 2) == ".t")) {
+			result.push_back(name.substr(0, name.size() - 2));
+		}
+	}
+	closedir(dir);
+	std::sort(result.begin(), result.end());
+	return result;
+}
+
+/**
+ * \brief Append a point to a series
+ *
+ * \param name		the name of the series
+ * \param timekey	the time key of the point
+ * \param value		the value of the point
+ */
+void	columncache::append(const std::string& name, int64_t timekey,
+		float value) {
+	auto	f = _fds.find(name);
+	if (f == _fds.end()) {
+		int	tfd = open((path(name) + ".t").c_str(),
+			O_CREAT | O_RDWR | O_APPEND, 0666);
+		int	vfd = open((path(name) + ".v").c_str(),
+			O_CREAT | O_RDWR | O_APPEND, 0666);
+		if ((tfd < 0) || (vfd < 0)) {
+			std::string	msg = stringprintf("cannot open columns "
+				"of %s: %s", name.c_str(), strerror(errno));
+			debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+			if (tfd >= 0) {
+				::close(tfd);
+			}
+			if (vfd >= 0) {
+				::close(vfd);
+			}
+			throw std::runtime_error(msg);
+		}
+		// cut both columns to the common length and get the last time
+		struct stat	ts, vs;
+		fstat(tfd, &ts);
+		fstat(vfd, &vs);
+		size_t	n = std::min(ts.st_size / sizeof(int64_t),
+			vs.st_size / sizeof(float));
+		if (ftruncate(tfd, n * sizeof(int64_t))
+			|| ftruncate(vfd, n * sizeof(float))) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "cannot truncate %s",
+				name.c_str());
+		}
+		int64_t	last = INT64_MIN;
+		if (n > 0) {
+			pread(tfd, &last, sizeof(last),
+				(n - 1) * sizeof(int64_t));
+		}
+		_last[name] = last;
+		f = _fds.insert(std::make_pair(name,
+			std::make_pair(tfd, vfd))).first;
+	}
+	// points already in the cache come again when a pull is repeated
+	if (timekey <= _last[name]) {
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "%s: ignoring point at %lld "
+			"not after %lld", name.c_str(), (long long)timekey,
+			(long long)_last[name]);
+		return;
+	}
+	if ((write(f->second.first, &timekey, sizeof(timekey))
+			!= sizeof(timekey))
+		|| (write(f->second.second, &value, sizeof(value))
+			!= sizeof(value))) {
+		std::string	msg = stringprintf("cannot append to %s: %s",
+			name.c_str(), strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	_last[name] = timekey;
+}
+
+/**
+ * \brief Close all open column files
+ */
+void	columncache::close() {
+	for (auto f = _fds.begin(); f != _fds.end(); f++) {
+		::close(f->second.first);
+		::close(f->second.second);
+	}
+	_fds.clear();
+	_last.clear();
+}
+
+/**
+ * \brief Aggregate a series in buckets
+ *
+ * The range of the series is split into as many slices as there are
+ * threads, each thread aggregates its slice into its own buckets, and
+ * the partial buckets are merged at the end.
+ *
+ * \param name		the series
+ * \param from		first time key to include
+ * \param to		last time key to include
+ * \param bucketsize	bucket length in seconds, 0 for a single bucket
+ * \param threads	number of threads to use
+ */
+std::vector<bucket>	columncache::aggregate(const std::string& name,
+		int64_t from, int64_t to, int64_t bucketsize,
+		int threads) const {
+	if (bucketsize <= 0) {
+		bucketsize = to - from + 1;
+	}
+	mappedseries	series(path(name));
+	size_t	first = series.lower(from);
+	size_t	last = series.lower(to + 1);
+	size_t	nbuckets = (to - from) / bucketsize + 1;
+	threads = std::max(1, std::min(threads, (int)((last - first) / 65536
+		+ 1)));
+
+	// each thread works on its own buckets
+	std::vector<std::vector<bucket> >	partial(threads,
+		std::vector<bucket>(nbuckets));
+	std::vector<std::thread>	workers;
+	size_t	slice = (last - first + threads - 1) / threads;
+	for (int t = 0; t < threads; t++) {
+		size_t	begin = std::min(last, first + t * slice);
+		size_t	end = std::min(last, begin + slice);
+		std::vector<bucket>	*buckets = &partial[t];
+		workers.push_back(std::thread([&series, buckets, begin, end,
+			from, bucketsize]() {
+			const int64_t	*times = series.times();
+			const float	*values = series.values();
+			for (size_t i = begin; i < end; i++) {
+				(*buckets)[(times[i] - from) / bucketsize]
+					.add(values[i]);
+			}
+		}));
+	}
+	for (auto w = workers.begin(); w != workers.end(); w++) {
+		w->join();
+	}
+
+	// merge the partial results
+	std::vector<bucket>	result;
+	for (size_t b = 0; b < nbuckets; b++) {
+		bucket	total(from + b * bucketsize);
+		for (int t = 0; t < threads; t++) {
+			total.add(partial[t][b]);
+		}
+		result.push_back(total);
+	}
+	return result;
+}
+
+} // namespace powermeter
@@ -0,0 +1,85 @@
+//
+// columncache.h -- local column files for the time series of a station
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _columncache_h
+#define _columncache_h
+
+#include <string>
+#include <vector>
+#include <map>
+#include <cstdint>
+#include <cstddef>
+
+namespace powermeter {
+
+/**
+ * \brief Read only memory mapping of the two columns of a series
+ *
+ * The time column contains sorted 64 bit time keys, the value column
+ * the float values in the same order, so the time column itself serves
+ * as the time index: a range is found by binary search.
+ */
+class mappedseries {
+	const int64_t	*_times;
+	const float	*_values;
+	size_t	_size;
+	size_t	_timeslength;
+	size_t	_valueslength;
+public:
+	mappedseries(const std::string& basename);
+	~mappedseries();
+	mappedseries(const mappedseries& other) = delete;
+	mappedseries&	operator=(const mappedseries& other) = delete;
+	size_t	size() const { return _size; }
+	const int64_t	*times() const { return _times; }
+	const float	*values() const { return _values; }
+	size_t	lower(int64_t timekey) const;
+};
+
+/**
+ * \brief Aggregate of the points in one time bucket
+ */
+struct bucket {
+	int64_t	start;
+	size_t	count;
+	double	sum;
+	float	min;
+	float	max;
+	bucket(int64_t s = 0) : start(s), count(0), sum(0), min(0), max(0) { }
+	void	add(float value);
+	void	add(const bucket& other);
+	double	mean() const { return (count) ? sum / count : 0; }
+};
+
+/**
+ * \brief Directory of column files, one pair per series
+ *
+ * The series sensor.field has the files sensor.field.t and
+ * sensor.field.v. The file watermark contains the largest time key
+ * pulled into the cache so far. Points are only ever appended, a
+ * point not newer than the last point of its series is ignored, so
+ * pulling a range again after a failed pull adds no duplicates.
+ */
+class columncache {
+	std::string	_directory;
+	std::map<std::string, int64_t>	_last;
+	std::map<std::string, std::pair<int, int> >	_fds;
+	std::string	path(const std::string& name) const;
+public:
+	columncache(const std::string& directory);
+	~columncache();
+	int64_t	watermark() const;
+	void	watermark(int64_t timekey);
+	std::vector<std::string>	names() const;
+	void	append(const std::string& name, int64_t timekey, float value);
+	void	close();
+	std::vector<bucket>	aggregate(const std::string& name,
+		int64_t from, int64_t to, int64_t bucketsize,
+		int threads) const;
+};
+
+} // namespace powermeter
+
+#endif /* _columncache_h */
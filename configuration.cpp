@@ -150,20 +150,24 @@ bool	configuration::boolvalue(const std::string& name, bool defaultvalue) const
 }
 
 void	configuration::set(const std::string& name, const std::string& value) {
-	insert(std::make_pair(name, value));
+	operator[](name) = value;
+}
+
+// without this overload, a string literal would be converted to bool
+void	configuration::set(const std::string& name, const char *value) {
+	operator[](name) = std::string(value);
 }
 
 void	configuration::set(const std::string& name, int value) {
-	insert(std::make_pair(name, std::to_string(value)));
+	operator[](name) = std::to_string(value);
 }
 
 void	configuration::set(const std::string& name, float value) {
-	insert(std::make_pair(name, std::to_string(value)));
+	operator[](name) = std::to_string(value);
 }
 
 void	configuration::set(const std::string& name, bool value) {
-	insert(std::make_pair(name,
-		(value) ? std::string("yes") : std::string("no")));
+	operator[](name) = (value) ? std::string("yes") : std::string("no");
 }
 
 } // namespace powermeter
@@ -25,6 +25,7 @@ public:
 	bool	boolvalue(const std::string& name) const;
 	bool	boolvalue(const std::string& name, bool defaultvalue) const;
 	void	set(const std::string& name, const std::string& value);
+	void	set(const std::string& name, const char *value);
 	void	set(const std::string& name, int value);
 	void	set(const std::string& name, float value);
 	void	set(const std::string& name, bool value);
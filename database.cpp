@@ -7,32 +7,197 @@
 #include <mysql.h>
 #include <format.h>
 #include <debug.h>
+#include <metrics.h>
+#include <flightrecorder.h>
 #include <cstring>
+#include <map>
+#include <vector>
+#include <ctime>
+#include <sys/socket.h>
 
 namespace powermeter {
 
-database::database(const configuration& config,
-	messagequeue& queue)
-	: _hostname(config.stringvalue("dbhostname")),
+/**
+ * \brief Create the sink, the connection is opened by start
+ *
+ * \param config	the configuration with the database parameters
+ */
+database::database(const configuration& config)
+	: sink("mysql"),
+	  _hostname(config.stringvalue("dbhostname")),
 	  _dbname(config.stringvalue("dbname")),
 	  _dbuser(config.stringvalue("dbuser")),
 	  _dbpassword(config.stringvalue("dbpassword")),
 	  _dbport(config.intvalue("dbport", 3307)),
 	  _stationname(config.stringvalue("stationname")),
-	  _timeout(std::chrono::seconds(config.intvalue("timeout", 80))),
-	  _queue(queue) {
+	  _idcache(config.stringvalue("idcachefile", "")),
+	  _wide(config.stringvalue("sdatalayout", "narrow") == "wide"),
+	  _written(time(NULL), config.intvalue("gapwindow", 7 * 86400)
+		/ config.intvalue("meterwindow", 60),
+		config.intvalue("meterwindow", 60)),
+	  _backfill(false), _unique(false),
+	  _commitrows(config.intvalue(name() + "commitrows",
+		config.intvalue("commitrows", 1000))),
+	  _mysql(NULL), _socket(-1), _insert(NULL) {
+	// the journal keeps the messages while the database is unreachable
+	std::string	journalfile = config.stringvalue("journalfile", "");
+	if (journalfile.size() > 0) {
+		_journal = std::unique_ptr<journal>(new journal(journalfile,
+			config.intvalue("journalsize", 10000)));
+	}
+
+	// use the cached ids until the database has been reached
+	if ((_idcache.size() > 0) && _ids.load(_idcache)) {
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "ids read from %s",
+			_idcache.c_str());
+	}
+}
+
+/**
+ * \brief Connect to the database in the thread of the sink queue
+ *
+ * If the database is not reachable, the first store will retry.
+ */
+void	database::start() {
+	try {
+		connect();
+		backfill();
+	} catch (const sinkunavailable& x) {
+		debug(LOG_WARNING, DEBUG_LOG, 0, "database not available yet: "
+			"%s", x.what());
+		_backfill = true;
+	}
+}
+
+/**
+ * \brief Connect to the database and read the sensor and field ids
+ *
+ * Everything derived from the connection, the ids, the prepared
+ * statement and the written slots, is read again on every connect,
+ * so that a restarted or reconfigured server is picked up correctly.
+ * If anything fails, the connection is closed again and the exception
+ * sinkunavailable is thrown.
+ */
+void	database::connect() {
+	static counter&	connects = metrics::newcounter(
+		"powermeter_db_connects_total", "Database connections opened");
+	static counter&	failures = metrics::newcounter(
+		"powermeter_db_connect_failures_total",
+		"Failed attempts to connect to the database");
+	idmap	previous = _ids;
+	try {
+		open();
+	} catch (const std::exception& x) {
+		disconnect();
+		_ids = previous;
+		failures.add();
+		throw sinkunavailable(x.what());
+	}
+	connects.add();
+	debug(LOG_INFO, DEBUG_LOG, 0, "connected to database %s on %s",
+		_dbname.c_str(), _hostname.c_str());
+
+	// keep the id cache up to date
+	if ((_idcache.size() > 0) && (_ids != previous)) {
+		if (!previous.empty()) {
+			debug(LOG_WARNING, DEBUG_LOG, 0, "ids in the database "
+				"differ from the cache %s", _idcache.c_str());
+		}
+		try {
+			_ids.save(_idcache);
+		} catch (const std::exception& x) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "id cache not updated: %s",
+				x.what());
+		}
+	}
+}
+
+/**
+ * \brief Close the connection and forget the prepared statement
+ */
+void	database::disconnect() {
+	{
+		std::unique_lock<std::mutex>	lock(_socketmutex);
+		_socket = -1;
+	}
+	if (_insert) {
+		mysql_stmt_close(_insert);
+		_insert = NULL;
+	}
+	for (auto s = _widestatements.begin(); s != _widestatements.end();
+		s++) {
+		mysql_stmt_close(s->second);
+	}
+	_widestatements.clear();
+	if (_mysql) {
+		mysql_close(_mysql);
+		_mysql = NULL;
+	}
+}
+
+/**
+ * \brief Open a connection and read everything derived from it
+ */
+void	database::open() {
+	disconnect();
+	_ids.clear();
+	_widecolumns.clear();
+
 	// create database connection
 	_mysql = mysql_init(NULL);
 	if (NULL == mysql_real_connect(_mysql, _hostname.c_str(),
 		_dbuser.c_str(), _dbpassword.c_str(), _dbname.c_str(),
 		_dbport, NULL, 0)) {
+		std::string	msg = stringprintf("cannot open database "
+			"connection: %s", mysql_error(_mysql));
 		mysql_close(_mysql);
 		_mysql = NULL;
-		std::string	msg("cannot open database connection");
 		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
 		throw std::runtime_error(msg);
 	}
+	{
+		std::unique_lock<std::mutex>	lock(_socketmutex);
+		_socket = mysql_get_socket(_mysql);
+	}
 
+	// read the ids, or take them from the cache if that fails
+	try {
+		readids();
+	} catch (const std::exception& x) {
+		idmap	cached;
+		if ((_idcache.size() == 0) || (!cached.load(_idcache))) {
+			throw;
+		}
+		debug(LOG_WARNING, DEBUG_LOG, 0, "using the ids cached in %s: "
+			"%s", _idcache.c_str(), x.what());
+		_ids = cached;
+		_stationid = _ids.stationid(_stationname);
+	}
+
+	// make sure the wide table has a column for every field
+	if (_wide) {
+		createwide();
+	}
+
+	// the backfill relies on upserts, which need a unique key
+	_unique = uniquekey();
+	if (!_unique) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s has no unique key on the "
+			"timekey, sensor and field, backfill disabled",
+			(_wide) ? "sdatawide" : "sdata");
+	}
+
+	// prepare the insert statement for the narrow layout
+	prepare();
+
+	// find the slots already written
+	loadwritten();
+}
+
+/**
+ * \brief Read the station, sensor and field ids from the database
+ */
+void	database::readids() {
 	// prepare a statement
 	MYSQL_STMT	*stmt = mysql_stmt_init(_mysql);
 	if (NULL == stmt) {
@@ -129,11 +294,12 @@ database::database(const configuration& config,
 		_stationname.c_str(), _stationid);
 
 	// fetch as many rows as there are
+	size_t	rows = 0;
 	while (0 == (rc = mysql_stmt_fetch(stmt))) {
 		debug(LOG_DEBUG, DEBUG_LOG, 0, "adding sensors '%s' -> %d",
 			sensorname, sensorid);
-		_sensors.insert(std::make_pair(std::string(sensorname),
-			sensorid));
+		_ids.addsensor(std::string(sensorname), sensorid);
+		rows++;
 	}
 	if (rc == 1) {
 		std::string	msg = stringprintf("cannot retrieve ids: %s",
@@ -142,6 +308,9 @@ database::database(const configuration& config,
 		mysql_stmt_close(stmt);
 		throw std::runtime_error(msg);
 	}
+	if (rows > 0) {
+		_ids.addstation(_stationname, _stationid);
+	}
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "sensors and fields retrieved");
 
 	// cleanup
@@ -161,139 +330,760 @@ database::database(const configuration& config,
 	while (NULL != (row = mysql_fetch_row(mres))) {
 		std::string	name = std::string(row[0]);
 		int	id = std::stoi(row[1]);
-		_fields.insert(std::make_pair(name, id));
+		_ids.addfield(name, id);
 		debug(LOG_DEBUG, DEBUG_LOG, 0, "'%s' -> %d", name.c_str(), id);
 	}
 	mysql_free_result(mres);
-
-	// launch the thread
-	std::unique_lock<std::mutex>	lock(_mutex);
-	_active = true;
-	_thread = std::thread(database::launch, this);
 }
 
+/**
+ * \brief Close the database connection
+ */
 database::~database() {
-	_active = false;
-	_signal.notify_all();
-	if (_thread.joinable()) {
-		_thread.join();
+	disconnect();
+}
+
+/**
+ * \brief Create the sdatawide table and add missing field columns
+ *
+ * The table has the primary key (timekey, sensorid) and a nullable
+ * float column for each field in the mfield table. Columns for fields
+ * added to mfield later are added when the daemon starts the next time.
+ */
+void	database::createwide() {
+	std::string	query(	"create table if not exists sdatawide ("
+				"  timekey bigint not null,"
+				"  sensorid int not null,"
+				"  primary key (timekey, sensorid)"
+				")");
+	if (mysql_query(_mysql, query.c_str())) {
+		std::string	msg = stringprintf("cannot create sdatawide: %s",
+			mysql_error(_mysql));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+
+	// find the columns the table already has
+	if (mysql_query(_mysql, "show columns from sdatawide")) {
+		std::string	msg = stringprintf("cannot get sdatawide "
+			"columns: %s", mysql_error(_mysql));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	MYSQL_RES	*mres = mysql_store_result(_mysql);
+	MYSQL_ROW	row;
+	while (NULL != (row = mysql_fetch_row(mres))) {
+		_widecolumns.insert(std::string(row[0]));
+	}
+	mysql_free_result(mres);
+
+	// add the columns for the fields
+	if (mysql_query(_mysql, "select name from mfield")) {
+		std::string	msg = stringprintf("cannot retrieve field "
+			"information: %s", mysql_error(_mysql));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	mres = mysql_store_result(_mysql);
+	std::vector<std::string>	fields;
+	while (NULL != (row = mysql_fetch_row(mres))) {
+		fields.push_back(std::string(row[0]));
+	}
+	mysql_free_result(mres);
+	for (auto f = fields.begin(); f != fields.end(); f++) {
+		if (_widecolumns.find(*f) != _widecolumns.end()) {
+			continue;
+		}
+		query = stringprintf("alter table sdatawide add column `%s` "
+			"float", f->c_str());
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "query: '%s'", query.c_str());
+		if (mysql_query(_mysql, query.c_str())) {
+			std::string	msg = stringprintf("cannot add column "
+				"%s: %s", f->c_str(), mysql_error(_mysql));
+			debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+			throw std::runtime_error(msg);
+		}
+		_widecolumns.insert(*f);
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "sdatawide has %d columns",
+		(int)_widecolumns.size());
+}
+
+/**
+ * \brief Make a query waiting for the server fail
+ *
+ * This is called from the supervisor thread. Shutting down the socket
+ * makes the pending call return an error, the sink thread then finds
+ * the connection dead, closes it and throws sinkunavailable.
+ */
+void	database::interrupt() {
+	std::unique_lock<std::mutex>	lock(_socketmutex);
+	if (_socket < 0) {
+		return;
+	}
+	debug(LOG_WARNING, DEBUG_LOG, 0, "interrupting the database "
+		"connection");
+	if (shutdown(_socket, SHUT_RDWR) < 0) {
+		debug(LOG_ERR, DEBUG_LOG, DEBUG_ERRNO, "cannot shut down the "
+			"database socket");
+	}
+}
+
+/**
+ * \brief Write a message accepted by the sink queue to the journal
+ *
+ * \param m	the message accepted
+ */
+void	database::accept(const message& m) {
+	if (_journal) {
+		_journal->append(m);
 	}
 }
 
-void	database::launch(database *d) {
+/**
+ * \brief Store a message
+ *
+ * \param m	the message to store
+ */
+void	database::store(const message& m) {
 	try {
-		debug(LOG_DEBUG, DEBUG_LOG, 0, "launch database thread");
-		d->run();
-		debug(LOG_DEBUG, DEBUG_LOG, 0, "database thread terminates");
-	} catch (const std::exception& x) {
-		debug(LOG_ERR, DEBUG_LOG, 0, "database thread fails with "
-			"exception %s", x.what());
+		commit(std::vector<const message*>(1, &m));
 	} catch (...) {
-		debug(LOG_ERR, DEBUG_LOG, 0, "database thread fails");
+		_backfill = true;
+		throw;
+	}
+	if (_backfill) {
+		backfill();
 	}
 }
 
-void	database::store(const message& m) {
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "storing a new message");
-	// prepare a statment
-	MYSQL_STMT	*stmt = mysql_stmt_init(_mysql);
-	if (NULL == stmt) {
+/**
+ * \brief Store a batch of messages in one transaction
+ *
+ * If any insert fails, the transaction is rolled back, so the batch
+ * can be retried as a whole.
+ *
+ * \param messages	the messages to store
+ */
+void	database::storebatch(const std::vector<message_ptr>& messages) {
+	std::vector<const message*>	batch;
+	for (auto m = messages.begin(); m != messages.end(); m++) {
+		batch.push_back(m->get());
+	}
+	try {
+		commit(batch);
+	} catch (...) {
+		_backfill = true;
+		throw;
+	}
+	if (_backfill) {
+		backfill();
+	}
+}
+
+/**
+ * \brief Insert messages in one transaction and mark their slots
+ *
+ * \param messages	the messages to insert
+ */
+void	database::commit(const std::vector<const message*>& messages) {
+	static histogram&	latency = metrics::newhistogram(
+		"powermeter_db_commit_seconds",
+		"Time to insert and commit a batch");
+	static histogram&	rows = metrics::newhistogram(
+		"powermeter_db_commit_rows", "Values per committed batch",
+		histogram::countbounds());
+	if (NULL == _mysql) {
+		connect();
+	}
+	std::chrono::steady_clock::time_point	start
+		= std::chrono::steady_clock::now();
+	tracespan	span(trace_commit_begin, trace_commit_end);
+	try {
+		if (mysql_query(_mysql, "start transaction")) {
+			std::string	msg = stringprintf("cannot start "
+				"transaction: %s", mysql_error(_mysql));
+			debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+			throw std::runtime_error(msg);
+		}
+		try {
+			for (auto m = messages.begin(); m != messages.end();
+				m++) {
+				insert(**m);
+			}
+		} catch (...) {
+			mysql_rollback(_mysql);
+			throw;
+		}
+		if (mysql_commit(_mysql)) {
+			std::string	msg = stringprintf("cannot commit: %s",
+				mysql_error(_mysql));
+			debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+			mysql_rollback(_mysql);
+			throw std::runtime_error(msg);
+		}
+	} catch (const std::exception& x) {
+		// find out whether the connection is still usable
+		if (mysql_ping(_mysql)) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "connection lost: %s",
+				mysql_error(_mysql));
+			disconnect();
+			throw sinkunavailable(x.what());
+		}
+		throw;
+	}
+	latency.observe(std::chrono::steady_clock::now() - start);
+	size_t	values = 0;
+	for (auto m = messages.begin(); m != messages.end(); m++) {
+		_written.set(std::chrono::duration_cast<std::chrono::seconds>(
+			(*m)->when().time_since_epoch()).count());
+		values += (*m)->size();
+	}
+	rows.observe(values);
+}
+
+/**
+ * \brief Find out whether the data table has a unique key on the slot
+ *
+ * The key must consist of timekey, sensorid and, in the narrow layout,
+ * fieldid, otherwise the upserts insert duplicate rows.
+ */
+bool	database::uniquekey() {
+	std::string	table = (_wide) ? "sdatawide" : "sdata";
+	std::set<std::string>	wanted = { "timekey", "sensorid" };
+	if (!_wide) {
+		wanted.insert("fieldid");
+	}
+	std::string	query = "show index from " + table;
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "query: '%s'", query.c_str());
+	if (mysql_query(_mysql, query.c_str())) {
+		std::string	msg = stringprintf("cannot read the indexes of "
+			"%s: %s", table.c_str(), mysql_error(_mysql));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	// columns of the unique keys by key name
+	std::map<std::string, std::set<std::string> >	keys;
+	MYSQL_RES	*mres = mysql_store_result(_mysql);
+	MYSQL_ROW	row;
+	while (NULL != (row = mysql_fetch_row(mres))) {
+		if (std::string(row[1]) == "0") {
+			keys[row[2]].insert(row[4]);
+		}
+	}
+	mysql_free_result(mres);
+	for (auto k = keys.begin(); k != keys.end(); k++) {
+		if (k->second == wanted) {
+			debug(LOG_DEBUG, DEBUG_LOG, 0, "unique key %s on %s",
+				k->first.c_str(), table.c_str());
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * \brief Read the slots written for the station from the database
+ */
+void	database::loadwritten() {
+	std::string	query = stringprintf("select distinct d.timekey "
+		"from %s d, sensor s "
+		"where d.sensorid = s.id "
+		"  and s.stationid = %d "
+		"  and d.timekey >= %lld",
+		(_wide) ? "sdatawide" : "sdata", _stationid,
+		(long long)_written.first());
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "query: '%s'", query.c_str());
+	if (mysql_query(_mysql, query.c_str())) {
+		std::string	msg = stringprintf("cannot read written time "
+			"keys: %s", mysql_error(_mysql));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	MYSQL_RES	*mres = mysql_store_result(_mysql);
+	MYSQL_ROW	row;
+	size_t	count = 0;
+	while (NULL != (row = mysql_fetch_row(mres))) {
+		_written.set(std::stoll(row[0]));
+		count++;
+	}
+	mysql_free_result(mres);
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "%lu time keys written since %lld",
+		count, (long long)_written.first());
+}
+
+/**
+ * \brief Store the journaled messages for slots missing in the database
+ *
+ * The messages are committed in chunks of commitrows rows. Errors are
+ * logged and not thrown, so that the batch whose commit triggered the
+ * backfill is not reported as failed. If the connection is lost, the
+ * backfill is tried again after the next successful commit.
+ */
+void	database::backfill() {
+	_backfill = false;
+	if ((!_journal) || (!_unique)) {
+		return;
+	}
+	std::vector<message>	journaled = _journal->messages();
+	std::vector<const message*>	missing;
+	for (auto m = journaled.begin(); m != journaled.end(); m++) {
+		int64_t	timekey = std::chrono::duration_cast<
+			std::chrono::seconds>(m->when().time_since_epoch())
+				.count();
+		if ((!_written.test(timekey))
+			&& (0 == _quarantined.count(timekey))) {
+			missing.push_back(&*m);
+		}
+	}
+	if (missing.size() > 0) {
+		debug(LOG_INFO, DEBUG_LOG, 0, "backfilling %lu of %lu journaled "
+			"messages", missing.size(), journaled.size());
+		try {
+			std::vector<const message*>	chunk;
+			size_t	rows = 0;
+			for (auto m = missing.begin(); m != missing.end(); m++) {
+				chunk.push_back(*m);
+				rows += (*m)->size();
+				if ((rows >= _commitrows)
+					|| (m + 1 == missing.end())) {
+					backfill(chunk);
+					chunk.clear();
+					rows = 0;
+				}
+			}
+		} catch (const std::exception& x) {
+			debug(LOG_WARNING, DEBUG_LOG, 0, "backfill interrupted: "
+				"%s", x.what());
+			_backfill = true;
+			return;
+		}
+	}
+
+	// report what the journal could not fill
+	if (journaled.size() > 0) {
+		int64_t	from = std::chrono::duration_cast<std::chrono::seconds>(
+			journaled.front().when().time_since_epoch()).count();
+		int64_t	to = std::chrono::duration_cast<std::chrono::seconds>(
+			journaled.back().when().time_since_epoch()).count();
+		std::vector<std::pair<int64_t, int64_t> >	g = gaps(from, to);
+		for (auto i = g.begin(); i != g.end(); i++) {
+			debug(LOG_WARNING, DEBUG_LOG, 0, "no data from %lld to "
+				"%lld", (long long)i->first,
+				(long long)i->second);
+		}
+	}
+}
+
+/**
+ * \brief Commit a chunk of journaled messages
+ *
+ * If the chunk fails while the connection is still there, its messages
+ * are committed one at a time. The slot of a message that fails on its
+ * own is quarantined, so that it is not backfilled again and cannot
+ * hold up the other messages.
+ *
+ * \param chunk	the messages to commit
+ */
+void	database::backfill(const std::vector<const message*>& chunk) {
+	try {
+		commit(chunk);
+		return;
+	} catch (const sinkunavailable&) {
+		throw;
+	} catch (const std::exception& x) {
+		if (chunk.size() == 1) {
+			int64_t	timekey = std::chrono::duration_cast<
+				std::chrono::seconds>(chunk.front()->when()
+					.time_since_epoch()).count();
+			debug(LOG_ERR, DEBUG_LOG, 0, "journaled message at "
+				"%lld quarantined: %s", (long long)timekey,
+				x.what());
+			_quarantined.insert(timekey);
+			return;
+		}
+		debug(LOG_WARNING, DEBUG_LOG, 0, "backfill of %lu messages "
+			"failed, committing them one at a time: %s",
+			chunk.size(), x.what());
+	}
+	for (auto m = chunk.begin(); m != chunk.end(); m++) {
+		backfill(std::vector<const message*>(1, *m));
+	}
+}
+
+/**
+ * \brief Time ranges without data for the station
+ *
+ * Only the last gapwindow seconds are known, earlier times count as
+ * missing.
+ *
+ * \param from	start of the time range
+ * \param to	end of the time range (exclusive)
+ */
+std::vector<std::pair<int64_t, int64_t> >	database::gaps(int64_t from,
+		int64_t to) const {
+	return _written.gaps(from, to);
+}
+
+/**
+ * \brief Insert a message in the layout selected in the configuration
+ *
+ * \param m	the message to insert
+ */
+void	database::insert(const message& m) {
+	if (_wide) {
+		storewide(m);
+	} else {
+		storenarrow(m);
+	}
+}
+
+/**
+ * \brief Prepare the insert statement of the narrow layout
+ *
+ * The parameters are bound to members, so the statement is prepared
+ * and bound only once per connection.
+ */
+void	database::prepare() {
+	_insert = mysql_stmt_init(_mysql);
+	if (NULL == _insert) {
 		throw std::runtime_error("cannot construct a statement");
 	}
 	std::string	query(
 		"insert into sdata(timekey, sensorid, fieldid, value) "
-		"values (?, ?, ?, ?)");
-	int	rc = mysql_stmt_prepare(stmt, query.c_str(), query.size());
-	if (0 != rc) {
+		"values (?, ?, ?, ?) "
+		"on duplicate key update value = values(value)");
+	if (0 != mysql_stmt_prepare(_insert, query.c_str(), query.size())) {
 		std::string	msg = stringprintf("cannot prepare statement "
-			"'%s': %s", query.c_str(), mysql_error(_mysql));
+			"'%s': %s", query.c_str(), mysql_stmt_error(_insert));
 		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
-		mysql_stmt_close(stmt);
 		throw std::runtime_error(msg);
 	}
 
 	// bind the parameters
-	MYSQL_BIND	parameters[4];
-	memset(parameters, 0, sizeof(parameters));
-	long long	timekey = std::chrono::duration_cast<std::chrono::seconds>(m.when().time_since_epoch()).count();
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "timekey = %ld", timekey);
-	parameters[0].buffer = &timekey;
-	parameters[0].buffer_type = MYSQL_TYPE_LONGLONG;
-	char	sid;
-	parameters[1].buffer = &sid;
-	parameters[1].buffer_type = MYSQL_TYPE_TINY;
-	char	fid;
-	parameters[2].buffer = &fid;
-	parameters[2].buffer_type = MYSQL_TYPE_TINY;
-	float	value;
-	parameters[3].buffer = &value;
-	parameters[3].buffer_type = MYSQL_TYPE_FLOAT;
-	rc = mysql_stmt_bind_param(stmt, parameters);
-	if (0 != rc) {
+	memset(_parameters, 0, sizeof(_parameters));
+	_parameters[0].buffer = &_timekey;
+	_parameters[0].buffer_type = MYSQL_TYPE_LONGLONG;
+	_parameters[1].buffer = &_sid;
+	_parameters[1].buffer_type = MYSQL_TYPE_TINY;
+	_parameters[2].buffer = &_fid;
+	_parameters[2].buffer_type = MYSQL_TYPE_TINY;
+	_parameters[3].buffer = &_value;
+	_parameters[3].buffer_type = MYSQL_TYPE_FLOAT;
+	if (0 != mysql_stmt_bind_param(_insert, _parameters)) {
 		std::string	msg = stringprintf("cannot bind: %s",
-			mysql_stmt_error(stmt));
+			mysql_stmt_error(_insert));
 		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
 		throw std::runtime_error(msg);
 	}
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "parameters bound");
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "insert statement prepared");
+}
+
+/**
+ * \brief Store a message with one row per value
+ *
+ * \param m	the message to store
+ */
+void	database::storenarrow(const message& m) {
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "storing a new message");
+	_timekey = std::chrono::duration_cast<std::chrono::seconds>(
+		m.when().time_since_epoch()).count();
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "timekey = %lld", _timekey);
 
 	// go through the message
 	for (auto i = m.begin(); i != m.end(); i++) {
-		//debug(LOG_DEBUG, DEBUG_LOG, 0, "store value for %s",
-		//	i->first.c_str());
-		sid = sensorid(i->first);
-		fid = fieldid(i->first);
-		value = i->second;
-		rc = mysql_stmt_execute(stmt);
-		if (0 != rc) {
+		_sid = sensorid(i->first);
+		_fid = fieldid(i->first);
+		_value = i->second;
+		tracespan	span(trace_execute_begin, trace_execute_end);
+		if (0 != mysql_stmt_execute(_insert)) {
 			std::string	msg = stringprintf("execute failed: %s",
-				mysql_stmt_error(stmt));
+				mysql_stmt_error(_insert));
 			debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
-			mysql_stmt_close(stmt);
 			throw std::runtime_error(msg);
 		}
 	}
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "all values stored");
-	
-	// cleanup
-	mysql_stmt_close(stmt);
 }
 
-void	database::run() {
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "running database thread");
-	while (_active) {
-		debug(LOG_DEBUG, DEBUG_LOG, 0, "waiting for message");
-		message	m = _queue.extract(_timeout);
-		// send the message to the database
-		debug(LOG_DEBUG, DEBUG_LOG, 0, "storing message");
-		store(m);
+/**
+ * \brief Get the prepared insert statement for a set of columns
+ *
+ * The statements are prepared once per connection, a message usually
+ * has the same columns for every sensor and every minute.
+ *
+ * \param fields	the field names of the columns in parameter order
+ */
+MYSQL_STMT	*database::widestatement(const std::vector<std::string>& fields) {
+	std::string	columns;
+	for (auto f = fields.begin(); f != fields.end(); f++) {
+		columns += ", `" + *f + "`";
+	}
+	auto	s = _widestatements.find(columns);
+	if (s != _widestatements.end()) {
+		return s->second;
 	}
+	std::string	placeholders;
+	std::string	updates;
+	for (auto f = fields.begin(); f != fields.end(); f++) {
+		placeholders += ", ?";
+		updates += std::string((updates.size()) ? ", " : "")
+			+ "`" + *f + "` = values(`" + *f + "`)";
+	}
+	std::string	query = "insert into sdatawide(timekey, sensorid"
+		+ columns + ") values (?, ?" + placeholders + ") "
+		+ "on duplicate key update " + updates;
+	MYSQL_STMT	*stmt = mysql_stmt_init(_mysql);
+	if (NULL == stmt) {
+		throw std::runtime_error("cannot construct a statement");
+	}
+	if (mysql_stmt_prepare(stmt, query.c_str(), query.size())) {
+		std::string	msg = stringprintf("cannot prepare "
+			"statement '%s': %s", query.c_str(),
+			mysql_stmt_error(stmt));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		mysql_stmt_close(stmt);
+		throw std::runtime_error(msg);
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "prepared '%s'", query.c_str());
+	_widestatements[columns] = stmt;
+	return stmt;
 }
 
-char	database::sensorid(const std::string& sfname) const {
-	std::string	key = sfname;
-	size_t	l = sfname.find(".");
-	if (std::string::npos != l) {
-		key = sfname.substr(0, l);
+/**
+ * \brief Store a message with one row per sensor
+ *
+ * The values of the message are grouped by sensor, and each group is
+ * inserted as a single row whose columns are the fields present in
+ * the message.
+ *
+ * \param m	the message to store
+ */
+void	database::storewide(const message& m) {
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "storing a new message in wide rows");
+	long long	timekey = std::chrono::duration_cast<std::chrono::seconds>(
+		m.when().time_since_epoch()).count();
+
+	// group the values by sensor
+	std::map<int, std::vector<std::pair<std::string, float> > >	rows;
+	for (auto i = m.begin(); i != m.end(); i++) {
+		int	sid = sensorid(i->first);
+		fieldid(i->first);
+		std::string	field = i->first.substr(i->first.find('.') + 1);
+		if (_widecolumns.find(field) == _widecolumns.end()) {
+			std::string	msg = stringprintf("no column for field "
+				"%s", field.c_str());
+			debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+			throw std::runtime_error(msg);
+		}
+		rows[sid].push_back(std::make_pair(field, i->second));
 	}
-	auto	i = _sensors.find(key);
-	if (i == _fields.end()) {
-		throw std::runtime_error("field name not found");
+
+	// insert one row per sensor
+	for (auto r = rows.begin(); r != rows.end(); r++) {
+		std::vector<std::string>	fields;
+		for (auto f = r->second.begin(); f != r->second.end(); f++) {
+			fields.push_back(f->first);
+		}
+		MYSQL_STMT	*stmt = widestatement(fields);
+
+		// bind the parameters
+		size_t	n = r->second.size() + 2;
+		std::vector<MYSQL_BIND>	parameters(n);
+		memset(parameters.data(), 0, n * sizeof(MYSQL_BIND));
+		parameters[0].buffer = &timekey;
+		parameters[0].buffer_type = MYSQL_TYPE_LONGLONG;
+		int	sid = r->first;
+		parameters[1].buffer = &sid;
+		parameters[1].buffer_type = MYSQL_TYPE_LONG;
+		std::vector<float>	values;
+		for (auto f = r->second.begin(); f != r->second.end(); f++) {
+			values.push_back(f->second);
+		}
+		for (size_t j = 0; j < values.size(); j++) {
+			parameters[j + 2].buffer = &values[j];
+			parameters[j + 2].buffer_type = MYSQL_TYPE_FLOAT;
+		}
+		tracespan	span(trace_execute_begin, trace_execute_end);
+		if (mysql_stmt_bind_param(stmt, parameters.data())
+			|| mysql_stmt_execute(stmt)) {
+			std::string	msg = stringprintf("execute failed: %s",
+				mysql_stmt_error(stmt));
+			debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+			throw std::runtime_error(msg);
+		}
 	}
-	return i->second;
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "%d wide rows stored",
+		(int)rows.size());
+}
+
+/**
+ * \brief Quote a string for use in a query
+ *
+ * \param s	the string to quote
+ */
+std::string	database::quote(const std::string& s) {
+	char	buffer[2 * s.size() + 1];
+	mysql_real_escape_string(_mysql, buffer, s.c_str(), s.size());
+	return std::string("'") + buffer + "'";
 }
 
-char	database::fieldid(const std::string& sfname) const {
-	std::string	key = sfname;
-	size_t	l = sfname.find(".");
-	if (std::string::npos != l) {
-		key = sfname.substr(l+1);
+/**
+ * \brief Execute a query that returns no result
+ *
+ * \param query	the query to execute
+ */
+void	database::execute(const std::string& query) {
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "query: '%s'", query.c_str());
+	tracespan	span(trace_execute_begin, trace_execute_end);
+	if (mysql_query(_mysql, query.c_str())) {
+		std::string	msg = stringprintf("cannot execute '%s': %s",
+			query.c_str(), mysql_error(_mysql));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
 	}
-	auto	i = _fields.find(key);
-	if (i == _fields.end()) {
-		throw std::runtime_error("field name not found");
+}
+
+/**
+ * \brief Execute a query returning an id in the first column
+ *
+ * \param query	the query to execute
+ * \return	the id of the first row, -1 if there is no row
+ */
+int	database::queryid(const std::string& query) {
+	execute(query);
+	MYSQL_RES	*res = mysql_store_result(_mysql);
+	if (NULL == res) {
+		std::string	msg = stringprintf("no result for '%s': %s",
+			query.c_str(), mysql_error(_mysql));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	int	id = -1;
+	MYSQL_ROW	row = mysql_fetch_row(res);
+	if ((NULL != row) && (NULL != row[0])) {
+		id = std::stoi(row[0]);
+	}
+	mysql_free_result(res);
+	return id;
+}
+
+/**
+ * \brief Create the missing station, sensor and mfield rows
+ *
+ * All rows are created in a single transaction, so either the complete
+ * station description is added or nothing. New rows get the next id
+ * after the largest id of the table. Afterwards the ids are read again.
+ *
+ * \param stations	the stations from the XML station file
+ */
+void	database::bootstrap(const stationfile& stations) {
+	if (NULL == _mysql) {
+		connect();
+	}
+	int	created = 0;
+	execute("start transaction");
+	try {
+		std::set<std::string>	fields;
+		std::vector<std::string>	names = stations.stations();
+		for (auto st = names.begin(); st != names.end(); st++) {
+			// the station
+			int	stationid = queryid("select id from station "
+				"where name = " + quote(*st));
+			if (stationid < 0) {
+				stationid = queryid("select coalesce(max(id), 0)"
+					" + 1 from station for update");
+				execute(stringprintf("insert into station(id, "
+					"name) values (%d, %s)", stationid,
+					quote(*st).c_str()));
+				debug(LOG_INFO, DEBUG_LOG, 0, "station %s "
+					"created with id %d", st->c_str(),
+					stationid);
+				created++;
+			}
+
+			// its sensors
+			const stationfile::sensormap&	sensors
+				= stations.sensors(*st);
+			for (auto se = sensors.begin(); se != sensors.end();
+				se++) {
+				int	sensorid = queryid(stringprintf(
+					"select id from sensor where "
+					"stationid = %d and name = %s",
+					stationid, quote(se->first).c_str()));
+				if (sensorid < 0) {
+					sensorid = queryid("select coalesce("
+						"max(id), 0) + 1 from sensor "
+						"for update");
+					execute(stringprintf("insert into "
+						"sensor(name, id, stationid) "
+						"values (%s, %d, %d)",
+						quote(se->first).c_str(),
+						sensorid, stationid));
+					debug(LOG_INFO, DEBUG_LOG, 0, "sensor "
+						"%s.%s created with id %d",
+						st->c_str(), se->first.c_str(),
+						sensorid);
+					created++;
+				}
+				fields.insert(se->second.begin(),
+					se->second.end());
+			}
+		}
+
+		// the fields are shared by all sensors
+		for (auto f = fields.begin(); f != fields.end(); f++) {
+			if (queryid("select id from mfield where name = "
+				+ quote(*f)) >= 0) {
+				continue;
+			}
+			int	fieldid = queryid("select coalesce(max(id), 0) "
+				"+ 1 from mfield for update");
+			execute(stringprintf("insert into mfield(id, name) "
+				"values (%d, %s)", fieldid, quote(*f).c_str()));
+			debug(LOG_INFO, DEBUG_LOG, 0, "field %s created with "
+				"id %d", f->c_str(), fieldid);
+			created++;
+		}
+	} catch (...) {
+		mysql_rollback(_mysql);
+		throw;
+	}
+	if (mysql_commit(_mysql)) {
+		std::string	msg = stringprintf("cannot commit: %s",
+			mysql_error(_mysql));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		mysql_rollback(_mysql);
+		throw std::runtime_error(msg);
+	}
+	debug(LOG_INFO, DEBUG_LOG, 0, "bootstrap created %d rows", created);
+
+	// read the ids again
+	if (created > 0) {
+		connect();
+	}
+}
+
+/**
+ * \brief Make sure that all value names resolve to ids
+ *
+ * \param names	the value names of the form sensor.field
+ */
+void	database::check(const std::vector<std::string>& names) const {
+	std::string	missing;
+	for (auto i = names.begin(); i != names.end(); i++) {
+		if (!_ids.has(*i)) {
+			missing = missing + ((missing.size()) ? ", " : "") + *i;
+		}
+	}
+	if (missing.size() > 0) {
+		std::string	msg = stringprintf("no ids for %s in station %s",
+			missing.c_str(), _stationname.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
 	}
-	return i->second;
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "all %d names have ids",
+		(int)names.size());
 }
 
 } // namespace powermeter
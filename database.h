@@ -6,18 +6,67 @@
 #ifndef _database_h
 #define _database_h
 
-#include <message.h>
+#include <sink.h>
+#include <idmap.h>
+#include <journal.h>
+#include <minutemap.h>
+#include <stationfile.h>
 #include <mysql.h>
 #include <string>
-#include <thread>
+#include <set>
+#include <map>
+#include <vector>
+#include <memory>
 #include <mutex>
-#include <condition_variable>
 #include <configuration.h>
-#include <atomic>
 
 namespace powermeter {
 
-class database {
+/**
+ * \brief Sink writing messages into the sdata table of a MySQL database
+ *
+ * In the default narrow layout every value of a message becomes a row
+ * (timekey, sensorid, fieldid, value) of the sdata table. In the wide
+ * layout (sdatalayout = wide) all values of a sensor with the same
+ * timekey are packed into a single row of the sdatawide table, which
+ * has one column for each field in the mfield table.
+ *
+ * A batch of messages is inserted in a single transaction, so that
+ * the log is flushed once per batch instead of once per row.
+ *
+ * Inserts are upserts on the key (timekey, sensorid, fieldid), so a
+ * message can be stored again without creating duplicate rows. The
+ * sink remembers in a minutemap which slots of the last gapwindow
+ * seconds (default one week) have been written for the station. If
+ * journalfile is set, every message is written once to a local journal
+ * of the journalsize (default 10000) most recent messages when the sink
+ * queue accepts it, so the journal also holds the messages still
+ * waiting in the queue. At startup and after a failed batch has been
+ * followed by a successful one, the messages of the journal for slots
+ * that are missing in the database are stored again, in chunks of
+ * commitrows rows. A journaled message that cannot be stored on its own
+ * is quarantined and not retried. The backfill is disabled if the data
+ * table has no unique key on the slot, because the upserts would then
+ * insert duplicate rows.
+ *
+ * The connection is opened in the thread of the sink queue. If
+ * idcachefile is set, the ids are taken from that file until the
+ * database has been reached, and the file is rewritten whenever the
+ * ids read from the database differ from it. If the ids cannot be read
+ * from the database, the cached ids are used.
+ *
+ * The bootstrap method creates the station, sensor and mfield rows
+ * described by an XML station file that are missing in the database,
+ * check verifies that a list of value names resolves to ids.
+ *
+ * If the connection is lost, the sink closes it and throws
+ * sinkunavailable, the sink queue then keeps the messages and retries
+ * with backoff. The next attempt connects again and reads the ids,
+ * prepares the statement and reloads the written slots. The interrupt
+ * method shuts down the socket of the connection, so that a query
+ * waiting for a hung server fails and the connection is reopened.
+ */
+class database : public sink {
 	// database parameters
 	std::string	_hostname;
 	std::string	_dbname;
@@ -26,34 +75,72 @@ class database {
 	int		_dbport;
 	std::string	_stationname;
 	char		_stationid;
-	std::map<std::string, int>	_fields;
-	std::map<std::string, int>	_sensors;
+	idmap		_ids;
+	std::string	_idcache;
+	bool		_wide;
+	std::set<std::string>	_widecolumns;
+	std::unique_ptr<journal>	_journal;
+	minutemap	_written;
+	bool		_backfill;
+	bool		_unique;
+	size_t		_commitrows;
+	// time keys of journaled messages that cannot be backfilled
+	std::set<int64_t>	_quarantined;
 	MYSQL		*_mysql;
+	// socket of the connection, for interrupt from another thread
+	std::mutex	_socketmutex;
+	int		_socket;
+	// insert statement of the narrow layout and its parameters
+	MYSQL_STMT	*_insert;
+	MYSQL_BIND	_parameters[4];
+	long long	_timekey;
+	char		_sid;
+	char		_fid;
+	float		_value;
+	// insert statements of the wide layout by column list
+	std::map<std::string, MYSQL_STMT*>	_widestatements;
+	MYSQL_STMT	*widestatement(const std::vector<std::string>& fields);
+	void	connect();
+	void	disconnect();
+	void	open();
+	void	readids();
+	void	prepare();
+	void	createwide();
+	bool	uniquekey();
+	void	loadwritten();
+	void	backfill();
+	void	backfill(const std::vector<const message*>& chunk);
+	void	commit(const std::vector<const message*>& messages);
+	void	insert(const message& m);
+	void	storenarrow(const message& m);
+	void	storewide(const message& m);
+	std::string	quote(const std::string& s);
+	void	execute(const std::string& query);
+	int	queryid(const std::string& query);
 public:
 	const std::string&	hostname() const { return _hostname; }
 	const std::string&	dbname() const { return _dbname; }
 	const std::string&	dbuser() const { return _dbuser; }
 	const std::string&	dbpassword() const { return _dbpassword; }
 	const char&	stationid() const { return _stationid; }
-	char	sensorid(const std::string& name) const;
-	char	fieldid(const std::string& fieldname) const;
-private:
-	// the queue
-	std::chrono::seconds	_timeout;
-	messagequeue&	_queue;
-
-	// processing thread
-	std::atomic<bool>	_active;
-	std::thread		_thread;
-	std::mutex		_mutex;
-	std::condition_variable	_signal;
-public:
-	database(const configuration& config,
-		messagequeue& queue);
+	char	sensorid(const std::string& name) const {
+		return _ids.sensorid(name);
+	}
+	char	fieldid(const std::string& fieldname) const {
+		return _ids.fieldid(fieldname);
+	}
+	const idmap&	ids() const { return _ids; }
+	database(const configuration& config);
 	~database();
-	void	store(const message& m);
-	static void	launch(database *d);
-	void	run();
+	virtual void	start();
+	virtual void	accept(const message& m);
+	void	bootstrap(const stationfile& stations);
+	void	check(const std::vector<std::string>& names) const;
+	virtual void	store(const message& m);
+	virtual void	storebatch(const std::vector<message_ptr>& messages);
+	virtual void	interrupt();
+	std::vector<std::pair<int64_t, int64_t> >	gaps(int64_t from,
+		int64_t to) const;
 };
 
 } // namespace powermeter
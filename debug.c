@@ -290,7 +290,7 @@ static void	_vdebug(int loglevel, const char *file, int line, int flags,
 	debug_rotate(".old");
 }
 
-void	debug(int loglevel, const char *file, int line, int flags,
+void	(debug)(int loglevel, const char *file, int line, int flags,
 	const char *format, ...) {
 	va_list	ap;
 	va_start(ap, format);
@@ -18,7 +18,11 @@
 #include <thread>
 #include <iostream>
 #include <sstream>
-#include <map>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <chrono>
+#include <pthread.h>
 #include <unistd.h>
 #include <syslog.h>
 #include <sys/time.h>
@@ -30,6 +34,7 @@
 int	debuglevel = LOG_ERR;
 int	debugtimeprecision = 0;
 int	debugthreads = 0;
+int	debugasync = 1;
 
 int	debugmaxlines = 0;
 int	debugnfiles = 0;
@@ -44,7 +49,7 @@ static char	*debug_ident = NULL;
 
 #define	DEBUG_IDENT	((debug_ident) ? debug_ident : "powermeter")
 
-extern "C" void	debug(int loglevel, const char *file, int line,
+extern "C" void	(debug)(int loglevel, const char *file, int line,
 	int flags, const char *format, ...) {
 	va_list ap;
 	if (loglevel > debuglevel) { return; }
@@ -53,10 +58,15 @@ extern "C" void	debug(int loglevel, const char *file, int line,
 	va_end(ap);
 }
 
+// changing the destination waits for the writer thread, messages logged
+// before the change still go to the old destination
+static std::unique_lock<std::mutex>	lock_destination();
+
 extern "C" void debug_set_ident(const char *ident) {
 	if (NULL == ident) {
 		return;
 	}
+	std::unique_lock<std::mutex>	lock = lock_destination();
 	if (debug_ident) {
 		free(debug_ident);
 		debug_ident = NULL;
@@ -65,19 +75,21 @@ extern "C" void debug_set_ident(const char *ident) {
 }
 
 extern "C" void	debug_syslog(int facility) {
+	std::unique_lock<std::mutex>	lock = lock_destination();
 	openlog(DEBUG_IDENT, LOG_NDELAY, facility);
 	debug_destination = DEBUG_SYSLOG;
 	logfilename = NULL;
 }
 
 extern "C" void	debug_stderr() {
+	std::unique_lock<std::mutex>	lock = lock_destination();
 	debug_destination = DEBUG_STDERR;
 	logfilename = NULL;
 }
 
 static int	debug_filedescriptor = -1;
 
-extern "C" void debug_fd(int fd) {
+static void	set_fd(int fd) {
 	logfilename = NULL;
 	if (debug_filedescriptor >= 0) {
 		close(debug_filedescriptor);
@@ -87,9 +99,14 @@ extern "C" void debug_fd(int fd) {
 	debug_destination = DEBUG_FD;
 }
 
+extern "C" void debug_fd(int fd) {
+	std::unique_lock<std::mutex>	lock = lock_destination();
+	set_fd(fd);
+}
+
 static int	linecounter = 0;
 
-extern "C" int debug_file(const char *filename) {
+static int	open_file(const char *filename) {
 	// find out whether the file exists
 	struct stat	sb;
 	if (stat(filename, &sb) < 0) {
@@ -103,11 +120,16 @@ extern "C" int debug_file(const char *filename) {
 	if (fd < 0) {
 		return -1;
 	}
-	debug_fd(fd);
+	set_fd(fd);
 	logfilename = strdup(filename);
 	return 0;
 }
 
+extern "C" int debug_file(const char *filename) {
+	std::unique_lock<std::mutex>	lock = lock_destination();
+	return open_file(filename);
+}
+
 static void	rotate_logfile() {
 	// if the log file name is not known, we cannot rotate the log file
 	if (NULL == logfilename) {
@@ -145,10 +167,49 @@ static void	rotate_logfile() {
 		rename(logfilename, to);
 	}
 	// reopen a new log file
-	debug_file(logfilename);
+	open_file(logfilename);
 }
 
-#define	MSGSIZE	8192
+#define	MSGSIZE		8192
+#define	RECORDSIZE	512
+#define	RINGSIZE	1024
+
+/**
+ * \brief A log record on its way from the logging thread to the writer
+ *
+ * The message text has to be formatted by the caller, because a va_list
+ * cannot be kept beyond the call. Everything else is kept raw: the time
+ * stamp, the errno value and the thread number are only turned into text
+ * by the writer. The file name is the __FILE__ literal, so keeping the
+ * pointer is safe.
+ */
+struct logrecord {
+	unsigned long	sequence;
+	int	loglevel;
+	const char	*file;
+	int	line;
+	int	flags;
+	int	error;
+	int	thread;
+	struct timeval	tv;
+	char	text[RECORDSIZE];
+};
+
+/**
+ * \brief Single producer single consumer ring of log records
+ *
+ * Only the owning thread advances head, only the writer advances tail,
+ * so neither side needs a lock. When the ring is full, the record is
+ * dropped and counted.
+ */
+struct logring {
+	logrecord	records[RINGSIZE];
+	std::atomic<unsigned int>	head;
+	std::atomic<unsigned int>	tail;
+	std::atomic<unsigned long>	dropped;
+	std::atomic<bool>	orphaned;
+	logring() : head(0), tail(0), dropped(0), orphaned(false) { }
+};
 
 /**
  * \brief auxiliary class to prevent the use of a static object
@@ -158,45 +219,200 @@ static void	rotate_logfile() {
  * been destroyed, leading to a crash at the end of the program.
  *
  * This class resolves the problem by instantiating the class once on the
- * heap and never destroying it. However, there is another problem with the
- * class namely that there is no mechanism to limit the size of the thread_map
- * member. This map gets a new entry each time a new thread logs something.
+ * heap and never destroying it. It owns the rings of all threads and the
+ * writer thread, which formats the records, writes them and rotates the
+ * log file. Rings of threads that have terminated are released by the
+ * writer as soon as they are empty, so the number of rings is bounded by
+ * the number of live threads.
  */
-class thread_helper {
-	int	nextthreadid;
-	typedef std::map<std::thread::id, int>	thread_map_t;
-	thread_map_t	thread_map;
+class log_backend {
+	std::mutex	ringmutex;
+	std::vector<logring *>	rings;
+	std::atomic<unsigned long>	sequence;
+	void	run();
 public:
-	std::recursive_mutex	mtx;
-	thread_helper() {
-		nextthreadid = 1;
+	std::mutex	writemutex;
+	std::atomic<unsigned long>	lost;
+	std::atomic<bool>	restart;
+	log_backend() : sequence(0), lost(0), restart(false) { }
+	logring	*newring();
+	unsigned long	nextsequence() {
+		return sequence.fetch_add(1, std::memory_order_relaxed);
 	}
-	int	lookupthreadid(std::thread::id);
-	static int	id();
+	void	drain();
+	void	start();
+	void	orphan(logring *keep);
+	void	prepare() { writemutex.lock(); drain(); ringmutex.lock(); }
+	void	release() { ringmutex.unlock(); writemutex.unlock(); }
 };
-static thread_helper	*th = NULL;
+static log_backend	*backend = NULL;
 
-struct std::once_flag	thread_helper_once;
+static std::once_flag	backend_once;
 
-void	thread_helper_initialize() {
-	th = new thread_helper();
+static void	backend_prepare() {
+	backend->prepare();
 }
 
-int	thread_helper::lookupthreadid(std::thread::id id) {
-	std::unique_lock<std::recursive_mutex>	lock(mtx);
-	thread_map_t::const_iterator	i = thread_map.find(id);
-	if (i != thread_map.end()) {
-		return i->second;
+static void	backend_parent() {
+	backend->release();
+}
+
+/**
+ * \brief Marks the ring of a thread as orphaned when the thread exits
+ */
+struct ringholder {
+	logring	*ring;
+	ringholder() : ring(NULL) { }
+	~ringholder() {
+		if (ring) {
+			ring->orphaned.store(true, std::memory_order_release);
+		}
 	}
-	int	newid = nextthreadid++;
-	thread_map.insert(std::make_pair(id, newid));
-	return newid;
+};
+static thread_local ringholder	holder;
+
+/**
+ * \brief Restart the backend in a forked child
+ *
+ * Only the thread calling fork survives in the child, so the rings of all
+ * other threads will never be written to again, and the writer has to be
+ * restarted. Starting a thread inside the fork handler is not safe, so
+ * this is left to the next call of vdebug.
+ */
+static void	backend_child() {
+	backend->release();
+	backend->orphan(holder.ring);
+	backend->restart = true;
+}
+
+static void	backend_exit() {
+	std::unique_lock<std::mutex>	lock(backend->writemutex);
+	backend->drain();
+}
+
+static void	backend_initialize() {
+	backend = new log_backend();
+	pthread_atfork(backend_prepare, backend_parent, backend_child);
+	atexit(backend_exit);
+	backend->start();
+}
+
+static std::unique_lock<std::mutex>	lock_destination() {
+	std::call_once(backend_once, backend_initialize);
+	std::unique_lock<std::mutex>	lock(backend->writemutex);
+	backend->drain();
+	return lock;
+}
+
+static std::atomic<int>	nextthreadid(1);
+static thread_local int	threadnumber = 0;
+
+static int	currentthread() {
+	if (0 == threadnumber) {
+		threadnumber = nextthreadid++;
+	}
+	return threadnumber;
 }
 
-int	thread_helper::id() {
-	// make sure thread helper is initialized
-	std::call_once(thread_helper_once, thread_helper_initialize);
-	return th->lookupthreadid(std::this_thread::get_id());
+logring	*log_backend::newring() {
+	logring	*ring = new logring();
+	std::unique_lock<std::mutex>	lock(ringmutex);
+	rings.push_back(ring);
+	return ring;
+}
+
+void	log_backend::orphan(logring *keep) {
+	std::unique_lock<std::mutex>	lock(ringmutex);
+	for (auto i = rings.begin(); i != rings.end(); i++) {
+		if (*i != keep) {
+			(*i)->tail.store((*i)->head.load());
+			(*i)->orphaned.store(true, std::memory_order_release);
+		}
+	}
+}
+
+void	log_backend::start() {
+	std::thread	writer(&log_backend::run, this);
+	writer.detach();
+}
+
+void	log_backend::run() {
+	while (1) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		std::unique_lock<std::mutex>	lock(writemutex);
+		drain();
+	}
+}
+
+static void	emit(const logrecord& record, const char *text);
+
+/**
+ * \brief Write all records waiting in the rings, in the order of logging
+ *
+ * The caller must hold the writemutex, which makes the calling thread
+ * the only consumer of the rings.
+ */
+void	log_backend::drain() {
+	// collect the waiting records, the producers never touch slots
+	// between tail and the head read here
+	std::vector<std::pair<logring *, unsigned int> >	heads;
+	std::vector<const logrecord *>	pending;
+	{
+		std::unique_lock<std::mutex>	lock(ringmutex);
+		for (auto i = rings.begin(); i != rings.end(); i++) {
+			logring	*ring = *i;
+			unsigned int	h = ring->head.load(
+						std::memory_order_acquire);
+			unsigned int	t = ring->tail.load(
+						std::memory_order_relaxed);
+			for (; t != h; t++) {
+				pending.push_back(&ring->records[t % RINGSIZE]);
+			}
+			heads.push_back(std::make_pair(ring, h));
+		}
+	}
+	std::sort(pending.begin(), pending.end(),
+		[](const logrecord *a, const logrecord *b) {
+			return a->sequence < b->sequence;
+		});
+	for (auto i = pending.begin(); i != pending.end(); i++) {
+		emit(**i, (*i)->text);
+	}
+
+	// give the slots back and collect the number of lost messages
+	unsigned long	dropped = 0;
+	for (auto i = heads.begin(); i != heads.end(); i++) {
+		i->first->tail.store(i->second, std::memory_order_release);
+		dropped += i->first->dropped.exchange(0);
+	}
+	if (dropped > 0) {
+		lost += dropped;
+		logrecord	record;
+		memset(&record, 0, sizeof(record));
+		record.loglevel = LOG_WARNING;
+		record.file = __FILE__;
+		record.line = __LINE__;
+		record.flags = DEBUG_NOFILELINE;
+		record.thread = currentthread();
+		gettimeofday(&record.tv, NULL);
+		snprintf(record.text, sizeof(record.text),
+			"%lu log messages lost", dropped);
+		emit(record, record.text);
+	}
+
+	// release the rings of threads that have gone away
+	std::unique_lock<std::mutex>	lock(ringmutex);
+	auto	i = rings.begin();
+	while (i != rings.end()) {
+		logring	*ring = *i;
+		if (ring->orphaned.load(std::memory_order_acquire)
+			&& (ring->head.load() == ring->tail.load())) {
+			delete ring;
+			i = rings.erase(i);
+		} else {
+			i++;
+		}
+	}
 }
 
 static void	writeout(char *prefix, char *msgbuffer) {
@@ -212,98 +428,91 @@ static void	writeout(char *prefix, char *msgbuffer) {
 	char	msgbuffer2[MSGSIZE];
 	snprintf(msgbuffer2, sizeof(msgbuffer2), "%s %s",
 		prefix, msgbuffer);
-	{
-		std::unique_lock<std::recursive_mutex>	lock(th->mtx);
-		linecounter++;
-		lseek(debug_filedescriptor, 0, SEEK_END);
-		if (write(debug_filedescriptor, msgbuffer2,
-			strlen(msgbuffer2)) < 0) {
-			std::cerr << "cannot write to debug fd=";
-			std::cerr << debug_filedescriptor;
-			std::cerr << ": ";
-			std::cerr << strerror(errno);
-			std::cerr << std::endl;
-		}
-		if (write(debug_filedescriptor, "\n", 1) < 0) {
-			std::cerr << "cannot write to debug fd=";
-			std::cerr << debug_filedescriptor;
-			std::cerr << ": ";
-			std::cerr << strerror(errno);
-			std::cerr << std::endl;
-		}
-		// check whether we have to rotate the 
-		if ((debugmaxlines > 0) && (linecounter >= debugmaxlines)) {
-			rotate_logfile();
-		}
+	linecounter++;
+	lseek(debug_filedescriptor, 0, SEEK_END);
+	if (write(debug_filedescriptor, msgbuffer2,
+		strlen(msgbuffer2)) < 0) {
+		std::cerr << "cannot write to debug fd=";
+		std::cerr << debug_filedescriptor;
+		std::cerr << ": ";
+		std::cerr << strerror(errno);
+		std::cerr << std::endl;
+	}
+	if (write(debug_filedescriptor, "\n", 1) < 0) {
+		std::cerr << "cannot write to debug fd=";
+		std::cerr << debug_filedescriptor;
+		std::cerr << ": ";
+		std::cerr << strerror(errno);
+		std::cerr << std::endl;
+	}
+	// check whether we have to rotate the 
+	if ((debugmaxlines > 0) && (linecounter >= debugmaxlines)) {
+		rotate_logfile();
 	}
 }
 
-extern "C" void vdebug(int loglevel, const char *file, int line,
-	int flags, const char *format, va_list ap) {
-	//time_t		t;
-	struct tm	*tmp;
-	char	msgbuffer[MSGSIZE], prefix[MSGSIZE],
-		msgbuffer2[MSGSIZE], tstp[MSGSIZE],
+/**
+ * \brief Format a record and write it to the destination
+ *
+ * This is called with the writemutex held, usually by the writer thread.
+ */
+static void	emit(const logrecord& record, const char *text) {
+	struct tm	tms;
+	char	msgbuffer[MSGSIZE], prefix[MSGSIZE], tstp[MSGSIZE],
 		threadid[20];
-	int	localerrno;
-
-	if (loglevel > debuglevel) { return; }
 
 	// message content
-	localerrno = errno;
-	vsnprintf(msgbuffer2, sizeof(msgbuffer2), format, ap);
-	if (flags & DEBUG_ERRNO) {
+	if (record.flags & DEBUG_ERRNO) {
 		snprintf(msgbuffer, sizeof(msgbuffer), "%s: %s (%d)",
-			msgbuffer2, strerror(localerrno), localerrno);
+			text, strerror(record.error), record.error);
 	} else {
-		strcpy(msgbuffer, msgbuffer2);
+		snprintf(msgbuffer, sizeof(msgbuffer), "%s", text);
 	}
 
-	// get time
-	struct timeval	tv;
-	gettimeofday(&tv, NULL);
-	tmp = localtime(&tv.tv_sec);
-	size_t	bytes = strftime(tstp, sizeof(tstp), "%b %e %H:%M:%S", tmp);
+	// format time
+	localtime_r(&record.tv.tv_sec, &tms);
+	size_t	bytes = strftime(tstp, sizeof(tstp), "%b %e %H:%M:%S", &tms);
 
 	// high resolution time
 	if (debugtimeprecision > 0) {
 		if (debugtimeprecision > 6) {
 			debugtimeprecision = 6;
 		}
-		unsigned int	u = tv.tv_usec;
+		unsigned int	u = record.tv.tv_usec;
 		int	p = 6 - debugtimeprecision;
 		while (p--) { u /= 10; }
 		snprintf(tstp + bytes, sizeof(tstp) - bytes, ".%0*u",
 			debugtimeprecision, u);
 	}
 
-	// find the current thread id if necessary
+	// the thread id if necessary
 	if (debugthreads) {
 		snprintf(threadid, sizeof(threadid), "[%d/%d]", getpid(),
-			thread_helper::id());
+			record.thread);
 	} else {
 		snprintf(threadid, sizeof(threadid), "[%d]", getpid());
 	}
 
 	// handle syslog case, where we have a much simpler 
 	if (debug_destination == DEBUG_SYSLOG) {
-		if (flags & DEBUG_NOFILELINE) {
+		if (record.flags & DEBUG_NOFILELINE) {
 			snprintf(prefix, sizeof(prefix), "%s", threadid);
 		} else {
 			snprintf(prefix, sizeof(prefix), "%s %s:%03d:",
-				threadid, file, line);
+				threadid, record.file, record.line);
 		}
-		syslog(loglevel, "%s %s", prefix, msgbuffer);
+		syslog(record.loglevel, "%s %s", prefix, msgbuffer);
 		return;
 	}
 
 	// get prefix
-	if (flags & DEBUG_NOFILELINE) {
+	if (record.flags & DEBUG_NOFILELINE) {
 		snprintf(prefix, sizeof(prefix), "%s %s[%d%s]:",
 			tstp, DEBUG_IDENT, getpid(), threadid);
 	} else {
 		snprintf(prefix, sizeof(prefix), "%s %s[%d%s] %s:%03d:",
-			tstp, DEBUG_IDENT, getpid(), threadid, file, line);
+			tstp, DEBUG_IDENT, getpid(), threadid, record.file,
+			record.line);
 	}
 
 	// split msgbuffer at newlines
@@ -325,3 +534,94 @@ extern "C" void vdebug(int loglevel, const char *file, int line,
 	}
 }
 
+/**
+ * \brief Write everything waiting in the rings
+ *
+ * Messages at level LOG_ERR and above flush implicitly, so that the
+ * message explaining an abort() is not lost.
+ */
+extern "C" void	debug_flush() {
+	std::call_once(backend_once, backend_initialize);
+	std::unique_lock<std::mutex>	lock(backend->writemutex);
+	backend->drain();
+}
+
+/**
+ * \brief Number of messages lost because a ring was full
+ */
+extern "C" unsigned long	debug_lost() {
+	std::call_once(backend_once, backend_initialize);
+	return backend->lost.load();
+}
+
+extern "C" void vdebug(int loglevel, const char *file, int line,
+	int flags, const char *format, va_list ap) {
+	if (loglevel > debuglevel) { return; }
+	std::call_once(backend_once, backend_initialize);
+
+	// a forked child has to restart the writer on first use
+	if (backend->restart.load(std::memory_order_relaxed)) {
+		if (backend->restart.exchange(false)) {
+			backend->start();
+		}
+	}
+
+	// find a free slot in the ring of this thread, if the ring is
+	// full, only errors are written synchronously
+	logring	*ring = NULL;
+	unsigned int	h = 0;
+	bool	queued = false;
+	if (debugasync) {
+		if (NULL == holder.ring) {
+			holder.ring = backend->newring();
+		}
+		ring = holder.ring;
+		h = ring->head.load(std::memory_order_relaxed);
+		unsigned int	t = ring->tail.load(std::memory_order_acquire);
+		queued = (h - t < RINGSIZE);
+		if ((!queued) && (loglevel > LOG_ERR)) {
+			ring->dropped.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+	}
+	logrecord	local;
+	logrecord	*record = (queued) ? &ring->records[h % RINGSIZE] : &local;
+
+	// record the raw data, only the message text is formatted here
+	record->error = errno;
+	gettimeofday(&record->tv, NULL);
+	record->sequence = backend->nextsequence();
+	record->loglevel = loglevel;
+	record->file = file;
+	record->line = line;
+	record->flags = flags;
+	record->thread = currentthread();
+	va_list	aq;
+	va_copy(aq, ap);
+	int	length = vsnprintf(record->text, sizeof(record->text),
+				format, ap);
+
+	// hand the record to the writer thread
+	if ((queued) && (length < RECORDSIZE)) {
+		va_end(aq);
+		ring->head.store(h + 1, std::memory_order_release);
+		if (loglevel <= LOG_ERR) {
+			debug_flush();
+		}
+		return;
+	}
+
+	// messages that do not fit into a record, errors that find
+	// the ring full and synchronous mode are written directly, after
+	// everything logged before them
+	char	msgbuffer[MSGSIZE];
+	const char	*text = record->text;
+	if (length >= RECORDSIZE) {
+		vsnprintf(msgbuffer, sizeof(msgbuffer), format, aq);
+		text = msgbuffer;
+	}
+	va_end(aq);
+	std::unique_lock<std::mutex>	lock(backend->writemutex);
+	backend->drain();
+	emit(*record, text);
+}
@@ -21,6 +21,7 @@ extern "C" {
 extern int	debuglevel;
 extern int	debugtimeprecision;
 extern int	debugthreads;
+extern int	debugasync;
 extern int	debugmaxlines;
 extern int	debugnfiles;
 extern void	debug(int loglevel, const char *filename, int line,
@@ -33,9 +34,33 @@ extern void	debug_syslog(int facility);
 extern void	debug_stderr();
 extern void	debug_fd(int fd);
 extern int	debug_file(const char *filename);
+extern void	debug_flush();
+extern unsigned long	debug_lost();
 
 #ifdef __cplusplus
 }
 #endif
 
+/*
+ * Messages above DEBUG_MAXLEVEL are removed at compile time, configure
+ * with --disable-debuglog to drop all LOG_DEBUG messages. Messages above
+ * the runtime debuglevel are skipped before their arguments are evaluated,
+ * so expensive arguments cost nothing when the level is off. Preparation
+ * that does not fit into the argument list should be guarded with
+ * debug_enabled.
+ */
+#ifndef DEBUG_MAXLEVEL
+#define DEBUG_MAXLEVEL		LOG_DEBUG
+#endif
+
+#define debug_enabled(loglevel)						\
+	(((loglevel) <= DEBUG_MAXLEVEL) && ((loglevel) <= debuglevel))
+
+#define debug(loglevel, ...)						\
+	do {								\
+		if (debug_enabled(loglevel)) {				\
+			(debug)(loglevel, __VA_ARGS__);			\
+		}							\
+	} while (0)
+
 #endif /* _debug_h */
@@ -0,0 +1,159 @@
+//
+// dispatcher.cpp
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <dispatcher.h>
+#include <debug.h>
+#include <format.h>
+
+namespace powermeter {
+
+/**
+ * \brief Start the sink queues and the thread feeding them
+ *
+ * \param config	configuration for the timeout and the sink queues
+ * \param queue		the queue to take the messages from
+ * \param sinks		the sinks to store the messages in
+ */
+dispatcher::dispatcher(const configuration& config, messagequeue& queue,
+	const std::vector<std::shared_ptr<sink> >& sinks)
+	: _queue(queue),
+	  _timeout(std::chrono::seconds(config.intvalue("timeout", 80))),
+	  _messages(0), _rows(0) {
+	for (auto s = sinks.begin(); s != sinks.end(); s++) {
+		_sinkqueues.push_back(std::shared_ptr<sinkqueue>(
+			new sinkqueue(config, *s)));
+	}
+	_active = true;
+	_thread = std::thread(dispatcher::launch, this);
+}
+
+/**
+ * \brief Stop the thread
+ *
+ * The queue is terminated to wake up the thread waiting for the next
+ * message, so it cannot be used any more afterwards.
+ */
+dispatcher::~dispatcher() {
+	_active = false;
+	_queue.terminate();
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+}
+
+void	dispatcher::launch(dispatcher *d) {
+	try {
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "launch dispatcher thread");
+		d->run();
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "dispatcher thread terminates");
+	} catch (const std::exception& x) {
+		// the queue is terminated when the dispatcher is stopped
+		debug((d->_active) ? LOG_ERR : LOG_DEBUG, DEBUG_LOG, 0,
+			"dispatcher thread fails with exception %s", x.what());
+	} catch (...) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "dispatcher thread fails");
+	}
+}
+
+void	dispatcher::run() {
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "running dispatcher thread");
+	while (_active) {
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "waiting for message");
+		message_ptr	m(new message(_queue.extract(_timeout)),
+			[this](const message *p) {
+				completed(*p);
+				delete p;
+			});
+
+		// hand the message to all sinks
+		for (auto s = _sinkqueues.begin(); s != _sinkqueues.end(); s++) {
+			(*s)->submit(m);
+		}
+	}
+}
+
+/**
+ * \brief Store all messages before shutting down
+ *
+ * The meter has to be stopped already. The dispatcher thread keeps
+ * going until the queue is empty, then it is stopped, so that the
+ * message it was handling has reached the sink queues, and finally the
+ * sink queues are drained.
+ *
+ * \param timeout	how long to wait for the messages to be stored
+ * \return		whether all messages were stored in time
+ */
+bool	dispatcher::drain(const std::chrono::duration<float>& timeout) {
+	std::chrono::steady_clock::time_point	deadline
+		= std::chrono::steady_clock::now()
+		+ std::chrono::duration_cast<
+			std::chrono::steady_clock::duration>(timeout);
+	debug(LOG_INFO, DEBUG_LOG, 0, "draining %lu messages",
+		_queue.depth());
+	while ((_queue.depth() > 0)
+		&& (std::chrono::steady_clock::now() < deadline)) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	}
+	_active = false;
+	_queue.terminate();
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+	bool	drained = (_queue.depth() == 0);
+	for (auto s = _sinkqueues.begin(); s != _sinkqueues.end(); s++) {
+		if (!(*s)->drain(deadline)) {
+			drained = false;
+		}
+	}
+	return drained;
+}
+
+/**
+ * \brief Update the statistics when all sinks are done with a message
+ *
+ * \param m	the completed message
+ */
+void	dispatcher::completed(const message& m) {
+	std::chrono::duration<float>	latency
+		= std::chrono::steady_clock::now() - m.submitted();
+	std::unique_lock<std::mutex>	lock(_statsmutex);
+	_messages++;
+	_rows += m.size();
+	_latencies.push_back(latency.count());
+}
+
+/**
+ * \brief Get the state of all sink queues
+ */
+std::vector<std::pair<std::string, sinklag> >	dispatcher::lags() {
+	std::vector<std::pair<std::string, sinklag> >	result;
+	for (auto s = _sinkqueues.begin(); s != _sinkqueues.end(); s++) {
+		result.push_back(std::make_pair((*s)->name(), (*s)->lag()));
+	}
+	return result;
+}
+
+/**
+ * \brief Retrieve and reset the statistics
+ *
+ * The latencies are the times in seconds between the submission of a
+ * message to the queue and the moment the last sink released it.
+ *
+ * \param messages	number of messages stored since the last call
+ * \param rows		number of rows stored since the last call
+ * \param latencies	the latencies of all these messages
+ */
+void	dispatcher::statistics(size_t& messages, size_t& rows,
+		std::vector<float>& latencies) {
+	std::unique_lock<std::mutex>	lock(_statsmutex);
+	messages = _messages;
+	rows = _rows;
+	latencies.swap(_latencies);
+	_latencies.clear();
+	_messages = 0;
+	_rows = 0;
+}
+
+} // namespace powermeter
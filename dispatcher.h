@@ -0,0 +1,64 @@
+//
+// dispatcher.h -- consumer of the message queue feeding the sinks
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _dispatcher_h
+#define _dispatcher_h
+
+#include <message.h>
+#include <sink.h>
+#include <sinkqueue.h>
+#include <configuration.h>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+
+namespace powermeter {
+
+/**
+ * \brief Thread taking messages from the queue and fanning them out
+ *
+ * Every sink has its own sinkqueue, the dispatcher only hands a shared
+ * reference to each message to all of them, so a slow or failing sink
+ * does not hold up the others. A message counts as completed when the
+ * last sink has released it. At shutdown, drain hands the messages
+ * still in the queue to the sinks and waits for them to be stored.
+ */
+class dispatcher {
+	messagequeue&	_queue;
+	std::chrono::seconds	_timeout;
+
+	// statistics about the completed messages
+	std::mutex		_statsmutex;
+	size_t			_messages;
+	size_t			_rows;
+	std::vector<float>	_latencies;
+	void	completed(const message& m);
+
+	// the sinks, destroyed before the statistics
+	std::vector<std::shared_ptr<sinkqueue> >	_sinkqueues;
+
+	// processing thread
+	std::atomic<bool>	_active;
+	std::thread		_thread;
+public:
+	dispatcher(const configuration& config, messagequeue& queue,
+		const std::vector<std::shared_ptr<sink> >& sinks);
+	~dispatcher();
+	static void	launch(dispatcher *d);
+	void	run();
+	bool	drain(const std::chrono::duration<float>& timeout);
+	void	statistics(size_t& messages, size_t& rows,
+			std::vector<float>& latencies);
+	std::vector<std::pair<std::string, sinklag> >	lags();
+	const std::vector<std::shared_ptr<sinkqueue> >&	sinkqueues() const {
+		return _sinkqueues;
+	}
+};
+
+} // namespace powermeter
+
+#endif /* _dispatcher_h */
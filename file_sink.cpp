@@ -0,0 +1,64 @@
+//
+// file_sink.cpp
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <file_sink.h>
+#include <debug.h>
+#include <format.h>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+namespace powermeter {
+
+/**
+ * \brief Open the file for appending
+ *
+ * \param config	the configuration, the file name is in sinkfile
+ */
+file_sink::file_sink(const configuration& config)
+	: sink("file"),
+	  _filename(config.stringvalue("sinkfile", "powermeter.csv")) {
+	_file = fopen(_filename.c_str(), "a");
+	if (NULL == _file) {
+		std::string	msg = stringprintf("cannot open %s: %s",
+			_filename.c_str(), strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "writing messages to %s",
+		_filename.c_str());
+}
+
+/**
+ * \brief Close the file
+ */
+file_sink::~file_sink() {
+	fclose(_file);
+}
+
+/**
+ * \brief Append the values of a message
+ *
+ * The file is flushed after each message, so that a crash loses at most
+ * the message currently being written.
+ *
+ * \param m	the message to write
+ */
+void	file_sink::store(const message& m) {
+	long long	timekey = std::chrono::duration_cast<std::chrono::seconds>(
+		m.when().time_since_epoch()).count();
+	for (auto i = m.begin(); i != m.end(); i++) {
+		fprintf(_file, "%lld,%s,%.9g\n", timekey, i->first.c_str(),
+			i->second);
+	}
+	if (0 != fflush(_file)) {
+		std::string	msg = stringprintf("cannot write to %s: %s",
+			_filename.c_str(), strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+}
+
+} // namespace powermeter
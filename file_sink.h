@@ -0,0 +1,29 @@
+//
+// file_sink.h -- sink writing messages as lines of text
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _file_sink_h
+#define _file_sink_h
+
+#include <sink.h>
+#include <configuration.h>
+#include <cstdio>
+
+namespace powermeter {
+
+/**
+ * \brief Sink appending one line timekey,name,value per value to a file
+ */
+class file_sink : public sink {
+	std::string	_filename;
+	FILE	*_file;
+public:
+	file_sink(const configuration& config);
+	~file_sink();
+	virtual void	store(const message& m);
+};
+
+} // namespace powermeter
+
+#endif /* _file_sink_h */
@@ -0,0 +1,235 @@
+//
+// flightrecorder.cpp -- per thread binary trace of the data path
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <flightrecorder.h>
+#include <debug.h>
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/param.h>
+
+namespace powermeter {
+
+#define	TRACE_THREADS	64
+#define	TRACE_EVENTS	8192
+
+const char	flightrecorder::magic[8] = { 'P', 'M', 'T', 'R', 'A', 'C', 'E',
+			'1' };
+
+/**
+ * \brief The ring of one thread
+ *
+ * next counts all events ever written, the event goes to the slot
+ * next modulo the ring size. When a thread exits, its ring is given
+ * to the next new thread, but keeps its events until they are
+ * overwritten.
+ */
+struct tracering {
+	std::atomic<bool>	inuse;
+	std::atomic<uint64_t>	next;
+	traceevent	events[TRACE_EVENTS];
+	tracering() : inuse(false), next(0) {
+		memset(events, 0, sizeof(events));
+	}
+};
+
+static std::atomic<tracering *>	rings[TRACE_THREADS];
+static std::atomic<uint32_t>	nextthread(1);
+static char	dumpfilename[MAXPATHLEN + 1] = "";
+
+/**
+ * \brief Claims a ring for the thread and releases it on thread exit
+ */
+struct traceholder {
+	tracering	*ring;
+	uint32_t	thread;
+	bool	claimed;
+	traceholder() : ring(NULL), thread(0), claimed(false) { }
+	~traceholder() {
+		if (ring) {
+			ring->inuse.store(false);
+		}
+	}
+	void	claim();
+};
+
+void	traceholder::claim() {
+	claimed = true;
+	thread = nextthread++;
+	for (int i = 0; i < TRACE_THREADS; i++) {
+		tracering	*r = rings[i].load();
+		if (NULL == r) {
+			tracering	*n = new tracering();
+			if (rings[i].compare_exchange_strong(r, n)) {
+				r = n;
+			} else {
+				delete n;
+			}
+		}
+		bool	expected = false;
+		if (r->inuse.compare_exchange_strong(expected, true)) {
+			ring = r;
+			return;
+		}
+	}
+	// all rings are taken, this thread does not record anything
+}
+
+static thread_local traceholder	holder;
+
+static uint64_t	nanoseconds(clockid_t clock) {
+	struct timespec	ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/**
+ * \brief Record an event in the ring of the calling thread
+ *
+ * \param type		the event type
+ * \param value		a number further describing the event, e.g. the
+ *			number of bytes received
+ */
+void	flightrecorder::record(tracetype type, double value) {
+	if (!holder.claimed) {
+		holder.claim();
+	}
+	tracering	*ring = holder.ring;
+	if (NULL == ring) {
+		return;
+	}
+	uint64_t	n = ring->next.load(std::memory_order_relaxed);
+	traceevent&	e = ring->events[n % TRACE_EVENTS];
+	e.nanoseconds = nanoseconds(CLOCK_MONOTONIC);
+	e.thread = holder.thread;
+	e.type = type;
+	e.value = value;
+	ring->next.store(n + 1, std::memory_order_release);
+}
+
+static bool	writeall(int fd, const void *data, size_t size) {
+	const char	*p = (const char *)data;
+	while (size > 0) {
+		ssize_t	rc = write(fd, p, size);
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		p += rc;
+		size -= rc;
+	}
+	return true;
+}
+
+/**
+ * \brief Write the header and the rings of all threads to a descriptor
+ *
+ * The events of each ring are written oldest first. Events that are
+ * being written while the dump runs may be torn, the conversion tool
+ * has to tolerate that.
+ *
+ * \param fd	the file descriptor to write to
+ */
+int	flightrecorder::dump(int fd) {
+	traceheader	header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, magic, sizeof(header.magic));
+	header.version = 1;
+	header.eventsize = sizeof(traceevent);
+	header.offset = (int64_t)nanoseconds(CLOCK_REALTIME)
+			- (int64_t)nanoseconds(CLOCK_MONOTONIC);
+	header.pid = getpid();
+	if (!writeall(fd, &header, sizeof(header))) {
+		return -1;
+	}
+	for (int i = 0; i < TRACE_THREADS; i++) {
+		tracering	*ring = rings[i].load();
+		if (NULL == ring) {
+			continue;
+		}
+		uint64_t	n = ring->next.load(std::memory_order_acquire);
+		size_t	start = n % TRACE_EVENTS;
+		bool	ok = true;
+		if (n >= TRACE_EVENTS) {
+			ok = writeall(fd, ring->events + start,
+				(TRACE_EVENTS - start) * sizeof(traceevent));
+		}
+		if ((!ok) || (!writeall(fd, ring->events,
+			start * sizeof(traceevent)))) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * \brief Dump the rings to the file set with install
+ */
+int	flightrecorder::dump() {
+	if (0 == dumpfilename[0]) {
+		return -1;
+	}
+	int	fd = open(dumpfilename, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+	if (fd < 0) {
+		return -1;
+	}
+	int	rc = dump(fd);
+	close(fd);
+	return rc;
+}
+
+static void	dumphandler(int /* sig */) {
+	int	saved = errno;
+	flightrecorder::dump();
+	errno = saved;
+}
+
+static void	fatalhandler(int sig) {
+	flightrecorder::dump();
+	// the handler was reset on entry, so this terminates the process
+	// the way the signal would have without the flight recorder
+	raise(sig);
+}
+
+/**
+ * \brief Install the signal handlers that dump the rings
+ *
+ * SIGUSR1 dumps the rings and continues, the fatal signals dump the
+ * rings and then terminate the process with the default action.
+ *
+ * \param filename	the file to dump to, it is overwritten by each dump
+ */
+void	flightrecorder::install(const std::string& filename) {
+	if (filename.size() >= sizeof(dumpfilename)) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "trace file name too long: %s",
+			filename.c_str());
+		return;
+	}
+	strcpy(dumpfilename, filename.c_str());
+
+	struct sigaction	sa;
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = dumphandler;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	sa.sa_handler = fatalhandler;
+	sa.sa_flags = SA_RESETHAND;
+	int	fatal[] = { SIGABRT, SIGSEGV, SIGBUS, SIGFPE, SIGILL };
+	for (unsigned int i = 0; i < sizeof(fatal) / sizeof(fatal[0]); i++) {
+		sigaction(fatal[i], &sa, NULL);
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "flight recorder dumps to %s",
+		dumpfilename);
+}
+
+} // namespace powermeter
@@ -0,0 +1,104 @@
+//
+// flightrecorder.h -- per thread binary trace of the data path
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _flightrecorder_h
+#define _flightrecorder_h
+
+#include <string>
+#include <cstdint>
+
+namespace powermeter {
+
+/**
+ * \brief Events recorded by the flight recorder
+ *
+ * The numbers are part of the dump format, new events go at the end.
+ */
+enum tracetype {
+	trace_poll_begin = 1,
+	trace_poll_end = 2,
+	trace_receive = 3,
+	trace_reject = 4,
+	trace_accumulate = 5,
+	trace_submit = 6,
+	trace_extract = 7,
+	trace_execute_begin = 8,
+	trace_execute_end = 9,
+	trace_commit_begin = 10,
+	trace_commit_end = 11
+};
+
+/**
+ * \brief Reasons for a trace_reject event, stored as the value
+ */
+enum tracereject {
+	reject_size = 1,
+	reject_format = 2,
+	reject_id = 3,
+	reject_crc = 4
+};
+
+/**
+ * \brief One event as it is kept in the ring and written to the dump
+ *
+ * The time stamp is taken from CLOCK_MONOTONIC, the dump header contains
+ * the offset to the real time clock at the time of the dump.
+ */
+struct traceevent {
+	uint64_t	nanoseconds;
+	uint32_t	thread;
+	uint16_t	type;
+	uint16_t	reserved;
+	double	value;
+};
+
+/**
+ * \brief Header of a dump file, followed by the events of all threads
+ */
+struct traceheader {
+	char	magic[8];
+	uint32_t	version;
+	uint32_t	eventsize;
+	int64_t	offset;
+	int32_t	pid;
+	uint32_t	reserved;
+};
+
+/**
+ * \brief Fixed size trace rings of all threads
+ *
+ * Every thread writes its events into its own ring without locks, when
+ * the ring is full the oldest events are overwritten. The rings are
+ * only read when they are dumped, which happens on SIGUSR1 and on fatal
+ * signals including the SIGABRT raised by abort(). Dumping only uses
+ * async signal safe functions. pmtrace converts a dump into the Chrome
+ * trace event format.
+ */
+class flightrecorder {
+public:
+	static const char	magic[8];
+	static void	record(tracetype type, double value = 0);
+	static void	install(const std::string& filename);
+	static int	dump();
+	static int	dump(int fd);
+};
+
+/**
+ * \brief Record a begin event now and the end event when leaving the scope
+ */
+class tracespan {
+	tracetype	_end;
+public:
+	tracespan(tracetype begin, tracetype end) : _end(end) {
+		flightrecorder::record(begin);
+	}
+	~tracespan() {
+		flightrecorder::record(_end);
+	}
+};
+
+} // namespace powermeter
+
+#endif /* _flightrecorder_h */
@@ -0,0 +1,275 @@
+//
+// gorilla.cpp -- compressed blocks of time series points
+//
+// Time stamp encoding of the delta of deltas d:
+//	d == 0			'0'
+//	-64 <= d <= 63		'10'   followed by 7 bits
+//	-256 <= d <= 255	'110'  followed by 9 bits
+//	-2048 <= d <= 2047	'1110' followed by 12 bits
+//	otherwise		'1111' followed by 32 bits
+// Value encoding of the XOR x with the previous value:
+//	x == 0			'0'
+//	inside previous window	'10'  followed by the meaningful bits
+//	otherwise		'11'  followed by 5 bits leading zeros,
+//				5 bits length - 1 and the meaningful bits
+// The first point has no time stamp in the stream (it is in the header)
+// and its value is stored with all 32 bits.
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <gorilla.h>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+namespace powermeter {
+
+static void	put(unsigned char *p, uint64_t value, int bytes) {
+	for (int i = 0; i < bytes; i++) {
+		p[i] = value & 0xff;
+		value >>= 8;
+	}
+}
+
+static uint64_t	get(const unsigned char *p, int bytes) {
+	uint64_t	result = 0;
+	for (int i = bytes - 1; i >= 0; i--) {
+		result = (result << 8) | p[i];
+	}
+	return result;
+}
+
+static int	leadingzeros(uint32_t x) {
+	return (x == 0) ? 32 : __builtin_clz(x);
+}
+
+static int	trailingzeros(uint32_t x) {
+	return (x == 0) ? 32 : __builtin_ctz(x);
+}
+
+/**
+ * \brief Reader for the bit stream of a block
+ */
+class bitreader {
+	const unsigned char	*_data;
+	size_t	_position;
+	size_t	_limit;
+public:
+	bitreader(const unsigned char *data, size_t limit)
+		: _data(data), _position(0), _limit(limit) { }
+	uint64_t	read(int nbits) {
+		if (_position + nbits > _limit) {
+			throw std::runtime_error("corrupt block");
+		}
+		uint64_t	result = 0;
+		while (nbits > 0) {
+			int	available = 8 - (_position & 7);
+			int	take = std::min(available, nbits);
+			int	bits = (_data[_position >> 3] >> (available - take))
+					& ((1 << take) - 1);
+			result = (result << take) | bits;
+			_position += take;
+			nbits -= take;
+		}
+		return result;
+	}
+};
+
+static int64_t	signextend(uint64_t value, int nbits) {
+	uint64_t	sign = 1ULL << (nbits - 1);
+	return (int64_t)(value ^ sign) - (int64_t)sign;
+}
+
+static uint32_t	floatbits(float value) {
+	uint32_t	bits;
+	memcpy(&bits, &value, sizeof(bits));
+	return bits;
+}
+
+static float	bitsfloat(uint32_t bits) {
+	float	value;
+	memcpy(&value, &bits, sizeof(value));
+	return value;
+}
+
+/**
+ * \brief Create an empty block
+ */
+gorilla_block::gorilla_block() : _count(0), _bits(0), _first(0), _last(0),
+	_delta(0), _value(0), _leading(-1), _trailing(0) {
+	memset(_data, 0, sizeof(_data));
+	writeheader();
+}
+
+/**
+ * \brief Reconstruct a block and its encoder state from its bytes
+ *
+ * This is used to continue appending to the last block of a series
+ * after a restart.
+ *
+ * \param data	blocksize bytes of a block
+ */
+gorilla_block::gorilla_block(const unsigned char *data) : _count(0),
+	_bits(0), _first(0), _last(0), _delta(0), _value(0), _leading(-1),
+	_trailing(0) {
+	std::vector<tspoint>	p = decode(data);
+	memset(_data, 0, sizeof(_data));
+	writeheader();
+	for (auto i = p.begin(); i != p.end(); i++) {
+		append(i->timekey, i->value);
+	}
+}
+
+void	gorilla_block::writeheader() {
+	put(_data, _count, 2);
+	put(_data + 2, _bits, 2);
+	put(_data + 8, _first, 8);
+	put(_data + 16, _last, 8);
+}
+
+void	gorilla_block::write(uint64_t value, int nbits) {
+	unsigned char	*stream = _data + headersize;
+	while (nbits > 0) {
+		int	available = 8 - (_bits & 7);
+		int	take = std::min(available, nbits);
+		int	bits = (value >> (nbits - take)) & ((1 << take) - 1);
+		stream[_bits >> 3] |= bits << (available - take);
+		_bits += take;
+		nbits -= take;
+	}
+}
+
+/**
+ * \brief Append a point to the block
+ *
+ * Time keys must not decrease.
+ *
+ * \param timekey	the time of the point in seconds since the epoch
+ * \param value		the value
+ * \return		false if the block is full
+ */
+bool	gorilla_block::append(int64_t timekey, float value) {
+	// the worst case for a point is 36 bits time stamp and 44 bits value
+	if ((_bits + 80 > capacity) || (_count == 0xffff)) {
+		return false;
+	}
+	if ((_count > 0) && (timekey < _last)) {
+		throw std::runtime_error("time keys must not decrease");
+	}
+	uint32_t	bits = floatbits(value);
+	if (_count == 0) {
+		_first = timekey;
+		write(bits, 32);
+	} else {
+		// the time stamp
+		int64_t	delta = timekey - _last;
+		int64_t	dod = delta - _delta;
+		if (dod == 0) {
+			write(0, 1);
+		} else if ((dod >= -64) && (dod <= 63)) {
+			write(2, 2);
+			write(dod & 0x7f, 7);
+		} else if ((dod >= -256) && (dod <= 255)) {
+			write(6, 3);
+			write(dod & 0x1ff, 9);
+		} else if ((dod >= -2048) && (dod <= 2047)) {
+			write(14, 4);
+			write(dod & 0xfff, 12);
+		} else {
+			write(15, 4);
+			write(dod & 0xffffffff, 32);
+		}
+		_delta = delta;
+
+		// the value
+		uint32_t	x = bits ^ _value;
+		if (x == 0) {
+			write(0, 1);
+		} else {
+			int	leading = std::min(leadingzeros(x), 31);
+			int	trailing = trailingzeros(x);
+			if ((_leading >= 0) && (leading >= _leading)
+				&& (trailing >= _trailing)) {
+				write(2, 2);
+				write(x >> _trailing, 32 - _leading - _trailing);
+			} else {
+				int	length = 32 - leading - trailing;
+				write(3, 2);
+				write(leading, 5);
+				write(length - 1, 5);
+				write(x >> trailing, length);
+				_leading = leading;
+				_trailing = trailing;
+			}
+		}
+	}
+	_value = bits;
+	_last = timekey;
+	_count++;
+	writeheader();
+	return true;
+}
+
+/**
+ * \brief Decode the points of this block
+ */
+std::vector<tspoint>	gorilla_block::points() const {
+	return decode(_data);
+}
+
+/**
+ * \brief Decode the points of a block
+ *
+ * \param data	blocksize bytes of a block
+ */
+std::vector<tspoint>	gorilla_block::decode(const unsigned char *data) {
+	unsigned short	count = get(data, 2);
+	size_t	nbits = get(data + 2, 2);
+	if (nbits > capacity) {
+		throw std::runtime_error("corrupt block");
+	}
+	std::vector<tspoint>	result;
+	result.reserve(count);
+	if (count == 0) {
+		return result;
+	}
+	bitreader	reader(data + headersize, nbits);
+	int64_t	timekey = get(data + 8, 8);
+	int64_t	delta = 0;
+	uint32_t	value = reader.read(32);
+	int	leading = 0;
+	int	trailing = 0;
+	result.push_back(tspoint(timekey, bitsfloat(value)));
+	for (unsigned short i = 1; i < count; i++) {
+		// the time stamp
+		int64_t	dod = 0;
+		if (reader.read(1)) {
+			if (!reader.read(1)) {
+				dod = signextend(reader.read(7), 7);
+			} else if (!reader.read(1)) {
+				dod = signextend(reader.read(9), 9);
+			} else if (!reader.read(1)) {
+				dod = signextend(reader.read(12), 12);
+			} else {
+				dod = signextend(reader.read(32), 32);
+			}
+		}
+		delta += dod;
+		timekey += delta;
+
+		// the value
+		if (reader.read(1)) {
+			if (reader.read(1)) {
+				leading = reader.read(5);
+				int	length = reader.read(5) + 1;
+				trailing = 32 - leading - length;
+			}
+			value ^= reader.read(32 - leading - trailing)
+				<< trailing;
+		}
+		result.push_back(tspoint(timekey, bitsfloat(value)));
+	}
+	return result;
+}
+
+} // namespace powermeter
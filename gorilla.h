@@ -0,0 +1,68 @@
+//
+// gorilla.h -- compressed blocks of time series points
+//
+// The encoding follows the Gorilla paper by Pelkonen et al: time stamps
+// are stored as delta of deltas, values as the XOR with the previous
+// value, using only the meaningful bits of the XOR.
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _gorilla_h
+#define _gorilla_h
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace powermeter {
+
+/**
+ * \brief A single point of a time series
+ */
+struct tspoint {
+	int64_t	timekey;
+	float	value;
+	tspoint(int64_t t = 0, float v = 0) : timekey(t), value(v) { }
+};
+
+/**
+ * \brief A fixed size block containing a compressed run of points
+ *
+ * The block has a 24 byte header with the number of points, the number
+ * of bits used and the first and last time key, all little endian,
+ * followed by the bit stream. Points can only be appended, append
+ * returns false when the block is full.
+ */
+class gorilla_block {
+public:
+	static const size_t	blocksize = 1024;
+	static const size_t	headersize = 24;
+	static const size_t	capacity = 8 * (blocksize - headersize);
+private:
+	unsigned char	_data[blocksize];
+	// encoder state
+	unsigned short	_count;
+	size_t	_bits;
+	int64_t	_first;
+	int64_t	_last;
+	int64_t	_delta;
+	uint32_t	_value;
+	int	_leading;
+	int	_trailing;
+	void	write(uint64_t value, int nbits);
+	void	writeheader();
+public:
+	gorilla_block();
+	gorilla_block(const unsigned char *data);
+	bool	append(int64_t timekey, float value);
+	unsigned short	count() const { return _count; }
+	int64_t	first() const { return _first; }
+	int64_t	last() const { return _last; }
+	const unsigned char	*data() const { return _data; }
+	std::vector<tspoint>	points() const;
+	static std::vector<tspoint>	decode(const unsigned char *data);
+};
+
+} // namespace powermeter
+
+#endif /* _gorilla_h */
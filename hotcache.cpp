@@ -0,0 +1,195 @@
+//
+// hotcache.cpp -- in memory ring of the most recent messages
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <hotcache.h>
+#include <debug.h>
+#include <cmath>
+#include <limits>
+
+namespace powermeter {
+
+static const int64_t	hour = 3600;
+
+/**
+ * \brief Create an empty cache
+ *
+ * \param minutes	number of slots of the minute ring
+ * \param hours		number of hourly aggregates
+ * \param resolution	seconds per slot of the minute ring
+ */
+hotcache::hotcache(size_t minutes, size_t hours, int resolution)
+	: _minutes(minutes), _hours(hours), _resolution(resolution),
+	  _times(minutes, -1), _hourtimes(hours, -1), _last(-1) {
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "hot cache for %d slots of %ds and "
+		"%d hours", (int)minutes, resolution, (int)hours);
+}
+
+/**
+ * \brief Find the column of a name, create it if necessary
+ *
+ * Must be called with the mutex held.
+ */
+size_t	hotcache::column(const std::string& name) {
+	auto	i = _index.find(name);
+	if (i != _index.end()) {
+		return i->second;
+	}
+	size_t	c = _names.size();
+	_index.insert(std::make_pair(name, c));
+	_names.push_back(name);
+	_values.push_back(std::vector<float>(_minutes,
+		std::numeric_limits<float>::quiet_NaN()));
+	_hourly.push_back(std::vector<bucket>(_hours));
+	return c;
+}
+
+/**
+ * \brief Add the values of a message
+ *
+ * \param m	the message
+ */
+void	hotcache::add(const message& m) {
+	int64_t	t = std::chrono::duration_cast<std::chrono::seconds>(
+		m.when().time_since_epoch()).count();
+	t -= t % _resolution;
+	std::unique_lock<std::mutex>	lock(_mutex);
+	if ((_last >= 0) && (t <= _last - (int64_t)_minutes * _resolution)) {
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "message %lld too old for the "
+			"hot cache", (long long)t);
+		return;
+	}
+
+	// prepare the minute slot, clear it if it held an older minute
+	size_t	slot = (t / _resolution) % _minutes;
+	bool	repeated = (_times[slot] == t);
+	if (!repeated) {
+		for (auto v = _values.begin(); v != _values.end(); v++) {
+			(*v)[slot] = std::numeric_limits<float>::quiet_NaN();
+		}
+		_times[slot] = t;
+	}
+
+	// prepare the hour slot
+	int64_t	h = t - t % hour;
+	size_t	hslot = (h / hour) % _hours;
+	if (_hourtimes[hslot] != h) {
+		for (auto b = _hourly.begin(); b != _hourly.end(); b++) {
+			(*b)[hslot] = bucket(h);
+		}
+		_hourtimes[hslot] = h;
+	}
+
+	for (auto i = m.begin(); i != m.end(); i++) {
+		size_t	c = column(i->first);
+		_values[c][slot] = i->second;
+		if (!repeated) {
+			_hourly[c][hslot].start = h;
+			_hourly[c][hslot].add(i->second);
+		}
+	}
+	if (t > _last) {
+		_last = t;
+	}
+}
+
+/**
+ * \brief The names of all values in the cache
+ */
+std::vector<std::string>	hotcache::names() {
+	std::unique_lock<std::mutex>	lock(_mutex);
+	return _names;
+}
+
+/**
+ * \brief Aggregate minute slots into buckets of step seconds
+ *
+ * Must be called with the mutex held.
+ */
+void	hotcache::minutes(size_t c, int64_t from, int64_t to, int64_t step,
+		std::vector<bucket>& result) {
+	const std::vector<float>&	values = _values[c];
+	int64_t	first = from - from % _resolution;
+	for (int64_t t = first; t <= to; t += _resolution) {
+		size_t	slot = (t / _resolution) % _minutes;
+		if ((_times[slot] != t) || std::isnan(values[slot])
+			|| (t < from)) {
+			continue;
+		}
+		int64_t	start = t - t % step;
+		if ((result.size() == 0) || (result.back().start != start)) {
+			result.push_back(bucket(start));
+		}
+		result.back().add(values[slot]);
+	}
+}
+
+/**
+ * \brief Aggregate hourly aggregates into buckets of step seconds
+ *
+ * Must be called with the mutex held.
+ */
+void	hotcache::hourly(size_t c, int64_t from, int64_t to, int64_t step,
+		std::vector<bucket>& result) {
+	const std::vector<bucket>&	hours = _hourly[c];
+	for (int64_t h = from - from % hour; h <= to; h += hour) {
+		size_t	hslot = (h / hour) % _hours;
+		if ((_hourtimes[hslot] != h) || (hours[hslot].count == 0)) {
+			continue;
+		}
+		int64_t	start = h - h % step;
+		if ((result.size() == 0) || (result.back().start != start)) {
+			result.push_back(bucket(start));
+		}
+		result.back().add(hours[hslot]);
+	}
+}
+
+/**
+ * \brief Aggregate the values of a name in a time range
+ *
+ * Steps that are multiples of an hour are computed from the hourly
+ * aggregates, which reach further back than the minute ring, all other
+ * steps from the minute slots. A step below the resolution returns
+ * the individual slots.
+ *
+ * \param name	the name of the value
+ * \param from	start of the range in seconds since the epoch
+ * \param to	end of the range (inclusive)
+ * \param step	bucket size in seconds
+ * \return	the non-empty buckets in ascending order
+ */
+std::vector<bucket>	hotcache::query(const std::string& name, int64_t from,
+		int64_t to, int64_t step) {
+	std::vector<bucket>	result;
+	if (step < _resolution) {
+		step = _resolution;
+	}
+	std::unique_lock<std::mutex>	lock(_mutex);
+	auto	i = _index.find(name);
+	if ((i == _index.end()) || (_last < 0)) {
+		return result;
+	}
+
+	// do not iterate over time that cannot be in the cache
+	if (to > _last) {
+		to = _last;
+	}
+	if (0 == step % hour) {
+		int64_t	oldest = _last - (int64_t)_hours * hour;
+		if (from < oldest) {
+			from = oldest;
+		}
+		hourly(i->second, from, to, step, result);
+	} else {
+		int64_t	oldest = _last - (int64_t)_minutes * _resolution;
+		if (from < oldest) {
+			from = oldest;
+		}
+		minutes(i->second, from, to, step, result);
+	}
+	return result;
+}
+
+} // namespace powermeter
@@ -0,0 +1,60 @@
+//
+// hotcache.h -- in memory ring of the most recent messages
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _hotcache_h
+#define _hotcache_h
+
+#include <message.h>
+#include <columncache.h>
+#include <map>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <cstdint>
+
+namespace powermeter {
+
+/**
+ * \brief Recent history of all values, kept in memory
+ *
+ * The cache has a ring of minutes slots of resolution seconds each
+ * (one slot per message) and a ring of hours hourly aggregates. Each
+ * value name has a contiguous float array per ring, a missing value
+ * is NaN. A message older than the oldest slot of the minute ring is
+ * ignored, a message for a slot that has already been filled replaces
+ * the values of the slot but is not counted in the hourly aggregates
+ * again.
+ *
+ * All methods lock the cache, so it can be filled by a sink and
+ * queried from another thread.
+ */
+class hotcache {
+	size_t	_minutes;
+	size_t	_hours;
+	int64_t	_resolution;
+	std::mutex	_mutex;
+	std::map<std::string, size_t>	_index;
+	std::vector<std::string>	_names;
+	std::vector<int64_t>	_times;
+	std::vector<std::vector<float> >	_values;
+	std::vector<int64_t>	_hourtimes;
+	std::vector<std::vector<bucket> >	_hourly;
+	int64_t	_last;
+	size_t	column(const std::string& name);
+	void	minutes(size_t c, int64_t from, int64_t to, int64_t step,
+			std::vector<bucket>& result);
+	void	hourly(size_t c, int64_t from, int64_t to, int64_t step,
+			std::vector<bucket>& result);
+public:
+	hotcache(size_t minutes, size_t hours, int resolution);
+	void	add(const message& m);
+	std::vector<std::string>	names();
+	std::vector<bucket>	query(const std::string& name, int64_t from,
+			int64_t to, int64_t step);
+};
+
+} // namespace powermeter
+
+#endif /* _hotcache_h */
@@ -0,0 +1,214 @@
+//
+// hotcache_sink.cpp
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <hotcache_sink.h>
+#include <debug.h>
+#include <format.h>
+#include <stdexcept>
+#include <cstring>
+#include <ctime>
+
+namespace powermeter {
+
+/**
+ * \brief Find the value of a key in a JSON text
+ *
+ * This is not a JSON parser, it only finds the first occurrence of the
+ * key at or after pos and returns its string or number value, which
+ * is all the simple JSON requests need.
+ *
+ * \param body	the JSON text
+ * \param key	the key to look for
+ * \param pos	where to start, set to the end of the value
+ */
+static std::string	jsonvalue(const std::string& body, const std::string& key,
+		size_t& pos) {
+	size_t	k = body.find("\"" + key + "\"", pos);
+	if (k == std::string::npos) {
+		pos = std::string::npos;
+		return std::string();
+	}
+	size_t	v = body.find_first_not_of(" \t\r\n:", k + key.size() + 2);
+	if (v == std::string::npos) {
+		pos = std::string::npos;
+		return std::string();
+	}
+	if (body[v] == '"') {
+		size_t	e = body.find('"', v + 1);
+		if (e == std::string::npos) {
+			pos = std::string::npos;
+			return std::string();
+		}
+		pos = e + 1;
+		return body.substr(v + 1, e - v - 1);
+	}
+	size_t	e = body.find_first_of(",}] \t\r\n", v);
+	pos = e;
+	return body.substr(v, (e == std::string::npos) ? e : e - v);
+}
+
+/**
+ * \brief Parse an ISO 8601 time like 2023-10-31T06:33:44.866Z
+ */
+static int64_t	isotime(const std::string& s) {
+	struct tm	tm;
+	memset(&tm, 0, sizeof(tm));
+	if (6 != sscanf(s.c_str(), "%d-%d-%dT%d:%d:%d", &tm.tm_year,
+		&tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec)) {
+		std::string	msg = stringprintf("bad time: %s", s.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	return timegm(&tm);
+}
+
+/**
+ * \brief Quote a string for a JSON response
+ */
+static std::string	jsonstring(const std::string& s) {
+	std::string	result("\"");
+	for (auto c = s.begin(); c != s.end(); c++) {
+		if ((*c == '"') || (*c == '\\')) {
+			result.push_back('\\');
+		}
+		result.push_back(*c);
+	}
+	return result + "\"";
+}
+
+/**
+ * \brief Create the cache and start the HTTP server
+ *
+ * \param config	the configuration
+ */
+hotcache_sink::hotcache_sink(const configuration& config)
+	: sink("hotcache"),
+	  _cache(config.intvalue("hotcacheminutes", 2880),
+		config.intvalue("hotcachehours", 744),
+		config.intvalue("meterwindow", 60)) {
+	_server = std::unique_ptr<httpserver>(new httpserver(
+		config.stringvalue("hotcacheaddress", "127.0.0.1"),
+		config.intvalue("hotcacheport", 8090),
+		[this](const std::string& path, const std::string& body,
+			httpresponse& response) {
+			respond(path, body, response);
+		}));
+}
+
+/**
+ * \brief Answer a request of the simple JSON datasource
+ */
+void	hotcache_sink::respond(const std::string& path,
+		const std::string& body, httpresponse& response) {
+	if (path == "/") {
+		response.type = "text/plain";
+		response.body = "OK";
+	} else if (path == "/search") {
+		response.body = search();
+	} else if (path == "/query") {
+		try {
+			response.body = query(body);
+		} catch (const std::exception& x) {
+			response.status = "400 Bad Request";
+			response.body = "{\"message\":" + jsonstring(x.what())
+				+ "}";
+		}
+	} else if ((path == "/annotations") || (path == "/tag-keys")
+		|| (path == "/tag-values")) {
+		response.body = "[]";
+	} else {
+		response.status = "404 Not Found";
+		response.type = "text/plain";
+		response.body = "not found";
+	}
+}
+
+/**
+ * \brief Answer a search request with all value names
+ */
+std::string	hotcache_sink::search() {
+	std::vector<std::string>	names = _cache.names();
+	std::string	result("[");
+	for (auto i = names.begin(); i != names.end(); i++) {
+		if (i != names.begin()) {
+			result.push_back(',');
+		}
+		result += jsonstring(*i);
+	}
+	return result + "]";
+}
+
+/**
+ * \brief Answer a query request
+ *
+ * \param body	the JSON body of the request
+ */
+std::string	hotcache_sink::query(const std::string& body) {
+	size_t	pos = body.find("\"range\"");
+	if (pos == std::string::npos) {
+		throw std::runtime_error("no range in query");
+	}
+	int64_t	from = isotime(jsonvalue(body, "from", pos));
+	pos = body.find("\"range\"");
+	int64_t	to = isotime(jsonvalue(body, "to", pos));
+	pos = 0;
+	std::string	interval = jsonvalue(body, "intervalMs", pos);
+	int64_t	step = (interval.size() > 0) ? std::stoll(interval) / 1000 : 0;
+
+	std::string	result("[");
+	pos = 0;
+	while (true) {
+		std::string	target = jsonvalue(body, "target", pos);
+		if (pos == std::string::npos) {
+			break;
+		}
+		std::string	name = target;
+		std::string	op("avg");
+		size_t	c = target.rfind(':');
+		if (c != std::string::npos) {
+			name = target.substr(0, c);
+			op = target.substr(c + 1);
+		}
+		std::vector<bucket>	buckets = _cache.query(name, from, to,
+			step);
+		if (result.size() > 1) {
+			result.push_back(',');
+		}
+		result += "{\"target\":" + jsonstring(target)
+			+ ",\"datapoints\":[";
+		for (auto b = buckets.begin(); b != buckets.end(); b++) {
+			double	value = b->mean();
+			if (op == "min") {
+				value = b->min;
+			} else if (op == "max") {
+				value = b->max;
+			} else if (op == "sum") {
+				value = b->sum;
+			} else if (op == "count") {
+				value = b->count;
+			}
+			if (b != buckets.begin()) {
+				result.push_back(',');
+			}
+			result += stringprintf("[%.9g,%lld000]", value,
+				(long long)b->start);
+		}
+		result += "]}";
+	}
+	return result + "]";
+}
+
+/**
+ * \brief Add the values of a message to the cache
+ *
+ * \param m	the message to store
+ */
+void	hotcache_sink::store(const message& m) {
+	_cache.add(m);
+}
+
+} // namespace powermeter
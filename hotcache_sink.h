@@ -0,0 +1,47 @@
+//
+// hotcache_sink.h -- sink keeping recent history in memory for HTTP queries
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _hotcache_sink_h
+#define _hotcache_sink_h
+
+#include <sink.h>
+#include <hotcache.h>
+#include <configuration.h>
+#include <httpserver.h>
+#include <memory>
+
+namespace powermeter {
+
+/**
+ * \brief Sink feeding a hotcache and serving it over HTTP
+ *
+ * The cache holds hotcacheminutes slots (default 2880, two days of
+ * minutes) and hotcachehours hourly aggregates (default 744, a month).
+ * The HTTP server listens on hotcacheaddress (default 127.0.0.1) port
+ * hotcacheport (default 8090) and implements the endpoints of the
+ * Grafana simple JSON datasource:
+ *
+ *   /          test connection, answers OK
+ *   /search    list of all value names
+ *   /query     time series for the targets in the request, the points
+ *              are averages over intervalMs, a target name:min, name:max,
+ *              name:sum or name:count selects another aggregate
+ *   /annotations, /tag-keys, /tag-values   empty lists
+ */
+class hotcache_sink : public sink {
+	hotcache	_cache;
+	std::unique_ptr<httpserver>	_server;
+	void	respond(const std::string& path, const std::string& body,
+			httpresponse& response);
+	std::string	search();
+	std::string	query(const std::string& body);
+public:
+	hotcache_sink(const configuration& config);
+	virtual void	store(const message& m);
+};
+
+} // namespace powermeter
+
+#endif /* _hotcache_sink_h */
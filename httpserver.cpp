@@ -0,0 +1,179 @@
+//
+// httpserver.cpp -- minimal HTTP server for local query endpoints
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <httpserver.h>
+#include <debug.h>
+#include <format.h>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+namespace powermeter {
+
+/**
+ * \brief Listen on an address and start the server thread
+ *
+ * \param address	the IP address to bind to, usually 127.0.0.1
+ * \param port		the port to listen on
+ * \param h		the handler for the requests
+ */
+httpserver::httpserver(const std::string& address, int port, handler h)
+	: _handler(h), _active(true) {
+	struct sockaddr_in	sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	if (0 == inet_aton(address.c_str(), &sa.sin_addr)) {
+		std::string	msg = stringprintf("bad address %s",
+			address.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	_listenfd = socket(PF_INET, SOCK_STREAM, 0);
+	int	on = 1;
+	if ((_listenfd < 0)
+		|| (setsockopt(_listenfd, SOL_SOCKET, SO_REUSEADDR, &on,
+			sizeof(on)) < 0)
+		|| (bind(_listenfd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		|| (listen(_listenfd, 16) < 0)) {
+		std::string	msg = stringprintf("cannot listen on %s:%d: %s",
+			address.c_str(), port, strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		if (_listenfd >= 0) {
+			close(_listenfd);
+		}
+		throw std::runtime_error(msg);
+	}
+	debug(LOG_INFO, DEBUG_LOG, 0, "http server on %s:%d", address.c_str(),
+		port);
+	_thread = std::thread(launch, this);
+}
+
+/**
+ * \brief Stop the server thread
+ */
+httpserver::~httpserver() {
+	_active = false;
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+	close(_listenfd);
+}
+
+void	httpserver::launch(httpserver *s) {
+	try {
+		s->run();
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "http server fails: %s", x.what());
+	} catch (...) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "http server fails");
+	}
+}
+
+/**
+ * \brief Accept and serve connections one at a time
+ *
+ * The poll timeout lets the thread notice that the server is destroyed.
+ */
+void	httpserver::run() {
+	while (_active) {
+		struct pollfd	p;
+		p.fd = _listenfd;
+		p.events = POLLIN;
+		if (poll(&p, 1, 1000) <= 0) {
+			continue;
+		}
+		int	fd = accept(_listenfd, NULL, NULL);
+		if (fd < 0) {
+			continue;
+		}
+		try {
+			serve(fd);
+		} catch (const std::exception& x) {
+			debug(LOG_WARNING, DEBUG_LOG, 0, "request failed: %s",
+				x.what());
+		}
+		close(fd);
+	}
+}
+
+/**
+ * \brief Read a request from a connection and answer it
+ *
+ * \param fd	the connection
+ */
+void	httpserver::serve(int fd) {
+	// read the header and as much of the body as content-length says
+	std::string	request;
+	size_t	headerend = std::string::npos;
+	size_t	length = 0;
+	while ((headerend == std::string::npos)
+		|| (request.size() < headerend + 4 + length)) {
+		struct pollfd	p;
+		p.fd = fd;
+		p.events = POLLIN;
+		if (poll(&p, 1, 2000) <= 0) {
+			throw std::runtime_error("timeout reading request");
+		}
+		char	buffer[4096];
+		ssize_t	rc = read(fd, buffer, sizeof(buffer));
+		if (rc <= 0) {
+			throw std::runtime_error("connection closed");
+		}
+		request.append(buffer, rc);
+		if (request.size() > 1024 * 1024) {
+			throw std::runtime_error("request too large");
+		}
+		if ((headerend == std::string::npos)
+			&& (std::string::npos
+				!= (headerend = request.find("\r\n\r\n")))) {
+			std::string	header = request.substr(0, headerend);
+			for (auto c = header.begin(); c != header.end(); c++) {
+				*c = tolower(*c);
+			}
+			size_t	l = header.find("\ncontent-length:");
+			if (l != std::string::npos) {
+				length = std::stoul(header.substr(l + 16));
+			}
+		}
+	}
+	std::string	body = request.substr(headerend + 4, length);
+	std::string	path = request.substr(0, request.find("\r\n"));
+	size_t	s = path.find(' ');
+	path = path.substr(s + 1, path.find(' ', s + 1) - s - 1);
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "request for %s", path.c_str());
+
+	// let the handler compute the response
+	httpresponse	response;
+	try {
+		_handler(path, body, response);
+	} catch (const std::exception& x) {
+		response.status = "500 Internal Server Error";
+		response.type = "text/plain";
+		response.body = x.what();
+	}
+	std::string	reply = "HTTP/1.0 " + response.status + "\r\n"
+		"Content-Type: " + response.type + "\r\n"
+		"Access-Control-Allow-Origin: *\r\n"
+		+ stringprintf("Content-Length: %lu\r\n",
+			(unsigned long)response.body.size())
+		+ "Connection: close\r\n\r\n" + response.body;
+	size_t	written = 0;
+	while (written < reply.size()) {
+		ssize_t	rc = ::send(fd, reply.data() + written,
+			reply.size() - written, MSG_NOSIGNAL);
+		if (rc <= 0) {
+			throw std::runtime_error("cannot send response");
+		}
+		written += rc;
+	}
+}
+
+} // namespace powermeter
@@ -0,0 +1,54 @@
+//
+// httpserver.h -- minimal HTTP server for local query endpoints
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _httpserver_h
+#define _httpserver_h
+
+#include <string>
+#include <functional>
+#include <thread>
+#include <atomic>
+
+namespace powermeter {
+
+/**
+ * \brief Response of a request handler
+ */
+struct httpresponse {
+	std::string	status;
+	std::string	type;
+	std::string	body;
+	httpresponse() : status("200 OK"), type("application/json") { }
+};
+
+/**
+ * \brief HTTP server answering one request at a time in its own thread
+ *
+ * The server is meant for local tools like dashboards and monitoring,
+ * it reads a single request per connection, hands path and body to the
+ * handler and closes the connection after the response. A client has
+ * two seconds for each part of the request.
+ */
+class httpserver {
+public:
+	typedef std::function<void(const std::string& path,
+		const std::string& body, httpresponse& response)>	handler;
+private:
+	handler	_handler;
+	int	_listenfd;
+	std::atomic<bool>	_active;
+	std::thread	_thread;
+	void	serve(int fd);
+public:
+	httpserver(const std::string& address, int port, handler h);
+	httpserver(const httpserver& other) = delete;
+	~httpserver();
+	static void	launch(httpserver *s);
+	void	run();
+};
+
+} // namespace powermeter
+
+#endif /* _httpserver_h */
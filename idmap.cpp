@@ -0,0 +1,184 @@
+/*
+ * idmap.cpp
+ *
+ * (c) 2023 Prof Dr Andreas Müller
+ */
+#include <idmap.h>
+#include <debug.h>
+#include <format.h>
+#include <stdexcept>
+#include <fstream>
+#include <cstdio>
+
+namespace powermeter {
+
+void	idmap::addstation(const std::string& name, int id) {
+	_stations[name] = id;
+}
+
+void	idmap::addsensor(const std::string& name, int id) {
+	_sensors.insert(std::make_pair(name, id));
+}
+
+void	idmap::addfield(const std::string& name, int id) {
+	_fields.insert(std::make_pair(name, id));
+}
+
+void	idmap::clear() {
+	_stations.clear();
+	_sensors.clear();
+	_fields.clear();
+}
+
+bool	idmap::operator==(const idmap& other) const {
+	return (_stations == other._stations) && (_sensors == other._sensors)
+		&& (_fields == other._fields);
+}
+
+/**
+ * \brief Read the map from a cache file
+ *
+ * \param filename	the cache file
+ * \return		false if the file does not exist or is damaged
+ */
+bool	idmap::load(const std::string& filename) {
+	std::ifstream	in(filename.c_str());
+	if (!in) {
+		return false;
+	}
+	idmap	result;
+	std::string	kind, name;
+	int	id;
+	while (in >> kind >> name >> id) {
+		if (kind == "station") {
+			result.addstation(name, id);
+		} else if (kind == "sensor") {
+			result.addsensor(name, id);
+		} else if (kind == "field") {
+			result.addfield(name, id);
+		} else {
+			return false;
+		}
+	}
+	if (!in.eof()) {
+		debug(LOG_WARNING, DEBUG_LOG, 0, "id cache %s is damaged",
+			filename.c_str());
+		return false;
+	}
+	*this = result;
+	return true;
+}
+
+/**
+ * \brief Write the map to a cache file
+ *
+ * The file is replaced atomically, so a concurrent load sees either
+ * the old or the new map.
+ *
+ * \param filename	the cache file
+ */
+void	idmap::save(const std::string& filename) const {
+	std::string	tmp = filename + ".tmp";
+	{
+		std::ofstream	out(tmp.c_str());
+		for (auto i = _stations.begin(); i != _stations.end(); i++) {
+			out << "station " << i->first << " " << i->second
+				<< std::endl;
+		}
+		for (auto i = _sensors.begin(); i != _sensors.end(); i++) {
+			out << "sensor " << i->first << " " << i->second
+				<< std::endl;
+		}
+		for (auto i = _fields.begin(); i != _fields.end(); i++) {
+			out << "field " << i->first << " " << i->second
+				<< std::endl;
+		}
+		if (!out) {
+			std::string	msg = stringprintf("cannot write id cache "
+				"%s", tmp.c_str());
+			debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+			throw std::runtime_error(msg);
+		}
+	}
+	if (rename(tmp.c_str(), filename.c_str()) < 0) {
+		std::string	msg = stringprintf("cannot replace id cache %s",
+			filename.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+}
+
+/**
+ * \brief Whether both parts of a name resolve to ids
+ *
+ * \param sfname	name of the form sensor.field
+ */
+bool	idmap::has(const std::string& sfname) const {
+	size_t	l = sfname.find(".");
+	if (std::string::npos == l) {
+		return (_sensors.find(sfname) != _sensors.end())
+			&& (_fields.find(sfname) != _fields.end());
+	}
+	return (_sensors.find(sfname.substr(0, l)) != _sensors.end())
+		&& (_fields.find(sfname.substr(l + 1)) != _fields.end());
+}
+
+/**
+ * \brief Get the id of a station
+ *
+ * \param name	name of the station
+ */
+char	idmap::stationid(const std::string& name) const {
+	auto	i = _stations.find(name);
+	if (i == _stations.end()) {
+		std::string	msg = stringprintf("station name not found: %s",
+			name.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	return i->second;
+}
+
+/**
+ * \brief Get the sensor id for the sensor part of a name
+ *
+ * \param sfname	name of the form sensor.field
+ */
+char	idmap::sensorid(const std::string& sfname) const {
+	std::string	key = sfname;
+	size_t	l = sfname.find(".");
+	if (std::string::npos != l) {
+		key = sfname.substr(0, l);
+	}
+	auto	i = _sensors.find(key);
+	if (i == _sensors.end()) {
+		std::string	msg = stringprintf("sensor name not found: %s",
+			key.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	return i->second;
+}
+
+/**
+ * \brief Get the field id for the field part of a name
+ *
+ * \param sfname	name of the form sensor.field
+ */
+char	idmap::fieldid(const std::string& sfname) const {
+	std::string	key = sfname;
+	size_t	l = sfname.find(".");
+	if (std::string::npos != l) {
+		key = sfname.substr(l+1);
+	}
+	auto	i = _fields.find(key);
+	if (i == _fields.end()) {
+		std::string	msg = stringprintf("field name not found: %s",
+			key.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	return i->second;
+}
+
+} // namespace powermeter
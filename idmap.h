@@ -0,0 +1,50 @@
+/*
+ * idmap.h -- map sensor.field names to database ids
+ *
+ * (c) 2023 Prof Dr Andreas Müller
+ */
+#ifndef _idmap_h
+#define _idmap_h
+
+#include <map>
+#include <string>
+
+namespace powermeter {
+
+/**
+ * \brief Resolution of the value names in a message to database ids
+ *
+ * The names in a message have the form sensor.field, the sensor part
+ * is resolved through the sensor table, the field part through the
+ * mfield table.
+ *
+ * The map also keeps the id of the station. It can be saved to a cache
+ * file with lines "station <name> <id>", "sensor <name> <id>" and
+ * "field <name> <id>", so that it is available before the database
+ * can be reached.
+ */
+class idmap {
+	std::map<std::string, int>	_fields;
+	std::map<std::string, int>	_sensors;
+	std::map<std::string, int>	_stations;
+public:
+	void	addstation(const std::string& name, int id);
+	void	addsensor(const std::string& name, int id);
+	void	addfield(const std::string& name, int id);
+	void	clear();
+	bool	empty() const { return _sensors.empty() && _fields.empty(); }
+	bool	operator==(const idmap& other) const;
+	bool	operator!=(const idmap& other) const {
+		return !(*this == other);
+	}
+	bool	load(const std::string& filename);
+	void	save(const std::string& filename) const;
+	bool	has(const std::string& name) const;
+	char	stationid(const std::string& name) const;
+	char	sensorid(const std::string& name) const;
+	char	fieldid(const std::string& name) const;
+};
+
+} // namespace powermeter
+
+#endif /* _idmap_h */
@@ -0,0 +1,135 @@
+//
+// journal.cpp
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <journal.h>
+#include <debug.h>
+#include <format.h>
+#include <stdexcept>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <cerrno>
+#include <cstring>
+#include <cmath>
+
+namespace powermeter {
+
+/**
+ * \brief Open the journal and count the messages already in it
+ *
+ * \param filename	name of the journal file
+ * \param limit		maximum number of messages to keep
+ */
+journal::journal(const std::string& filename, size_t limit)
+	: _filename(filename), _limit(std::max(limit, (size_t)2)),
+	  _count(0), _file(NULL) {
+	std::vector<message>	current;
+	read(_filename, current);
+	_count = current.size();
+	open();
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "journal %s has %lu messages",
+		_filename.c_str(), _count);
+}
+
+journal::~journal() {
+	if (_file) {
+		fclose(_file);
+	}
+}
+
+void	journal::open() {
+	_file = fopen(_filename.c_str(), "a");
+	if (NULL == _file) {
+		std::string	msg = stringprintf("cannot open journal %s: %s",
+			_filename.c_str(), strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+}
+
+/**
+ * \brief Append a message to the journal
+ *
+ * \param m	the message to append
+ */
+void	journal::append(const message& m) {
+	std::unique_lock<std::mutex>	lock(_mutex);
+	if ((NULL != _file) && (_count >= _limit / 2)) {
+		fclose(_file);
+		_file = NULL;
+		std::string	old = _filename + ".old";
+		if (rename(_filename.c_str(), old.c_str()) < 0) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "cannot rotate journal: %s",
+				strerror(errno));
+		}
+	}
+	// a failed reopen is tried again with the next message
+	if (NULL == _file) {
+		open();
+		_count = 0;
+	}
+	long long	timekey = std::chrono::duration_cast<std::chrono::seconds>(
+		m.when().time_since_epoch()).count();
+	fprintf(_file, "%lld", timekey);
+	for (auto i = m.begin(); i != m.end(); i++) {
+		// nan and inf could not be read back
+		if (!std::isfinite(i->second)) {
+			continue;
+		}
+		fprintf(_file, " %s %.9g", i->first.c_str(), i->second);
+	}
+	fprintf(_file, "\n");
+	if (0 != fflush(_file)) {
+		std::string	msg = stringprintf("cannot write journal %s: %s",
+			_filename.c_str(), strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	_count++;
+}
+
+/**
+ * \brief Read the complete messages in a journal file
+ *
+ * A line cut short by a crash has no newline at the end and is skipped.
+ */
+void	journal::read(const std::string& filename,
+		std::vector<message>& messages) {
+	std::ifstream	in(filename.c_str());
+	std::string	line;
+	while (std::getline(in, line)) {
+		if (in.eof()) {
+			break;
+		}
+		std::istringstream	fields(line);
+		long long	timekey;
+		if (!(fields >> timekey)) {
+			continue;
+		}
+		std::chrono::system_clock::time_point	when
+			= std::chrono::system_clock::time_point(
+				std::chrono::seconds(timekey));
+		message	m(when);
+		std::string	name;
+		float	value;
+		while (fields >> name >> value) {
+			m.update(name, value);
+		}
+		messages.push_back(m);
+	}
+}
+
+/**
+ * \brief All messages in the journal, oldest first
+ */
+std::vector<message>	journal::messages() const {
+	std::unique_lock<std::mutex>	lock(_mutex);
+	std::vector<message>	result;
+	read(_filename + ".old", result);
+	read(_filename, result);
+	return result;
+}
+
+} // namespace powermeter
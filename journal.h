@@ -0,0 +1,47 @@
+//
+// journal.h -- bounded local record of the most recent messages
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _journal_h
+#define _journal_h
+
+#include <message.h>
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <mutex>
+
+namespace powermeter {
+
+/**
+ * \brief Local journal of recent messages
+ *
+ * Every message is appended as a text line "timekey name value ...",
+ * values that are not finite are left out.
+ * When the journal file holds limit/2 messages it is renamed to
+ * <file>.old and a new file is started, so the journal keeps between
+ * limit/2 and limit of the most recent messages. Messages can be
+ * appended and read from different threads.
+ */
+class journal {
+	std::string	_filename;
+	size_t	_limit;
+	size_t	_count;
+	FILE	*_file;
+	mutable std::mutex	_mutex;
+	void	open();
+	static void	read(const std::string& filename,
+			std::vector<message>& messages);
+public:
+	journal(const std::string& filename, size_t limit);
+	~journal();
+	journal(const journal& other) = delete;
+	journal&	operator=(const journal& other) = delete;
+	void	append(const message& m);
+	std::vector<message>	messages() const;
+};
+
+} // namespace powermeter
+
+#endif /* _journal_h */
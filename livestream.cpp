@@ -0,0 +1,430 @@
+//
+// livestream.cpp -- publish samples and messages on a Unix domain socket
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <livestream.h>
+#include <debug.h>
+#include <format.h>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <cmath>
+#include <sstream>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+namespace powermeter {
+
+/**
+ * \brief Format a time point as seconds with milliseconds
+ */
+static std::string	jsontime(const std::chrono::system_clock::time_point& t) {
+	long long	ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+		t.time_since_epoch()).count();
+	return stringprintf("%lld.%03lld", ms / 1000, ms % 1000);
+}
+
+/**
+ * \brief Format a value, JSON has no representation for nan and inf
+ */
+static std::string	jsonvalue(float value) {
+	if (!std::isfinite(value)) {
+		return std::string("null");
+	}
+	return stringprintf("%.9g", value);
+}
+
+/**
+ * \brief Quote a name as a JSON string
+ */
+static std::string	jsonstring(const std::string& s) {
+	std::string	result("\"");
+	for (auto c = s.begin(); c != s.end(); c++) {
+		if ((*c == '"') || (*c == '\\')) {
+			result.push_back('\\');
+		}
+		if ((unsigned char)*c < 0x20) {
+			continue;
+		}
+		result.push_back(*c);
+	}
+	return result + "\"";
+}
+
+/**
+ * \brief Set a file descriptor to non blocking mode
+ */
+static void	nonblocking(int fd) {
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+}
+
+/**
+ * \brief Whether the subscriber wants values with this name
+ */
+bool	livestream::subscriber::selects(const std::string& name) const {
+	if (filters.size() == 0) {
+		return true;
+	}
+	for (auto f = filters.begin(); f != filters.end(); f++) {
+		if (0 == name.compare(0, f->size(), *f)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * \brief Create the socket and start the server thread
+ *
+ * \param config	the configuration, the socket is livesocket
+ */
+livestream::livestream(const configuration& config)
+	: _path(config.stringvalue("livesocket")),
+	  _limit(config.intvalue("livebuffer", 1000)),
+	  _active(true) {
+	struct sockaddr_un	sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (_path.size() >= sizeof(sa.sun_path)) {
+		std::string	msg = stringprintf("socket path too long: %s",
+			_path.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	strcpy(sa.sun_path, _path.c_str());
+
+	// a socket left over from a previous run would make bind fail
+	unlink(_path.c_str());
+	_listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if ((_listenfd < 0)
+		|| (bind(_listenfd, (struct sockaddr *)&sa, sizeof(sa)) < 0)
+		|| (listen(_listenfd, 16) < 0)) {
+		std::string	msg = stringprintf("cannot listen on %s: %s",
+			_path.c_str(), strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		if (_listenfd >= 0) {
+			close(_listenfd);
+		}
+		throw std::runtime_error(msg);
+	}
+	nonblocking(_listenfd);
+
+	// the pipe wakes up the server thread when there is new data
+	if (pipe(_wakeup) < 0) {
+		std::string	msg = stringprintf("cannot create pipe: %s",
+			strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		close(_listenfd);
+		throw std::runtime_error(msg);
+	}
+	nonblocking(_wakeup[0]);
+	nonblocking(_wakeup[1]);
+	debug(LOG_INFO, DEBUG_LOG, 0, "live stream on %s", _path.c_str());
+	_thread = std::thread(launch, this);
+}
+
+/**
+ * \brief Stop the server thread and disconnect all subscribers
+ */
+livestream::~livestream() {
+	_active = false;
+	wakeup();
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+	for (auto s = _subscribers.begin(); s != _subscribers.end(); s++) {
+		close(s->fd);
+	}
+	close(_listenfd);
+	close(_wakeup[0]);
+	close(_wakeup[1]);
+	unlink(_path.c_str());
+}
+
+void	livestream::launch(livestream *l) {
+	try {
+		l->run();
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "live stream thread fails: %s",
+			x.what());
+	} catch (...) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "live stream thread fails");
+	}
+}
+
+/**
+ * \brief Wake up the server thread
+ *
+ * If the pipe is full, the thread is awake anyway.
+ */
+void	livestream::wakeup() {
+	char	c = 0;
+	if (write(_wakeup[1], &c, 1) < 0) {
+		return;
+	}
+}
+
+/**
+ * \brief Add a line to the buffer of a subscriber, or drop it
+ *
+ * Must be called with the mutex held.
+ */
+void	livestream::push(subscriber& s, const std::string& line) {
+	if (s.lines.size() >= _limit) {
+		s.dropped++;
+		return;
+	}
+	if (s.dropped > 0) {
+		if (s.lines.size() + 1 >= _limit) {
+			s.dropped++;
+			return;
+		}
+		s.lines.push_back(stringprintf("{\"type\":\"dropped\","
+			"\"count\":%lu}\n", (unsigned long)s.dropped));
+		s.dropped = 0;
+	}
+	s.lines.push_back(line);
+}
+
+/**
+ * \brief Publish the value of a single sample
+ *
+ * \param when		the time of the sample
+ * \param name		the name of the value
+ * \param value		the value
+ */
+void	livestream::publish(const std::chrono::system_clock::time_point& when,
+		const std::string& name, float value) {
+	std::unique_lock<std::mutex>	lock(_mutex);
+	if (_subscribers.size() == 0) {
+		return;
+	}
+	std::string	line;
+	for (auto s = _subscribers.begin(); s != _subscribers.end(); s++) {
+		if (!s->selects(name)) {
+			continue;
+		}
+		if (line.size() == 0) {
+			line = "{\"type\":\"sample\",\"time\":" + jsontime(when)
+				+ ",\"name\":" + jsonstring(name)
+				+ ",\"value\":" + jsonvalue(value) + "}\n";
+		}
+		push(*s, line);
+	}
+	lock.unlock();
+	if (line.size() > 0) {
+		wakeup();
+	}
+}
+
+/**
+ * \brief Publish the values of a completed message
+ *
+ * Each subscriber only gets the values selected by its filter.
+ *
+ * \param m	the message
+ */
+void	livestream::publish(const message& m) {
+	std::unique_lock<std::mutex>	lock(_mutex);
+	if (_subscribers.size() == 0) {
+		return;
+	}
+	std::string	head = "{\"type\":\"message\",\"time\":"
+		+ jsontime(m.when()) + ",\"values\":{";
+	bool	published = false;
+	for (auto s = _subscribers.begin(); s != _subscribers.end(); s++) {
+		std::string	values;
+		for (auto i = m.begin(); i != m.end(); i++) {
+			if (!s->selects(i->first)) {
+				continue;
+			}
+			if (values.size() > 0) {
+				values.push_back(',');
+			}
+			values += jsonstring(i->first) + ":"
+				+ jsonvalue(i->second);
+		}
+		if (values.size() == 0) {
+			continue;
+		}
+		push(*s, head + values + "}}\n");
+		published = true;
+	}
+	lock.unlock();
+	if (published) {
+		wakeup();
+	}
+}
+
+/**
+ * \brief Number of connected subscribers
+ */
+size_t	livestream::subscribers() {
+	std::unique_lock<std::mutex>	lock(_mutex);
+	return _subscribers.size();
+}
+
+/**
+ * \brief Accept all pending connections
+ */
+void	livestream::accept() {
+	int	fd;
+	while ((fd = ::accept(_listenfd, NULL, NULL)) >= 0) {
+		nonblocking(fd);
+		std::unique_lock<std::mutex>	lock(_mutex);
+		_subscribers.push_back(subscriber(fd));
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "new subscriber on fd %d", fd);
+	}
+}
+
+/**
+ * \brief Read the commands of a subscriber
+ *
+ * Must be called with the mutex held.
+ *
+ * \return	false if the subscriber has closed the connection
+ */
+bool	livestream::receive(subscriber& s) {
+	char	buffer[1024];
+	ssize_t	rc;
+	while ((rc = ::recv(s.fd, buffer, sizeof(buffer), 0)) > 0) {
+		s.input.append(buffer, rc);
+		if (s.input.size() > 65536) {
+			debug(LOG_WARNING, DEBUG_LOG, 0, "subscriber on fd %d "
+				"sends garbage", s.fd);
+			return false;
+		}
+	}
+	if ((rc == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK))) {
+		return false;
+	}
+	size_t	l;
+	while (std::string::npos != (l = s.input.find('\n'))) {
+		std::string	command = s.input.substr(0, l);
+		s.input.erase(0, l + 1);
+		if ((command.size() > 0) && (command.back() == '\r')) {
+			command.pop_back();
+		}
+		if (0 != command.compare(0, 6, "filter")) {
+			debug(LOG_DEBUG, DEBUG_LOG, 0, "unknown command '%s'",
+				command.c_str());
+			continue;
+		}
+		s.filters.clear();
+		std::istringstream	in(command.substr(6));
+		std::string	prefix;
+		while (std::getline(in, prefix, ',')) {
+			size_t	b = prefix.find_first_not_of(" \t");
+			if (b != std::string::npos) {
+				s.filters.push_back(prefix.substr(b,
+					prefix.find_last_not_of(" \t") + 1 - b));
+			}
+		}
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "subscriber on fd %d has %zu "
+			"filters", s.fd, s.filters.size());
+	}
+	return true;
+}
+
+/**
+ * \brief Write as much of the buffer of a subscriber as possible
+ *
+ * Must be called with the mutex held.
+ *
+ * \return	false if the connection has failed
+ */
+bool	livestream::send(subscriber& s) {
+	while (s.lines.size() > 0) {
+		const std::string&	line = s.lines.front();
+		ssize_t	rc = ::send(s.fd, line.data() + s.offset,
+			line.size() - s.offset, MSG_NOSIGNAL);
+		if (rc < 0) {
+			return (errno == EAGAIN) || (errno == EWOULDBLOCK);
+		}
+		s.offset += rc;
+		if (s.offset < line.size()) {
+			return true;
+		}
+		s.lines.pop_front();
+		s.offset = 0;
+	}
+	return true;
+}
+
+/**
+ * \brief Main method of the server thread
+ */
+void	livestream::run() {
+	std::vector<struct pollfd>	fds;
+	while (_active) {
+		// collect the descriptors to watch
+		fds.clear();
+		struct pollfd	p;
+		p.fd = _listenfd;
+		p.events = POLLIN;
+		fds.push_back(p);
+		p.fd = _wakeup[0];
+		fds.push_back(p);
+		{
+			std::unique_lock<std::mutex>	lock(_mutex);
+			for (auto s = _subscribers.begin();
+				s != _subscribers.end(); s++) {
+				p.fd = s->fd;
+				p.events = POLLIN;
+				if (s->lines.size() > 0) {
+					p.events |= POLLOUT;
+				}
+				fds.push_back(p);
+			}
+		}
+		if (poll(fds.data(), fds.size(), 1000) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			std::string	msg = stringprintf("poll failed: %s",
+				strerror(errno));
+			debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+			throw std::runtime_error(msg);
+		}
+
+		// drain the wakeup pipe
+		char	buffer[256];
+		while (read(_wakeup[0], buffer, sizeof(buffer)) > 0) { }
+
+		// serve the subscribers, new lines may have arrived since
+		// the poll, so try to send to all of them
+		std::unique_lock<std::mutex>	lock(_mutex);
+		for (size_t i = 2; i < fds.size(); i++) {
+			auto	s = _subscribers.begin();
+			while ((s != _subscribers.end()) && (s->fd != fds[i].fd)) {
+				s++;
+			}
+			if (s == _subscribers.end()) {
+				continue;
+			}
+			bool	ok = true;
+			if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				ok = receive(*s);
+			}
+			if (ok) {
+				ok = send(*s);
+			}
+			if (!ok) {
+				debug(LOG_DEBUG, DEBUG_LOG, 0, "subscriber on "
+					"fd %d disconnected", s->fd);
+				close(s->fd);
+				_subscribers.erase(s);
+			}
+		}
+		lock.unlock();
+		if (fds[0].revents & POLLIN) {
+			accept();
+		}
+	}
+}
+
+} // namespace powermeter
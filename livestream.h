@@ -0,0 +1,82 @@
+//
+// livestream.h -- publish samples and messages on a Unix domain socket
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _livestream_h
+#define _livestream_h
+
+#include <message.h>
+#include <configuration.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <list>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+namespace powermeter {
+
+/**
+ * \brief Server streaming live values to local subscribers
+ *
+ * The server listens on the Unix domain socket livesocket and writes
+ * one JSON object per line to each connected subscriber:
+ *
+ *     {"type":"sample","time":1700000000.250,"name":"phase1.power","value":812.5}
+ *     {"type":"message","time":1700000000.000,"values":{"phase1.power":790.1}}
+ *     {"type":"dropped","count":17}
+ *
+ * Samples are the decoded values of a single reading of the meter,
+ * messages are the integrated values at the end of each window.
+ * A subscriber can send the line "filter <prefix>,<prefix>..." to
+ * receive only values whose name starts with one of the prefixes, an
+ * empty filter selects everything again.
+ *
+ * Publishing never blocks on a subscriber: each subscriber has a buffer
+ * of at most livebuffer lines (default 1000). When it is full, new lines
+ * for that subscriber are dropped and a dropped line with their number
+ * is sent as soon as there is room again. All socket I/O happens in the
+ * server thread.
+ */
+class livestream {
+	struct subscriber {
+		int	fd;
+		std::vector<std::string>	filters;
+		std::deque<std::string>	lines;
+		size_t	offset;		// bytes of the first line written
+		size_t	dropped;
+		std::string	input;
+		subscriber(int f) : fd(f), offset(0), dropped(0) { }
+		bool	selects(const std::string& name) const;
+	};
+	std::string	_path;
+	size_t	_limit;
+	int	_listenfd;
+	int	_wakeup[2];
+	std::mutex	_mutex;
+	std::list<subscriber>	_subscribers;
+	std::atomic<bool>	_active;
+	std::thread	_thread;
+	void	push(subscriber& s, const std::string& line);
+	void	wakeup();
+	void	accept();
+	bool	receive(subscriber& s);
+	bool	send(subscriber& s);
+public:
+	livestream(const configuration& config);
+	livestream(const livestream& other) = delete;
+	~livestream();
+	static void	launch(livestream *l);
+	void	run();
+	void	publish(const std::chrono::system_clock::time_point& when,
+			const std::string& name, float value);
+	void	publish(const message& m);
+	size_t	subscribers();
+};
+
+} // namespace powermeter
+
+#endif /* _livestream_h */
@@ -0,0 +1,255 @@
+/*
+ * loadgen.cpp -- load generator for the messagequeue -> sink path
+ *
+ * The load generator creates a fleet of simulated meters that submit
+ * their messages to a single queue which is drained by the dispatcher
+ * into the configured sinks, exactly as in the powermeterd daemon. Once
+ * per second it reports the throughput, the queue depth, the end-to-end
+ * latency and the lag of each sink (queued messages, age of the
+ * oldest one, mean rows per commit and mean commit time), and it stops
+ * as soon as the queue depth shows that the sinks cannot keep up with
+ * the fleet.
+ *
+ * (c) 2023 Prof Dr Andreas Müller
+ */
+#include <cstdlib>
+#include <cstdio>
+#include <getopt.h>
+#include <stdexcept>
+#include <message.h>
+#include <dispatcher.h>
+#include <sinkfactory.h>
+#include <simulated_meter.h>
+#include <simulator.h>
+#include <debug.h>
+#include <configuration.h>
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <config.h>
+
+namespace powermeter {
+
+static struct option	longopts[] = {
+{ "config",		required_argument,	NULL,		'c' },
+{ "debug",		no_argument,		NULL,		'd' },
+{ "duration",		required_argument,	NULL,		't' },
+{ "fields",		required_argument,	NULL,		'f' },
+{ "help",		no_argument,		NULL,		'?' },
+{ "interval",		required_argument,	NULL,		'i' },
+{ "maxdepth",		required_argument,	NULL,		'q' },
+{ "meters",		required_argument,	NULL,		'n' },
+{ "seed",		required_argument,	NULL,		'e' },
+{ "sensorname",		required_argument,	NULL,		's' },
+{ "version",		no_argument,		NULL,		'V' },
+{ "window",		required_argument,	NULL,		'w' },
+{ NULL,			0,			NULL,		 0  }
+};
+
+static void	usage(const char *progname) {
+	std::cout << progname << " [ options ]" << std::endl;
+	std::cout << std::endl;
+	std::cout << "load generator for the powermeter ingest path"
+		<< std::endl;
+	std::cout << std::endl;
+	std::cout << "options:" << std::endl;
+	std::cout << "  -c,--config=<f>     sink configuration file"
+		<< std::endl;
+	std::cout << "  -d,--debug          debug output" << std::endl;
+	std::cout << "  -n,--meters=<n>     number of simulated meters "
+		"(default 100)" << std::endl;
+	std::cout << "  -w,--window=<s>     integration window in seconds "
+		"(default 10)" << std::endl;
+	std::cout << "  -i,--interval=<s>   sampling interval in seconds "
+		"(default 1)" << std::endl;
+	std::cout << "  -f,--fields=<n>     number of fields per message"
+		<< std::endl;
+	std::cout << "  -s,--sensorname=<s> sensor the fields belong to"
+		<< std::endl;
+	std::cout << "  -t,--duration=<s>   stop after <s> seconds "
+		"(default 600)" << std::endl;
+	std::cout << "  -q,--maxdepth=<n>   stop when more than <n> messages "
+		"are queued (default 2 * meters)" << std::endl;
+	std::cout << "  -e,--seed=<s>       seed for the first meter"
+		<< std::endl;
+}
+
+/**
+ * \brief Compute a percentile of a sorted vector of latencies
+ */
+static float	percentile(const std::vector<float>& sorted, float p) {
+	if (sorted.size() == 0) {
+		return 0;
+	}
+	size_t	i = p * (sorted.size() - 1);
+	return sorted[i];
+}
+
+/**
+ * \brief Main method for the load generator
+ *
+ * \param argc		number of arguments
+ * \param argv		argument strings
+ */
+int	main(int argc, char *argv[]) {
+	int	c;
+	configuration	config;
+	debug_set_ident("loadgen");
+	debugthreads = 1;
+	int	meters = 100;
+	int	duration = 600;
+	int	maxdepth = -1;
+	config.set("meterwindow", 10);
+	config.set("meterinterval", 1);
+	config.set("sensorname", "simulated");
+
+	// read parameters from the command line
+	std::vector<std::pair<std::string, std::string> >	overrides;
+	while (EOF != (c = getopt_long(argc, argv, "c:dt:f:i:q:n:e:s:Vw:",
+		longopts, NULL)))
+		switch (c) {
+		case 'c':
+			{
+			configuration	file(optarg);
+			for (auto i = file.begin(); i != file.end(); i++) {
+				config.set(i->first, i->second);
+			}
+			}
+			break;
+		case 'd':
+			debuglevel = LOG_DEBUG;
+			break;
+		case 't':
+			duration = std::stoi(optarg);
+			break;
+		case 'f':
+			overrides.push_back(std::make_pair("simfieldcount",
+				optarg));
+			break;
+		case 'i':
+			overrides.push_back(std::make_pair("meterinterval",
+				optarg));
+			break;
+		case 'q':
+			maxdepth = std::stoi(optarg);
+			break;
+		case 'n':
+			meters = std::stoi(optarg);
+			break;
+		case 'e':
+			overrides.push_back(std::make_pair("seed", optarg));
+			break;
+		case 's':
+			overrides.push_back(std::make_pair("sensorname",
+				optarg));
+			break;
+		case 'V':
+			std::cout << "loadgen " << VERSION << std::endl;
+			return EXIT_SUCCESS;
+		case 'w':
+			overrides.push_back(std::make_pair("meterwindow",
+				optarg));
+			break;
+		case '?':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		}
+	for (auto i = overrides.begin(); i != overrides.end(); i++) {
+		config.set(i->first, i->second);
+	}
+	if (maxdepth < 0) {
+		maxdepth = 2 * meters;
+	}
+	unsigned int	seed = simulator::seed(config);
+
+	// the queue and the dispatcher draining it into the sinks
+	messagequeue	queue;
+	sinkfactory	sinks(config);
+	std::unique_ptr<dispatcher>	consumer(new dispatcher(config, queue,
+		sinks.sinks()));
+
+	// create the fleet, every meter gets its own seed
+	std::vector<std::shared_ptr<meter> >	fleet;
+	for (int i = 0; i < meters; i++) {
+		configuration	meterconfig = config;
+		meterconfig.set("seed", (int)(seed + i));
+		fleet.push_back(std::shared_ptr<meter>(
+			new simulated_meter(meterconfig, queue)));
+	}
+	debug(LOG_INFO, DEBUG_LOG, 0, "%d meters running", meters);
+
+	// report once per second
+	int	status = EXIT_SUCCESS;
+	size_t	previousdepth = 0;
+	printf("%6s %10s %10s %10s %8s %10s %10s\n", "time", "submit/s",
+		"msgs/s", "rows/s", "depth", "p50[ms]", "p99[ms]");
+	for (int t = 1; t <= duration; t++) {
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+		size_t	messages, rows;
+		std::vector<float>	latencies;
+		consumer->statistics(messages, rows, latencies);
+		// the depth includes the longest sink queue
+		size_t	depth = queue.depth();
+		size_t	sinkdepth = 0;
+		size_t	dropped = 0;
+		std::vector<std::pair<std::string, sinklag> >	lags
+			= consumer->lags();
+		for (auto l = lags.begin(); l != lags.end(); l++) {
+			sinkdepth = std::max(sinkdepth, l->second.queued);
+			dropped += l->second.dropped;
+		}
+		depth += sinkdepth;
+		// whatever was not completed must still be in a queue
+		size_t	submitrate = messages + depth - previousdepth;
+		previousdepth = depth;
+		std::sort(latencies.begin(), latencies.end());
+		printf("%6d %10lu %10lu %10lu %8lu %10.1f %10.1f", t,
+			submitrate, messages, rows, depth,
+			1000 * percentile(latencies, 0.5),
+			1000 * percentile(latencies, 0.99));
+		for (auto l = lags.begin(); l != lags.end(); l++) {
+			const sinklag&	lag = l->second;
+			size_t	commits = std::max(lag.commits, (size_t)1);
+			printf("  %s:%lu/%.1fs/%lur/%.1fms", l->first.c_str(),
+				lag.queued, lag.age, lag.committedrows / commits,
+				1000 * lag.committime / commits);
+		}
+		printf("\n");
+		fflush(stdout);
+		if (depth > (size_t)maxdepth) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "queue depth %lu exceeds %d, "
+				"the pipeline is falling behind", depth,
+				maxdepth);
+			status = EXIT_FAILURE;
+			break;
+		}
+		if (dropped > 0) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "%lu messages dropped, "
+				"the pipeline is falling behind", dropped);
+			status = EXIT_FAILURE;
+			break;
+		}
+	}
+
+	// stop the meters first, then release the dispatcher thread
+	fleet.clear();
+	queue.terminate();
+	consumer.reset();
+	return status;
+}
+
+} // namespace powermeter
+
+int	main(int argc, char *argv[]) {
+	try {
+		return powermeter::main(argc, argv);
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "loadgen main failed: %s",
+			x.what());
+	} catch (...) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "loadgen main failed");
+	}
+	return EXIT_FAILURE;
+}
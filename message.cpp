@@ -5,6 +5,8 @@
  */
 #include <message.h>
 #include <debug.h>
+#include <metrics.h>
+#include <flightrecorder.h>
 
 namespace powermeter {
 
@@ -12,7 +14,8 @@ namespace powermeter {
 // message implementation
 //
 
-message::message(const std::chrono::system_clock::time_point& when) : _when(when) {
+message::message(const std::chrono::system_clock::time_point& when)
+	: _when(when), _observer(NULL) {
 }
 
 const std::chrono::system_clock::time_point&	message::when() const {
@@ -31,6 +34,10 @@ void	message::accumulate(const std::chrono::duration<float>& duration,
 		const std::string& name, const float value) {
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "accumulate %s -> %.3f", name.c_str(),
 		value);
+	if ((_observer) && (duration.count() > 0)) {
+		_observer->sample(name, value);
+	}
+	flightrecorder::record(trace_accumulate, value);
 	float	ivalue = value * duration.count();
 	std::map<std::string, float>::const_iterator	i = find(name);
 	if (i == end()) {
@@ -50,6 +57,9 @@ void	message::accumulate_signed(const std::chrono::duration<float>& duration,
 }
 
 void	message::update(const std::string& name, const float value) {
+	if (_observer) {
+		_observer->sample(name, value);
+	}
 	std::map<std::string, float>::const_iterator	i = find(name);
 	if (i == end()) {
 		insert(std::make_pair(name, value));
@@ -97,14 +107,24 @@ void	messagequeue::submit(const message& m) {
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "submitting a message");
 	std::unique_lock<std::mutex>	lock(_mutex);
 	push_front(m);
+	front().submitted(std::chrono::steady_clock::now());
 	_last_submit = std::chrono::system_clock::now();
+	flightrecorder::record(trace_submit, size());
 	_signal.notify_all();
 }
 
 /**
  * \brief Extract a message from the queue
+ *
+ * A meter that stops producing messages is restarted by the supervisor,
+ * so a long wait is only reported here.
+ *
+ * \param timeout	how long to wait before warning about the silence
  */
 message	messagequeue::extract(const std::chrono::seconds& timeout) {
+	static histogram&	waittime = metrics::newhistogram(
+		"powermeter_queue_wait_seconds",
+		"Time messages wait in the message queue");
 	std::unique_lock<std::mutex>	lock(_mutex);
 	while (_active) {
 		if (size() > 0) {
@@ -113,14 +133,16 @@ message	messagequeue::extract(const std::chrono::seconds& timeout) {
 			auto result = back();
 			pop_back();
 			_last_extract = std::chrono::system_clock::now();
+			flightrecorder::record(trace_extract, size());
+			waittime.observe(std::chrono::steady_clock::now()
+				- result.submitted());
 			return result;
 		}
 		debug(LOG_DEBUG, DEBUG_LOG, 0, "waiting for message");
-		switch (_signal.wait_for(lock, std::chrono::seconds(80))) {
+		switch (_signal.wait_for(lock, timeout)) {
 		case std::cv_status::timeout:
-			debug(LOG_ERR, DEBUG_LOG, 0,
-				"timeout waiting for new message");
-			abort();
+			debug(LOG_WARNING, DEBUG_LOG, 0, "no new message for "
+				"%lds", (long)timeout.count());
 			break;
 		default:
 			break;
@@ -129,6 +151,26 @@ message	messagequeue::extract(const std::chrono::seconds& timeout) {
 	throw std::runtime_error("queue terminated");
 }
 
+/**
+ * \brief Number of messages waiting in the queue
+ */
+size_t	messagequeue::depth() {
+	std::unique_lock<std::mutex>	lock(_mutex);
+	return size();
+}
+
+/**
+ * \brief Terminate the queue
+ *
+ * This wakes up all threads waiting in extract or wait, extract then
+ * throws an exception.
+ */
+void	messagequeue::terminate() {
+	std::unique_lock<std::mutex>	lock(_mutex);
+	_active = false;
+	_signal.notify_all();
+}
+
 /**
  * \brief Wait for the queue to get signaled
  *
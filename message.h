@@ -15,13 +15,31 @@
 
 namespace powermeter {
 
+/**
+ * \brief Receiver of the individual samples accumulated into a message
+ */
+class sampleobserver {
+public:
+	virtual ~sampleobserver() { }
+	virtual void	sample(const std::string& name, float value) = 0;
+};
+
 class message : public std::map<std::string, float> {
 	std::chrono::system_clock::time_point	_when;
+	std::chrono::steady_clock::time_point	_submitted;
+	sampleobserver	*_observer;
 public:
 	static std::pair<std::string, std::string>	split(const std::string& s);
 	message(const std::chrono::system_clock::time_point& when);
 	const std::chrono::system_clock::time_point&	when() const;
 	void	when(const std::chrono::system_clock::time_point& w);
+	const std::chrono::steady_clock::time_point&	submitted() const {
+		return _submitted;
+	}
+	void	submitted(const std::chrono::steady_clock::time_point& s) {
+		_submitted = s;
+	}
+	void	observer(sampleobserver *o) { _observer = o; }
 	bool	has(const std::string& name);
 	void	accumulate(const std::chrono::duration<float>& duration,
 			const std::string& name,
@@ -47,6 +65,8 @@ public:
 	~messagequeue();
 	void	submit(const message& m);
 	message	extract(const std::chrono::seconds& timeout);
+	void	terminate();
+	size_t	depth();
 	status	wait(const std::chrono::duration<float>& howlong);
 };
 
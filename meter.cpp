@@ -7,6 +7,7 @@
 #include <stdexcept>
 #include <debug.h>
 #include <format.h>
+#include <metrics.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <cstring>
@@ -58,6 +59,18 @@ void	meter::stopthread() {
 	}
 }
 
+/**
+ * \brief Wait for the meter thread to terminate on its own
+ *
+ * This is used in replay mode, where the thread ends when the capture
+ * is exhausted.
+ */
+void	meter::waitthread() {
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+}
+
 /**
  * \brief Constructor for a meter object
  *
@@ -69,7 +82,21 @@ void	meter::stopthread() {
 meter::meter(const configuration& config, messagequeue& queue)
 	: _queue(queue),
 	  _interval(std::chrono::duration<float>(
-		config.floatvalue("meterinterval"))) {
+		config.floatvalue("meterinterval"))),
+	  _window(config.intvalue("meterwindow", 60)),
+	  _clock(meterclock::get(config)), _ready(false),
+	  _samples(0) {
+	std::string	replayfile = config.stringvalue("replayfile", "");
+	std::string	capturefile = config.stringvalue("capturefile", "");
+	if (replayfile.size() > 0) {
+		_replay = std::shared_ptr<replay>(new replay(replayfile,
+			config.boolvalue("replaypace", false)));
+	} else if (capturefile.size() > 0) {
+		_capture = std::shared_ptr<capture>(new capture(capturefile));
+	}
+	if (config.stringvalue("livesocket", "").size() > 0) {
+		_live = std::unique_ptr<livestream>(new livestream(config));
+	}
 }
 
 /**
@@ -82,23 +109,333 @@ meter::~meter() {
  * \brief The main method for the meter thread
  */
 void	meter::run() {
+	static histogram&	windowsamples = metrics::newhistogram(
+		"powermeter_window_samples", "Samples integrated per window",
+		histogram::countbounds());
 	while (_active) {
 		debug(LOG_DEBUG, DEBUG_LOG, 0, "wait for a message");
 		// during an integration interval
 		try {
+			_samples = 0;
 			message	m = integrate();
 			debug(LOG_DEBUG, DEBUG_LOG, 0, "got a new message");
-			
-			// submit it to the queue
-			debug(LOG_DEBUG, DEBUG_LOG, 0, "submit message");
-			_queue.submit(m);
+			windowsamples.observe(_samples);
+			submit(m);
 		} catch (const std::exception& x) {
 			debug(LOG_ERR, DEBUG_LOG, 0, "cannot process a "
 				"message: %s, %s", x.what(),
 				(_active) ? "retry" : "terminate");
+			// a stopped thread leaves the partial window to its
+			// successor, after a failure the window is discarded
+			if (_active) {
+				_partial.reset();
+			}
+			if (_capture) {
+				_capture->record(capture_discard,
+					_clock->now());
+			}
 		}
 	}
 	debug(LOG_INFO, DEBUG_LOG, 0, "meter thread has been deactivated");
 }
 
+/**
+ * \brief Publish a completed message and submit it to the queue
+ *
+ * \param m	the message to submit
+ */
+void	meter::submit(message& m) {
+	m.observer(NULL);
+	if (_live) {
+		_live->publish(m);
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "submit message");
+	_queue.submit(m);
+	_alive.beat();
+}
+
+/**
+ * \brief Start a new window or continue the partial window
+ *
+ * A partial window left by a previous thread is continued if it has not
+ * ended yet. If it has, it is submitted with the values averaged over
+ * the part of the window it covers, and a new window is started.
+ */
+message&	meter::openwindow() {
+	if (_partial) {
+		if (replaying() || (_clock->now() < _windowend)) {
+			debug(LOG_INFO, DEBUG_LOG, 0, "continuing the partial "
+				"window");
+			observe(*_partial);
+			return *_partial;
+		}
+		flushwindow();
+	}
+	std::chrono::system_clock::time_point	start = windowstart();
+	_partial = std::unique_ptr<message>(new message(start));
+	_windowend = start + _window;
+	_previous = start;
+	observe(*_partial);
+	return *_partial;
+}
+
+/**
+ * \brief Finalize the completed window
+ *
+ * The integrals are divided by the length of the window, like a window
+ * that was sampled to its end.
+ */
+message	meter::closewindow() {
+	message	result = *_partial;
+	_partial.reset();
+	float	d = std::chrono::duration<double>(_windowend
+			- result.when()).count();
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "duration was %.6f", d);
+	finalize(result, 1. / d);
+	return result;
+}
+
+/**
+ * \brief Submit the partial window
+ *
+ * The integrals only cover the time from the start of the window to the
+ * last sample, so they are divided by that time rather than by the
+ * length of the window. A partial window without samples is dropped.
+ * The meter thread must not be running.
+ */
+void	meter::flushwindow() {
+	if (!_partial) {
+		return;
+	}
+	message	m = *_partial;
+	_partial.reset();
+	double	covered = std::chrono::duration<double>(_previous
+			- m.when()).count();
+	if (covered <= 0) {
+		debug(LOG_WARNING, DEBUG_LOG, 0, "partial window without "
+			"samples dropped");
+		return;
+	}
+	debug(LOG_INFO, DEBUG_LOG, 0, "submitting partial window covering "
+		"%.1fs", covered);
+	finalize(m, 1. / covered);
+	submit(m);
+}
+
+/**
+ * \brief Reconnect to the device, the default does nothing
+ */
+void	meter::reconnect() {
+}
+
+/**
+ * \brief Restart the meter thread
+ *
+ * The thread is stopped, leaving its partial window behind, the
+ * connection to the device is reopened and a new thread continues
+ * the window.
+ */
+void	meter::restart() {
+	stopthread();
+	if (!replaying()) {
+		try {
+			reconnect();
+		} catch (const std::exception& x) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "cannot reconnect: %s",
+				x.what());
+		}
+	}
+	_alive.beat();
+	startthread();
+}
+
+/**
+ * \brief Stop sampling and submit the partial window
+ */
+void	meter::shutdown() {
+	stopthread();
+	if (!replaying()) {
+		flushwindow();
+	}
+}
+
+/**
+ * \brief Find the start of the integration interval
+ *
+ * This is the start of the current window, i.e. the start of the current
+ * minute for the default window of 60 seconds. In replay mode, the start
+ * time is taken from the capture.
+ */
+std::chrono::system_clock::time_point	meter::windowstart() {
+	if (replaying()) {
+		if (NULL == _replay->peek()) {
+			_active = false;
+			throw std::runtime_error("replay complete");
+		}
+		return _replay->next(capture_window).when;
+	}
+
+	// compute the time for the next minute interval
+	std::chrono::system_clock::time_point	start = _clock->now();
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "start is %ld",
+		start.time_since_epoch().count());
+
+	// round down to the start of the window
+	std::chrono::seconds	startduration
+		= std::chrono::duration_cast<std::chrono::seconds>(
+			start.time_since_epoch());
+	startduration -= startduration % _window;
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "startduration is %ld",
+		startduration.count());
+	start = std::chrono::time_point<std::chrono::system_clock,
+		std::chrono::seconds>(startduration);
+
+	if (_capture) {
+		_capture->record(capture_window, start);
+	}
+	return start;
+}
+
+/**
+ * \brief Find out whether the integration interval is still running
+ *
+ * In replay mode, the interval ends where the capture has the start of
+ * the next interval.
+ *
+ * \param end	the end of the integration interval
+ */
+bool	meter::windowactive(const std::chrono::system_clock::time_point& end) {
+	if (!replaying()) {
+		return _clock->now() < end;
+	}
+	const capture_record	*r = _replay->peek();
+	if (NULL == r) {
+		_active = false;
+		throw std::runtime_error("replay complete");
+	}
+	switch (r->type) {
+	case capture_window:
+		return false;
+	case capture_discard:
+		_replay->next();
+		throw std::runtime_error("interval discarded in capture");
+	default:
+		return true;
+	}
+}
+
+/**
+ * \brief Wait for the time of the next sample
+ *
+ * \param lock	the lock on the meter mutex, used to wait for the signal
+ * \param end	the end of the integration interval
+ */
+void	meter::waitsample(std::unique_lock<std::mutex>& lock,
+		const std::chrono::system_clock::time_point& end) {
+	std::chrono::duration<float>	remaining;
+	if (replaying()) {
+		remaining = _replay->delay();
+		if (remaining.count() <= 0) {
+			if (!_active) {
+				throw std::runtime_error("meter thread "
+					"interrupted");
+			}
+			return;
+		}
+	} else {
+		// compute the largest possible interval we can wait
+		remaining = end - _clock->now();
+		if (remaining > _interval) {
+			remaining = _interval;
+		}
+	}
+
+	// wait for the remaining time, a virtual clock does not wait
+	// for the signal, so we check the active flag as well
+	switch (_clock->wait_for(_signal, lock, remaining)) {
+	case std::cv_status::timeout:
+		break;
+	case std::cv_status::no_timeout:
+		// this means we were signaled to interrupt
+		std::string	msg("meter thread interrupted by signal");
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	if (!_active) {
+		throw std::runtime_error("meter thread interrupted");
+	}
+}
+
+/**
+ * \brief Get the time point of the current sample
+ *
+ * The time point is recorded in the capture, so that a replay integrates
+ * with exactly the same time steps. The first sample also signals
+ * that the meter is ready.
+ */
+std::chrono::system_clock::time_point	meter::sampletime() {
+	std::chrono::system_clock::time_point	now;
+	if (replaying()) {
+		now = _replay->next(capture_sample).when;
+	} else {
+		now = _clock->now();
+		if (_capture) {
+			_capture->record(capture_sample, now);
+		}
+	}
+	if (!_ready) {
+		ready();
+	}
+	_samplewhen = now;
+	_samples++;
+	return now;
+}
+
+/**
+ * \brief Let the meter see the samples accumulated into a message
+ *
+ * \param m	the message being integrated
+ */
+void	meter::observe(message& m) {
+	if (_live) {
+		m.observer(this);
+	}
+}
+
+/**
+ * \brief Publish a sample on the live stream
+ *
+ * \param name		name of the value
+ * \param value		the value of the current sample
+ */
+void	meter::sample(const std::string& name, float value) {
+	_live->publish(_samplewhen, name, value);
+}
+
+/**
+ * \brief Signal that the meter has started sampling
+ */
+void	meter::ready() {
+	std::unique_lock<std::mutex>	lock(_readymutex);
+	if (_ready) {
+		return;
+	}
+	_ready = true;
+	debug(LOG_INFO, DEBUG_LOG, 0, "meter is ready");
+	_readysignal.notify_all();
+}
+
+/**
+ * \brief Wait until the meter has taken its first sample
+ *
+ * \param timeout	how long to wait at most
+ * \return		whether the meter is ready
+ */
+bool	meter::waitready(const std::chrono::duration<float>& timeout) {
+	std::unique_lock<std::mutex>	lock(_readymutex);
+	return _readysignal.wait_for(lock, timeout, [this]() {
+		return (bool)_ready;
+	});
+}
+
 } // namespace powermeter
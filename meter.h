@@ -14,15 +14,38 @@
 #include <condition_variable>
 #include <configuration.h>
 #include <simulator.h>
+#include <capture.h>
+#include <meterclock.h>
+#include <livestream.h>
+#include <supervisor.h>
+#include <memory>
 
 namespace powermeter {
 
 class meter;
 
-class meter {
+/**
+ * \brief Base class of all meters
+ *
+ * If livesocket is set, the meter publishes every sample and every
+ * completed message on a livestream. The integrate methods register the
+ * meter as the sample observer of the message they build.
+ *
+ * The window being integrated is kept in the meter rather than in the
+ * integrate method. When the thread is stopped in the middle of a
+ * window, e.g. because the supervisor restarts the meter, the next
+ * thread continues the partial window. The meter beats its heartbeat
+ * whenever it submits a message, restart stops the thread, reconnects
+ * to the device and starts a new thread. shutdown stops the thread and
+ * submits the partial window, so that stopping the daemon does not
+ * lose the data of the current window.
+ */
+class meter : public sampleobserver {
 protected:
 	messagequeue&		_queue;
 	std::chrono::duration<float>	_interval;
+	std::chrono::seconds	_window;
+	std::shared_ptr<meterclock>	_clock;
 	// managing the thread
 	std::atomic<bool>	_active;
 	std::thread		_thread;
@@ -30,14 +53,60 @@ protected:
 	std::condition_variable	_signal;
 	virtual message	integrate() = 0;
 
+	// readiness, signaled when the first sample is taken
+	std::atomic<bool>	_ready;
+	std::mutex		_readymutex;
+	std::condition_variable	_readysignal;
+	void	ready();
+
+	// live stream of the samples
+	std::unique_ptr<livestream>	_live;
+	std::chrono::system_clock::time_point	_samplewhen;
+	size_t	_samples;
+	void	observe(message& m);
+
 	void	stopthread();
+
+	// the window being integrated, survives a restart of the thread
+	std::unique_ptr<message>	_partial;
+	std::chrono::system_clock::time_point	_windowend;
+	std::chrono::system_clock::time_point	_previous;
+	message&	openwindow();
+	message	closewindow();
+	void	submit(message& m);
+	virtual void	finalize(message& m, float factor) = 0;
+
+	// proof of life for the supervisor
+	heartbeat	_alive;
+	virtual void	reconnect();
+
+	// capture and replay of the raw meter data
+	std::shared_ptr<capture>	_capture;
+	std::shared_ptr<replay>		_replay;
+	bool	replaying() const { return (bool)_replay; }
+
+	// integration interval helpers
+	std::chrono::system_clock::time_point	windowstart();
+	bool	windowactive(const std::chrono::system_clock::time_point& end);
+	void	waitsample(std::unique_lock<std::mutex>& lock,
+			const std::chrono::system_clock::time_point& end);
+	std::chrono::system_clock::time_point	sampletime();
 public:
 	meter(const configuration& config, messagequeue& queue);
 	meter(const meter& other) = delete;
 	virtual ~meter();
 	void	startthread();
+	void	waitthread();
+	bool	active() const { return _active; }
+	bool	isready() const { return _ready; }
+	bool	waitready(const std::chrono::duration<float>& timeout);
 	static void	launch(meter* m);
 	void	run();
+	virtual void	sample(const std::string& name, float value);
+	heartbeat&	alive() { return _alive; }
+	void	restart();
+	void	flushwindow();
+	void	shutdown();
 };
 
 } // namespace powermeter
@@ -0,0 +1,86 @@
+//
+// meterclock.cpp -- time source for the meters and the simulator
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <meterclock.h>
+#include <debug.h>
+#include <format.h>
+#include <stdexcept>
+
+namespace powermeter {
+
+meterclock::~meterclock() {
+}
+
+/**
+ * \brief Create the clock selected in the configuration
+ *
+ * The clock variable selects between the system clock (the default) and
+ * a virtual clock. The virtual clock starts at the clockstart time given
+ * in seconds since the epoch, or at the current time if it is not set.
+ *
+ * \param config	the configuration to read the clock parameters from
+ */
+std::shared_ptr<meterclock>	meterclock::get(const configuration& config) {
+	std::string	clockname = config.stringvalue("clock", "system");
+	if (clockname == "system") {
+		return std::shared_ptr<meterclock>(new systemclock());
+	}
+	if (clockname == "virtual") {
+		time_point	start = std::chrono::system_clock::now();
+		if (config.find("clockstart") != config.end()) {
+			start = time_point(std::chrono::seconds(
+				config.intvalue("clockstart")));
+		}
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "virtual clock starts at %ld",
+			std::chrono::duration_cast<std::chrono::seconds>(
+				start.time_since_epoch()).count());
+		return std::shared_ptr<meterclock>(new virtualclock(start));
+	}
+	std::string	msg = stringprintf("unknown clock: %s",
+		clockname.c_str());
+	debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+	throw std::runtime_error(msg);
+}
+
+//////////////////////////////////////////////////////////////////////
+// systemclock implementation
+//////////////////////////////////////////////////////////////////////
+
+meterclock::time_point	systemclock::now() {
+	return std::chrono::system_clock::now();
+}
+
+std::cv_status	systemclock::wait_for(std::condition_variable& signal,
+		std::unique_lock<std::mutex>& lock,
+		const std::chrono::duration<float>& howlong) {
+	return signal.wait_for(lock, howlong);
+}
+
+//////////////////////////////////////////////////////////////////////
+// virtualclock implementation
+//////////////////////////////////////////////////////////////////////
+
+virtualclock::virtualclock(const time_point& start) : _now(start) {
+}
+
+meterclock::time_point	virtualclock::now() {
+	std::unique_lock<std::mutex>	lock(_mutex);
+	return _now;
+}
+
+void	virtualclock::advance(const std::chrono::duration<float>& howlong) {
+	std::unique_lock<std::mutex>	lock(_mutex);
+	_now += std::chrono::duration_cast<
+		std::chrono::system_clock::duration>(howlong);
+}
+
+std::cv_status	virtualclock::wait_for(std::condition_variable& /* signal */,
+		std::unique_lock<std::mutex>& /* lock */,
+		const std::chrono::duration<float>& howlong) {
+	advance(howlong);
+	return std::cv_status::timeout;
+}
+
+} // namespace powermeter
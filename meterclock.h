@@ -0,0 +1,68 @@
+//
+// meterclock.h -- time source for the meters and the simulator
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _meterclock_h
+#define _meterclock_h
+
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <configuration.h>
+
+namespace powermeter {
+
+/**
+ * \brief Abstract time source
+ *
+ * The meters take all time points from a clock and do all their waiting
+ * through the clock, so that integration can also run in virtual time.
+ */
+class meterclock {
+public:
+	typedef std::chrono::system_clock::time_point	time_point;
+	virtual ~meterclock();
+	virtual time_point	now() = 0;
+	virtual std::cv_status	wait_for(std::condition_variable& signal,
+			std::unique_lock<std::mutex>& lock,
+			const std::chrono::duration<float>& howlong) = 0;
+	static std::shared_ptr<meterclock>	get(const configuration& config);
+};
+
+/**
+ * \brief The wall clock, waiting really takes time
+ */
+class systemclock : public meterclock {
+public:
+	virtual time_point	now();
+	virtual std::cv_status	wait_for(std::condition_variable& signal,
+			std::unique_lock<std::mutex>& lock,
+			const std::chrono::duration<float>& howlong);
+};
+
+/**
+ * \brief A clock that advances only when somebody waits
+ *
+ * Waiting on a virtual clock returns immediately after advancing the
+ * clock by the requested time, so a simulated day takes only as long
+ * as the computation needs. The waiting thread is not released by
+ * the signal, callers have to check their termination condition after
+ * each wait.
+ */
+class virtualclock : public meterclock {
+	std::mutex	_mutex;
+	time_point	_now;
+public:
+	virtualclock(const time_point& start);
+	virtual time_point	now();
+	virtual std::cv_status	wait_for(std::condition_variable& signal,
+			std::unique_lock<std::mutex>& lock,
+			const std::chrono::duration<float>& howlong);
+	void	advance(const std::chrono::duration<float>& howlong);
+};
+
+} // namespace powermeter
+
+#endif /* _meterclock_h */
@@ -7,6 +7,7 @@
 #include <solivia_meter.h>
 #include <ale3_meter.h>
 #include <modbus_meter.h>
+#include <simulated_meter.h>
 #include <format.h>
 #include <debug.h>
 
@@ -23,6 +24,38 @@ std::shared_ptr<meter>	meterfactory::get(const std::string& metertypename,
 	if (metertypename == "modbus") {
 		return std::shared_ptr<meter>(new modbus_meter(_config, queue));
 	}
+	if (metertypename == "simulated") {
+		return std::shared_ptr<meter>(new simulated_meter(_config,
+			queue));
+	}
+	std::string	msg = stringprintf("unknown meter type: %s",
+		metertypename.c_str());
+	debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+	throw std::runtime_error(msg);
+}
+
+/**
+ * \brief Names of all values a meter of this type puts into messages
+ *
+ * The names are derived from the configuration alone, so they can be
+ * checked against the database before the meter starts sampling.
+ *
+ * \param metertypename	the meter type
+ */
+std::vector<std::string>	meterfactory::fieldnames(
+		const std::string& metertypename) {
+	if (metertypename == "solivia") {
+		return solivia_meter::fieldnames(_config);
+	}
+	if (metertypename == "ale3") {
+		return ale3_meter::fieldnames(_config);
+	}
+	if (metertypename == "modbus") {
+		return modbus_meter::fieldnames(_config);
+	}
+	if (metertypename == "simulated") {
+		return simulated_meter::fieldnames(_config);
+	}
 	std::string	msg = stringprintf("unknown meter type: %s",
 		metertypename.c_str());
 	debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
@@ -8,6 +8,8 @@
 
 #include <meter.h>
 #include <configuration.h>
+#include <vector>
+#include <string>
 
 namespace powermeter {
 
@@ -17,6 +19,8 @@ public:
 	meterfactory(const configuration& config) : _config(config) { }
 	std::shared_ptr<meter>	get(const std::string& metertypename,
 					messagequeue& queue);
+	std::vector<std::string>	fieldnames(
+					const std::string& metertypename);
 };
 
 } // namespace powermeter
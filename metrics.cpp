@@ -0,0 +1,225 @@
+//
+// metrics.cpp -- counters and histograms in Prometheus text format
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <metrics.h>
+#include <debug.h>
+#include <format.h>
+#include <map>
+
+namespace powermeter {
+
+/**
+ * \brief The slot of the calling thread
+ *
+ * Threads get consecutive slot numbers in the order in which they
+ * first touch a metric.
+ */
+size_t	metricslot() {
+	static std::atomic<size_t>	next(0);
+	static thread_local size_t	slot = next++ % metricslots;
+	return slot;
+}
+
+//////////////////////////////////////////////////////////////////////
+// metric implementation
+//////////////////////////////////////////////////////////////////////
+
+std::string	metric::family() const {
+	return _name.substr(0, _name.find('{'));
+}
+
+/**
+ * \brief The labels without braces, empty if there are none
+ */
+std::string	metric::labels() const {
+	size_t	b = _name.find('{');
+	if (b == std::string::npos) {
+		return std::string();
+	}
+	return _name.substr(b + 1, _name.rfind('}') - b - 1);
+}
+
+uint64_t	counter::value() const {
+	uint64_t	result = 0;
+	for (size_t i = 0; i < metricslots; i++) {
+		result += _slots[i].value.load(std::memory_order_relaxed);
+	}
+	return result;
+}
+
+std::string	counter::exposition() const {
+	return stringprintf("%s %llu\n", name().c_str(),
+		(unsigned long long)value());
+}
+
+std::string	gauge::exposition() const {
+	return stringprintf("%s %lld\n", name().c_str(),
+		(long long)_value.load(std::memory_order_relaxed));
+}
+
+std::string	callbackgauge::exposition() const {
+	return stringprintf("%s %.9g\n", name().c_str(), _callback());
+}
+
+histogram::slot::slot() : sum(0) {
+	for (size_t i = 0; i <= maxbuckets; i++) {
+		counts[i] = 0;
+	}
+}
+
+histogram::histogram(const std::string& name, const std::string& help,
+	const std::vector<double>& bounds)
+	: metric(name, help), _bounds(bounds) {
+	if (_bounds.size() > maxbuckets) {
+		_bounds.resize(maxbuckets);
+	}
+}
+
+/**
+ * \brief Record an observation
+ *
+ * Only the bucket the value falls into is incremented, the cumulative
+ * counts are computed in the exposition.
+ */
+void	histogram::observe(double value) {
+	size_t	b = 0;
+	while ((b < _bounds.size()) && (value > _bounds[b])) {
+		b++;
+	}
+	slot&	s = _slots[metricslot()];
+	s.counts[b].fetch_add(1, std::memory_order_relaxed);
+	s.sum.fetch_add((uint64_t)(value * 1000000.),
+		std::memory_order_relaxed);
+}
+
+std::string	histogram::exposition() const {
+	std::string	l = labels();
+	if (l.size() > 0) {
+		l = l + ",";
+	}
+	std::string	f = family();
+	std::string	result;
+	uint64_t	cumulative = 0;
+	uint64_t	sum = 0;
+	for (size_t b = 0; b <= _bounds.size(); b++) {
+		for (size_t i = 0; i < metricslots; i++) {
+			cumulative += _slots[i].counts[b].load(
+				std::memory_order_relaxed);
+		}
+		std::string	le = (b < _bounds.size())
+			? stringprintf("%g", _bounds[b]) : std::string("+Inf");
+		result += stringprintf("%s_bucket{%sle=\"%s\"} %llu\n",
+			f.c_str(), l.c_str(), le.c_str(),
+			(unsigned long long)cumulative);
+	}
+	for (size_t i = 0; i < metricslots; i++) {
+		sum += _slots[i].sum.load(std::memory_order_relaxed);
+	}
+	std::string	braces = (l.size() > 0)
+		? "{" + l.substr(0, l.size() - 1) + "}" : std::string();
+	result += stringprintf("%s_sum%s %.6f\n", f.c_str(), braces.c_str(),
+		sum / 1000000.);
+	result += stringprintf("%s_count%s %llu\n", f.c_str(), braces.c_str(),
+		(unsigned long long)cumulative);
+	return result;
+}
+
+/**
+ * \brief Buckets for latencies from half a millisecond to ten seconds
+ */
+std::vector<double>	histogram::latencybounds() {
+	return std::vector<double>({ 0.0005, 0.001, 0.0025, 0.005, 0.01,
+		0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 });
+}
+
+/**
+ * \brief Buckets for counts like rows per commit or samples per window
+ */
+std::vector<double>	histogram::countbounds() {
+	return std::vector<double>({ 1, 2, 5, 10, 20, 50, 100, 200, 500,
+		1000, 2000, 5000, 10000 });
+}
+
+//////////////////////////////////////////////////////////////////////
+// metrics registry implementation
+//////////////////////////////////////////////////////////////////////
+
+metrics&	metrics::registry() {
+	static metrics	instance;
+	return instance;
+}
+
+metric&	metrics::add(metric *m) {
+	std::unique_lock<std::mutex>	lock(_mutex);
+	_metrics.push_back(std::unique_ptr<metric>(m));
+	return *m;
+}
+
+counter&	metrics::newcounter(const std::string& name,
+		const std::string& help) {
+	return (counter&)registry().add(new counter(name, help));
+}
+
+gauge&	metrics::newgauge(const std::string& name, const std::string& help) {
+	return (gauge&)registry().add(new gauge(name, help));
+}
+
+callbackgauge&	metrics::newgauge(const std::string& name,
+		const std::string& help, std::function<double()> callback) {
+	return (callbackgauge&)registry().add(new callbackgauge(name, help,
+		callback));
+}
+
+histogram&	metrics::newhistogram(const std::string& name,
+		const std::string& help, const std::vector<double>& bounds) {
+	return (histogram&)registry().add(new histogram(name, help, bounds));
+}
+
+/**
+ * \brief All metrics in the Prometheus text exposition format
+ *
+ * The metrics are grouped by family, each family gets its HELP and
+ * TYPE line once.
+ */
+std::string	metrics::exposition() {
+	metrics&	r = registry();
+	std::unique_lock<std::mutex>	lock(r._mutex);
+	std::map<std::string, std::vector<const metric*> >	families;
+	for (auto m = r._metrics.begin(); m != r._metrics.end(); m++) {
+		families[(*m)->family()].push_back(m->get());
+	}
+	std::string	result;
+	for (auto f = families.begin(); f != families.end(); f++) {
+		const metric	*first = f->second.front();
+		result += "# HELP " + f->first + " " + first->help() + "\n";
+		result += "# TYPE " + f->first + " " + first->type() + "\n";
+		for (auto m = f->second.begin(); m != f->second.end(); m++) {
+			result += (*m)->exposition();
+		}
+	}
+	return result;
+}
+
+//////////////////////////////////////////////////////////////////////
+// metricsserver implementation
+//////////////////////////////////////////////////////////////////////
+
+metricsserver::metricsserver(const configuration& config)
+	: _server(config.stringvalue("metricsaddress", "127.0.0.1"),
+		config.intvalue("metricsport"),
+		[](const std::string& path, const std::string& /* body */,
+			httpresponse& response) {
+			if (path != "/metrics") {
+				response.status = "404 Not Found";
+				response.type = "text/plain";
+				response.body = "not found";
+				return;
+			}
+			response.type = "text/plain; version=0.0.4";
+			response.body = metrics::exposition();
+		}) {
+}
+
+} // namespace powermeter
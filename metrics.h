@@ -0,0 +1,174 @@
+//
+// metrics.h -- counters and histograms in Prometheus text format
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _metrics_h
+#define _metrics_h
+
+#include <configuration.h>
+#include <httpserver.h>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace powermeter {
+
+/**
+ * \brief Number of per thread slots of a metric
+ *
+ * Every thread updates its own slot of a metric with relaxed atomic
+ * operations, so instrumentation needs no locks. The slots are padded
+ * to a multiple of the cache line size, so threads do not contend for
+ * the same cache line. Threads beyond the number of
+ * slots share slots, which is still correct, only slower.
+ */
+static const size_t	metricslots = 16;
+static const size_t	maxbuckets = 16;
+
+size_t	metricslot();
+
+/**
+ * \brief Common part of all metrics: name, labels and help text
+ *
+ * The name may contain labels, e.g. rejects_total{reason="crc"}, all
+ * metrics with the same name before the labels form a family.
+ */
+class metric {
+	std::string	_name;
+	std::string	_help;
+public:
+	metric(const std::string& name, const std::string& help)
+		: _name(name), _help(help) { }
+	virtual ~metric() { }
+	const std::string&	name() const { return _name; }
+	const std::string&	help() const { return _help; }
+	std::string	family() const;
+	std::string	labels() const;
+	virtual const char	*type() const = 0;
+	virtual std::string	exposition() const = 0;
+};
+
+/**
+ * \brief Monotonic counter
+ */
+class counter : public metric {
+	struct slot {
+		std::atomic<uint64_t>	value;
+		char	padding[64 - sizeof(std::atomic<uint64_t>)];
+		slot() : value(0) { }
+	};
+	slot	_slots[metricslots];
+public:
+	counter(const std::string& name, const std::string& help)
+		: metric(name, help) { }
+	void	add(uint64_t n = 1) {
+		_slots[metricslot()].value.fetch_add(n,
+			std::memory_order_relaxed);
+	}
+	uint64_t	value() const;
+	virtual const char	*type() const { return "counter"; }
+	virtual std::string	exposition() const;
+};
+
+/**
+ * \brief Value that can go up and down, set by its owner
+ */
+class gauge : public metric {
+	std::atomic<int64_t>	_value;
+public:
+	gauge(const std::string& name, const std::string& help)
+		: metric(name, help), _value(0) { }
+	void	set(int64_t v) { _value.store(v, std::memory_order_relaxed); }
+	virtual const char	*type() const { return "gauge"; }
+	virtual std::string	exposition() const;
+};
+
+/**
+ * \brief Gauge whose value is computed when the metrics are read
+ */
+class callbackgauge : public metric {
+	std::function<double()>	_callback;
+public:
+	callbackgauge(const std::string& name, const std::string& help,
+		std::function<double()> callback)
+		: metric(name, help), _callback(callback) { }
+	virtual const char	*type() const { return "gauge"; }
+	virtual std::string	exposition() const;
+};
+
+/**
+ * \brief Distribution of observations in fixed buckets
+ *
+ * The sum is kept in millionths of the observed unit, so that it can be
+ * updated atomically as an integer.
+ */
+class histogram : public metric {
+	std::vector<double>	_bounds;
+	struct slot {
+		std::atomic<uint64_t>	counts[maxbuckets + 1];
+		std::atomic<uint64_t>	sum;
+		char	padding[192 - (maxbuckets + 2)
+				* sizeof(std::atomic<uint64_t>)];
+		slot();
+	};
+	slot	_slots[metricslots];
+public:
+	histogram(const std::string& name, const std::string& help,
+		const std::vector<double>& bounds);
+	void	observe(double value);
+	void	observe(const std::chrono::duration<double>& d) {
+		observe(d.count());
+	}
+	virtual const char	*type() const { return "histogram"; }
+	virtual std::string	exposition() const;
+	static std::vector<double>	latencybounds();
+	static std::vector<double>	countbounds();
+};
+
+/**
+ * \brief Registry of all metrics of the process
+ *
+ * Metrics are created once, usually into a function local static
+ * reference, and live as long as the process. Only creation and
+ * exposition lock the registry, updates go to the metric directly.
+ */
+class metrics {
+	std::mutex	_mutex;
+	std::list<std::unique_ptr<metric> >	_metrics;
+	metric&	add(metric *m);
+	static metrics&	registry();
+public:
+	static counter&	newcounter(const std::string& name,
+		const std::string& help);
+	static gauge&	newgauge(const std::string& name,
+		const std::string& help);
+	static callbackgauge&	newgauge(const std::string& name,
+		const std::string& help, std::function<double()> callback);
+	static histogram&	newhistogram(const std::string& name,
+		const std::string& help, const std::vector<double>& bounds
+			= histogram::latencybounds());
+	static std::string	exposition();
+};
+
+/**
+ * \brief HTTP endpoint /metrics serving the registry
+ *
+ * The server listens on metricsaddress (default 127.0.0.1) port
+ * metricsport.
+ */
+class metricsserver {
+	httpserver	_server;
+public:
+	metricsserver(const configuration& config);
+};
+
+} // namespace powermeter
+
+#endif /* _metrics_h */
@@ -0,0 +1,97 @@
+//
+// minutemap.cpp
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <minutemap.h>
+#include <algorithm>
+
+namespace powermeter {
+
+/**
+ * \brief Create an empty map ending at the current time
+ *
+ * \param now		the current time
+ * \param slots		number of slots to keep
+ * \param resolution	length of a slot in seconds
+ */
+minutemap::minutemap(int64_t now, size_t slots, int resolution)
+	: _resolution(resolution), _bits((slots + 63) / 64 + 1, 0) {
+	_base = (slot(now) - (int64_t)(_bits.size() - 1) * 64) & ~(int64_t)63;
+}
+
+int64_t	minutemap::slot(int64_t timekey) const {
+	return timekey / _resolution;
+}
+
+/**
+ * \brief The end of the time covered by the map
+ */
+int64_t	minutemap::last() const {
+	return (_base + (int64_t)_bits.size() * 64) * _resolution;
+}
+
+/**
+ * \brief Mark the slot containing a time key as written
+ *
+ * \param timekey	the time key of a stored message
+ */
+void	minutemap::set(int64_t timekey) {
+	int64_t	s = slot(timekey);
+	if (s < _base) {
+		return;
+	}
+	// move the window so that the slot falls into the last word
+	int64_t	words = (s - _base) / 64 - (int64_t)_bits.size() + 1;
+	if (words > 0) {
+		size_t	n = std::min((size_t)words, _bits.size());
+		_bits.erase(_bits.begin(), _bits.begin() + n);
+		_bits.insert(_bits.end(), n, 0);
+		_base += words * 64;
+	}
+	int64_t	offset = s - _base;
+	_bits[offset / 64] |= (uint64_t)1 << (offset % 64);
+}
+
+/**
+ * \brief Find out whether the slot containing a time key was written
+ *
+ * \param timekey	the time key to check
+ */
+bool	minutemap::test(int64_t timekey) const {
+	int64_t	s = slot(timekey);
+	if ((s < _base) || (s >= _base + (int64_t)_bits.size() * 64)) {
+		return false;
+	}
+	int64_t	offset = s - _base;
+	return (_bits[offset / 64] >> (offset % 64)) & 1;
+}
+
+/**
+ * \brief Ranges of slots not written between two times
+ *
+ * \param from	start of the time range
+ * \param to	end of the time range (exclusive)
+ * \return	pairs of start and end time (exclusive) of the gaps
+ */
+std::vector<std::pair<int64_t, int64_t> >	minutemap::gaps(int64_t from,
+		int64_t to) const {
+	std::vector<std::pair<int64_t, int64_t> >	result;
+	int64_t	start = -1;
+	for (int64_t t = slot(from) * _resolution; t < to; t += _resolution) {
+		if (test(t)) {
+			if (start >= 0) {
+				result.push_back(std::make_pair(start, t));
+				start = -1;
+			}
+		} else if (start < 0) {
+			start = t;
+		}
+	}
+	if (start >= 0) {
+		result.push_back(std::make_pair(start, to));
+	}
+	return result;
+}
+
+} // namespace powermeter
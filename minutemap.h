@@ -0,0 +1,42 @@
+//
+// minutemap.h -- bitmap of the time slots written to the database
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _minutemap_h
+#define _minutemap_h
+
+#include <vector>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+namespace powermeter {
+
+/**
+ * \brief Sliding bitmap with one bit per time slot
+ *
+ * A slot is resolution seconds long (one minute by default, the meter
+ * window). The map covers the most recent slots slots, setting a slot
+ * beyond the end moves the window forward and forgets the oldest
+ * slots. Slots outside the window count as not written.
+ */
+class minutemap {
+	int	_resolution;
+	int64_t	_base;
+	std::vector<uint64_t>	_bits;
+	int64_t	slot(int64_t timekey) const;
+public:
+	minutemap(int64_t now, size_t slots, int resolution = 60);
+	int	resolution() const { return _resolution; }
+	int64_t	first() const { return _base * _resolution; }
+	int64_t	last() const;
+	void	set(int64_t timekey);
+	bool	test(int64_t timekey) const;
+	std::vector<std::pair<int64_t, int64_t> >	gaps(int64_t from,
+		int64_t to) const;
+};
+
+} // namespace powermeter
+
+#endif /* _minutemap_h */
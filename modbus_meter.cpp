@@ -9,6 +9,8 @@
 #include <arpa/inet.h>
 #include <cstring>
 #include <format.h>
+#include <metrics.h>
+#include <flightrecorder.h>
 #include <fstream>
 #include <algorithm>
 
@@ -19,7 +21,9 @@ namespace powermeter {
  *
  * \param filename	the name of the file containing the information
  */
-void	modbus_meter::parsefields(const std::string& filename) {
+std::list<modbus_meter::modrec_t>	modbus_meter::parsefields(
+		const std::string& filename) {
+	std::list<modrec_t>	result;
 	std::ifstream	in(filename.c_str());
 	char	buffer[1024];
 	in.getline(buffer, sizeof(buffer));
@@ -85,12 +89,35 @@ void	modbus_meter::parsefields(const std::string& filename) {
 				record.op = m_signed;
 			}
 			// store the record
-			datatypes.push_back(record);
+			result.push_back(record);
 			debug(LOG_DEBUG, DEBUG_LOG, 0, "added type '%s'",
 				record.name.c_str());
 		}
 		in.getline(buffer, sizeof(buffer));
 	}
+	return result;
+}
+
+/**
+ * \brief Names of the values in the messages of the meter
+ *
+ * Fields with the signed operator are split into a _pos and a _neg
+ * value, see message::accumulate_signed.
+ */
+std::vector<std::string>	modbus_meter::fieldnames(
+		const configuration& config) {
+	std::list<modrec_t>	records
+		= parsefields(config.stringvalue("datafields"));
+	std::vector<std::string>	names;
+	for (auto i = records.begin(); i != records.end(); i++) {
+		if (i->op == m_signed) {
+			names.push_back(i->name + "_pos");
+			names.push_back(i->name + "_neg");
+		} else {
+			names.push_back(i->name);
+		}
+	}
+	return names;
 }
 
 
@@ -152,9 +179,11 @@ void	modbus_meter::connect(const std::string& hostname, int port) {
 }
 
 void	modbus_meter::reconnect() {
-	modbus_close(mb);
-	modbus_free(mb);
-	mb = NULL;
+	if (mb) {
+		modbus_close(mb);
+		modbus_free(mb);
+		mb = NULL;
+	}
 	connect_common();
 }
 
@@ -165,12 +194,12 @@ void	modbus_meter::reconnect() {
  * \param queue		the message queue to use to send messages
  */
 modbus_meter::modbus_meter(const configuration& config, messagequeue& queue)
-	: meter(config, queue) {
+	: meter(config, queue), mb(NULL) {
 	// find the file name for the datatypes
 	std::string	filename = config.stringvalue("datafields");
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "field configuration: %s",
 		filename.c_str());
-	parsefields(filename);
+	datatypes = parsefields(filename);
 
 	// get the host name of the meter
 	std::string	hostname = config.stringvalue("meterhostname",
@@ -180,8 +209,13 @@ modbus_meter::modbus_meter(const configuration& config, messagequeue& queue)
 	int	port = config.intvalue("meterport", 502);
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "using port %d", port);
 
-	// connect
-	connect(hostname, port);
+	// connect, unless we replay a capture
+	if (replaying()) {
+		_hostname = hostname;
+		_port = port;
+	} else {
+		connect(hostname, port);
+	}
 
 	// start the thread
 	startthread();
@@ -191,8 +225,11 @@ modbus_meter::modbus_meter(const configuration& config, messagequeue& queue)
  * \brief Destroy the modbus device
  */
 modbus_meter::~modbus_meter() {
-	modbus_close(mb);
-	modbus_free(mb);
+	stopthread();
+	if (mb) {
+		modbus_close(mb);
+		modbus_free(mb);
+	}
 }
 
 const std::list<modbus_meter::modrec_t>::const_iterator	modbus_meter::byname(const std::string& name) {
@@ -203,27 +240,77 @@ const std::list<modbus_meter::modrec_t>::const_iterator	modbus_meter::byname(con
 	);
 }
 
-float	modbus_meter::get(const modrec_t modrec) {
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "getting %s", modrec.name.c_str());
-	if (modrec.type == m_phases) {
-		return get_phases(modrec);
-	}
+/**
+ * \brief Read a single register from the device
+ *
+ * \param modrec	the description of the register
+ * \param u		where to store the register value
+ */
+void	modbus_meter::readregister(const modrec_t& modrec, unsigned short *u) {
 	if (modbus_set_slave(mb, modrec.unit) < 0) {
 		debug(LOG_ERR, DEBUG_LOG, 0, "cannot set unit id: %s",
 			modbus_strerror(errno));
 	}
-	unsigned short	u;
-	if (modbus_read_registers(mb, modrec.address, 1, &u) < 0) {
+	static histogram&	latency = metrics::newhistogram(
+		"powermeter_meter_poll_seconds{meter=\"modbus\"}",
+		"Time from request to response of a meter");
+	std::chrono::steady_clock::time_point	start
+		= std::chrono::steady_clock::now();
+	int	rc;
+	{
+		tracespan	span(trace_poll_begin, trace_poll_end);
+		rc = modbus_read_registers(mb, modrec.address, 1, u);
+	}
+	latency.observe(std::chrono::steady_clock::now() - start);
+	if (rc > 0) {
+		flightrecorder::record(trace_receive, 2 * rc);
+	}
+	if (rc < 0) {
 		debug(LOG_ERR, DEBUG_LOG, 0, "read failure (%s), reconnecting",
 			modbus_strerror(errno));
 		reconnect();
-		if (modbus_read_registers(mb, modrec.address, 1, &u) < 0) {
+		if (modbus_read_registers(mb, modrec.address, 1, u) < 0) {
 			debug(LOG_ERR, DEBUG_LOG, 0,
 				"failure after reconnect: %s",
 				modbus_strerror(errno));
 			throw std::runtime_error("failure to reconnect");
 		}
 	}
+	if (_capture) {
+		_capture->modbus(modrec.unit, modrec.address, 1, u);
+	}
+}
+
+/**
+ * \brief Get a register value from the capture
+ *
+ * \param modrec	the description of the register
+ * \param u		where to store the register value
+ */
+void	modbus_meter::replayregister(const modrec_t& modrec,
+		unsigned short *u) {
+	capture_record	r = _replay->next(capture_modbus);
+	if ((r.unit() != modrec.unit) || (r.address() != modrec.address)
+		|| (r.count() != 1)) {
+		std::string	msg = stringprintf("capture does not match "
+			"register %hu/%hu", modrec.unit, modrec.address);
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	*u = r.registerat(0);
+}
+
+float	modbus_meter::get(const modrec_t modrec) {
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "getting %s", modrec.name.c_str());
+	if (modrec.type == m_phases) {
+		return get_phases(modrec);
+	}
+	unsigned short	u;
+	if (replaying()) {
+		replayregister(modrec, &u);
+	} else {
+		readregister(modrec, &u);
+	}
 	float	value = 0.;
 	if (m_uint16 == modrec.type) {
 		value = u * modrec.scalefactor;
@@ -249,36 +336,14 @@ message	modbus_meter::integrate() {
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "integrate a message");
 	std::unique_lock<std::mutex>    lock(_mutex);
 
-	// compute the time for the next minute interval
-	std::chrono::system_clock::time_point   start
-		= std::chrono::system_clock::now();
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "start is %ld",
-		start.time_since_epoch().count());
-
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "seconds: %d",
-		start.time_since_epoch()
-			* std::chrono::system_clock::period::num
-			/ std::chrono::system_clock::period::den);
-
-	// round down to the start of the minute
-	std::chrono::seconds    startduration
-		= std::chrono::duration_cast<std::chrono::seconds>(
-			std::chrono::duration_cast<std::chrono::minutes>(
-			start.time_since_epoch()));
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "startduration is %ld",
-		startduration.count());
-	start = std::chrono::time_point<std::chrono::system_clock,
-		std::chrono::seconds>(startduration);
-
-	auto    end = start + std::chrono::seconds(60);
+	// the integration interval is the current window, which may
+	// have been started by a previous thread
+	message&	result = openwindow();
+	auto    end = _windowend;
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "start: %ld, end: %ld",
-		start.time_since_epoch().count(),
+		result.when().time_since_epoch().count(),
 		end.time_since_epoch().count());
 
-	// create the result
-	message result(start);
-	std::chrono::system_clock::time_point   previous = start;
-
 	// ensure that pos/neg fields are always present
 	for (auto i = datatypes.begin(); i != datatypes.end(); i++) {
 		if (i->op == m_signed) {
@@ -290,39 +355,16 @@ message	modbus_meter::integrate() {
 	}
 
 	// iterate until the end
-	std::chrono::system_clock::time_point   now;
 	int     counter = 0;
-	while ((now = std::chrono::system_clock::now()) < end) {
-		// compute the remaining time
-		std::chrono::duration<float>    remaining = end - now;
-		//debug(LOG_DEBUG, DEBUG_LOG, 0, "remaining: %.3f",
-		//      remaining.count());
-
-		// compute the largest possible interval we can wait
-		if (remaining > _interval) {
-			remaining = _interval;
-		}
-
-		// wait for the remaining time
-		//debug(LOG_DEBUG, DEBUG_LOG, 0, "waiting for %.3f",
-		//      remaining.count());
-		switch (_signal.wait_for(lock, remaining)) {
-		case std::cv_status::timeout:
-			//debug(LOG_DEBUG, DEBUG_LOG, 0, "timeout");
-			break;
-		case std::cv_status::no_timeout:
-			// this means we were signaled to interrup
-			//debug(LOG_DEBUG, DEBUG_LOG, 0, "wait interrupted");
-			std::string     msg("meter thread interrupted by signal");
-		debug(LOG_DEBUG, DEBUG_LOG, 0, "%s", msg.c_str());
-			throw std::runtime_error(msg);
-		}
+	while (windowactive(end)) {
+		// wait for the next sample
+		waitsample(lock, end);
 
 		// end time for this integration step
-		std::chrono::duration<float>    delta(
-			std::chrono::system_clock::now() - previous);
+		std::chrono::system_clock::time_point	now = sampletime();
+		std::chrono::duration<float>    delta(now - _previous);
 		debug(LOG_DEBUG, DEBUG_LOG, 0, "delta: %.3f", delta.count());
-		previous = std::chrono::system_clock::now();
+		_previous = now;
 
 		// read the data
 		for (auto i = datatypes.begin(); i != datatypes.end(); i++) {
@@ -342,13 +384,17 @@ message	modbus_meter::integrate() {
 		counter++;
 	}
 
-	// when we get here, we are at the end of the interval, so we now
-	// have to extrapolate to the full minute
-	float   d = std::chrono::duration<double>(end - start).count();
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "duration was %.6f", d);
+	// when we get here, we are at the end of the interval
+	return closewindow();
+}
 
-	// finalize the message
-	float   factor = 1. / d;
+/**
+ * \brief Convert the integrals of the window into averages
+ *
+ * \param result	the message to finalize
+ * \param factor	inverse of the time the integrals cover
+ */
+void	modbus_meter::finalize(message& result, float factor) {
 	for (auto i = datatypes.begin(); i != datatypes.end(); i++) {
 		switch (i->op) {
 		case m_average:
@@ -362,9 +408,6 @@ message	modbus_meter::integrate() {
 			break;
 		}
 	}
-
-	// return the message
-	return result;
 }
 
 } // namespace powermeter
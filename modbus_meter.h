@@ -9,6 +9,8 @@
 #include <meter.h>
 #include <modbus.h>
 #include <list>
+#include <vector>
+#include <string>
 
 namespace powermeter {
 
@@ -32,20 +34,25 @@ public:
 	std::string	_hostname;
 	int	_port;
 	void	connect(const std::string& hostname, int port);
-	void	reconnect();
+	virtual void	reconnect();
 	void	connect_common();
 private:
 	modbus_t	*mb;
 	std::list<modrec_t>	datatypes;
-	void	parsefields(const std::string& filename);
+	static std::list<modrec_t>	parsefields(const std::string& filename);
+	void	readregister(const modrec_t& modrec, unsigned short *u);
+	void	replayregister(const modrec_t& modrec, unsigned short *u);
 	float	get(const modrec_t modrec);
 	float	get_phases(const modrec_t modrec);
 	const std::list<modrec_t>::const_iterator	byname(const std::string& name);
 protected:
 	virtual message integrate();
+	virtual void	finalize(message& result, float factor);
 public:
 	modbus_meter(const configuration& config, messagequeue& queue);
 	virtual ~modbus_meter();
+	static std::vector<std::string>	fieldnames(
+		const configuration& config);
 };
 
 } // namespace powermeter
@@ -0,0 +1,237 @@
+/*
+ * modbusemu.cpp -- Modbus TCP emulator for the ALE3 and CCGX register maps
+ *
+ * The emulator answers read requests for unit id ccgxunit (default 100)
+ * from the CCGX-style register map, all other unit ids get the ALE3
+ * register map. The register values come from the simulator.
+ *
+ * (c) 2023 Prof Dr Andreas Müller
+ */
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <getopt.h>
+#include <stdexcept>
+#include <simulator.h>
+#include <debug.h>
+#include <format.h>
+#include <configuration.h>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <modbus.h>
+#include <sys/select.h>
+#include <unistd.h>
+#include <config.h>
+
+namespace powermeter {
+
+static struct option	longopts[] = {
+{ "debug",		no_argument,		NULL,		'd' },
+{ "help",		no_argument,		NULL,		'?' },
+{ "port",		required_argument,	NULL,		'p' },
+{ "latency",		required_argument,	NULL,		'L' },
+{ "loss",		required_argument,	NULL,		'o' },
+{ "seed",		required_argument,	NULL,		'e' },
+{ "ccgxunit",		required_argument,	NULL,		'u' },
+{ "version",		no_argument,		NULL,		'V' },
+{ NULL,			0,			NULL,		 0  }
+};
+
+static void	usage(const char *progname) {
+	std::cout << progname << " [ options ]" << std::endl;
+	std::cout << std::endl;
+	std::cout << "Modbus TCP emulator for ALE3 and CCGX register maps"
+		<< std::endl;
+	std::cout << std::endl;
+	std::cout << "options:" << std::endl;
+	std::cout << "  -d,--debug          debug output" << std::endl;
+	std::cout << "  -p,--port=<p>       listen on port <p> (default 1502)"
+		<< std::endl;
+	std::cout << "  -L,--latency=<ms>   delay every response by <ms>"
+		<< std::endl;
+	std::cout << "  -o,--loss=<p>       drop responses with probability <p>"
+		<< std::endl;
+	std::cout << "  -e,--seed=<s>       seed for the simulator" << std::endl;
+	std::cout << "  -u,--ccgxunit=<u>   unit id of the CCGX map "
+		"(default 100)" << std::endl;
+}
+
+/**
+ * \brief Main method for the modbus emulator
+ *
+ * \param argc		number of arguments
+ * \param argv		argument strings
+ */
+int	main(int argc, char *argv[]) {
+	int	c;
+	configuration	config;
+	debug_set_ident("modbusemu");
+	int	port = 1502;
+	int	latency = 0;
+	float	loss = 0;
+	int	ccgxunit = 100;
+	while (EOF != (c = getopt_long(argc, argv, "dp:L:o:e:u:V",
+		longopts, NULL)))
+		switch (c) {
+		case 'd':
+			debuglevel = LOG_DEBUG;
+			break;
+		case 'p':
+			port = std::stoi(optarg);
+			break;
+		case 'L':
+			latency = std::stoi(optarg);
+			break;
+		case 'o':
+			loss = std::stof(optarg);
+			break;
+		case 'e':
+			config.set("seed", std::stoi(optarg));
+			break;
+		case 'u':
+			ccgxunit = std::stoi(optarg);
+			break;
+		case 'V':
+			std::cout << "modbusemu " << VERSION << std::endl;
+			return EXIT_SUCCESS;
+		case '?':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		}
+
+	// simulator and random numbers for the packet loss
+	unsigned int	seed = simulator::seed(config);
+	simulator	sim(std::chrono::system_clock::now(), seed);
+	std::mt19937	engine(seed);
+	std::uniform_real_distribution<float>	uniform(0, 1);
+
+	// register maps
+	modbus_mapping_t	*ale3map = modbus_mapping_new(0, 0, 53, 0);
+	modbus_mapping_t	*ccgxmap = modbus_mapping_new(0, 0, 900, 0);
+	if ((NULL == ale3map) || (NULL == ccgxmap)) {
+		std::string	msg = stringprintf("cannot create mapping: %s",
+			modbus_strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+
+	// listen for connections
+	modbus_t	*ctx = modbus_new_tcp("127.0.0.1", port);
+	if (NULL == ctx) {
+		std::string	msg = stringprintf("cannot create context: %s",
+			modbus_strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	int	server = modbus_tcp_listen(ctx, 16);
+	if (server < 0) {
+		std::string	msg = stringprintf("cannot listen on port %d: %s",
+			port, modbus_strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	debug(LOG_INFO, DEBUG_LOG, 0, "listening on port %d", port);
+
+	fd_set	clients;
+	FD_ZERO(&clients);
+	FD_SET(server, &clients);
+	int	maxfd = server;
+	int	headerlength = modbus_get_header_length(ctx);
+	unsigned char	query[MODBUS_TCP_MAX_ADU_LENGTH];
+	while (1) {
+		fd_set	fds = clients;
+		if (select(maxfd + 1, &fds, NULL, NULL, NULL) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			std::string	msg = stringprintf("select failed: %s",
+				strerror(errno));
+			debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+			throw std::runtime_error(msg);
+		}
+		for (int fd = 0; fd <= maxfd; fd++) {
+			if (!FD_ISSET(fd, &fds)) {
+				continue;
+			}
+
+			// new connection
+			if (fd == server) {
+				int	s = server;
+				int	client = modbus_tcp_accept(ctx, &s);
+				if (client < 0) {
+					debug(LOG_ERR, DEBUG_LOG, 0,
+						"accept failed: %s",
+						modbus_strerror(errno));
+					continue;
+				}
+				debug(LOG_DEBUG, DEBUG_LOG, 0,
+					"new connection on fd %d", client);
+				FD_SET(client, &clients);
+				if (client > maxfd) {
+					maxfd = client;
+				}
+				continue;
+			}
+
+			// request from a connected client
+			modbus_set_socket(ctx, fd);
+			int	rc = modbus_receive(ctx, query);
+			if (rc < 0) {
+				debug(LOG_DEBUG, DEBUG_LOG, 0,
+					"connection on fd %d closed", fd);
+				close(fd);
+				FD_CLR(fd, &clients);
+				continue;
+			}
+			if (rc == 0) {
+				continue;
+			}
+
+			// update the map for the unit id of the request
+			std::chrono::system_clock::time_point	now
+				= std::chrono::system_clock::now();
+			int	unit = query[headerlength - 1];
+			modbus_mapping_t	*mapping = ale3map;
+			if (unit == ccgxunit) {
+				mapping = ccgxmap;
+				for (unsigned short a = 800; a < 900; a++) {
+					mapping->tab_registers[a]
+						= sim.ccgx(a, now);
+				}
+			} else {
+				sim.ale3(mapping->tab_registers, now);
+			}
+
+			// simulate latency and loss
+			if (latency > 0) {
+				std::this_thread::sleep_for(
+					std::chrono::milliseconds(latency));
+			}
+			if (uniform(engine) < loss) {
+				debug(LOG_DEBUG, DEBUG_LOG, 0,
+					"dropping response to unit %d", unit);
+				continue;
+			}
+			if (modbus_reply(ctx, query, rc, mapping) < 0) {
+				debug(LOG_ERR, DEBUG_LOG, 0, "reply failed: %s",
+					modbus_strerror(errno));
+			}
+		}
+	}
+}
+
+} // namespace powermeter
+
+int	main(int argc, char *argv[]) {
+	try {
+		return powermeter::main(argc, argv);
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "modbusemu main failed: %s",
+			x.what());
+	} catch (...) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "modbusemu main failed");
+	}
+	return EXIT_FAILURE;
+}
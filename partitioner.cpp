@@ -0,0 +1,320 @@
+//
+// partitioner.cpp -- monthly range partitions of the sdata table
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <partitioner.h>
+#include <debug.h>
+#include <format.h>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+
+namespace powermeter {
+
+/**
+ * \brief Connect to the database containing the table to maintain
+ *
+ * \param config	the configuration with the database parameters
+ */
+partitioner::partitioner(const configuration& config)
+	: _table(config.stringvalue("partitiontable", "sdata")),
+	  _dbname(config.stringvalue("dbname")),
+	  _ahead(config.intvalue("partitionahead", 3)),
+	  _retention(config.intvalue("retention", 0)),
+	  _action(config.stringvalue("retentionaction", "drop")),
+	  _init(config.boolvalue("partitioninit", false)),
+	  _dryrun(config.boolvalue("partitiondryrun", false)),
+	  _mysql(NULL) {
+	if ((_action != "drop") && (_action != "archive")) {
+		std::string	msg = stringprintf("unknown retention action: %s",
+			_action.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	_mysql = mysql_init(NULL);
+	if (NULL == mysql_real_connect(_mysql,
+		config.stringvalue("dbhostname").c_str(),
+		config.stringvalue("dbuser").c_str(),
+		config.stringvalue("dbpassword").c_str(),
+		_dbname.c_str(), config.intvalue("dbport", 3307), NULL, 0)) {
+		std::string	msg = stringprintf("cannot open database "
+			"connection: %s", mysql_error(_mysql));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		mysql_close(_mysql);
+		_mysql = NULL;
+		throw std::runtime_error(msg);
+	}
+}
+
+partitioner::~partitioner() {
+	if (_mysql) {
+		mysql_close(_mysql);
+	}
+}
+
+/**
+ * \brief Start of a month in UTC
+ *
+ * \param timekey	a time in the month
+ * \param offset	number of months to move forward (or backward)
+ */
+int64_t	partitioner::monthstart(int64_t timekey, int offset) {
+	time_t	t = timekey;
+	struct tm	tm;
+	gmtime_r(&t, &tm);
+	int	month = tm.tm_year * 12 + tm.tm_mon + offset;
+	memset(&tm, 0, sizeof(tm));
+	tm.tm_year = month / 12;
+	tm.tm_mon = month % 12;
+	tm.tm_mday = 1;
+	return timegm(&tm);
+}
+
+/**
+ * \brief Name of the partition for the month starting at monthstart
+ */
+std::string	partitioner::partitionname(int64_t monthstart) {
+	time_t	t = monthstart;
+	struct tm	tm;
+	gmtime_r(&t, &tm);
+	return stringprintf("p%04d%02d", tm.tm_year + 1900, tm.tm_mon + 1);
+}
+
+/**
+ * \brief Execute a maintenance statement, or only log it in a dry run
+ */
+void	partitioner::execute(const std::string& query) {
+	debug(LOG_INFO, DEBUG_LOG, 0, "%s%s", (_dryrun) ? "dry run: " : "",
+		query.c_str());
+	if (_dryrun) {
+		return;
+	}
+	if (mysql_query(_mysql, query.c_str())) {
+		std::string	msg = stringprintf("cannot execute '%s': %s",
+			query.c_str(), mysql_error(_mysql));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+}
+
+/**
+ * \brief The current partitions of the table in ascending order
+ *
+ * An unpartitioned table has no partitions.
+ */
+std::vector<partition>	partitioner::partitions() {
+	std::string	query = stringprintf("select partition_name, "
+		"partition_description "
+		"from information_schema.partitions "
+		"where table_schema = '%s' and table_name = '%s' "
+		"  and partition_name is not null "
+		"order by partition_ordinal_position",
+		_dbname.c_str(), _table.c_str());
+	if (mysql_query(_mysql, query.c_str())) {
+		std::string	msg = stringprintf("cannot read partitions: %s",
+			mysql_error(_mysql));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	std::vector<partition>	result;
+	MYSQL_RES	*mres = mysql_store_result(_mysql);
+	MYSQL_ROW	row;
+	while (NULL != (row = mysql_fetch_row(mres))) {
+		partition	p;
+		p.name = std::string(row[0]);
+		std::string	description(row[1] ? row[1] : "MAXVALUE");
+		if (description == "MAXVALUE") {
+			p.maxvalue = true;
+		} else {
+			p.lessthan = std::stoll(description);
+		}
+		result.push_back(p);
+	}
+	mysql_free_result(mres);
+	return result;
+}
+
+/**
+ * \brief The columns of the primary key of the table
+ */
+std::vector<std::string>	partitioner::primarykey() {
+	std::string	query = stringprintf("show index from %s "
+		"where key_name = 'PRIMARY'", _table.c_str());
+	if (mysql_query(_mysql, query.c_str())) {
+		std::string	msg = stringprintf("cannot read indexes: %s",
+			mysql_error(_mysql));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	std::vector<std::string>	result;
+	MYSQL_RES	*mres = mysql_store_result(_mysql);
+	MYSQL_ROW	row;
+	while (NULL != (row = mysql_fetch_row(mres))) {
+		// column 4 of show index is the column name
+		result.push_back(std::string(row[4]));
+	}
+	mysql_free_result(mres);
+	return result;
+}
+
+/**
+ * \brief The smallest timekey in the table, 0 if it is empty
+ */
+int64_t	partitioner::minimumtimekey() {
+	std::string	query = stringprintf("select min(timekey) from %s",
+		_table.c_str());
+	if (mysql_query(_mysql, query.c_str())) {
+		std::string	msg = stringprintf("cannot get first timekey: %s",
+			mysql_error(_mysql));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	MYSQL_RES	*mres = mysql_store_result(_mysql);
+	MYSQL_ROW	row = mysql_fetch_row(mres);
+	int64_t	result = 0;
+	if ((NULL != row) && (NULL != row[0])) {
+		result = std::stoll(row[0]);
+	}
+	mysql_free_result(mres);
+	return result;
+}
+
+/**
+ * \brief Partition an unpartitioned table
+ *
+ * Every unique key of a partitioned table must contain the partitioning
+ * column, so this requires a primary key starting with timekey. The
+ * recommended key is (timekey, sensorid, fieldid), which also clusters
+ * the rows by time. Converting the table copies all rows, so it is
+ * only done if partitioninit is set.
+ *
+ * \param now	the current time
+ */
+void	partitioner::initialize(int64_t now) {
+	std::vector<std::string>	key = primarykey();
+	if ((key.size() == 0) || (key[0] != "timekey")) {
+		debug(LOG_WARNING, DEBUG_LOG, 0, "%s cannot be partitioned by "
+			"timekey, recommended: alter table %s drop primary key, "
+			"add primary key (timekey, sensorid, fieldid)",
+			_table.c_str(), _table.c_str());
+		return;
+	}
+	if (!_init) {
+		debug(LOG_WARNING, DEBUG_LOG, 0, "set partitioninit = yes to "
+			"partition %s", _table.c_str());
+		return;
+	}
+	int64_t	first = minimumtimekey();
+	if (first == 0) {
+		first = now;
+	}
+	std::string	query = stringprintf("alter table %s partition by "
+		"range (timekey) (", _table.c_str());
+	for (int64_t m = monthstart(first); m <= monthstart(now, _ahead);
+		m = monthstart(m, 1)) {
+		query += stringprintf("partition %s values less than (%lld), ",
+			partitionname(m).c_str(), (long long)monthstart(m, 1));
+	}
+	query += "partition pmax values less than maxvalue)";
+	execute(query);
+}
+
+/**
+ * \brief Create the partitions up to partitionahead months from now
+ *
+ * \param current	the current partitions
+ * \param now		the current time
+ */
+void	partitioner::extend(const std::vector<partition>& current,
+		int64_t now) {
+	// find the end of the last monthly partition
+	int64_t	end = 0;
+	bool	hasmax = false;
+	for (auto p = current.begin(); p != current.end(); p++) {
+		if (p->maxvalue) {
+			hasmax = true;
+		} else {
+			end = std::max(end, p->lessthan);
+		}
+	}
+	if (end == 0) {
+		end = monthstart(now);
+	}
+
+	// list the missing partitions
+	std::string	partitions;
+	for (int64_t m = end; m <= monthstart(now, _ahead);
+		m = monthstart(m, 1)) {
+		partitions += stringprintf("partition %s values less than "
+			"(%lld), ", partitionname(m).c_str(),
+			(long long)monthstart(m, 1));
+	}
+	if (partitions.size() == 0) {
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "partitions exist up to %lld",
+			(long long)end);
+		return;
+	}
+
+	// split them off pmax, or simply add them if there is no pmax
+	if (hasmax) {
+		execute(stringprintf("alter table %s reorganize partition pmax "
+			"into (%spartition pmax values less than maxvalue)",
+			_table.c_str(), partitions.c_str()));
+	} else {
+		partitions.resize(partitions.size() - 2);
+		execute(stringprintf("alter table %s add partition (%s)",
+			_table.c_str(), partitions.c_str()));
+	}
+}
+
+/**
+ * \brief Drop or archive the partitions beyond the retention period
+ *
+ * \param current	the current partitions
+ * \param now		the current time
+ */
+void	partitioner::expire(const std::vector<partition>& current,
+		int64_t now) {
+	if (_retention <= 0) {
+		return;
+	}
+	int64_t	limit = monthstart(now, -_retention);
+	for (auto p = current.begin(); p != current.end(); p++) {
+		if (p->maxvalue || (p->lessthan > limit)) {
+			continue;
+		}
+		if (_action == "archive") {
+			std::string	archive = _table + "_" + p->name;
+			execute(stringprintf("create table %s like %s",
+				archive.c_str(), _table.c_str()));
+			execute(stringprintf("alter table %s remove partitioning",
+				archive.c_str()));
+			execute(stringprintf("alter table %s exchange partition "
+				"%s with table %s", _table.c_str(),
+				p->name.c_str(), archive.c_str()));
+		}
+		execute(stringprintf("alter table %s drop partition %s",
+			_table.c_str(), p->name.c_str()));
+	}
+}
+
+/**
+ * \brief Bring the partitions of the table up to date
+ *
+ * \param now	the current time
+ */
+void	partitioner::maintain(int64_t now) {
+	std::vector<partition>	current = partitions();
+	if (current.size() == 0) {
+		debug(LOG_INFO, DEBUG_LOG, 0, "%s is not partitioned",
+			_table.c_str());
+		initialize(now);
+		return;
+	}
+	extend(current, now);
+	expire(current, now);
+}
+
+} // namespace powermeter
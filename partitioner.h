@@ -0,0 +1,68 @@
+//
+// partitioner.h -- monthly range partitions of the sdata table
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _partitioner_h
+#define _partitioner_h
+
+#include <configuration.h>
+#include <mysql.h>
+#include <string>
+#include <vector>
+#include <cstdint>
+
+namespace powermeter {
+
+/**
+ * \brief A range partition of the data table
+ *
+ * The partition pYYYYMM contains the rows with timekey below the start
+ * of the following month, the partition pmax catches all later rows.
+ */
+struct partition {
+	std::string	name;
+	int64_t	lessthan;
+	bool	maxvalue;
+	partition() : lessthan(0), maxvalue(false) { }
+};
+
+/**
+ * \brief Maintenance of the time partitions of the data table
+ *
+ * Partitions are created partitionahead months (default 3) ahead of the
+ * current time by splitting pmax. Partitions ending more than
+ * retention months ago (0, the default, keeps everything) are either
+ * dropped or, with retentionaction = archive, exchanged into a table
+ * sdata_pYYYYMM of their own before being dropped. Both operations
+ * only touch metadata, no rows have to be deleted.
+ */
+class partitioner {
+	std::string	_table;
+	std::string	_dbname;
+	int	_ahead;
+	int	_retention;
+	std::string	_action;
+	bool	_init;
+	bool	_dryrun;
+	MYSQL	*_mysql;
+	void	execute(const std::string& query);
+	std::vector<std::string>	primarykey();
+	int64_t	minimumtimekey();
+	void	initialize(int64_t now);
+	void	extend(const std::vector<partition>& current, int64_t now);
+	void	expire(const std::vector<partition>& current, int64_t now);
+public:
+	partitioner(const configuration& config);
+	~partitioner();
+	partitioner(const partitioner& other) = delete;
+	partitioner&	operator=(const partitioner& other) = delete;
+	std::vector<partition>	partitions();
+	void	maintain(int64_t now);
+	static int64_t	monthstart(int64_t timekey, int offset = 0);
+	static std::string	partitionname(int64_t monthstart);
+};
+
+} // namespace powermeter
+
+#endif /* _partitioner_h */
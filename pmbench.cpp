@@ -0,0 +1,466 @@
+/*
+ * pmbench.cpp -- micro benchmarks for the core data path
+ *
+ * Every benchmark runs a warmup pass and then a number of timed
+ * repetitions of a fixed number of iterations. For each benchmark one
+ * line is written with the minimum, median and maximum time per
+ * iteration over the repetitions, either tab separated (the default)
+ * or as one JSON object per line.
+ *
+ * (c) 2023 Prof Dr Andreas Müller
+ */
+#include <cstdlib>
+#include <cstdio>
+#include <getopt.h>
+#include <stdexcept>
+#include <message.h>
+#include <idmap.h>
+#include <solivia_packet.h>
+#include <gorilla.h>
+#include <tsarchive.h>
+#include <simulator.h>
+#include <configuration.h>
+#include <debug.h>
+#include <format.h>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include <vector>
+#include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <config.h>
+
+namespace powermeter {
+
+static struct option	longopts[] = {
+{ "help",		no_argument,		NULL,		'?' },
+{ "iterations",		required_argument,	NULL,		'n' },
+{ "json",		no_argument,		NULL,		'j' },
+{ "list",		no_argument,		NULL,		'l' },
+{ "repeat",		required_argument,	NULL,		'r' },
+{ "version",		no_argument,		NULL,		'V' },
+{ "warmup",		required_argument,	NULL,		'w' },
+{ NULL,			0,			NULL,		 0  }
+};
+
+static void	usage(const char *progname) {
+	std::cout << progname << " [ options ] [ pattern ... ]" << std::endl;
+	std::cout << std::endl;
+	std::cout << "micro benchmarks for the powermeter data path, only "
+		"benchmarks containing" << std::endl;
+	std::cout << "one of the patterns in their name are run" << std::endl;
+	std::cout << std::endl;
+	std::cout << "options:" << std::endl;
+	std::cout << "  -n,--iterations=<n> iterations per repetition "
+		"(default 100000)" << std::endl;
+	std::cout << "  -r,--repeat=<r>     number of timed repetitions "
+		"(default 7)" << std::endl;
+	std::cout << "  -w,--warmup=<n>     untimed warmup iterations "
+		"(default 10000)" << std::endl;
+	std::cout << "  -j,--json           one JSON object per benchmark"
+		<< std::endl;
+	std::cout << "  -l,--list           list the benchmarks" << std::endl;
+}
+
+/**
+ * \brief A benchmark runs the operation under test a number of times
+ */
+struct benchmark {
+	std::string	name;
+	std::function<void(size_t)>	run;
+	benchmark(const std::string& n, std::function<void(size_t)> r)
+		: name(n), run(r) { }
+};
+
+// results go here so that the compiler cannot drop the computation
+static volatile float	sink;
+
+static const char	*solivianames[] = {
+	"phase1.voltage", "phase1.current", "phase1.power", "phase1.frequency",
+	"phase2.voltage", "phase2.current", "phase2.power", "phase2.frequency",
+	"phase3.voltage", "phase3.current", "phase3.power", "phase3.frequency",
+	"string1.voltage", "string1.current", "string1.power",
+	"string2.voltage", "string2.current", "string2.power",
+	"inverter.power", "inverter.energy", "inverter.feedtime",
+	"inverter.temperature"
+};
+static const size_t	nnames = sizeof(solivianames) / sizeof(solivianames[0]);
+
+/**
+ * \brief Submit and extract messages with several producer threads
+ *
+ * \param iterations	total number of messages
+ * \param producers	number of submitting threads
+ */
+static void	queuecontention(size_t iterations, int producers) {
+	messagequeue	queue;
+	message	m(std::chrono::system_clock::now());
+	m.update("phase1.voltage", 230);
+	std::vector<std::thread>	threads;
+	for (int p = 0; p < producers; p++) {
+		size_t	count = iterations / producers
+			+ ((p < (int)(iterations % producers)) ? 1 : 0);
+		threads.push_back(std::thread([&queue, m, count]() {
+			for (size_t i = 0; i < count; i++) {
+				queue.submit(m);
+			}
+		}));
+	}
+	for (size_t i = 0; i < iterations; i++) {
+		sink = queue.extract(std::chrono::seconds(10)).size();
+	}
+	for (auto t = threads.begin(); t != threads.end(); t++) {
+		t->join();
+	}
+}
+
+/**
+ * \brief Archive with a year of minute values of one series
+ *
+ * The archive is built on first use, and its files are removed right
+ * away, the open descriptors keep them readable.
+ */
+static std::shared_ptr<tsarchive>	yeararchive() {
+	static std::shared_ptr<tsarchive>	archive;
+	if (archive) {
+		return archive;
+	}
+	std::string	filename = stringprintf("/tmp/pmbench.%d.ts", getpid());
+	{
+		tsarchive	writer(filename, true);
+		for (int64_t i = 0; i < 365 * 1440; i++) {
+			writer.append("phase1.voltage", 60 * i,
+				230 + (i % 7) * 0.1f);
+		}
+	}
+	archive = std::shared_ptr<tsarchive>(new tsarchive(filename));
+	unlink(filename.c_str());
+	unlink((filename + ".idx").c_str());
+	return archive;
+}
+
+/**
+ * \brief Build the list of all benchmarks
+ */
+static std::vector<benchmark>	benchmarks() {
+	std::vector<benchmark>	result;
+
+	// message operations, one iteration handles all solivia fields
+	result.push_back(benchmark("message.accumulate", [](size_t n) {
+		message	m(std::chrono::system_clock::now());
+		std::chrono::duration<float>	delta(1.5);
+		for (size_t i = 0; i < n; i++) {
+			m.accumulate(delta, solivianames[i % nnames], i);
+		}
+		sink = m.size();
+	}));
+	result.push_back(benchmark("message.finalize", [](size_t n) {
+		message	m(std::chrono::system_clock::now());
+		for (size_t i = 0; i < nnames; i++) {
+			m.update(solivianames[i], 1);
+		}
+		for (size_t i = 0; i < n; i++) {
+			m.finalize(solivianames[i % nnames], 1.0001);
+		}
+		sink = m.size();
+	}));
+
+	// the message queue
+	result.push_back(benchmark("messagequeue.submit_extract", [](size_t n) {
+		messagequeue	queue;
+		message	m(std::chrono::system_clock::now());
+		m.update("phase1.voltage", 230);
+		for (size_t i = 0; i < n; i++) {
+			queue.submit(m);
+			sink = queue.extract(std::chrono::seconds(10)).size();
+		}
+	}));
+	result.push_back(benchmark("messagequeue.contention_2", [](size_t n) {
+		queuecontention(n, 2);
+	}));
+	result.push_back(benchmark("messagequeue.contention_8", [](size_t n) {
+		queuecontention(n, 8);
+	}));
+
+	// name resolution as done by the database class
+	std::shared_ptr<idmap>	ids(new idmap());
+	const char	*sensors[] = { "phase1", "phase2", "phase3", "string1",
+		"string2", "inverter" };
+	for (int i = 0; i < 6; i++) {
+		ids->addsensor(sensors[i], i + 1);
+	}
+	const char	*fields[] = { "voltage", "current", "power", "frequency",
+		"energy", "feedtime", "temperature" };
+	for (int i = 0; i < 7; i++) {
+		ids->addfield(fields[i], i + 1);
+	}
+	result.push_back(benchmark("database.sensorid", [ids](size_t n) {
+		int	s = 0;
+		for (size_t i = 0; i < n; i++) {
+			s += ids->sensorid(solivianames[i % nnames]);
+		}
+		sink = s;
+	}));
+	result.push_back(benchmark("database.fieldid", [ids](size_t n) {
+		int	s = 0;
+		for (size_t i = 0; i < n; i++) {
+			s += ids->fieldid(solivianames[i % nnames]);
+		}
+		sink = s;
+	}));
+
+	// solivia packet decoding
+	std::shared_ptr<solivia_packet>	packet(new solivia_packet());
+	simulator	sim(std::chrono::system_clock::now(), 1);
+	sim.solivia(packet->data(), 1, std::chrono::system_clock::now());
+	result.push_back(benchmark("solivia.decode", [packet](size_t n) {
+		float	s = 0;
+		for (size_t i = 0; i < n; i++) {
+			const solivia_packet&	p = *packet;
+			s += p.phase1_voltage() + p.phase1_current()
+				+ p.phase1_power() + p.phase1_frequency()
+				+ p.phase2_voltage() + p.phase2_current()
+				+ p.phase2_power() + p.phase2_frequency()
+				+ p.phase3_voltage() + p.phase3_current()
+				+ p.phase3_power() + p.phase3_frequency()
+				+ p.string1_voltage() + p.string1_current()
+				+ p.string1_power() + p.string2_voltage()
+				+ p.string2_current() + p.string2_power()
+				+ p.power() + p.energy() + p.feedtime()
+				+ p.temperature();
+		}
+		sink = s;
+	}));
+	result.push_back(benchmark("solivia.check", [packet](size_t n) {
+		int	s = 0;
+		for (size_t i = 0; i < n; i++) {
+			s += packet->check(solivia_packet::packetsize, 1);
+		}
+		sink = s;
+	}));
+
+	// compression of time series, one iteration is one point
+	result.push_back(benchmark("gorilla.append", [](size_t n) {
+		gorilla_block	block;
+		for (size_t i = 0; i < n; i++) {
+			if (!block.append(60 * i, 230 + (i % 7) * 0.1f)) {
+				block = gorilla_block();
+			}
+		}
+		sink = block.count();
+	}));
+	result.push_back(benchmark("gorilla.decode", [](size_t n) {
+		gorilla_block	block;
+		for (size_t i = 0; block.append(60 * i, 230 + (i % 7) * 0.1f);
+			i++) {
+		}
+		size_t	s = 0;
+		while (s < n) {
+			s += gorilla_block::decode(block.data()).size();
+		}
+		sink = s;
+	}));
+
+	// scan of a year in the archive, one iteration is one point
+	result.push_back(benchmark("tsarchive.scan_year", [](size_t n) {
+		std::shared_ptr<tsarchive>	archive = yeararchive();
+		size_t	s = 0;
+		while (s < n) {
+			s += archive->points("phase1.voltage", 0,
+				365 * 86400).size();
+		}
+		sink = s;
+	}));
+
+	// configuration lookups
+	std::shared_ptr<configuration>	config(new configuration());
+	config->set("stationname", "Solivia");
+	config->set("meterinterval", 2.5f);
+	result.push_back(benchmark("configuration.stringvalue",
+		[config](size_t n) {
+		size_t	s = 0;
+		for (size_t i = 0; i < n; i++) {
+			s += config->stringvalue("stationname").size();
+		}
+		sink = s;
+	}));
+	result.push_back(benchmark("configuration.intvalue",
+		[config](size_t n) {
+		int	s = 0;
+		for (size_t i = 0; i < n; i++) {
+			s += config->intvalue("meterport");
+		}
+		sink = s;
+	}));
+	result.push_back(benchmark("configuration.floatvalue",
+		[config](size_t n) {
+		float	s = 0;
+		for (size_t i = 0; i < n; i++) {
+			s += config->floatvalue("meterinterval");
+		}
+		sink = s;
+	}));
+
+	// logging, enabled logging writes to /dev/null, the debug module
+	// closes the descriptor when the next one is installed. Disabled
+	// logging must not evaluate its arguments, so disabled_arguments
+	// should cost no more than the baseline loop
+	result.push_back(benchmark("debug.disabled", [](size_t n) {
+		int	level = debuglevel;
+		debuglevel = LOG_ERR;
+		for (size_t i = 0; i < n; i++) {
+			debug(LOG_DEBUG, DEBUG_LOG, 0, "accumulate %s -> %.3f",
+				solivianames[i % nnames], 1.5);
+		}
+		debuglevel = level;
+	}));
+	result.push_back(benchmark("debug.disabled_arguments", [](size_t n) {
+		int	level = debuglevel;
+		debuglevel = LOG_ERR;
+		auto	start = std::chrono::system_clock::now();
+		for (size_t i = 0; i < n; i++) {
+			debug(LOG_DEBUG, DEBUG_LOG, 0, "%s after %.3fs",
+				std::string(solivianames[i % nnames]).c_str(),
+				std::chrono::duration<float>(
+					std::chrono::system_clock::now()
+					- start).count());
+		}
+		debuglevel = level;
+	}));
+	result.push_back(benchmark("debug.baseline", [](size_t n) {
+		int	s = 0;
+		for (size_t i = 0; i < n; i++) {
+			s += solivianames[i % nnames][0];
+		}
+		sink = s;
+	}));
+	result.push_back(benchmark("debug.enabled", [](size_t n) {
+		int	level = debuglevel;
+		int	fd = open("/dev/null", O_WRONLY);
+		debug_fd(fd);
+		debuglevel = LOG_DEBUG;
+		for (size_t i = 0; i < n; i++) {
+			debug(LOG_DEBUG, DEBUG_LOG, 0, "accumulate %s -> %.3f",
+				solivianames[i % nnames], 1.5);
+		}
+		debuglevel = level;
+		debug_stderr();
+	}));
+	return result;
+}
+
+/**
+ * \brief Main method for the benchmarks
+ *
+ * \param argc		number of arguments
+ * \param argv		argument strings
+ */
+int	main(int argc, char *argv[]) {
+	int	c;
+	debug_set_ident("pmbench");
+	debuglevel = LOG_ERR;
+	size_t	iterations = 100000;
+	int	repeat = 7;
+	size_t	warmup = 10000;
+	bool	json = false;
+	bool	list = false;
+	while (EOF != (c = getopt_long(argc, argv, "n:jlr:Vw:", longopts,
+		NULL)))
+		switch (c) {
+		case 'n':
+			iterations = std::stoul(optarg);
+			break;
+		case 'j':
+			json = true;
+			break;
+		case 'l':
+			list = true;
+			break;
+		case 'r':
+			repeat = std::stoi(optarg);
+			break;
+		case 'V':
+			std::cout << "pmbench " << VERSION << std::endl;
+			return EXIT_SUCCESS;
+		case 'w':
+			warmup = std::stoul(optarg);
+			break;
+		case '?':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		}
+	if ((iterations == 0) || (repeat <= 0)) {
+		throw std::runtime_error("iterations and repeat must be "
+			"positive");
+	}
+
+	// select the benchmarks
+	std::vector<benchmark>	all = benchmarks();
+	std::vector<benchmark>	selected;
+	for (auto b = all.begin(); b != all.end(); b++) {
+		bool	match = (optind >= argc);
+		for (int i = optind; i < argc; i++) {
+			if (b->name.find(argv[i]) != std::string::npos) {
+				match = true;
+			}
+		}
+		if (match) {
+			selected.push_back(*b);
+		}
+	}
+	if (list) {
+		for (auto b = selected.begin(); b != selected.end(); b++) {
+			std::cout << b->name << std::endl;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	// run them
+	if (!json) {
+		printf("%s\t%s\t%s\t%s\t%s\t%s\n", "name", "iterations",
+			"repeat", "min_ns", "median_ns", "max_ns");
+	}
+	for (auto b = selected.begin(); b != selected.end(); b++) {
+		if (warmup > 0) {
+			b->run(warmup);
+		}
+		std::vector<double>	times;
+		for (int r = 0; r < repeat; r++) {
+			auto	start = std::chrono::steady_clock::now();
+			b->run(iterations);
+			std::chrono::duration<double, std::nano>	elapsed
+				= std::chrono::steady_clock::now() - start;
+			times.push_back(elapsed.count() / iterations);
+		}
+		std::sort(times.begin(), times.end());
+		double	median = times[times.size() / 2];
+		if (json) {
+			printf("{\"name\":\"%s\",\"iterations\":%lu,"
+				"\"repeat\":%d,\"min_ns\":%.2f,"
+				"\"median_ns\":%.2f,\"max_ns\":%.2f}\n",
+				b->name.c_str(), iterations, repeat,
+				times.front(), median, times.back());
+		} else {
+			printf("%s\t%lu\t%d\t%.2f\t%.2f\t%.2f\n",
+				b->name.c_str(), iterations, repeat,
+				times.front(), median, times.back());
+		}
+		fflush(stdout);
+	}
+	return EXIT_SUCCESS;
+}
+
+} // namespace powermeter
+
+int	main(int argc, char *argv[]) {
+	try {
+		return powermeter::main(argc, argv);
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "pmbench main failed: %s",
+			x.what());
+	} catch (...) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "pmbench main failed");
+	}
+	return EXIT_FAILURE;
+}
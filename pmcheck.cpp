@@ -0,0 +1,255 @@
+/*
+ * pmcheck.cpp -- self tests run by make check
+ *
+ * Every check is a function that throws when it fails. For each check
+ * one line with its name and the result is written, the exit status
+ * is the number of failed checks. Only checks containing one of the
+ * patterns given on the command line are run.
+ *
+ * (c) 2023 Prof Dr Andreas Müller
+ */
+#include <cstdlib>
+#include <cstdio>
+#include <stdexcept>
+#include <tsarchive.h>
+#include <sinkqueue.h>
+#include <dispatcher.h>
+#include <configuration.h>
+#include <debug.h>
+#include <format.h>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <iostream>
+#include <vector>
+#include <unistd.h>
+
+namespace powermeter {
+
+/**
+ * \brief A named check
+ */
+struct check {
+	std::string	name;
+	std::function<void()>	run;
+	check(const std::string& n, std::function<void()> r)
+		: name(n), run(r) { }
+};
+
+/**
+ * \brief Fail the current check if a condition does not hold
+ *
+ * \param condition	the condition that must hold
+ * \param what		description of the condition for the message
+ */
+static void	expect(bool condition, const std::string& what) {
+	if (!condition) {
+		throw std::runtime_error(what);
+	}
+}
+
+/**
+ * \brief Temporary archive files that are removed at the end of a check
+ */
+struct tempfiles {
+	std::string	filename;
+	tempfiles(const std::string& name)
+		: filename(stringprintf("/tmp/pmcheck.%d.%s", getpid(),
+			name.c_str())) {
+		unlink(filename.c_str());
+		unlink((filename + ".idx").c_str());
+	}
+	~tempfiles() {
+		unlink(filename.c_str());
+		unlink((filename + ".idx").c_str());
+	}
+};
+
+/**
+ * \brief Write two interleaved series over many blocks and read them back
+ *
+ * The flushes fall in the middle of blocks, so blocks roll over
+ * between flushes, and the archive is reopened for appending once.
+ */
+static void	tsarchive_roundtrip() {
+	tempfiles	files("roundtrip.ts");
+	const int	n = 20000;
+	for (int part = 0; part < 2; part++) {
+		tsarchive	archive(files.filename, true);
+		for (int i = part * n / 2; i < (part + 1) * n / 2; i++) {
+			archive.append("phase1.voltage", 60 * i,
+				230 + (i % 97) * 0.5f);
+			archive.append("phase1.power", 60 * i, (i % 13) * 1.5f);
+			if (i % 1000 == 999) {
+				archive.flush();
+			}
+		}
+	}
+	tsarchive	archive(files.filename);
+	expect(archive.index().size() > 2, "no block rollover");
+	std::vector<tspoint>	points = archive.points("phase1.voltage", 0,
+		60 * n);
+	expect(points.size() == (size_t)n, stringprintf("%zu points "
+		"instead of %d", points.size(), n));
+	for (int i = 0; i < n; i++) {
+		expect((points[i].timekey == 60 * i)
+			&& (points[i].value == 230 + (i % 97) * 0.5f),
+			stringprintf("point %d differs", i));
+	}
+	points = archive.points("phase1.power", 60 * 100, 60 * 199);
+	expect(points.size() == 100, "range query");
+	expect(points.front().timekey == 60 * 100, "range start");
+}
+
+/**
+ * \brief Sink that rejects messages with a value named bad
+ */
+class rejectingsink : public sink {
+public:
+	std::vector<float>	stored;
+	rejectingsink() : sink("rejecting") { }
+	virtual void	store(const message& m) {
+		if (m.find("bad") != m.end()) {
+			throw std::runtime_error("bad message");
+		}
+		stored.push_back(m.find("index")->second);
+	}
+};
+
+static message_ptr	testmessage(int index, bool bad) {
+	message	*m = new message(std::chrono::system_clock::now());
+	m->update("index", index);
+	if (bad) {
+		m->update("bad", 1);
+	}
+	return message_ptr(m);
+}
+
+/**
+ * \brief A failed default storebatch resumes with the failed message
+ */
+static void	sink_resume() {
+	rejectingsink	s;
+	std::vector<message_ptr>	batch;
+	for (int i = 0; i < 4; i++) {
+		batch.push_back(testmessage(i, false));
+	}
+	batch.push_back(testmessage(4, true));
+	try {
+		s.storebatch(batch);
+		expect(false, "bad message stored");
+	} catch (const std::runtime_error&) {
+	}
+	batch.back() = testmessage(4, false);
+	s.storebatch(batch);
+	expect(s.stored.size() == 5, stringprintf("%zu messages stored "
+		"instead of 5", s.stored.size()));
+}
+
+/**
+ * \brief A bad message only discards itself, not its batch
+ */
+static void	sinkqueue_fallback() {
+	configuration	config;
+	config.set("sinkretries", 0);
+	config.set("commitlatency", 0.5f);
+	std::shared_ptr<rejectingsink>	s(new rejectingsink());
+	sinkqueue	queue(config, s);
+	for (int i = 0; i < 5; i++) {
+		queue.submit(testmessage(i, i == 2));
+	}
+	queue.drain(std::chrono::steady_clock::now()
+		+ std::chrono::seconds(10));
+	sinklag	lag = queue.lag();
+	expect((lag.stored == 4) && (lag.failed == 1), stringprintf(
+		"%zu stored, %zu failed", lag.stored, lag.failed));
+	expect(s->stored.size() == 4, "good messages lost");
+}
+
+/**
+ * \brief Destroying a dispatcher on an idle queue does not hang
+ *
+ * The dispatcher is destroyed in a separate thread, which is left
+ * behind if it hangs, so that the check fails instead of hanging.
+ */
+static void	dispatcher_idle_destroy() {
+	std::shared_ptr<std::atomic<bool> >	done(new std::atomic<bool>(false));
+	std::thread	destroyer([done]() {
+		configuration	config;
+		messagequeue	queue;
+		{
+			dispatcher	d(config, queue,
+				std::vector<std::shared_ptr<sink> >());
+			usleep(100000);
+		}
+		*done = true;
+	});
+	for (int i = 0; (i < 50) && (!*done); i++) {
+		usleep(100000);
+	}
+	if (!*done) {
+		destroyer.detach();
+		expect(false, "dispatcher destructor hangs");
+	}
+	destroyer.join();
+}
+
+/**
+ * \brief Build the list of all checks
+ */
+static std::vector<check>	checks() {
+	std::vector<check>	result;
+	result.push_back(check("dispatcher.idle_destroy",
+		dispatcher_idle_destroy));
+	result.push_back(check("sink.resume", sink_resume));
+	result.push_back(check("sinkqueue.fallback", sinkqueue_fallback));
+	result.push_back(check("tsarchive.roundtrip", tsarchive_roundtrip));
+	return result;
+}
+
+/**
+ * \brief Main method for the checks
+ *
+ * \param argc		number of arguments
+ * \param argv		argument strings
+ */
+int	main(int argc, char *argv[]) {
+	debug_set_ident("pmcheck");
+	debuglevel = LOG_ERR;
+	int	failed = 0;
+	std::vector<check>	all = checks();
+	for (auto c = all.begin(); c != all.end(); c++) {
+		bool	selected = (argc < 2);
+		for (int i = 1; i < argc; i++) {
+			if (c->name.find(argv[i]) != std::string::npos) {
+				selected = true;
+			}
+		}
+		if (!selected) {
+			continue;
+		}
+		try {
+			c->run();
+			printf("%s\tok\n", c->name.c_str());
+		} catch (const std::exception& x) {
+			printf("%s\tFAILED: %s\n", c->name.c_str(), x.what());
+			failed++;
+		}
+		fflush(stdout);
+	}
+	return failed;
+}
+
+} // namespace powermeter
+
+int	main(int argc, char *argv[]) {
+	try {
+		return powermeter::main(argc, argv);
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "pmcheck main failed: %s",
+			x.what());
+	} catch (...) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "pmcheck main failed");
+	}
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,208 @@
+/*
+ * pmtrace.cpp -- convert a flight recorder dump to Chrome trace JSON
+ *
+ * The output can be loaded into chrome://tracing or Perfetto. Begin and
+ * end events become duration events, all other events are instant
+ * events with the value of the event as argument.
+ *
+ * (c) 2023 Prof Dr Andreas Müller
+ */
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <getopt.h>
+#include <stdexcept>
+#include <flightrecorder.h>
+#include <debug.h>
+#include <format.h>
+#include <iostream>
+#include <algorithm>
+#include <vector>
+#include <config.h>
+
+namespace powermeter {
+
+static struct option	longopts[] = {
+{ "debug",		no_argument,		NULL,		'd' },
+{ "help",		no_argument,		NULL,		'?' },
+{ "output",		required_argument,	NULL,		'o' },
+{ "version",		no_argument,		NULL,		'V' },
+{ NULL,			0,			NULL,		 0  }
+};
+
+static void	usage(const char *progname) {
+	std::cout << progname << " [ options ] <dump>" << std::endl;
+	std::cout << std::endl;
+	std::cout << "convert a powermeterd flight recorder dump to Chrome "
+		"trace JSON" << std::endl;
+	std::cout << std::endl;
+	std::cout << "options:" << std::endl;
+	std::cout << "  -d,--debug          debug output" << std::endl;
+	std::cout << "  -o,--output=<f>     write JSON to <f> instead of stdout"
+		<< std::endl;
+}
+
+/**
+ * \brief How an event type is rendered in the trace
+ */
+struct eventformat {
+	const char	*name;
+	char	phase;
+	const char	*arg;
+};
+
+static const eventformat	formats[] = {
+	{ NULL,		0,	NULL },
+	{ "poll",	'B',	NULL },
+	{ "poll",	'E',	NULL },
+	{ "receive",	'i',	"bytes" },
+	{ "reject",	'i',	"reason" },
+	{ "accumulate",	'i',	"value" },
+	{ "submit",	'i',	"depth" },
+	{ "extract",	'i',	"depth" },
+	{ "execute",	'B',	NULL },
+	{ "execute",	'E',	NULL },
+	{ "commit",	'B',	NULL },
+	{ "commit",	'E',	NULL }
+};
+static const size_t	nformats = sizeof(formats) / sizeof(formats[0]);
+
+static const char	*rejectreason(int reason) {
+	switch (reason) {
+	case reject_size:	return "size";
+	case reject_format:	return "format";
+	case reject_id:		return "id";
+	case reject_crc:	return "crc";
+	}
+	return "unknown";
+}
+
+/**
+ * \brief Read the events of a dump, skipping empty and torn slots
+ *
+ * \param filename	the dump file
+ * \param header	where to store the header of the dump
+ */
+static std::vector<traceevent>	readdump(const char *filename,
+		traceheader& header) {
+	FILE	*in = fopen(filename, "rb");
+	if (NULL == in) {
+		std::string	msg = stringprintf("cannot open %s: %s",
+			filename, strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	if ((1 != fread(&header, sizeof(header), 1, in))
+		|| (0 != memcmp(header.magic, flightrecorder::magic,
+			sizeof(header.magic)))
+		|| (header.eventsize != sizeof(traceevent))) {
+		fclose(in);
+		std::string	msg = stringprintf("%s is not a flight "
+			"recorder dump", filename);
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	std::vector<traceevent>	events;
+	traceevent	e;
+	while (1 == fread(&e, sizeof(e), 1, in)) {
+		if ((0 == e.nanoseconds) || (0 == e.type)
+			|| (e.type >= nformats)) {
+			continue;
+		}
+		events.push_back(e);
+	}
+	fclose(in);
+	std::stable_sort(events.begin(), events.end(),
+		[](const traceevent& a, const traceevent& b) {
+			return a.nanoseconds < b.nanoseconds;
+		});
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "%lu events read from %s",
+		events.size(), filename);
+	return events;
+}
+
+/**
+ * \brief Main method for the trace converter
+ *
+ * \param argc		number of arguments
+ * \param argv		argument strings
+ */
+int	main(int argc, char *argv[]) {
+	int	c;
+	debug_set_ident("pmtrace");
+	const char	*outputname = NULL;
+	while (EOF != (c = getopt_long(argc, argv, "do:V", longopts, NULL)))
+		switch (c) {
+		case 'd':
+			debuglevel = LOG_DEBUG;
+			break;
+		case 'o':
+			outputname = optarg;
+			break;
+		case 'V':
+			std::cout << "pmtrace " << VERSION << std::endl;
+			return EXIT_SUCCESS;
+		case '?':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		}
+	if (optind >= argc) {
+		throw std::runtime_error("dump file argument missing");
+	}
+
+	traceheader	header;
+	std::vector<traceevent>	events = readdump(argv[optind], header);
+
+	FILE	*out = stdout;
+	if (NULL != outputname) {
+		out = fopen(outputname, "w");
+		if (NULL == out) {
+			std::string	msg = stringprintf("cannot create %s: %s",
+				outputname, strerror(errno));
+			debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+			throw std::runtime_error(msg);
+		}
+	}
+
+	fprintf(out, "{\"traceEvents\":[\n");
+	fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+		"\"tid\":0,\"args\":{\"name\":\"powermeterd\"}}", header.pid);
+	for (auto e = events.begin(); e != events.end(); e++) {
+		const eventformat&	f = formats[e->type];
+		double	ts = (e->nanoseconds + header.offset) / 1000.;
+		fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+			"\"pid\":%d,\"tid\":%u", f.name, f.phase, ts,
+			header.pid, e->thread);
+		if ('i' == f.phase) {
+			fprintf(out, ",\"s\":\"t\"");
+		}
+		if (e->type == trace_reject) {
+			fprintf(out, ",\"args\":{\"%s\":\"%s\"}", f.arg,
+				rejectreason((int)e->value));
+		} else if (NULL != f.arg) {
+			fprintf(out, ",\"args\":{\"%s\":%.9g}", f.arg,
+				e->value);
+		}
+		fprintf(out, "}");
+	}
+	fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+	if (out != stdout) {
+		fclose(out);
+	}
+	return EXIT_SUCCESS;
+}
+
+} // namespace powermeter
+
+int	main(int argc, char *argv[]) {
+	try {
+		return powermeter::main(argc, argv);
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "pmtrace main failed: %s",
+			x.what());
+	} catch (...) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "pmtrace main failed");
+	}
+	return EXIT_FAILURE;
+}
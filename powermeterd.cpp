@@ -8,7 +8,14 @@
 #include <getopt.h>
 #include <stdexcept>
 #include <message.h>
+#include <dispatcher.h>
+#include <sinkfactory.h>
+#include <partitioner.h>
 #include <database.h>
+#include <stationfile.h>
+#include <metrics.h>
+#include <flightrecorder.h>
+#include <supervisor.h>
 #include <meterfactory.h>
 #include <ale3_meter.h>
 #include <debug.h>
@@ -18,6 +25,7 @@
 #include <iostream>
 #include <config.h>
 #include <unistd.h>
+#include <ctime>
 #include <atomic>
 
 namespace powermeter {
@@ -42,6 +50,20 @@ static struct option	longopts[] = {
 { "foreground",		no_argument,		NULL,		'f' },
 { "simulate",		no_argument,		NULL,		'x' },
 { "syslog", 		no_argument,		NULL,		'l' },
+{ "capture",		required_argument,	NULL,		'C' },
+{ "replay",		required_argument,	NULL,		'R' },
+{ "replaypace",		no_argument,		NULL,		'r' },
+{ "virtualclock",	no_argument,		NULL,		'v' },
+{ "clockstart",		required_argument,	NULL,		'k' },
+{ "seed",		required_argument,	NULL,		'e' },
+{ "sinks",		required_argument,	NULL,		'o' },
+{ "sdatalayout",	required_argument,	NULL,		'W' },
+{ "maintain",		no_argument,		NULL,		'M' },
+{ "idcache",		required_argument,	NULL,		'I' },
+{ "bootstrap",		required_argument,	NULL,		'B' },
+{ "livesocket",		required_argument,	NULL,		'L' },
+{ "metricsport",	required_argument,	NULL,		'X' },
+{ "tracefile",		required_argument,	NULL,		'F' },
 { NULL,			0,			NULL,		 0  }
 };
 
@@ -53,6 +75,32 @@ static void	usage(const char *progname) {
 	std::cout << "options:" << std::endl;
 }
 
+/**
+ * \brief Replay a capture and write the resulting messages to stdout
+ *
+ * The values are written with enough digits to reproduce the floats
+ * exactly, so that the output of two replays can be compared with diff.
+ *
+ * \param config	the configuration, used to construct the meter
+ */
+static int	replaymain(const configuration& config) {
+	messagequeue	queue;
+	meterfactory	factory(config);
+	std::shared_ptr<meter>	meterp
+		= factory.get(config.stringvalue("metertype"), queue);
+	meterp->waitthread();
+	while (queue.size() > 0) {
+		message	m = queue.extract(std::chrono::seconds(1));
+		long long	timekey = std::chrono::duration_cast<
+			std::chrono::seconds>(m.when().time_since_epoch()).count();
+		for (auto i = m.begin(); i != m.end(); i++) {
+			printf("%lld %s %.9g\n", timekey, i->first.c_str(),
+				i->second);
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
 /**
  * \brief Main method for the powermeter
  *
@@ -63,13 +111,14 @@ int	main(int argc, char *argv[]) {
 	int	c;
 	configuration	config;
 	bool	foreground = false;
+	bool	maintain = false;
 	debug_set_ident("powermeterd");
 	//debuglevel = LOG_DEBUG;
 	debugthreads = 1;
 
 	// read parameters from the command line
 	while (EOF != (c = getopt_long(argc, argv,
-		"c:dH:D:U:P:Q:S:s::m:p:i:Vxt:T:l",
+		"c:dH:D:U:P:Q:S:s::m:p:i:Vxt:T:lC:R:rvk:e:o:W:MI:B:L:X:F:",
 		longopts, NULL)))
 		switch (c) {
 		case 'c':
@@ -149,9 +198,93 @@ int	main(int argc, char *argv[]) {
 		case 'l':
 			debug_syslog(LOG_LOCAL0);
 			break;
+		case 'C':
+			config.set("capturefile", optarg);
+			debug(LOG_DEBUG, DEBUG_LOG, 0, "capture file: %s",
+				optarg);
+			break;
+		case 'R':
+			config.set("replayfile", optarg);
+			debug(LOG_DEBUG, DEBUG_LOG, 0, "replay file: %s",
+				optarg);
+			break;
+		case 'r':
+			config.set("replaypace", true);
+			break;
+		case 'v':
+			config.set("clock", "virtual");
+			break;
+		case 'k':
+			config.set("clockstart", std::stoi(optarg));
+			break;
+		case 'e':
+			config.set("seed", std::stoi(optarg));
+			debug(LOG_DEBUG, DEBUG_LOG, 0, "seed: %d",
+				config.intvalue("seed"));
+			break;
+		case 'o':
+			config.set("sinks", optarg);
+			debug(LOG_DEBUG, DEBUG_LOG, 0, "sinks: %s", optarg);
+			break;
+		case 'W':
+			config.set("sdatalayout", optarg);
+			debug(LOG_DEBUG, DEBUG_LOG, 0, "sdata layout: %s",
+				optarg);
+			break;
+		case 'M':
+			maintain = true;
+			break;
+		case 'I':
+			config.set("idcachefile", optarg);
+			break;
+		case 'B':
+			config.set("stationfile", optarg);
+			break;
+		case 'L':
+			config.set("livesocket", optarg);
+			break;
+		case 'X':
+			config.set("metricsport", std::stoi(optarg));
+			break;
+		case 'F':
+			config.set("tracefile", optarg);
+			break;
 		}
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "command line read");
 
+	// a replay runs in the foreground and needs no database
+	if (config.stringvalue("replayfile", "").size() > 0) {
+		return replaymain(config);
+	}
+
+	// maintenance of the partitions runs once in the foreground
+	if (maintain) {
+		partitioner	p(config);
+		p.maintain(time(NULL));
+		return EXIT_SUCCESS;
+	}
+
+	// create missing station, sensor and field rows from the station
+	// file and make sure every value of the meter has ids
+	std::string	stationfilename = config.stringvalue("stationfile", "");
+	if (stationfilename.size() > 0) {
+		stationfile	stations(stationfilename);
+		database	db(config);
+		db.bootstrap(stations);
+		meterfactory	factory(config);
+		std::vector<std::string>	names
+			= factory.fieldnames(config.stringvalue("metertype"));
+		std::string	stationname = config.stringvalue("stationname");
+		for (auto i = names.begin(); i != names.end(); i++) {
+			if (!stations.has(stationname, *i)) {
+				debug(LOG_WARNING, DEBUG_LOG, 0, "%s not "
+					"described in %s", i->c_str(),
+					stationfilename.c_str());
+			}
+		}
+		db.check(names);
+	}
+
 	// if not running in the foreground, daemonize now
 	if (foreground) {
 		debug(LOG_DEBUG, DEBUG_LOG, 0, "stay in foreground");
@@ -169,26 +302,101 @@ int	main(int argc, char *argv[]) {
 		umask(0);
 	} 
 
+	// dump the flight recorder on SIGUSR1 and when we crash
+	flightrecorder::install(config.stringvalue("tracefile",
+		"/var/tmp/powermeterd.trace"));
+
 	// create the queue
 	messagequeue	queue;
 
-	// create the destination, i.e. the thread writing into the database
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "start the database");
-	database	db(config, queue);
+	// create the destinations and the thread writing into them
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "start the sinks");
+	sinkfactory	sinks(config);
+	dispatcher	consumer(config, queue, sinks.sinks());
+
+	// export the state of the queues as metrics
+	std::unique_ptr<metricsserver>	metricsp;
+	if (config.intvalue("metricsport", 0) > 0) {
+		metrics::newgauge("powermeter_queue_depth",
+			"Messages waiting in the message queue",
+			[&queue]() { return (double)queue.depth(); });
+		metrics::newgauge("powermeter_log_lost",
+			"Log messages lost because a log ring was full",
+			[]() { return (double)debug_lost(); });
+		auto	lags = consumer.lags();
+		for (auto i = lags.begin(); i != lags.end(); i++) {
+			std::string	name = i->first;
+			auto	lag = [&consumer, name]() -> sinklag {
+				auto	l = consumer.lags();
+				for (auto j = l.begin(); j != l.end(); j++) {
+					if (j->first == name) {
+						return j->second;
+					}
+				}
+				return sinklag();
+			};
+			std::string	label = "{sink=\"" + name + "\"}";
+			metrics::newgauge("powermeter_sink_queued" + label,
+				"Messages waiting for a sink",
+				[lag]() { return (double)lag().queued; });
+			metrics::newgauge("powermeter_sink_age_seconds" + label,
+				"Age of the oldest message waiting for a sink",
+				[lag]() { return (double)lag().age; });
+			metrics::newgauge("powermeter_sink_dropped" + label,
+				"Messages dropped because the sink queue was full",
+				[lag]() { return (double)lag().dropped; });
+			metrics::newgauge("powermeter_sink_failed" + label,
+				"Messages a sink has given up on",
+				[lag]() { return (double)lag().failed; });
+		}
+		metricsp = std::unique_ptr<metricsserver>(
+			new metricsserver(config));
+	}
 	
+	// SIGTERM and SIGINT stop the daemon after storing all data
+	supervisor::catchsignals();
+
 	// create the source, i.e. the thread reading from the power meter
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "start the meter");
 	meterfactory	factory(config);
 	std::shared_ptr<meter>	meterp
 		= factory.get(config.stringvalue("metertype"), queue);
 
-	sleep(10);
+	// restart the meter and the sinks when they stall
+	supervisor	sup(config);
+	sup.watch("meter", meterp->alive(), std::chrono::seconds(
+		config.intvalue("meterstalltimeout",
+			2 * config.intvalue("meterwindow", 60))),
+		[meterp]() { meterp->restart(); });
+	auto	sinkqueues = consumer.sinkqueues();
+	for (auto i = sinkqueues.begin(); i != sinkqueues.end(); i++) {
+		std::shared_ptr<sinkqueue>	q = *i;
+		sup.watch(q->name(), q->alive(), std::chrono::seconds(
+			config.intvalue("sinkstalltimeout", 300)),
+			[q]() { q->restart(); });
+	}
+
+	// wait for the first sample, the sinks connect in their own threads,
+	// a meter that does not get ready is left to the supervisor
+	if (!meterp->waitready(std::chrono::seconds(
+		config.intvalue("readytimeout", 120)))) {
+		debug(LOG_WARNING, DEBUG_LOG, 0, "meter not ready yet");
+	}
+	sup.ready();
 
-	// wait for the message queue to report a problem
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "waiting for queue event");
-	queue.wait(std::chrono::seconds(120));
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "queue timeout, abort");
-	abort();
+	// watch the components until we are asked to stop
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "supervising the threads");
+	sup.run();
+
+	// submit the partial window and store everything in the queues
+	meterp->shutdown();
+	if (!consumer.drain(std::chrono::seconds(
+		config.intvalue("shutdowntimeout", 20)))) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "not all messages stored before "
+			"shutdown");
+	}
+	debug(LOG_INFO, DEBUG_LOG, 0, "powermeterd stopped");
+	return EXIT_SUCCESS;
 }
 
 } // namespace powermeter
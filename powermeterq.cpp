@@ -0,0 +1,428 @@
+/*
+ * powermeterq.cpp -- local column cache and queries for the sdata table
+ *
+ * The pull command copies all sdata rows of the station newer than the
+ * watermark of the cache into per series column files, the query
+ * command aggregates a series from the memory mapped columns without
+ * touching the database. The archive command aggregates a series from
+ * a compressed archive written by the tsarchive sink.
+ *
+ * (c) 2023 Prof Dr Andreas Müller
+ */
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <getopt.h>
+#include <stdexcept>
+#include <columncache.h>
+#include <tsarchive.h>
+#include <configuration.h>
+#include <debug.h>
+#include <format.h>
+#include <mysql.h>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <config.h>
+
+namespace powermeter {
+
+static struct option	longopts[] = {
+{ "config",		required_argument,	NULL,		'c' },
+{ "cachedir",		required_argument,	NULL,		'C' },
+{ "cachelag",		required_argument,	NULL,		'L' },
+{ "debug",		no_argument,		NULL,		'd' },
+{ "help",		no_argument,		NULL,		'?' },
+{ "stationname",	required_argument,	NULL,		'S' },
+{ "threads",		required_argument,	NULL,		'j' },
+{ "version",		no_argument,		NULL,		'V' },
+{ NULL,			0,			NULL,		 0  }
+};
+
+static void	usage(const char *progname) {
+	std::cout << progname << " [ options ] pull" << std::endl;
+	std::cout << progname << " [ options ] list" << std::endl;
+	std::cout << progname << " [ options ] query <sensor.field> <from> "
+		"<to> [ <bucket> ]" << std::endl;
+	std::cout << progname << " [ options ] archive <file> <sensor.field> "
+		"<from> <to> [ <bucket> ]" << std::endl;
+	std::cout << std::endl;
+	std::cout << "pull new sdata rows into a local column cache and query "
+		"them" << std::endl;
+	std::cout << std::endl;
+	std::cout << "times are seconds since the epoch or local times of the "
+		"form" << std::endl;
+	std::cout << "YYYY-MM-DD[ HH:MM:SS], the bucket is in seconds"
+		<< std::endl;
+	std::cout << std::endl;
+	std::cout << "options:" << std::endl;
+	std::cout << "  -c,--config=<f>       read configuration from <f>"
+		<< std::endl;
+	std::cout << "  -C,--cachedir=<d>     cache directory (default pmcache)"
+		<< std::endl;
+	std::cout << "  -L,--cachelag=<s>     only pull rows older than <s> "
+		"seconds (default 300)" << std::endl;
+	std::cout << "  -S,--stationname=<s>  station to pull" << std::endl;
+	std::cout << "  -j,--threads=<n>      scan with <n> threads" << std::endl;
+	std::cout << "  -d,--debug            debug output" << std::endl;
+}
+
+/**
+ * \brief Parse a time argument
+ *
+ * \param s	seconds since the epoch or a local date and time
+ */
+static int64_t	parsetime(const std::string& s) {
+	if (s.find('-') == std::string::npos) {
+		return std::stoll(s);
+	}
+	struct tm	tm;
+	memset(&tm, 0, sizeof(tm));
+	if ((NULL == strptime(s.c_str(), "%Y-%m-%d %H:%M:%S", &tm))
+		&& (NULL == strptime(s.c_str(), "%Y-%m-%d", &tm))) {
+		std::string	msg = stringprintf("cannot parse time '%s'",
+			s.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	tm.tm_isdst = -1;
+	return mktime(&tm);
+}
+
+/**
+ * \brief Copy all new rows of the station into the cache
+ *
+ * Rows are pulled in timekey order, so the watermark can be advanced to
+ * the last timekey seen. Rows younger than cachelag seconds are left
+ * for the next pull, because the daemon may still be writing rows for
+ * that timekey.
+ *
+ * The watermark is a timekey, not an insertion order, so rows that the
+ * daemon inserts later for older minutes, e.g. when it backfills from
+ * its journal after an outage longer than cachelag, are never pulled.
+ * Remove the cache directory to pull such rows.
+ *
+ * \param config	the configuration with the database parameters
+ * \param cache		the cache to append to
+ */
+static int	pull(const configuration& config, columncache& cache) {
+	std::string	stationname = config.stringvalue("stationname");
+	int64_t	from = cache.watermark();
+	int64_t	to = time(NULL) - config.intvalue("cachelag", 300);
+	if (to <= from) {
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "cache is up to date");
+		return EXIT_SUCCESS;
+	}
+
+	// connect to the database
+	MYSQL	*mysql = mysql_init(NULL);
+	if (NULL == mysql_real_connect(mysql,
+		config.stringvalue("dbhostname").c_str(),
+		config.stringvalue("dbuser").c_str(),
+		config.stringvalue("dbpassword").c_str(),
+		config.stringvalue("dbname").c_str(),
+		config.intvalue("dbport", 3307), NULL, 0)) {
+		std::string	msg = stringprintf("cannot open database "
+			"connection: %s", mysql_error(mysql));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		mysql_close(mysql);
+		throw std::runtime_error(msg);
+	}
+
+	// prepare the query
+	MYSQL_STMT	*stmt = mysql_stmt_init(mysql);
+	std::string	query(	"select d.timekey, se.name, f.name, d.value "
+				"from sdata d, sensor se, mfield f, station st "
+				"where d.sensorid = se.id "
+				"  and d.fieldid = f.id "
+				"  and se.stationid = st.id "
+				"  and st.name = ? "
+				"  and d.timekey > ? "
+				"  and d.timekey <= ? "
+				"order by d.timekey");
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "query: '%s'", query.c_str());
+	if ((NULL == stmt)
+		|| mysql_stmt_prepare(stmt, query.c_str(), query.size())) {
+		std::string	msg = stringprintf("cannot prepare query: %s",
+			mysql_error(mysql));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		if (stmt) {
+			mysql_stmt_close(stmt);
+		}
+		mysql_close(mysql);
+		throw std::runtime_error(msg);
+	}
+
+	// bind the parameters
+	MYSQL_BIND	parameters[3];
+	memset(parameters, 0, sizeof(parameters));
+	char	stationbuffer[stationname.size() + 1];
+	strcpy(stationbuffer, stationname.c_str());
+	unsigned long	stationlength = stationname.size();
+	parameters[0].buffer = stationbuffer;
+	parameters[0].buffer_length = stationlength + 1;
+	parameters[0].length = &stationlength;
+	parameters[0].buffer_type = MYSQL_TYPE_VAR_STRING;
+	long long	fromkey = from;
+	parameters[1].buffer = &fromkey;
+	parameters[1].buffer_type = MYSQL_TYPE_LONGLONG;
+	long long	tokey = to;
+	parameters[2].buffer = &tokey;
+	parameters[2].buffer_type = MYSQL_TYPE_LONGLONG;
+
+	if (mysql_stmt_bind_param(stmt, parameters)
+		|| mysql_stmt_execute(stmt)) {
+		std::string	msg = stringprintf("cannot execute query: %s",
+			mysql_stmt_error(stmt));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		mysql_stmt_close(stmt);
+		mysql_close(mysql);
+		throw std::runtime_error(msg);
+	}
+
+	// the name buffers are as long as the columns of the result
+	unsigned long	sensorsize = 64;
+	unsigned long	fieldsize = 64;
+	MYSQL_RES	*metadata = mysql_stmt_result_metadata(stmt);
+	if (metadata) {
+		sensorsize = std::max(sensorsize,
+			mysql_fetch_field_direct(metadata, 1)->length + 1);
+		fieldsize = std::max(fieldsize,
+			mysql_fetch_field_direct(metadata, 2)->length + 1);
+		mysql_free_result(metadata);
+	}
+
+	// bind the results
+	MYSQL_BIND	results[4];
+	memset(results, 0, sizeof(results));
+	long long	timekey = 0;
+	results[0].buffer = &timekey;
+	results[0].buffer_type = MYSQL_TYPE_LONGLONG;
+	std::vector<char>	sensorname(sensorsize);
+	unsigned long	sensorlength = 0;
+	results[1].buffer = sensorname.data();
+	results[1].buffer_length = sensorname.size();
+	results[1].length = &sensorlength;
+	results[1].buffer_type = MYSQL_TYPE_VAR_STRING;
+	std::vector<char>	fieldname(fieldsize);
+	unsigned long	fieldlength = 0;
+	results[2].buffer = fieldname.data();
+	results[2].buffer_length = fieldname.size();
+	results[2].length = &fieldlength;
+	results[2].buffer_type = MYSQL_TYPE_VAR_STRING;
+	float	value = 0;
+	results[3].buffer = &value;
+	results[3].buffer_type = MYSQL_TYPE_FLOAT;
+	if (mysql_stmt_bind_result(stmt, results)) {
+		std::string	msg = stringprintf("cannot bind results: %s",
+			mysql_stmt_error(stmt));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		mysql_stmt_close(stmt);
+		mysql_close(mysql);
+		throw std::runtime_error(msg);
+	}
+
+	// append all rows to the columns
+	int	rc;
+	long	rows = 0;
+	int64_t	last = from;
+	while (0 == (rc = mysql_stmt_fetch(stmt))) {
+		std::string	name = std::string(sensorname.data(),
+			sensorlength) + "." + std::string(fieldname.data(),
+			fieldlength);
+		cache.append(name, timekey, value);
+		last = timekey;
+		rows++;
+	}
+
+	// anything but the end of the rows, including a truncated name,
+	// must not advance the watermark past rows not read
+	if (rc != MYSQL_NO_DATA) {
+		std::string	msg = stringprintf("cannot fetch rows after "
+			"%ld rows: %s", rows, (rc == MYSQL_DATA_TRUNCATED)
+				? "data truncated" : mysql_stmt_error(stmt));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		mysql_stmt_close(stmt);
+		mysql_close(mysql);
+		cache.close();
+		throw std::runtime_error(msg);
+	}
+	mysql_stmt_close(stmt);
+	mysql_close(mysql);
+
+	// the columns are complete up to the end of the pulled range
+	cache.close();
+	cache.watermark(std::max(last, to));
+	debug(LOG_INFO, DEBUG_LOG, 0, "pulled %ld rows up to %lld", rows,
+		(long long)to);
+	return EXIT_SUCCESS;
+}
+
+/**
+ * \brief Print the non empty buckets of a query
+ *
+ * \param buckets	the buckets to print
+ */
+static void	printbuckets(const std::vector<bucket>& buckets) {
+	printf("start\tcount\tsum\tmean\tmin\tmax\n");
+	for (auto b = buckets.begin(); b != buckets.end(); b++) {
+		if (b->count == 0) {
+			continue;
+		}
+		printf("%lld\t%lu\t%.9g\t%.9g\t%.9g\t%.9g\n",
+			(long long)b->start, (unsigned long)b->count,
+			b->sum, b->mean(), b->min, b->max);
+	}
+}
+
+/**
+ * \brief Aggregate a series of a compressed archive
+ *
+ * Only the blocks whose time range overlaps the query are read and
+ * decoded, see tsarchive::points.
+ *
+ * \param filename	the data file of the archive
+ * \param name		the series to aggregate
+ * \param from		the first time key to include
+ * \param to		the last time key to include
+ * \param bucketsize	bucket length in seconds, 0 for a single bucket
+ */
+static std::vector<bucket>	archivebuckets(const std::string& filename,
+		const std::string& name, int64_t from, int64_t to,
+		int64_t bucketsize) {
+	if (bucketsize <= 0) {
+		bucketsize = to - from + 1;
+	}
+	std::vector<bucket>	result;
+	for (int64_t start = from; start <= to; start += bucketsize) {
+		result.push_back(bucket(start));
+	}
+	tsarchive	archive(filename);
+	std::vector<tspoint>	points = archive.points(name, from, to);
+	for (auto p = points.begin(); p != points.end(); p++) {
+		result[(p->timekey - from) / bucketsize].add(p->value);
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "%zu points of %s aggregated",
+		points.size(), name.c_str());
+	return result;
+}
+
+/**
+ * \brief Main method for the query tool
+ *
+ * \param argc		number of arguments
+ * \param argv		argument strings
+ */
+int	main(int argc, char *argv[]) {
+	int	c;
+	configuration	config;
+	debug_set_ident("powermeterq");
+	int	threads = std::max(1u, std::thread::hardware_concurrency());
+	while (EOF != (c = getopt_long(argc, argv, "c:C:L:dS:j:V",
+		longopts, NULL)))
+		switch (c) {
+		case 'c':
+			config = configuration(optarg);
+			break;
+		case 'C':
+			config.set("cachedir", optarg);
+			break;
+		case 'L':
+			config.set("cachelag", std::stoi(optarg));
+			break;
+		case 'd':
+			debuglevel = LOG_DEBUG;
+			break;
+		case 'S':
+			config.set("stationname", optarg);
+			break;
+		case 'j':
+			threads = std::stoi(optarg);
+			break;
+		case 'V':
+			std::cout << "powermeterq " << VERSION << std::endl;
+			return EXIT_SUCCESS;
+		case '?':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	std::string	command(argv[optind++]);
+
+	if (command == "archive") {
+		if ((argc - optind) < 4) {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+		std::string	filename(argv[optind]);
+		std::string	name(argv[optind + 1]);
+		int64_t	from = parsetime(argv[optind + 2]);
+		int64_t	to = parsetime(argv[optind + 3]);
+		int64_t	bucketsize = ((argc - optind) > 4)
+					? std::stoll(argv[optind + 4]) : 0;
+		if (to < from) {
+			std::cerr << "empty time range" << std::endl;
+			return EXIT_FAILURE;
+		}
+		printbuckets(archivebuckets(filename, name, from, to,
+			bucketsize));
+		return EXIT_SUCCESS;
+	}
+
+	// the other commands work on the column cache
+	columncache	cache(config.stringvalue("cachedir", "pmcache"));
+
+	if (command == "pull") {
+		return pull(config, cache);
+	}
+
+	if (command == "list") {
+		std::vector<std::string>	names = cache.names();
+		for (auto i = names.begin(); i != names.end(); i++) {
+			std::cout << *i << std::endl;
+		}
+		return EXIT_SUCCESS;
+	}
+
+	if (command == "query") {
+		if ((argc - optind) < 3) {
+			usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+		std::string	name(argv[optind]);
+		int64_t	from = parsetime(argv[optind + 1]);
+		int64_t	to = parsetime(argv[optind + 2]);
+		int64_t	bucketsize = ((argc - optind) > 3)
+					? std::stoll(argv[optind + 3]) : 0;
+		if (to < from) {
+			std::cerr << "empty time range" << std::endl;
+			return EXIT_FAILURE;
+		}
+		printbuckets(cache.aggregate(name, from, to, bucketsize,
+			threads));
+		return EXIT_SUCCESS;
+	}
+
+	std::cerr << "unknown command: " << command << std::endl;
+	return EXIT_FAILURE;
+}
+
+} // namespace powermeter
+
+int	main(int argc, char *argv[]) {
+	try {
+		return powermeter::main(argc, argv);
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "powermeterq main failed: %s",
+			x.what());
+		std::cerr << "powermeterq failed: " << x.what() << std::endl;
+	} catch (...) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "powermeterq main failed");
+	}
+	return EXIT_FAILURE;
+}
@@ -0,0 +1,153 @@
+/*
+ * simulated_meter.cpp
+ *
+ * (c) 2023 Prof Dr Andreas Müller
+ */
+#include <simulated_meter.h>
+#include <ale3_meter.h>
+#include <debug.h>
+#include <format.h>
+#include <sstream>
+
+namespace powermeter {
+
+// registers used for the fields and their scale factors, in ALE3 order
+static const int	nregisters = 17;
+static const int	registers[nregisters] = {
+	ALE3_URMS_PHASE1, ALE3_IRMS_PHASE1, ALE3_PRMS_PHASE1,
+	ALE3_QRMS_PHASE1, ALE3_COSPHI_PHASE1,
+	ALE3_URMS_PHASE2, ALE3_IRMS_PHASE2, ALE3_PRMS_PHASE2,
+	ALE3_QRMS_PHASE2, ALE3_COSPHI_PHASE2,
+	ALE3_URMS_PHASE3, ALE3_IRMS_PHASE3, ALE3_PRMS_PHASE3,
+	ALE3_QRMS_PHASE3, ALE3_COSPHI_PHASE3,
+	ALE3_PRMS_TOTAL, ALE3_QRMS_TOTAL
+};
+static const float	scales[nregisters] = {
+	1., 0.1, 10, 0.01, 0.01,
+	1., 0.1, 10, 0.01, 0.01,
+	1., 0.1, 10, 0.01, 0.01,
+	10, 0.01
+};
+static const char	*defaultfields = "urms_phase1,irms_phase1,prms_phase1,"
+	"qrms_phase1,cosphi_phase1,urms_phase2,irms_phase2,prms_phase2,"
+	"qrms_phase2,cosphi_phase2,urms_phase3,irms_phase3,prms_phase3,"
+	"qrms_phase3,cosphi_phase3,prms_total,qrms_total";
+
+/**
+ * \brief Field names of the simulated meter, without the sensor name
+ *
+ * If simfieldcount is larger than the number of names in simfields,
+ * the additional fields get the names field<n>.
+ */
+static std::vector<std::string>	simfields(const configuration& config) {
+	std::vector<std::string>	fields;
+	std::istringstream	in(config.stringvalue("simfields",
+		defaultfields));
+	std::string	name;
+	while (std::getline(in, name, ',')) {
+		if (name.size() > 0) {
+			fields.push_back(name);
+		}
+	}
+	size_t	count = config.intvalue("simfieldcount", fields.size());
+	while (fields.size() < count) {
+		fields.push_back(stringprintf("field%zu", fields.size()));
+	}
+	fields.resize(count);
+	return fields;
+}
+
+/**
+ * \brief Names of the values in the messages of the simulated meter
+ */
+std::vector<std::string>	simulated_meter::fieldnames(
+		const configuration& config) {
+	std::string	sensorname = config.stringvalue("sensorname",
+		"simulated");
+	std::vector<std::string>	names = simfields(config);
+	for (auto i = names.begin(); i != names.end(); i++) {
+		*i = sensorname + "." + *i;
+	}
+	return names;
+}
+
+/**
+ * \brief Construct a simulated meter
+ *
+ * \param config	configuration
+ * \param queue		the queue to place messages on
+ */
+simulated_meter::simulated_meter(const configuration& config,
+	messagequeue& queue)
+	: meter(config, queue),
+	  _sensorname(config.stringvalue("sensorname", "simulated")),
+	  _fields(simfields(config)),
+	  sim(_clock->now(), simulator::seed(config)) {
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "simulated meter %s with %zu fields",
+		_sensorname.c_str(), _fields.size());
+
+	// run the thread
+	startthread();
+}
+
+/**
+ * \brief Destroy the simulated meter
+ */
+simulated_meter::~simulated_meter() {
+	stopthread();
+}
+
+/**
+ * \brief Integrate simulated data over the current window
+ */
+message	simulated_meter::integrate() {
+	std::unique_lock<std::mutex>	lock(_mutex);
+
+	// the integration interval is the current window, which may
+	// have been started by a previous thread
+	message&	result = openwindow();
+	auto	end = _windowend;
+	while (windowactive(end)) {
+		waitsample(lock, end);
+
+		// get a register block from the simulator
+		unsigned short	r[53] = { 0 };
+		if (replaying()) {
+			capture_record	block = _replay->next(capture_modbus);
+			for (unsigned short i = 0; i < block.count(); i++) {
+				if (block.address() + i < 53) {
+					r[block.address() + i]
+						= block.registerat(i);
+				}
+			}
+		} else {
+			sim.ale3(r, _clock->now());
+			if (_capture) {
+				_capture->modbus(0, 0, 53, r);
+			}
+		}
+
+		// accumulate all fields
+		std::chrono::system_clock::time_point	now = sampletime();
+		std::chrono::duration<float>	delta(now - _previous);
+		_previous = now;
+		for (size_t i = 0; i < _fields.size(); i++) {
+			int	j = i % nregisters;
+			result.accumulate(delta, _sensorname + "." + _fields[i],
+				scales[j] * r[registers[j]]);
+		}
+	}
+
+	return closewindow();
+}
+
+/**
+ * \brief Convert the integrals of the window into averages
+ */
+void	simulated_meter::finalize(message& result, float factor) {
+	for (size_t i = 0; i < _fields.size(); i++) {
+		result.finalize(_sensorname + "." + _fields[i], factor);
+	}
+}
+
+} // namespace powermeter
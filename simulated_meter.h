@@ -0,0 +1,43 @@
+/*
+ * simulated_meter.h -- meter producing simulated data only
+ *
+ * (c) 2023 Prof Dr Andreas Müller
+ */
+#ifndef _simulated_meter_h
+#define _simulated_meter_h
+
+#include <meter.h>
+#include <message.h>
+#include <configuration.h>
+#include <simulator.h>
+#include <vector>
+#include <string>
+
+namespace powermeter {
+
+/**
+ * \brief A meter that integrates simulated ALE3 data
+ *
+ * The simulated meter needs no device at all. The field names are taken
+ * from the comma separated simfields variable, the simfieldcount variable
+ * limits or extends the number of fields, so that load tests can produce
+ * messages of arbitrary size.
+ */
+class simulated_meter : public meter {
+	std::string	_sensorname;
+	std::vector<std::string>	_fields;
+	simulator	sim;
+protected:
+	virtual message	integrate();
+	virtual void	finalize(message& result, float factor);
+public:
+	simulated_meter(const configuration& config, messagequeue& queue);
+	~simulated_meter();
+	const std::vector<std::string>&	fields() const { return _fields; }
+	static std::vector<std::string>	fieldnames(
+		const configuration& config);
+};
+
+} // namespace powermeter
+
+#endif /* _simulated_meter_h */
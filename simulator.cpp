@@ -4,6 +4,8 @@
 // (c) 2023 Prof Dr Andreas Müller
 //
 #include <simulator.h>
+#include <ale3_meter.h>
+#include <solivia_packet.h>
 #include <debug.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -11,13 +13,16 @@
 #include <cstring>
 #include <format.h>
 #include <stdexcept>
+#include <cmath>
+#include <boost/crc.hpp>
 
 namespace powermeter {
 
 //////////////////////////////////////////////////////////////////////
 // phase implementation
 //////////////////////////////////////////////////////////////////////
-phase::phase() : _start(std::chrono::system_clock::now()) {
+phase::phase(const std::chrono::system_clock::time_point& start,
+	unsigned int seed) : _start(start), generator(seed) {
 }
 
 phase::~phase() {
@@ -35,7 +40,8 @@ float	phase::prms(const std::chrono::system_clock::time_point& _t) {
 // phase1 implementation
 //////////////////////////////////////////////////////////////////////
 
-phase1::phase1() {
+phase1::phase1(const std::chrono::system_clock::time_point& start,
+	unsigned int seed) : phase(start, seed) {
 }
 
 float	phase1::urms(const std::chrono::system_clock::time_point& _t) {
@@ -67,7 +73,8 @@ float	phase2::squarewave(const std::chrono::system_clock::time_point& _t) const
 	return (s > l) ? 1 : -1;
 }
 
-phase2::phase2() {
+phase2::phase2(const std::chrono::system_clock::time_point& start,
+	unsigned int seed) : phase(start, seed) {
 }
 
 float	phase2::urms(const std::chrono::system_clock::time_point& _t) {
@@ -100,7 +107,8 @@ float	phase3::trianglewave(const std::chrono::system_clock::time_point& _t) cons
 	return result;
 }
 
-phase3::phase3() {
+phase3::phase3(const std::chrono::system_clock::time_point& start,
+	unsigned int seed) : phase(start, seed) {
 }
 
 float	phase3::urms(const std::chrono::system_clock::time_point& _t) {
@@ -123,17 +131,37 @@ float	phase3::cosphi(const std::chrono::system_clock::time_point& _t) {
 // simulator implementation
 //////////////////////////////////////////////////////////////////////
 
-simulator::simulator() {
-	int     fd = open("/dev/random", O_RDONLY);
-	int     rc = read(fd, _serial, sizeof(_serial));
-	if (rc < 0) {
-		std::string     msg = stringprintf("read "
-			"failed: %s", strerror(errno));
-		close(fd);
-		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
-		throw std::runtime_error(msg);
+/**
+ * \brief Construct a simulator
+ *
+ * All random numbers are derived from the seed, so two simulators
+ * constructed with the same start time and seed produce the same data.
+ *
+ * \param start	the time point where the simulated signals start
+ * \param seed		the seed for the random number generators
+ */
+simulator::simulator(const std::chrono::system_clock::time_point& start,
+	unsigned int seed)
+	: p1(start, seed + 1), p2(start, seed + 2), p3(start, seed + 3),
+	  _engine(seed) {
+	for (int i = 0; i < 3; i++) {
+		_serial[i] = _engine() & 0xffff;
 	}
-	close(fd);
+}
+
+/**
+ * \brief Get the seed for the simulator from the configuration
+ *
+ * Without a seed variable, a random seed is used.
+ *
+ * \param config	the configuration
+ */
+unsigned int	simulator::seed(const configuration& config) {
+	if (config.find("seed") != config.end()) {
+		return config.intvalue("seed");
+	}
+	std::random_device	rd;
+	return rd();
 }
 
 unsigned short	simulator::urms(float value) const {
@@ -229,4 +257,209 @@ unsigned short	simulator::qrms_total(std::chrono::system_clock::time_point _t) {
 	return qrms((1/3.) * (p1.qrms(_t) + p2.qrms(_t) + p3.qrms(_t)));
 }
 
+//////////////////////////////////////////////////////////////////////
+// register maps and packets for the emulators
+//////////////////////////////////////////////////////////////////////
+
+/**
+ * \brief Fill the ALE3 register map
+ *
+ * \param registers	an array of 53 registers
+ * \param t		the time point to simulate
+ */
+void	simulator::ale3(unsigned short *registers,
+		const std::chrono::system_clock::time_point& t) {
+	memset(registers, 0, 53 * sizeof(short));
+	registers[ALE3_FIRMWARE_VERSION] = 11;
+	registers[ALE3_NUMBER_OF_REGISTERS] = 52;
+	registers[ALE3_NUMBER_OF_FLAGS] = 0;
+	registers[ALE3_BAUDRATE_HIGH] = 1;
+	registers[ALE3_BAUDRATE_LOW] = 49664;
+	registers[ALE3_ASN1] = 0x414c; // AL
+	registers[ALE3_ASN2] = 0x4533; // E3
+	registers[ALE3_ASN3] = 0x4435; // D5
+	registers[ALE3_ASN4] = 0x4644; // FD
+	registers[ALE3_ASN5] = 0x3130; // 10
+	registers[ALE3_ASN6] = 0x4332; // C2
+	registers[ALE3_ASN7] = 0x4130; // A0
+	registers[ALE3_ASN8] = 0x3000; // 0
+	registers[ALE3_HW_VERSION] = 11;
+	registers[ALE3_SERIAL_LOW] = _serial[0];
+	registers[ALE3_SERIAL_HIGH] = _serial[1];
+	registers[ALE3_STATUS] = 0;
+	registers[ALE3_RESPONSE_TIMEOUT] = 0;
+	registers[ALE3_MODBUS_ADDRESS] = 47;
+	registers[ALE3_ERROR] = 0;
+	registers[ALE3_TARIFF] = 4;
+	registers[ALE3_TOTAL_TARIFF1_HIGH] = 13;
+	registers[ALE3_TOTAL_TARIFF1_LOW] = 60383;
+	registers[ALE3_PARTIAL_TARIFF1_HIGH] = 13;
+	registers[ALE3_PARTIAL_TARIFF1_LOW] = 60383;
+	registers[ALE3_TOTAL_TARIFF2_HIGH] = 13;
+	registers[ALE3_TOTAL_TARIFF2_LOW] = 60383;
+	registers[ALE3_PARTIAL_TARIFF2_HIGH] = 13;
+	registers[ALE3_PARTIAL_TARIFF2_LOW] = 60383;
+
+	registers[ALE3_URMS_PHASE1] = urms_phase1(t);
+	registers[ALE3_IRMS_PHASE1] = irms_phase1(t);
+	registers[ALE3_PRMS_PHASE1] = prms_phase1(t);
+	registers[ALE3_QRMS_PHASE1] = qrms_phase1(t);
+	registers[ALE3_COSPHI_PHASE1] = cosphi_phase1(t);
+
+	registers[ALE3_URMS_PHASE2] = urms_phase2(t);
+	registers[ALE3_IRMS_PHASE2] = irms_phase2(t);
+	registers[ALE3_PRMS_PHASE2] = prms_phase2(t);
+	registers[ALE3_QRMS_PHASE2] = qrms_phase2(t);
+	registers[ALE3_COSPHI_PHASE2] = cosphi_phase2(t);
+
+	registers[ALE3_URMS_PHASE3] = urms_phase3(t);
+	registers[ALE3_IRMS_PHASE3] = irms_phase3(t);
+	registers[ALE3_PRMS_PHASE3] = prms_phase3(t);
+	registers[ALE3_QRMS_PHASE3] = qrms_phase3(t);
+	registers[ALE3_COSPHI_PHASE3] = cosphi_phase3(t);
+
+	registers[ALE3_PRMS_TOTAL] = prms_total(t);
+	registers[ALE3_QRMS_TOTAL] = qrms_total(t);
+}
+
+/**
+ * \brief Simulated PV power
+ *
+ * The PV power follows the sun from 6 to 18 o'clock UTC.
+ *
+ * \param t	the time point to simulate
+ */
+float	simulator::pv(const std::chrono::system_clock::time_point& t) {
+	long	seconds = std::chrono::duration_cast<std::chrono::seconds>(
+			t.time_since_epoch()).count() % 86400;
+	float	h = seconds / 3600.;
+	if ((h < 6) || (h > 18)) {
+		return 0;
+	}
+	return 3000 * sin(M_PI * (h - 6) / 12);
+}
+
+/**
+ * \brief Get a register of the CCGX-style register map
+ *
+ * The addresses are those of the Victron CCGX Modbus TCP register list,
+ * as used in etc/salidomo.csv: PV power, consumption and grid power per
+ * phase, battery power and state of charge.
+ *
+ * \param address	the register address
+ * \param t		the time point to simulate
+ */
+unsigned short	simulator::ccgx(unsigned short address,
+		const std::chrono::system_clock::time_point& t) {
+	switch (address) {
+	case 811:
+	case 812:
+	case 813:
+		return (unsigned short)(pv(t) / 3);
+	case 817:
+		return (unsigned short)p1.prms(t);
+	case 818:
+		return (unsigned short)p2.prms(t);
+	case 819:
+		return (unsigned short)p3.prms(t);
+	case 820:
+		return (unsigned short)(short)(p1.prms(t) - pv(t) / 3);
+	case 821:
+		return (unsigned short)(short)(p2.prms(t) - pv(t) / 3);
+	case 822:
+		return (unsigned short)(short)(p3.prms(t) - pv(t) / 3);
+	case 842:
+		return (unsigned short)(short)(0.2 * (pv(t) - p1.prms(t)
+			- p2.prms(t) - p3.prms(t)));
+	case 843:
+		return (unsigned short)(50 + 30 * sin(2 * M_PI * std::chrono::
+			duration<double>(t.time_since_epoch()).count() / 86400));
+	default:
+		return 0;
+	}
+}
+
+static void	putshort(unsigned char *p, unsigned short value) {
+	p[0] = (value >> 8) & 0xff;
+	p[1] = value & 0xff;
+}
+
+static void	putlong(unsigned char *p, unsigned long value) {
+	for (int i = 3; i >= 0; i--) {
+		p[i] = value & 0xff;
+		value >>= 8;
+	}
+}
+
+/**
+ * \brief Construct a Solivia response packet
+ *
+ * The packet has the layout decoded by solivia_packet, including a
+ * correct CRC.
+ *
+ * \param packet	a buffer of solivia_packet::packetsize bytes
+ * \param id		the inverter id
+ * \param t		the time point to simulate
+ */
+void	simulator::solivia(unsigned char *packet, unsigned char id,
+		const std::chrono::system_clock::time_point& t) {
+	const size_t	packetsize = solivia_packet::packetsize;
+	memset(packet, 0, packetsize);
+	packet[0] = 0x02;
+	packet[1] = 0x06;
+	packet[2] = id;
+	packet[3] = packetsize - 6;
+	putshort(packet + 4, 0x6001);
+	memcpy(packet + solivia_packet::partoffset, "EOE46010287", 11);
+	std::string	serial = stringprintf("%04hx%04hx%04hx",
+		_serial[0], _serial[1], _serial[2]);
+	memcpy(packet + solivia_packet::serialoffset, serial.c_str(),
+		serial.size());
+	packet[solivia_packet::version] = 1;
+	packet[solivia_packet::version + 4] = 1;
+	packet[solivia_packet::version + 8] = 1;
+
+	// AC side, one phase of the simulator per phase of the inverter
+	phase	*phases[3] = { &p1, &p2, &p3 };
+	size_t	offsets[3] = { solivia_packet::phase1, solivia_packet::phase2,
+				solivia_packet::phase3 };
+	float	acpower = 0;
+	for (int i = 0; i < 3; i++) {
+		float	u = phases[i]->urms(t);
+		float	power = pv(t) / 3;
+		acpower += power;
+		putshort(packet + offsets[i], u / 0.1);
+		putshort(packet + offsets[i] + 2, (power / u) / 0.01);
+		putshort(packet + offsets[i] + 4, power);
+		putshort(packet + offsets[i] + 6, (50 + 0.01 * noise()) / 0.01);
+	}
+
+	// DC side, two strings sharing the power
+	float	dcpower = acpower / 0.96;
+	size_t	strings[2] = { solivia_packet::string1, solivia_packet::string2 };
+	for (int i = 0; i < 2; i++) {
+		float	u = (dcpower > 0) ? 600 + 5 * noise() : 0;
+		float	power = dcpower / 2;
+		putshort(packet + strings[i], u / 0.1);
+		putshort(packet + strings[i] + 2,
+			(u > 0) ? (power / u) / 0.01 : 0);
+		putshort(packet + strings[i] + 4, power);
+	}
+
+	// inverter data
+	double	seconds = std::chrono::duration<double>(
+		t.time_since_epoch()).count();
+	putshort(packet + solivia_packet::inverter, acpower);
+	putlong(packet + solivia_packet::inverter + 6, acpower / 4);
+	putlong(packet + solivia_packet::inverter + 10, seconds / 3600);
+	putlong(packet + solivia_packet::inverter + 14, seconds / 360);
+	putshort(packet + solivia_packet::inverter + 22, 25 + acpower / 200);
+
+	// checksum and trailer
+	boost::crc_16_type	crc;
+	crc.process_bytes(packet + 1, packetsize - 4);
+	putshort(packet + packetsize - 3, crc.checksum());
+	packet[packetsize - 1] = 0x03;
+}
+
 } // namespace powermeter
@@ -8,6 +8,7 @@
 
 #include <chrono>
 #include <random>
+#include <configuration.h>
 
 namespace powermeter {
 
@@ -21,7 +22,8 @@ private:
 protected:
 	float	random() { return distribution(generator); }
 public:
-	phase();
+	phase(const std::chrono::system_clock::time_point& start,
+		unsigned int seed);
 	virtual ~phase();
 	virtual float	urms(const std::chrono::system_clock::time_point&) = 0;
 	virtual float	irms(const std::chrono::system_clock::time_point&) = 0;
@@ -32,7 +34,8 @@ public:
 
 class phase1 : public phase {
 public:
-	phase1();
+	phase1(const std::chrono::system_clock::time_point& start,
+		unsigned int seed);
 	float	urms(const std::chrono::system_clock::time_point&);
 	float	irms(const std::chrono::system_clock::time_point&);
 	float	qrms(const std::chrono::system_clock::time_point&);
@@ -43,7 +46,8 @@ class phase2 : public phase {
 	static float	period;
 	float	squarewave(const std::chrono::system_clock::time_point&) const;
 public:
-	phase2();
+	phase2(const std::chrono::system_clock::time_point& start,
+		unsigned int seed);
 	float	urms(const std::chrono::system_clock::time_point&);
 	float	irms(const std::chrono::system_clock::time_point&);
 	float	qrms(const std::chrono::system_clock::time_point&);
@@ -54,7 +58,8 @@ class phase3 : public phase {
 	static float	period;
 	float	trianglewave(const std::chrono::system_clock::time_point&) const;
 public:
-	phase3();
+	phase3(const std::chrono::system_clock::time_point& start,
+		unsigned int seed);
 	float	urms(const std::chrono::system_clock::time_point&);
 	float	irms(const std::chrono::system_clock::time_point&);
 	float	qrms(const std::chrono::system_clock::time_point&);
@@ -66,31 +71,44 @@ class simulator {
 	phase1	p1;
 	phase2	p2;
 	phase3	p3;
+	std::mt19937	_engine;
+	std::normal_distribution<float>	_noise;
+	float	noise() { return _noise(_engine); }
+	float	pv(const std::chrono::system_clock::time_point& t);
 	unsigned short	urms(float) const;
 	unsigned short	irms(float) const;
 	unsigned short	prms(float) const;
 	unsigned short	qrms(float) const;
 	unsigned short	cosphi(float) const;
 public:
-	simulator();
-	unsigned short	urms_phase1(const std::chrono::system_clock::time_point _t = std::chrono::system_clock::now());
-	unsigned short	urms_phase2(const std::chrono::system_clock::time_point _t = std::chrono::system_clock::now());
-	unsigned short	urms_phase3(const std::chrono::system_clock::time_point _t = std::chrono::system_clock::now());
-	unsigned short	irms_phase1(const std::chrono::system_clock::time_point _t = std::chrono::system_clock::now());
-	unsigned short	irms_phase2(const std::chrono::system_clock::time_point _t = std::chrono::system_clock::now());
-	unsigned short	irms_phase3(const std::chrono::system_clock::time_point _t = std::chrono::system_clock::now());
-	unsigned short	prms_phase1(const std::chrono::system_clock::time_point _t = std::chrono::system_clock::now());
-	unsigned short	prms_phase2(const std::chrono::system_clock::time_point _t = std::chrono::system_clock::now());
-	unsigned short	prms_phase3(const std::chrono::system_clock::time_point _t = std::chrono::system_clock::now());
-	unsigned short	qrms_phase1(const std::chrono::system_clock::time_point _t = std::chrono::system_clock::now());
-	unsigned short	qrms_phase2(const std::chrono::system_clock::time_point _t = std::chrono::system_clock::now());
-	unsigned short	qrms_phase3(const std::chrono::system_clock::time_point _t = std::chrono::system_clock::now());
-	unsigned short	cosphi_phase1(const std::chrono::system_clock::time_point _t = std::chrono::system_clock::now());
-	unsigned short	cosphi_phase2(const std::chrono::system_clock::time_point _t = std::chrono::system_clock::now());
-	unsigned short	cosphi_phase3(const std::chrono::system_clock::time_point _t = std::chrono::system_clock::now());
-	unsigned short	prms_total(const std::chrono::system_clock::time_point _t = std::chrono::system_clock::now());
-	unsigned short	qrms_total(const std::chrono::system_clock::time_point _t = std::chrono::system_clock::now());
+	simulator(const std::chrono::system_clock::time_point& start,
+		unsigned int seed);
+	static unsigned int	seed(const configuration& config);
+	unsigned short	urms_phase1(const std::chrono::system_clock::time_point _t);
+	unsigned short	urms_phase2(const std::chrono::system_clock::time_point _t);
+	unsigned short	urms_phase3(const std::chrono::system_clock::time_point _t);
+	unsigned short	irms_phase1(const std::chrono::system_clock::time_point _t);
+	unsigned short	irms_phase2(const std::chrono::system_clock::time_point _t);
+	unsigned short	irms_phase3(const std::chrono::system_clock::time_point _t);
+	unsigned short	prms_phase1(const std::chrono::system_clock::time_point _t);
+	unsigned short	prms_phase2(const std::chrono::system_clock::time_point _t);
+	unsigned short	prms_phase3(const std::chrono::system_clock::time_point _t);
+	unsigned short	qrms_phase1(const std::chrono::system_clock::time_point _t);
+	unsigned short	qrms_phase2(const std::chrono::system_clock::time_point _t);
+	unsigned short	qrms_phase3(const std::chrono::system_clock::time_point _t);
+	unsigned short	cosphi_phase1(const std::chrono::system_clock::time_point _t);
+	unsigned short	cosphi_phase2(const std::chrono::system_clock::time_point _t);
+	unsigned short	cosphi_phase3(const std::chrono::system_clock::time_point _t);
+	unsigned short	prms_total(const std::chrono::system_clock::time_point _t);
+	unsigned short	qrms_total(const std::chrono::system_clock::time_point _t);
 	const unsigned short	*serial() const { return _serial; }
+	// register maps and packets for the emulators
+	void	ale3(unsigned short *registers,
+			const std::chrono::system_clock::time_point& t);
+	unsigned short	ccgx(unsigned short address,
+			const std::chrono::system_clock::time_point& t);
+	void	solivia(unsigned char *packet, unsigned char id,
+			const std::chrono::system_clock::time_point& t);
 };
 
 } // namespace powermeter
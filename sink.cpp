@@ -0,0 +1,60 @@
+//
+// sink.cpp
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <sink.h>
+
+namespace powermeter {
+
+sink::~sink() {
+}
+
+void	sink::start() {
+}
+
+/**
+ * \brief Note a message accepted by the sink queue, the default ignores it
+ */
+void	sink::accept(const message& /* m */) {
+}
+
+/**
+ * \brief Store a batch of messages one at a time
+ *
+ * If the previous call failed on the same batch, the messages it has
+ * already stored are skipped. The first message is kept as a shared
+ * pointer, so it cannot be mistaken for a new message at the same
+ * address.
+ *
+ * \param messages	the messages to store
+ */
+void	sink::storebatch(const std::vector<message_ptr>& messages) {
+	size_t	start = stored(messages);
+	_first = (messages.size() > 0) ? messages.front() : message_ptr();
+	for (_stored = start; _stored < messages.size(); _stored++) {
+		store(*messages[_stored]);
+	}
+	_first.reset();
+	_stored = 0;
+}
+
+/**
+ * \brief Number of messages of a batch already stored by a failed call
+ *
+ * \param messages	the batch
+ */
+size_t	sink::stored(const std::vector<message_ptr>& messages) const {
+	if ((messages.size() > _stored) && (messages.front() == _first)) {
+		return _stored;
+	}
+	return 0;
+}
+
+/**
+ * \brief Interrupt a stuck store, the default cannot do anything
+ */
+void	sink::interrupt() {
+}
+
+} // namespace powermeter
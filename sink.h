@@ -0,0 +1,77 @@
+//
+// sink.h -- destinations for the messages produced by the meters
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _sink_h
+#define _sink_h
+
+#include <message.h>
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+
+namespace powermeter {
+
+typedef std::shared_ptr<const message>	message_ptr;
+
+/**
+ * \brief Exception thrown by a sink whose destination is unreachable
+ *
+ * Unlike other failures this does not say anything about the messages,
+ * so the sink queue keeps retrying them until the destination is back.
+ */
+class sinkunavailable : public std::runtime_error {
+public:
+	sinkunavailable(const std::string& what) : std::runtime_error(what) { }
+};
+
+/**
+ * \brief Abstract destination for messages
+ *
+ * A sink stores messages somewhere. The store method is called from
+ * the consumer thread only, so implementations need no locking. A
+ * sink signals failure to store a message by throwing an exception.
+ *
+ * The start method is called in the thread of the sink queue before
+ * the first message, so that slow setup work like connecting to a
+ * server does not hold up the start of the daemon.
+ *
+ * Sinks that can store several messages more cheaply than one at a
+ * time override storebatch, which has to store either all messages
+ * or, when it throws, none of them. The default storebatch stores the
+ * messages one at a time. When a message fails, it remembers how far
+ * it got, and the retry of the same batch resumes with the failed
+ * message, so that no message is stored twice, and stored tells how
+ * many messages at the front of a failed batch are already stored.
+ *
+ * The accept method is called once for every message when the sink
+ * queue accepts it, in the thread of the dispatcher and before the
+ * message is stored. Sinks that keep a local record of the messages
+ * override it, implementations must be thread safe.
+ *
+ * The interrupt method is called from another thread when the sink
+ * queue has been stuck in store for too long. Sinks that wait on a
+ * connection override it to make the pending call fail.
+ */
+class sink {
+	std::string	_name;
+	// progress of the default storebatch in a batch that failed
+	message_ptr	_first;
+	size_t	_stored;
+public:
+	sink(const std::string& name) : _name(name), _stored(0) { }
+	virtual ~sink();
+	const std::string&	name() const { return _name; }
+	virtual void	start();
+	virtual void	accept(const message& m);
+	virtual void	store(const message& m) = 0;
+	virtual void	storebatch(const std::vector<message_ptr>& messages);
+	size_t	stored(const std::vector<message_ptr>& messages) const;
+	virtual void	interrupt();
+};
+
+} // namespace powermeter
+
+#endif /* _sink_h */
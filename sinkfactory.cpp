@@ -0,0 +1,70 @@
+//
+// sinkfactory.cpp
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <sinkfactory.h>
+#include <database.h>
+#include <asyncdb_sink.h>
+#include <file_sink.h>
+#include <archive_sink.h>
+#include <tsarchive_sink.h>
+#include <hotcache_sink.h>
+#include <format.h>
+#include <debug.h>
+#include <sstream>
+
+namespace powermeter {
+
+std::shared_ptr<sink>	sinkfactory::get(const std::string& sinktypename) {
+	if (sinktypename == "mysql") {
+		return std::shared_ptr<sink>(new database(_config));
+	}
+	if (sinktypename == "asyncmysql") {
+		return std::shared_ptr<sink>(new asyncdb_sink(_config));
+	}
+	if (sinktypename == "file") {
+		return std::shared_ptr<sink>(new file_sink(_config));
+	}
+	if (sinktypename == "archive") {
+		return std::shared_ptr<sink>(new archive_sink(_config));
+	}
+	if (sinktypename == "tsarchive") {
+		return std::shared_ptr<sink>(new tsarchive_sink(_config));
+	}
+	if (sinktypename == "hotcache") {
+		return std::shared_ptr<sink>(new hotcache_sink(_config));
+	}
+	std::string	msg = stringprintf("unknown sink type: %s",
+		sinktypename.c_str());
+	debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+	throw std::runtime_error(msg);
+}
+
+/**
+ * \brief Create all sinks listed in the sinks variable
+ *
+ * The sinks variable is a comma separated list of sink types, the
+ * default is the MySQL database only.
+ */
+std::vector<std::shared_ptr<sink> >	sinkfactory::sinks() {
+	std::vector<std::shared_ptr<sink> >	result;
+	std::istringstream	in(_config.stringvalue("sinks", "mysql"));
+	std::string	sinktypename;
+	while (std::getline(in, sinktypename, ',')) {
+		if (sinktypename.size() == 0) {
+			continue;
+		}
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "creating sink %s",
+			sinktypename.c_str());
+		result.push_back(get(sinktypename));
+	}
+	if (result.size() == 0) {
+		std::string	msg("no sinks configured");
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	return result;
+}
+
+} // namespace powermeter
@@ -0,0 +1,26 @@
+//
+// sinkfactory.h
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _sinkfactory_h
+#define _sinkfactory_h
+
+#include <sink.h>
+#include <configuration.h>
+#include <memory>
+#include <vector>
+
+namespace powermeter {
+
+class sinkfactory {
+	const configuration&	_config;
+public:
+	sinkfactory(const configuration& config) : _config(config) { }
+	std::shared_ptr<sink>	get(const std::string& sinktypename);
+	std::vector<std::shared_ptr<sink> >	sinks();
+};
+
+} // namespace powermeter
+
+#endif /* _sinkfactory_h */
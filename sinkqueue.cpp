@@ -0,0 +1,303 @@
+//
+// sinkqueue.cpp
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <sinkqueue.h>
+#include <debug.h>
+#include <format.h>
+#include <algorithm>
+
+namespace powermeter {
+
+/**
+ * \brief Create the queue and start the thread for a sink
+ *
+ * \param config	configuration containing the queue and retry parameters
+ * \param s		the sink to feed
+ */
+sinkqueue::sinkqueue(const configuration& config, std::shared_ptr<sink> s)
+	: _sink(s),
+	  _capacity(config.intvalue(s->name() + "queuesize",
+		config.intvalue("sinkqueuesize", 1000))),
+	  _retries(config.intvalue(s->name() + "retries",
+		config.intvalue("sinkretries", 3))),
+	  _retrydelay(config.floatvalue(s->name() + "retrydelay",
+		config.floatvalue("sinkretrydelay", 1))),
+	  _retrymax(config.floatvalue(s->name() + "retrymax",
+		config.floatvalue("sinkretrymax", 60))),
+	  _engine(std::random_device()()),
+	  _commitrows(config.intvalue(s->name() + "commitrows",
+		config.intvalue("commitrows", 1000))),
+	  _commitlatency(config.floatvalue(s->name() + "commitlatency",
+		config.floatvalue("commitlatency", 0))),
+	  _lag({ 0, 0, 0, 0, 0, 0, 0, 0 }), _active(true),
+	  _draining(false), _pending(0) {
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "sink %s: queue size %lu, %d retries, "
+		"%lu rows per commit", name().c_str(), _capacity, _retries,
+		_commitrows);
+	_running = true;
+	_thread = std::thread(sinkqueue::launch, this);
+}
+
+/**
+ * \brief Stop the thread, messages still in the queue are lost
+ */
+sinkqueue::~sinkqueue() {
+	{
+		std::unique_lock<std::mutex>	lock(_mutex);
+		_active = false;
+		_signal.notify_all();
+	}
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+	if (_messages.size() > 0) {
+		debug(LOG_WARNING, DEBUG_LOG, 0, "sink %s: %lu messages not "
+			"stored", name().c_str(), _messages.size());
+	}
+}
+
+/**
+ * \brief Add a message to the queue
+ *
+ * This never blocks, if the queue is full, the oldest message is dropped.
+ *
+ * \param m	the message to add
+ */
+void	sinkqueue::submit(message_ptr m) {
+	try {
+		_sink->accept(*m);
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "sink %s does not accept the "
+			"message: %s", name().c_str(), x.what());
+	}
+	std::unique_lock<std::mutex>	lock(_mutex);
+	if (_messages.size() >= _capacity) {
+		_messages.pop_front();
+		_lag.dropped++;
+		debug(LOG_WARNING, DEBUG_LOG, 0, "sink %s: queue full, "
+			"oldest message dropped", name().c_str());
+	}
+	_messages.push_back(m);
+	_signal.notify_all();
+}
+
+/**
+ * \brief Get the current state of the queue
+ */
+sinklag	sinkqueue::lag() {
+	std::unique_lock<std::mutex>	lock(_mutex);
+	sinklag	result = _lag;
+	result.queued = _messages.size();
+	result.age = 0;
+	if (_messages.size() > 0) {
+		std::chrono::duration<float>	age
+			= std::chrono::steady_clock::now()
+				- _messages.front()->submitted();
+		result.age = age.count();
+	}
+	return result;
+}
+
+/**
+ * \brief Wait until all messages are stored
+ *
+ * \param deadline	when to give up waiting
+ * \return		whether the queue is empty
+ */
+bool	sinkqueue::drain(
+		const std::chrono::steady_clock::time_point& deadline) {
+	std::unique_lock<std::mutex>	lock(_mutex);
+	_draining = true;
+	_signal.notify_all();
+	bool	drained = _signal.wait_until(lock, deadline, [this]() {
+			return (_messages.size() == 0) && (_pending == 0);
+		});
+	if (!drained) {
+		debug(LOG_WARNING, DEBUG_LOG, 0, "sink %s: %lu messages not "
+			"drained in time", name().c_str(),
+			_messages.size() + _pending);
+	}
+	return drained;
+}
+
+void	sinkqueue::launch(sinkqueue *q) {
+	try {
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "launch sink %s thread",
+			q->name().c_str());
+		q->_sink->start();
+		q->run();
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "sink %s thread terminates",
+			q->name().c_str());
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "sink %s thread fails with "
+			"exception %s", q->name().c_str(), x.what());
+	} catch (...) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "sink %s thread fails",
+			q->name().c_str());
+	}
+	q->_running = false;
+}
+
+/**
+ * \brief Get a stalled sink going again
+ *
+ * If the thread is still running, it hangs in the sink, which is asked
+ * to interrupt the pending store. If the thread has died, a new one is
+ * started.
+ */
+void	sinkqueue::restart() {
+	if (_running) {
+		_sink->interrupt();
+		return;
+	}
+	if (_thread.joinable()) {
+		_thread.join();
+	}
+	std::unique_lock<std::mutex>	lock(_mutex);
+	if (!_active) {
+		return;
+	}
+	debug(LOG_WARNING, DEBUG_LOG, 0, "sink %s: starting a new thread",
+		name().c_str());
+	_running = true;
+	_thread = std::thread(sinkqueue::launch, this);
+}
+
+/**
+ * \brief Store a batch, retrying according to the retry policy
+ *
+ * \param batch	the messages to store
+ * \param retries	how often to retry a failed batch
+ * \return		whether the batch was stored
+ */
+bool	sinkqueue::store(const std::vector<message_ptr>& batch, int retries) {
+	std::chrono::duration<float>	delay = _retrydelay;
+	std::uniform_real_distribution<float>	jitter(0.75, 1.25);
+	int	attempt = 0;
+	while (1) {
+		try {
+			_sink->storebatch(batch);
+			_alive.beat();
+			return true;
+		} catch (const sinkunavailable& x) {
+			_alive.beat();
+			// does not count as an attempt, wait for the destination
+			debug(LOG_ERR, DEBUG_LOG, 0, "sink %s unavailable, retry "
+				"in %.1fs: %s", name().c_str(), delay.count(),
+				x.what());
+		} catch (const std::exception& x) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "sink %s cannot store "
+				"%lu messages (attempt %d): %s", name().c_str(),
+				batch.size(), attempt + 1, x.what());
+			_alive.beat();
+			if (attempt++ >= retries) {
+				return false;
+			}
+		}
+		std::unique_lock<std::mutex>	lock(_mutex);
+		_signal.wait_for(lock, delay * jitter(_engine),
+			[this]() { return !_active; });
+		if (!_active) {
+			return false;
+		}
+		delay = std::min(2 * delay, _retrymax);
+	}
+}
+
+/**
+ * \brief Store the messages of a failed batch one at a time
+ *
+ * \param batch	the messages to store
+ * \return		the number of messages that could not be stored
+ */
+size_t	sinkqueue::storesingly(const std::vector<message_ptr>& batch) {
+	debug(LOG_WARNING, DEBUG_LOG, 0, "sink %s: storing %lu messages "
+		"one at a time", name().c_str(), batch.size());
+	size_t	failed = 0;
+	for (auto m = batch.begin() + _sink->stored(batch); m != batch.end();
+		m++) {
+		if (!store(std::vector<message_ptr>(1, *m), 0)) {
+			failed++;
+		}
+	}
+	if (failed > 0) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "sink %s: %lu of %lu messages "
+			"discarded", name().c_str(), failed, batch.size());
+	}
+	return failed;
+}
+
+void	sinkqueue::run() {
+	std::unique_lock<std::mutex>	lock(_mutex);
+	std::vector<message_ptr>	batch;
+	size_t	rows = 0;
+	std::chrono::steady_clock::time_point	deadline;
+	while (_active) {
+		// collect the waiting messages up to the row budget
+		while ((_messages.size() > 0) && (rows < _commitrows)) {
+			if (batch.size() == 0) {
+				deadline = std::chrono::steady_clock::now()
+					+ std::chrono::duration_cast<
+					std::chrono::steady_clock::duration>(
+						_commitlatency);
+			}
+			rows += _messages.front()->size();
+			batch.push_back(_messages.front());
+			_messages.pop_front();
+		}
+		_pending = batch.size();
+		if (batch.size() == 0) {
+			_alive.idle();
+			_signal.wait(lock);
+			_alive.beat();
+			continue;
+		}
+
+		// keep the batch open until the latency budget is used up
+		if ((rows < _commitrows) && (!_draining)
+			&& (std::chrono::steady_clock::now() < deadline)) {
+			_signal.wait_until(lock, deadline);
+			continue;
+		}
+
+		// the sink is accessed without the lock
+		lock.unlock();
+		std::chrono::steady_clock::time_point	start
+			= std::chrono::steady_clock::now();
+		bool	stored = store(batch, _retries);
+		std::chrono::duration<float>	committime
+			= std::chrono::steady_clock::now() - start;
+		size_t	n = batch.size();
+		size_t	failed = 0;
+		if ((!stored) && (n > 1)) {
+			failed = storesingly(batch);
+		} else if (!stored) {
+			failed = n;
+		}
+		batch.clear();
+		lock.lock();
+		if (stored) {
+			_lag.stored += n;
+			_lag.commits++;
+			_lag.committedrows += rows;
+			_lag.committime += committime.count();
+			debug(LOG_DEBUG, DEBUG_LOG, 0, "sink %s: %lu messages, "
+				"%lu rows committed in %.3fs", name().c_str(),
+				n, rows, committime.count());
+		} else {
+			_lag.stored += n - failed;
+			_lag.failed += failed;
+		}
+		rows = 0;
+		_pending = 0;
+		_signal.notify_all();
+	}
+
+	// an open batch counts as not stored
+	_messages.insert(_messages.begin(), batch.begin(), batch.end());
+	_alive.idle();
+}
+
+} // namespace powermeter
@@ -0,0 +1,105 @@
+//
+// sinkqueue.h -- bounded queue and consumer thread for a single sink
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _sinkqueue_h
+#define _sinkqueue_h
+
+#include <sink.h>
+#include <configuration.h>
+#include <supervisor.h>
+#include <memory>
+#include <atomic>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <random>
+
+namespace powermeter {
+
+/**
+ * \brief State of a sink queue
+ */
+struct sinklag {
+	size_t	queued;		// messages waiting in the queue
+	float	age;		// seconds since the oldest waiting message
+				// was submitted by the meter
+	size_t	stored;		// messages stored successfully
+	size_t	dropped;	// messages dropped because the queue was full
+	size_t	failed;		// messages given up after all retries
+	size_t	commits;	// batches stored successfully
+	size_t	committedrows;	// rows in these batches
+	float	committime;	// seconds spent storing these batches
+};
+
+/**
+ * \brief Queue and thread feeding one sink
+ *
+ * Each sink gets its own queue so that a slow sink cannot stall the
+ * others. The queue holds at most <sink>queuesize messages (default
+ * sinkqueuesize, 1000), when it is full the oldest message is dropped.
+ * A message that cannot be stored is retried <sink>retries times
+ * (default sinkretries, 3), the delay starts at <sink>retrydelay
+ * seconds (default sinkretrydelay, 1) and doubles with each retry.
+ * While the sink reports that its destination is unavailable, the
+ * message is retried without limit, the delay doubling up to
+ * <sink>retrymax seconds (default sinkretrymax, 60) with a random
+ * jitter of +-25%, so the messages stay in the queue until the
+ * destination is back.
+ *
+ * All messages waiting in the queue are handed to the sink as a single
+ * batch, which the database sink commits as one transaction. A batch
+ * is closed when it reaches <sink>commitrows rows (default commitrows,
+ * 1000), and it is kept open for up to <sink>commitlatency seconds
+ * (default commitlatency, 0) after its first message to collect more.
+ * If a batch still fails after all retries, its messages are stored
+ * one at a time without further retries, so that a single bad message
+ * does not take the good messages of its batch with it.
+ *
+ * The thread beats its heartbeat after every attempt to store a batch
+ * and is idle while the queue is empty. A restart interrupts a store
+ * that hangs in the sink, or starts a new thread if the thread died.
+ *
+ * At shutdown, drain stores the batches that are still waiting without
+ * holding them back for the commit latency, and waits until the queue
+ * is empty or the deadline has passed.
+ */
+class sinkqueue {
+	std::shared_ptr<sink>	_sink;
+	size_t	_capacity;
+	int	_retries;
+	std::chrono::duration<float>	_retrydelay;
+	std::chrono::duration<float>	_retrymax;
+	std::mt19937	_engine;
+	size_t	_commitrows;
+	std::chrono::duration<float>	_commitlatency;
+	std::deque<message_ptr>	_messages;
+	sinklag	_lag;
+	bool	_active;
+	bool	_draining;
+	size_t	_pending;
+	std::mutex	_mutex;
+	std::condition_variable	_signal;
+	std::thread	_thread;
+	std::atomic<bool>	_running;
+	heartbeat	_alive;
+	bool	store(const std::vector<message_ptr>& batch, int retries);
+	size_t	storesingly(const std::vector<message_ptr>& batch);
+public:
+	sinkqueue(const configuration& config, std::shared_ptr<sink> s);
+	~sinkqueue();
+	const std::string&	name() const { return _sink->name(); }
+	void	submit(message_ptr m);
+	sinklag	lag();
+	heartbeat&	alive() { return _alive; }
+	void	restart();
+	bool	drain(const std::chrono::steady_clock::time_point& deadline);
+	static void	launch(sinkqueue *q);
+	void	run();
+};
+
+} // namespace powermeter
+
+#endif /* _sinkqueue_h */
@@ -0,0 +1,28 @@
+--
+-- solivia-views-wide.sql -- the views of solivia-views.sql for stations
+--                           using the wide sdata layout
+--
+-- (c) 2023 Prof Dr Andreas Müller
+--
+
+create view gridpower as
+select d.timekey, s.stationid, sum(d.power) as 'power'
+from sdatawide d, sensor s
+where d.sensorid = s.id
+  and s.name like 'phase%'
+group by d.timekey, s.stationid;
+
+create view solarpower as
+select d.timekey, s.stationid, sum(d.power) as 'power'
+from sdatawide d, sensor s
+where d.sensorid = s.id
+  and s.name like 'string%'
+group by d.timekey, s.stationid;
+
+create view power as
+select g.timekey, g.stationid,
+       g.power as gridpower, s.power as solarpower,
+       g.power / s.power as efficiency
+from gridpower g, solarpower s
+where g.timekey = s.timekey
+  and g.stationid = s.stationid;
@@ -13,11 +13,14 @@
 #include <arpa/inet.h>
 #include <debug.h>
 #include <format.h>
+#include <metrics.h>
+#include <flightrecorder.h>
 #include <cerrno>
 #include <cstring>
 #include <fcntl.h>
 #include <unistd.h>
 #include <chrono>
+#include <algorithm>
 #include <boost/crc.hpp>
 
 namespace powermeter {
@@ -30,11 +33,64 @@ namespace powermeter {
  */
 solivia_meter::solivia_meter(const configuration& config, messagequeue& queue)
 	: meter(config, queue),
+	  _hostname(config.stringvalue("meterhostname", "")),
 	  _receive_port(config.intvalue("listenport")),
 	  _send_port(config.intvalue("meterport")),
 	  _id(config.intvalue("meterid")),
 	  _passive(config.boolvalue("meterpassive")),
 	  _request { 0x02, 0x05, _id, 0x02, 0x60, 0x01, 0x85, 0xfc, 0x03 } {
+	// set up the network sockets unless we replay a capture
+	_receive_fd = -1;
+	_send_fd = -1;
+	if (!replaying()) {
+		setupsockets();
+	}
+
+	// compute the solivia checksum
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "compute the request CRC");
+	boost::crc_16_type	crc;
+	crc.process_bytes(_request + 1, 5);
+	unsigned short	c = crc.checksum();
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "crc: %04x", c);
+	_request[6] = (c & 0xff);
+	_request[7] = (c >> 8) & 0xff;
+	if (debug_enabled(LOG_DEBUG)) {
+		char	p[3 * sizeof(_request) + 1] = "";
+		for (unsigned int i = 0; i < sizeof(_request); i++) {
+			snprintf(p + 3 * i, 4, " %02x", _request[i]);
+		}
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "request packet:%s", p);
+	}
+
+	// start the thread
+	startthread();
+}
+
+/**
+ * \brief Names of the values in the messages of the inverter
+ */
+std::vector<std::string>	solivia_meter::fieldnames(
+		const configuration& /* config */) {
+	static const char	*names[] = {
+		"phase1.voltage", "phase1.current", "phase1.power",
+		"phase1.frequency",
+		"phase2.voltage", "phase2.current", "phase2.power",
+		"phase2.frequency",
+		"phase3.voltage", "phase3.current", "phase3.power",
+		"phase3.frequency",
+		"string1.voltage", "string1.current", "string1.power",
+		"string2.voltage", "string2.current", "string2.power",
+		"inverter.power", "inverter.feedtime", "inverter.energy",
+		"inverter.temperature"
+	};
+	return std::vector<std::string>(names,
+		names + sizeof(names) / sizeof(names[0]));
+}
+
+/**
+ * \brief Create the sockets to talk to the inverter
+ */
+void	solivia_meter::setupsockets() {
 	// create the listen port
 	_receive_fd = socket(PF_INET, SOCK_DGRAM, 0);
 	if (_receive_fd < 0) {
@@ -68,13 +124,12 @@ solivia_meter::solivia_meter(const configuration& config, messagequeue& queue)
 	}
 
 	// get the host name
-	std::string	hostname = config.stringvalue("meterhostname");
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "meter hostname: %s",
-		hostname.c_str());
-	struct hostent	*hp = gethostbyname(hostname.c_str());
+		_hostname.c_str());
+	struct hostent	*hp = gethostbyname(_hostname.c_str());
 	if (NULL == hp) {
 		std::string	msg = stringprintf("cannot resolve '%s': %s",
-			hostname.c_str(), strerror(errno));
+			_hostname.c_str(), strerror(errno));
 		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
 		throw std::runtime_error(msg);
 	}
@@ -87,95 +142,73 @@ solivia_meter::solivia_meter(const configuration& config, messagequeue& queue)
 	memcpy(&(_addr.sin_addr), hp->h_addr, hp->h_length);
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "copied %d address bytes, %s:%hd",
 		hp->h_length, inet_ntoa(_addr.sin_addr), ntohs(_addr.sin_port));
-
-	// compute the solivia checksum
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "compute the request CRC");
-	boost::crc_16_type	crc;
-	crc.process_bytes(_request + 1, 5);
-	unsigned short	c = crc.checksum();
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "crc: %04x", c);
-	_request[6] = (c & 0xff);
-	_request[7] = (c >> 8) & 0xff;
-	std::string	p;
-	for (unsigned int i = 0; i < sizeof(_request); i++) {
-		p = p + stringprintf(" %02x", _request[i]);
-	}
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "request packet: %s", p.c_str());
-
-	// start the thread
-	startthread();
 }
 
 /**
- * \brief Destructor for the solivia meter class
+ * \brief Close the sockets
  */
-solivia_meter::~solivia_meter() {
+void	solivia_meter::closesockets() {
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "closing the socket");
-	stopthread();
-	close(_receive_fd);
-	_receive_fd = -1;
-}
-
-/**
- * \brief Get an unsigned short from a certain offset in the data packet
- *
- * \param offset	offset
- */
-unsigned short solivia_meter::shortat(unsigned int offset) const {
-	unsigned short	result = _packet[offset];
-	result <<= 8;
-	result += _packet[offset + 1];
-	return result;
-}
-
-/**
- * \brief Get a float from the packet at a certain offest
- *
- * \param offset	the offset where to get the number
- * \param scale		factor to rescale the number
- */
-float	solivia_meter::floatat(unsigned int offset, float scale) const {
-	return scale * shortat(offset);
+	if (_receive_fd >= 0) {
+		close(_receive_fd);
+		_receive_fd = -1;
+	}
+	if (_send_fd >= 0) {
+		close(_send_fd);
+		_send_fd = -1;
+	}
 }
 
 /**
- * \brief Extract a string of a given length from the packet
- *
- * \param offset	offset of the string in the packet
- * \param length	the length of the string
+ * \brief Rebind the sockets, used by the supervisor after a stall
  */
-std::string	solivia_meter::stringat(unsigned int offset, size_t length) const {
-	return std::string((const char *)(_packet + offset), length);
+void	solivia_meter::reconnect() {
+	closesockets();
+	setupsockets();
 }
 
 /**
- * \brief Extract a version string from two bytes at a given offset
- *
- * \param offset	the offset of the version number
+ * \brief Destructor for the solivia meter class
  */
-std::string	solivia_meter::versionat(unsigned int offset) const {
-	return stringprintf("%d.%d", _packet[offset], _packet[offset + 1]);
+solivia_meter::~solivia_meter() {
+	stopthread();
+	closesockets();
 }
 
 /**
- * \brief Retrieve a float from 4 bytes at a given offset
+ * \brief Retrieve a packet from the capture
  *
- * \param offset	the offset of the number
- * \param scale		the scaling factor
+ * This consumes the datagrams recorded during one call to getpacket.
  */
-float	solivia_meter::longfloatat(unsigned int offset, float scale) const {
-	unsigned long	result = _packet[offset];
-	for (int i = 1; i <= 3; i++) {
-		result <<= 8;
-		result += _packet[offset + i];
+int	solivia_meter::replaypacket() {
+	const capture_record	*r;
+	while ((NULL != (r = _replay->peek()))
+		&& (capture_solivia == r->type)) {
+		capture_record	datagram = _replay->next();
+		size_t	size = std::min(datagram.data.size(),
+			(size_t)solivia_packet::packetsize);
+		memcpy(_packet.data(), datagram.data.data(), size);
+		if (_packet.check(datagram.data.size(), _id)) {
+			return 1;
+		}
 	}
-	return scale * result;
+	debug(LOG_ERR, DEBUG_LOG, 0, "no packet in capture");
+	return 0;
 }
 
 /**
- * \brief Retrieve a packet
+ * \brief Retrieve a packet
  */
 int	solivia_meter::getpacket() {
+	if (replaying()) {
+		return replaypacket();
+	}
+	static histogram&	latency = metrics::newhistogram(
+		"powermeter_meter_poll_seconds{meter=\"solivia\"}",
+		"Time from request to response of a meter");
+	std::chrono::steady_clock::time_point	start
+		= std::chrono::steady_clock::now();
+	tracespan	span(trace_poll_begin, trace_poll_end);
 	//debug(LOG_DEBUG, DEBUG_LOG, 0, "get a packet");
 	// send a packet
 	int	rc;
@@ -203,45 +236,30 @@ int	solivia_meter::getpacket() {
 		//	tv.tv_usec);
 		// read the packet
 		//debug(LOG_DEBUG, DEBUG_LOG, 0, "reading a packet");
-		rc = read(_receive_fd, _packet, packetsize);
+		rc = read(_receive_fd, _packet.data(),
+			solivia_packet::packetsize);
 		if (rc < 0) {
 			debug(LOG_ERR, DEBUG_LOG, 0, "cannot read packet: %s",
 				strerror(errno));
 			continue;
 		}
+		flightrecorder::record(trace_receive, rc);
 
-		// check packet size
-		if (rc != packetsize) {
-			debug(LOG_DEBUG, DEBUG_LOG, 0,
-				"wrong packet size (%d), skipping", rc);
-			continue;
-		}
-
-		// skip if this is a bad packet
-		if ((0x02 != stx()) || (0x06 != ack())) {
-			debug(LOG_ERR, DEBUG_LOG, 0, "incorrect packet "
-				"format, skipping");
-			continue;
-		}
-
-		// check the id
-		if (_id != id()) {
-			debug(LOG_ERR, DEBUG_LOG, 0, "ID mismatch, skipping");
-			continue;
+		// journal the raw datagram
+		if (_capture) {
+			_capture->record(capture_solivia,
+				std::chrono::system_clock::now(), _packet.data(),
+				rc);
 		}
 
-		// check the CRC
-		boost::crc_16_type	crc;
-		crc.process_bytes(_packet + 1, packetsize - 4);
-		if (crc.checksum() != crc()) {
-			debug(LOG_ERR, DEBUG_LOG, 0,
-				"bad backed CRC: %hu != %hu, ignoring",
-				crc.checksum(), crc());
+		// skip packets that are not valid
+		if (!_packet.check(rc, _id)) {
 			continue;
 		}
 
 		// if we get to this point, then we have a correct packet
 		// in the packet buffer
+		latency.observe(std::chrono::steady_clock::now() - start);
 		return 1;
 	}
 	// handle the case where select did not work
@@ -267,118 +285,84 @@ message	solivia_meter::integrate() {
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "integrate a message");
 	std::unique_lock<std::mutex>	lock(_mutex);
 
-	// compute the time for the next minute interval
-	std::chrono::system_clock::time_point   start
-		= std::chrono::system_clock::now();
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "start is %ld",
-		start.time_since_epoch().count());
-
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "seconds: %d",
-		start.time_since_epoch()
-		* std::chrono::system_clock::period::num
-		/ std::chrono::system_clock::period::den);
-
-	// round down to the start of the minute
-	std::chrono::seconds    startduration
-		= std::chrono::duration_cast<std::chrono::seconds>(
-			std::chrono::duration_cast<std::chrono::minutes>(
-			start.time_since_epoch()));
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "startduration is %ld",
-		startduration.count());
-	start = std::chrono::time_point<std::chrono::system_clock,
-		std::chrono::seconds>(startduration);
-
-	auto    end = start + std::chrono::seconds(60);
+	// the integration interval is the current window, unless a
+	// previous thread left a partial window
+	message&	result = openwindow();
+	auto    end = _windowend;
 	debug(LOG_DEBUG, DEBUG_LOG, 0, "start: %ld, end: %ld",
-		start.time_since_epoch().count(),
+		result.when().time_since_epoch().count(),
 		end.time_since_epoch().count());
 
-	// create the result
-	message result(start);
-	std::chrono::system_clock::time_point   previous = start;
-
 	// iterate until the end
-	std::chrono::system_clock::time_point   now;
 	int	counter = 0;
-	while ((now = std::chrono::system_clock::now()) < end) {
-		// compute the remaining time
-		std::chrono::duration<float>    remaining = end - now;
-		//debug(LOG_DEBUG, DEBUG_LOG, 0, "remaining: %.3f",
-		//	remaining.count());
-
-		// compute the largest possible interval we can wait
-		if (remaining > _interval) {
-			remaining = _interval;
-		}
-
-		// wait for the remaining time
-		//debug(LOG_DEBUG, DEBUG_LOG, 0, "waiting for %.3f",
-		//	remaining.count());
-		switch (_signal.wait_for(lock, remaining)) {
-		case std::cv_status::timeout:
-			//debug(LOG_DEBUG, DEBUG_LOG, 0, "timeout");
-			break;
-		case std::cv_status::no_timeout:
-			// this means we were signaled to interrup
-			//debug(LOG_DEBUG, DEBUG_LOG, 0, "wait interrupted");
-			std::string     msg("meter thread interrupted by signal");
-			debug(LOG_DEBUG, DEBUG_LOG, 0, "%s", msg.c_str());
-			throw std::runtime_error(msg);
-		}
+	while (windowactive(end)) {
+		// wait for the next sample
+		waitsample(lock, end);
 
 		// get a new packet
 		lock.unlock();
-		if (0 == getpacket()) {
+		int	rc = getpacket();
+		lock.lock();
+		if (0 == rc) {
 			debug(LOG_ERR, DEBUG_LOG, 0, "no packet, maybe lost, "
 				"trying next packet");
 			continue;
 		}
-		lock.lock();
 
 		// end time for this integration step
-		std::chrono::duration<float>    delta(std::chrono::system_clock::now() - previous);
+		std::chrono::system_clock::time_point	now = sampletime();
+		std::chrono::duration<float>    delta(now - _previous);
 		//debug(LOG_DEBUG, DEBUG_LOG, 0, "delta: %.3f", delta.count());
-		previous = std::chrono::system_clock::now();
+		_previous = now;
 
 		//debug(LOG_DEBUG, DEBUG_LOG, 0, "processing a packet");
 		counter++;
 
 		// accumulate the data
-		result.accumulate(delta, "phase1.voltage", phase1_voltage());
-		result.accumulate(delta, "phase1.current", phase1_current());
-		result.accumulate(delta, "phase1.power", phase1_power());
-		result.accumulate(delta, "phase1.frequency", phase1_frequency());
-
-		result.accumulate(delta, "phase2.voltage", phase2_voltage());
-		result.accumulate(delta, "phase2.current", phase2_current());
-		result.accumulate(delta, "phase2.power", phase2_power());
-		result.accumulate(delta, "phase2.frequency", phase2_frequency());
-
-		result.accumulate(delta, "phase3.voltage", phase3_voltage());
-		result.accumulate(delta, "phase3.current", phase3_current());
-		result.accumulate(delta, "phase3.power", phase3_power());
-		result.accumulate(delta, "phase3.frequency", phase3_frequency());
-
-		result.accumulate(delta, "string1.voltage", string1_voltage());
-		result.accumulate(delta, "string1.current", string1_current());
-		result.accumulate(delta, "string1.power", string1_power());
-
-		result.accumulate(delta, "string2.voltage", string2_voltage());
-		result.accumulate(delta, "string2.current", string2_current());
-		result.accumulate(delta, "string2.power", string2_power());
-
-		result.accumulate(delta, "inverter.power", power());
-		result.update("inverter.feedtime", feedtime());
-		result.update("inverter.energy", energy());
-		result.accumulate(delta, "inverter.temperature", temperature());
+		const solivia_packet&	p = _packet;
+		result.accumulate(delta, "phase1.voltage", p.phase1_voltage());
+		result.accumulate(delta, "phase1.current", p.phase1_current());
+		result.accumulate(delta, "phase1.power", p.phase1_power());
+		result.accumulate(delta, "phase1.frequency", p.phase1_frequency());
+
+		result.accumulate(delta, "phase2.voltage", p.phase2_voltage());
+		result.accumulate(delta, "phase2.current", p.phase2_current());
+		result.accumulate(delta, "phase2.power", p.phase2_power());
+		result.accumulate(delta, "phase2.frequency", p.phase2_frequency());
+
+		result.accumulate(delta, "phase3.voltage", p.phase3_voltage());
+		result.accumulate(delta, "phase3.current", p.phase3_current());
+		result.accumulate(delta, "phase3.power", p.phase3_power());
+		result.accumulate(delta, "phase3.frequency", p.phase3_frequency());
+
+		result.accumulate(delta, "string1.voltage", p.string1_voltage());
+		result.accumulate(delta, "string1.current", p.string1_current());
+		result.accumulate(delta, "string1.power", p.string1_power());
+
+		result.accumulate(delta, "string2.voltage", p.string2_voltage());
+		result.accumulate(delta, "string2.current", p.string2_current());
+		result.accumulate(delta, "string2.power", p.string2_power());
+
+		result.accumulate(delta, "inverter.power", p.power());
+		result.update("inverter.feedtime", p.feedtime());
+		result.update("inverter.energy", p.energy());
+		result.accumulate(delta, "inverter.temperature", p.temperature());
 	}
 
-        // when we get here, we are at the end of the interval, so we now
-        // have to extrapolate to the full minute
-        float   d = std::chrono::duration<double>(end - start).count();
-        debug(LOG_DEBUG, DEBUG_LOG, 0, "duration was %.6f", d);
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "window complete with %d packets",
+		counter);
 
-	float	factor = 1. / d;
+	// return the message
+	return closewindow();
+}
+
+/**
+ * \brief Convert the integrals of a window to averages
+ *
+ * \param result	the message of the window
+ * \param factor	the inverse of the time the integrals cover
+ */
+void	solivia_meter::finalize(message& result, float factor) {
 	result.finalize("phase1.voltage", factor);
 	result.finalize("phase1.current", factor);
 	result.finalize("phase1.power", factor);
@@ -404,12 +388,6 @@ message	solivia_meter::integrate() {
 
 	result.finalize("inverter.power", factor);
 	result.finalize("inverter.temperature", factor);
-
-	debug(LOG_DEBUG, DEBUG_LOG, 0, "message finalized with %d packets",
-		counter);
-
-	// return the message
-	return result;
 }
 
 } // namespace powermeter
@@ -0,0 +1,131 @@
+//
+// solivia_packet.cpp -- decoding of the packets sent by the Solivia inverter
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <solivia_packet.h>
+#include <debug.h>
+#include <format.h>
+#include <metrics.h>
+#include <flightrecorder.h>
+#include <boost/crc.hpp>
+
+namespace powermeter {
+
+/**
+ * \brief Get an unsigned short from a certain offset in the data packet
+ *
+ * \param offset	offset
+ */
+unsigned short solivia_packet::shortat(unsigned int offset) const {
+	unsigned short	result = _packet[offset];
+	result <<= 8;
+	result += _packet[offset + 1];
+	return result;
+}
+
+/**
+ * \brief Get a float from the packet at a certain offest
+ *
+ * \param offset	the offset where to get the number
+ * \param scale		factor to rescale the number
+ */
+float	solivia_packet::floatat(unsigned int offset, float scale) const {
+	return scale * shortat(offset);
+}
+
+/**
+ * \brief Extract a string of a given length from the packet
+ *
+ * \param offset	offset of the string in the packet
+ * \param length	the length of the string
+ */
+std::string	solivia_packet::stringat(unsigned int offset, size_t length) const {
+	return std::string((const char *)(_packet + offset), length);
+}
+
+/**
+ * \brief Extract a version string from two bytes at a given offset
+ *
+ * \param offset	the offset of the version number
+ */
+std::string	solivia_packet::versionat(unsigned int offset) const {
+	return stringprintf("%d.%d", _packet[offset], _packet[offset + 1]);
+}
+
+/**
+ * \brief Retrieve a float from 4 bytes at a given offset
+ *
+ * \param offset	the offset of the number
+ * \param scale		the scaling factor
+ */
+float	solivia_packet::longfloatat(unsigned int offset, float scale) const {
+	unsigned long	result = _packet[offset];
+	for (int i = 1; i <= 3; i++) {
+		result <<= 8;
+		result += _packet[offset + i];
+	}
+	return scale * result;
+}
+
+/**
+ * \brief Check whether the packet buffer contains a valid packet
+ *
+ * \param size		the number of bytes received
+ * \param expectedid	the id of the inverter the packet should come from
+ */
+bool	solivia_packet::check(int size, unsigned char expectedid) const {
+	static counter&	sizerejects = metrics::newcounter(
+		"powermeter_solivia_rejects_total{reason=\"size\"}",
+		"Solivia packets rejected");
+	static counter&	formatrejects = metrics::newcounter(
+		"powermeter_solivia_rejects_total{reason=\"format\"}",
+		"Solivia packets rejected");
+	static counter&	idrejects = metrics::newcounter(
+		"powermeter_solivia_rejects_total{reason=\"id\"}",
+		"Solivia packets rejected");
+	static counter&	crcrejects = metrics::newcounter(
+		"powermeter_solivia_rejects_total{reason=\"crc\"}",
+		"Solivia packets rejected");
+
+	// check packet size
+	if (size != packetsize) {
+		sizerejects.add();
+		flightrecorder::record(trace_reject, reject_size);
+		debug(LOG_DEBUG, DEBUG_LOG, 0,
+			"wrong packet size (%d), skipping", size);
+		return false;
+	}
+
+	// skip if this is a bad packet
+	if ((0x02 != stx()) || (0x06 != ack())) {
+		formatrejects.add();
+		flightrecorder::record(trace_reject, reject_format);
+		debug(LOG_ERR, DEBUG_LOG, 0, "incorrect packet "
+			"format, skipping");
+		return false;
+	}
+
+	// check the id
+	if (expectedid != id()) {
+		idrejects.add();
+		flightrecorder::record(trace_reject, reject_id);
+		debug(LOG_ERR, DEBUG_LOG, 0, "ID mismatch, skipping");
+		return false;
+	}
+
+	// check the CRC
+	boost::crc_16_type	crc;
+	crc.process_bytes(_packet + 1, packetsize - 4);
+	if (crc.checksum() != this->crc()) {
+		crcrejects.add();
+		flightrecorder::record(trace_reject, reject_crc);
+		debug(LOG_ERR, DEBUG_LOG, 0,
+			"bad backed CRC: %hu != %hu, ignoring",
+			crc.checksum(), this->crc());
+		return false;
+	}
+	return true;
+}
+
+} // namespace powermeter
@@ -0,0 +1,208 @@
+/*
+ * soliviaemu.cpp -- UDP emulator for the Solivia inverter gateway
+ *
+ * The emulator receives the 9 byte requests sent by the solivia meter
+ * and answers with a 164 byte packet built by the simulator. The answer
+ * goes to the address of the requester, but to the reply port, because
+ * the solivia meter listens on a different socket than it sends from.
+ *
+ * (c) 2023 Prof Dr Andreas Müller
+ */
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+#include <cstring>
+#include <getopt.h>
+#include <stdexcept>
+#include <simulator.h>
+#include <solivia_packet.h>
+#include <debug.h>
+#include <format.h>
+#include <configuration.h>
+#include <iostream>
+#include <random>
+#include <thread>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <boost/crc.hpp>
+#include <config.h>
+
+namespace powermeter {
+
+static struct option	longopts[] = {
+{ "corrupt",		required_argument,	NULL,		'c' },
+{ "debug",		no_argument,		NULL,		'd' },
+{ "help",		no_argument,		NULL,		'?' },
+{ "port",		required_argument,	NULL,		'p' },
+{ "replyport",		required_argument,	NULL,		'r' },
+{ "latency",		required_argument,	NULL,		'L' },
+{ "loss",		required_argument,	NULL,		'o' },
+{ "seed",		required_argument,	NULL,		'e' },
+{ "version",		no_argument,		NULL,		'V' },
+{ NULL,			0,			NULL,		 0  }
+};
+
+static void	usage(const char *progname) {
+	std::cout << progname << " [ options ]" << std::endl;
+	std::cout << std::endl;
+	std::cout << "UDP emulator for the Solivia inverter gateway" << std::endl;
+	std::cout << std::endl;
+	std::cout << "options:" << std::endl;
+	std::cout << "  -d,--debug          debug output" << std::endl;
+	std::cout << "  -p,--port=<p>       listen for requests on port <p> "
+		"(default 1471)" << std::endl;
+	std::cout << "  -r,--replyport=<p>  send responses to port <p> "
+		"(default 1471)" << std::endl;
+	std::cout << "  -L,--latency=<ms>   delay every response by <ms>"
+		<< std::endl;
+	std::cout << "  -o,--loss=<p>       drop responses with probability <p>"
+		<< std::endl;
+	std::cout << "  -c,--corrupt=<p>    corrupt the CRC with probability <p>"
+		<< std::endl;
+	std::cout << "  -e,--seed=<s>       seed for the simulator" << std::endl;
+}
+
+/**
+ * \brief Main method for the solivia emulator
+ *
+ * \param argc		number of arguments
+ * \param argv		argument strings
+ */
+int	main(int argc, char *argv[]) {
+	int	c;
+	configuration	config;
+	debug_set_ident("soliviaemu");
+	int	port = 1471;
+	int	replyport = 1471;
+	int	latency = 0;
+	float	loss = 0;
+	float	corrupt = 0;
+	while (EOF != (c = getopt_long(argc, argv, "c:dp:r:L:o:e:V",
+		longopts, NULL)))
+		switch (c) {
+		case 'c':
+			corrupt = std::stof(optarg);
+			break;
+		case 'd':
+			debuglevel = LOG_DEBUG;
+			break;
+		case 'p':
+			port = std::stoi(optarg);
+			break;
+		case 'r':
+			replyport = std::stoi(optarg);
+			break;
+		case 'L':
+			latency = std::stoi(optarg);
+			break;
+		case 'o':
+			loss = std::stof(optarg);
+			break;
+		case 'e':
+			config.set("seed", std::stoi(optarg));
+			break;
+		case 'V':
+			std::cout << "soliviaemu " << VERSION << std::endl;
+			return EXIT_SUCCESS;
+		case '?':
+			usage(argv[0]);
+			return EXIT_SUCCESS;
+		}
+
+	// simulator and random numbers for loss and corruption
+	unsigned int	seed = simulator::seed(config);
+	simulator	sim(std::chrono::system_clock::now(), seed);
+	std::mt19937	engine(seed);
+	std::uniform_real_distribution<float>	uniform(0, 1);
+
+	// create the socket
+	int	fd = socket(PF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		std::string	msg = stringprintf("cannot create socket: %s",
+			strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	struct sockaddr_in	sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sin_family = AF_INET;
+	sa.sin_port = htons(port);
+	sa.sin_addr.s_addr = INADDR_ANY;
+	if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) < 0) {
+		std::string	msg = stringprintf("cannot bind: %s",
+			strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	debug(LOG_INFO, DEBUG_LOG, 0, "listening on port %d", port);
+
+	unsigned char	request[64];
+	unsigned char	packet[solivia_packet::packetsize];
+	while (1) {
+		struct sockaddr_in	from;
+		socklen_t	fromlen = sizeof(from);
+		int	rc = recvfrom(fd, request, sizeof(request), 0,
+			(struct sockaddr *)&from, &fromlen);
+		if (rc < 0) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "cannot receive: %s",
+				strerror(errno));
+			continue;
+		}
+
+		// check the request
+		if ((rc != 9) || (request[0] != 0x02) || (request[1] != 0x05)) {
+			debug(LOG_DEBUG, DEBUG_LOG, 0, "not a request, skipping");
+			continue;
+		}
+		boost::crc_16_type	crc;
+		crc.process_bytes(request + 1, 5);
+		unsigned short	expected = request[6] | (request[7] << 8);
+		if (crc.checksum() != expected) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "bad request CRC, skipping");
+			continue;
+		}
+		unsigned char	id = request[2];
+
+		// build the response
+		sim.solivia(packet, id, std::chrono::system_clock::now());
+		if (uniform(engine) < corrupt) {
+			packet[solivia_packet::packetsize - 2] ^= 0xff;
+		}
+
+		// simulate latency and loss
+		if (latency > 0) {
+			std::this_thread::sleep_for(
+				std::chrono::milliseconds(latency));
+		}
+		if (uniform(engine) < loss) {
+			debug(LOG_DEBUG, DEBUG_LOG, 0, "dropping response");
+			continue;
+		}
+
+		// send it to the reply port of the requester
+		from.sin_port = htons(replyport);
+		if (sendto(fd, packet, sizeof(packet), 0,
+			(struct sockaddr *)&from, sizeof(from)) < 0) {
+			debug(LOG_ERR, DEBUG_LOG, 0, "cannot send response: %s",
+				strerror(errno));
+		}
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "response sent to %s:%d",
+			inet_ntoa(from.sin_addr), replyport);
+	}
+}
+
+} // namespace powermeter
+
+int	main(int argc, char *argv[]) {
+	try {
+		return powermeter::main(argc, argv);
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "soliviaemu main failed: %s",
+			x.what());
+	} catch (...) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "soliviaemu main failed");
+	}
+	return EXIT_FAILURE;
+}
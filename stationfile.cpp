@@ -0,0 +1,159 @@
+//
+// stationfile.cpp -- stations, sensors and fields from the XML station files
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <stationfile.h>
+#include <debug.h>
+#include <format.h>
+#include <stdexcept>
+#include <algorithm>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+
+namespace powermeter {
+
+/**
+ * \brief Get an attribute of an element as a string
+ */
+static std::string	attribute(xmlNodePtr node, const char *name) {
+	xmlChar	*value = xmlGetProp(node, (const xmlChar *)name);
+	if (NULL == value) {
+		return std::string();
+	}
+	std::string	result((const char *)value);
+	xmlFree(value);
+	return result;
+}
+
+/**
+ * \brief Get the text content of an element
+ */
+static std::string	content(xmlNodePtr node) {
+	xmlChar	*value = xmlNodeGetContent(node);
+	if (NULL == value) {
+		return std::string();
+	}
+	std::string	result((const char *)value);
+	xmlFree(value);
+	// strip white space
+	size_t	b = result.find_first_not_of(" \t\r\n");
+	if (b == std::string::npos) {
+		return std::string();
+	}
+	size_t	e = result.find_last_not_of(" \t\r\n");
+	return result.substr(b, e - b + 1);
+}
+
+/**
+ * \brief Whether a node is an element with a given name
+ */
+static bool	iselement(xmlNodePtr node, const char *name) {
+	return (node->type == XML_ELEMENT_NODE)
+		&& (0 == xmlStrcmp(node->name, (const xmlChar *)name));
+}
+
+/**
+ * \brief Read the stations from an XML station file
+ *
+ * \param filename	the name of the XML file
+ */
+stationfile::stationfile(const std::string& filename) {
+	xmlDocPtr	doc = xmlReadFile(filename.c_str(), NULL, XML_PARSE_NONET);
+	if (NULL == doc) {
+		std::string	msg = stringprintf("cannot parse station file %s",
+			filename.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	xmlNodePtr	root = xmlDocGetRootElement(doc);
+	for (xmlNodePtr st = root ? root->children : NULL; st; st = st->next) {
+		if (!iselement(st, "station")) {
+			continue;
+		}
+		std::string	stationname = attribute(st, "name");
+		sensormap&	sensors = _stations[stationname];
+		for (xmlNodePtr ss = st->children; ss; ss = ss->next) {
+			if (!iselement(ss, "sensors")) {
+				continue;
+			}
+			for (xmlNodePtr se = ss->children; se; se = se->next) {
+				if (!iselement(se, "sensor")) {
+					continue;
+				}
+				std::vector<std::string>&	fields
+					= sensors[attribute(se, "name")];
+				for (xmlNodePtr f = se->children; f;
+					f = f->next) {
+					if (iselement(f, "field")) {
+						fields.push_back(content(f));
+					}
+				}
+			}
+		}
+		debug(LOG_DEBUG, DEBUG_LOG, 0, "station %s has %zu sensors",
+			stationname.c_str(), sensors.size());
+	}
+	xmlFreeDoc(doc);
+	if (_stations.size() == 0) {
+		std::string	msg = stringprintf("no station in %s",
+			filename.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+}
+
+/**
+ * \brief Names of all stations in the file
+ */
+std::vector<std::string>	stationfile::stations() const {
+	std::vector<std::string>	result;
+	for (auto i = _stations.begin(); i != _stations.end(); i++) {
+		result.push_back(i->first);
+	}
+	return result;
+}
+
+/**
+ * \brief The sensors of a station with their fields
+ *
+ * \param stationname	the name of the station
+ */
+const stationfile::sensormap&	stationfile::sensors(
+		const std::string& stationname) const {
+	auto	i = _stations.find(stationname);
+	if (i == _stations.end()) {
+		std::string	msg = stringprintf("station %s not in station "
+			"file", stationname.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	return i->second;
+}
+
+/**
+ * \brief Whether a station has a sensor with a field
+ *
+ * \param stationname	the name of the station
+ * \param sfname	name of the form sensor.field
+ */
+bool	stationfile::has(const std::string& stationname,
+		const std::string& sfname) const {
+	auto	i = _stations.find(stationname);
+	if (i == _stations.end()) {
+		return false;
+	}
+	size_t	l = sfname.find('.');
+	if (l == std::string::npos) {
+		return false;
+	}
+	auto	j = i->second.find(sfname.substr(0, l));
+	if (j == i->second.end()) {
+		return false;
+	}
+	std::string	field = sfname.substr(l + 1);
+	return (std::find(j->second.begin(), j->second.end(), field)
+		!= j->second.end());
+}
+
+} // namespace powermeter
@@ -0,0 +1,37 @@
+//
+// stationfile.h -- stations, sensors and fields from the XML station files
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _stationfile_h
+#define _stationfile_h
+
+#include <map>
+#include <string>
+#include <vector>
+
+namespace powermeter {
+
+/**
+ * \brief The station part of a meteo XML file like etc/solivia.xml
+ *
+ * Only the station names and the sensors element of each station are
+ * read, a sensor element lists the field elements the sensor delivers.
+ * All other elements (database, averages, graphs) are ignored.
+ */
+class stationfile {
+public:
+	typedef std::map<std::string, std::vector<std::string> >	sensormap;
+private:
+	std::map<std::string, sensormap>	_stations;
+public:
+	stationfile(const std::string& filename);
+	std::vector<std::string>	stations() const;
+	const sensormap&	sensors(const std::string& stationname) const;
+	bool	has(const std::string& stationname,
+			const std::string& sfname) const;
+};
+
+} // namespace powermeter
+
+#endif /* _stationfile_h */
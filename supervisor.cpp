@@ -0,0 +1,243 @@
+//
+// supervisor.cpp -- heartbeats and restart of stalled components
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <supervisor.h>
+#include <metrics.h>
+#include <debug.h>
+#include <format.h>
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <csignal>
+#include <thread>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace powermeter {
+
+//////////////////////////////////////////////////////////////////////
+// heartbeat implementation
+//////////////////////////////////////////////////////////////////////
+
+heartbeat::heartbeat() : _idle(false) {
+	beat();
+}
+
+/**
+ * \brief Record progress of the component
+ */
+void	heartbeat::beat() {
+	_last = std::chrono::steady_clock::now().time_since_epoch().count();
+	_idle = false;
+}
+
+/**
+ * \brief Declare that the component waits for work
+ */
+void	heartbeat::idle() {
+	_idle = true;
+}
+
+/**
+ * \brief Time since the last beat
+ */
+std::chrono::duration<float>	heartbeat::age() const {
+	std::chrono::steady_clock::duration	last(_last.load());
+	return std::chrono::steady_clock::now()
+		- std::chrono::steady_clock::time_point(last);
+}
+
+//////////////////////////////////////////////////////////////////////
+// supervisor implementation
+//////////////////////////////////////////////////////////////////////
+
+// set from the signal handler, so it has to be lock free
+static std::atomic<bool>	stoprequested(false);
+
+/**
+ * \brief Create a supervisor
+ *
+ * \param config	configuration containing the restart limits
+ */
+supervisor::supervisor(const configuration& config)
+	: _maxrestarts(config.intvalue("supervisorrestarts", 5)),
+	  _restartwindow(config.intvalue("supervisorwindow", 3600)),
+	  _watchdog(0) {
+	const char	*socket = getenv("NOTIFY_SOCKET");
+	if (NULL != socket) {
+		_notifysocket = socket;
+	}
+	// the watchdog applies to us only if the pid matches
+	const char	*usec = getenv("WATCHDOG_USEC");
+	const char	*pid = getenv("WATCHDOG_PID");
+	if ((NULL != usec) && ((NULL == pid) || (atoi(pid) == getpid()))) {
+		_watchdog = std::chrono::microseconds(atoll(usec));
+		debug(LOG_INFO, DEBUG_LOG, 0, "systemd watchdog every %.1fs",
+			_watchdog.count() / 1000000.);
+	}
+}
+
+/**
+ * \brief Add a component to watch
+ *
+ * \param name		name of the component, used in the log and metrics
+ * \param alive		the heartbeat of the component
+ * \param timeout	how long the component may go without a beat
+ * \param restart	function to restart the component
+ */
+void	supervisor::watch(const std::string& name, heartbeat& alive,
+		const std::chrono::duration<float>& timeout,
+		std::function<void()> restart) {
+	counter&	c = metrics::newcounter(
+		"powermeter_restarts_total{component=\"" + name + "\"}",
+		"Restarts of stalled components by the supervisor");
+	_components.push_back(component(name, alive, timeout, restart, c));
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "supervising %s, timeout %.0fs",
+		name.c_str(), timeout.count());
+}
+
+/**
+ * \brief Send a state notification to systemd
+ *
+ * This implements the sd_notify protocol directly, so we do not depend
+ * on libsystemd.
+ *
+ * \param state		the state string, e.g. READY=1
+ */
+void	supervisor::notify(const std::string& state) {
+	if (_notifysocket.size() == 0) {
+		return;
+	}
+	struct sockaddr_un	sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (_notifysocket.size() >= sizeof(sa.sun_path)) {
+		return;
+	}
+	memcpy(sa.sun_path, _notifysocket.data(), _notifysocket.size());
+	// a leading @ denotes an abstract socket
+	if ('@' == sa.sun_path[0]) {
+		sa.sun_path[0] = '\0';
+	}
+	socklen_t	length = offsetof(struct sockaddr_un, sun_path)
+				+ _notifysocket.size();
+	int	fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		debug(LOG_ERR, DEBUG_LOG, DEBUG_ERRNO, "cannot create "
+			"notify socket");
+		return;
+	}
+	// never block the supervisor on a notify socket nobody reads
+	if (sendto(fd, state.data(), state.size(),
+		MSG_NOSIGNAL | MSG_DONTWAIT,
+		(struct sockaddr *)&sa, length) < 0) {
+		debug(LOG_ERR, DEBUG_LOG, DEBUG_ERRNO, "cannot notify %s",
+			state.c_str());
+	}
+	close(fd);
+}
+
+/**
+ * \brief Tell systemd that the daemon is up
+ */
+void	supervisor::ready() {
+	notify("READY=1");
+}
+
+/**
+ * \brief Restart a component if its heartbeat is too old
+ *
+ * \param c	the component to check
+ */
+void	supervisor::check(component& c) {
+	if (c.alive.isidle()) {
+		return;
+	}
+	std::chrono::duration<float>	age = c.alive.age();
+	if (age <= c.timeout) {
+		return;
+	}
+
+	// give up if restarting does not help
+	std::chrono::steady_clock::time_point	now
+		= std::chrono::steady_clock::now();
+	while ((c.restarts.size() > 0)
+		&& (now - c.restarts.front() > _restartwindow)) {
+		c.restarts.pop_front();
+	}
+	if ((int)c.restarts.size() >= _maxrestarts) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s restarted %d times in %lds, "
+			"giving up", c.name.c_str(), _maxrestarts,
+			(long)_restartwindow.count());
+		abort();
+	}
+
+	debug(LOG_ERR, DEBUG_LOG, 0, "no heartbeat from %s for %.0fs, "
+		"restarting it", c.name.c_str(), age.count());
+	c.restarts.push_back(now);
+	c.restartcounter.add();
+	try {
+		c.restart();
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "cannot restart %s: %s",
+			c.name.c_str(), x.what());
+	}
+	// give the component a full timeout to recover
+	c.alive.beat();
+}
+
+/**
+ * \brief Ask the supervisor to return from run
+ *
+ * This only sets a flag, so it may be called from a signal handler.
+ */
+void	supervisor::stop() {
+	stoprequested = true;
+}
+
+static void	stophandler(int /* sig */) {
+	supervisor::stop();
+}
+
+/**
+ * \brief Stop the supervisor on SIGTERM and SIGINT
+ */
+void	supervisor::catchsignals() {
+	struct sigaction	sa;
+	memset(&sa, 0, sizeof(sa));
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = stophandler;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+}
+
+/**
+ * \brief Watch the components until stop is called
+ */
+void	supervisor::run() {
+	std::chrono::duration<float>	period(1);
+	if ((_watchdog.count() > 0) && (_watchdog / 2 < period)) {
+		period = _watchdog / 2;
+	}
+	while (!stoprequested) {
+		std::this_thread::sleep_for(period);
+		if (stoprequested) {
+			break;
+		}
+		for (auto c = _components.begin(); c != _components.end();
+			c++) {
+			check(*c);
+		}
+		if (_watchdog.count() > 0) {
+			notify("WATCHDOG=1");
+		}
+	}
+	debug(LOG_INFO, DEBUG_LOG, 0, "stop requested");
+	notify("STOPPING=1");
+}
+
+} // namespace powermeter
@@ -0,0 +1,91 @@
+//
+// supervisor.h -- heartbeats and restart of stalled components
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _supervisor_h
+#define _supervisor_h
+
+#include <configuration.h>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <list>
+#include <string>
+
+namespace powermeter {
+
+class counter;
+
+/**
+ * \brief Proof of life of a component thread
+ *
+ * A component beats whenever it makes progress. While it waits for
+ * work that may take arbitrarily long to arrive, it declares itself
+ * idle, and the supervisor leaves it alone until the next beat.
+ */
+class heartbeat {
+	std::atomic<long long>	_last;
+	std::atomic<bool>	_idle;
+public:
+	heartbeat();
+	void	beat();
+	void	idle();
+	bool	isidle() const { return _idle; }
+	std::chrono::duration<float>	age() const;
+};
+
+/**
+ * \brief Watch the heartbeats of the components and restart them
+ *
+ * A component that has not beaten for longer than its timeout is
+ * restarted with its restart function, which only touches that
+ * component. If a component needs more than supervisorrestarts
+ * restarts (default 5) within supervisorwindow seconds (default 3600),
+ * the supervisor gives up and aborts, so that the service manager
+ * restarts the whole daemon.
+ *
+ * When started by systemd with NOTIFY_SOCKET set, the supervisor sends
+ * READY=1 when ready is called, and WATCHDOG=1 at half the interval
+ * given in WATCHDOG_USEC, so that WatchdogSec= catches a supervisor
+ * that hangs itself.
+ *
+ * The run method returns when stop is called or, once catchsignals has
+ * been called, when the process receives SIGTERM or SIGINT.
+ */
+class supervisor {
+	struct component {
+		std::string	name;
+		heartbeat&	alive;
+		std::chrono::duration<float>	timeout;
+		std::function<void()>	restart;
+		std::deque<std::chrono::steady_clock::time_point>	restarts;
+		counter&	restartcounter;
+		component(const std::string& n, heartbeat& h,
+			const std::chrono::duration<float>& t,
+			std::function<void()> r, counter& c)
+			: name(n), alive(h), timeout(t), restart(r),
+			  restartcounter(c) { }
+	};
+	std::list<component>	_components;
+	int	_maxrestarts;
+	std::chrono::seconds	_restartwindow;
+	std::string	_notifysocket;
+	std::chrono::microseconds	_watchdog;
+	void	check(component& c);
+	void	notify(const std::string& state);
+public:
+	supervisor(const configuration& config);
+	void	watch(const std::string& name, heartbeat& alive,
+			const std::chrono::duration<float>& timeout,
+			std::function<void()> restart);
+	void	ready();
+	void	run();
+	static void	stop();
+	static void	catchsignals();
+};
+
+} // namespace powermeter
+
+#endif /* _supervisor_h */
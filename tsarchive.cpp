@@ -0,0 +1,325 @@
+//
+// tsarchive.cpp -- append only archive of compressed time series
+//
+// The data file starts with a block sized header containing the magic
+// string, block n is at offset (n + 1) * blocksize. The index file
+// starts with the magic string, followed by one entry per block:
+// name (40 bytes, NUL padded), count (2), reserved (6), first (8) and
+// last (8) time key, all integers little endian.
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <tsarchive.h>
+#include <debug.h>
+#include <format.h>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace powermeter {
+
+static const char	magic[8] = { 'P', 'M', 'T', 'S', 'A', '0', '1', '\n' };
+static const size_t	entrysize = 64;
+static const size_t	blocksize = gorilla_block::blocksize;
+
+static void	put(unsigned char *p, uint64_t value, int bytes) {
+	for (int i = 0; i < bytes; i++) {
+		p[i] = value & 0xff;
+		value >>= 8;
+	}
+}
+
+static uint64_t	get(const unsigned char *p, int bytes) {
+	uint64_t	result = 0;
+	for (int i = bytes - 1; i >= 0; i--) {
+		result = (result << 8) | p[i];
+	}
+	return result;
+}
+
+static int	openfile(const std::string& filename, bool writable) {
+	int	fd = open(filename.c_str(),
+		(writable) ? (O_CREAT | O_RDWR) : O_RDONLY, 0666);
+	if (fd < 0) {
+		std::string	msg = stringprintf("cannot open %s: %s",
+			filename.c_str(), strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	return fd;
+}
+
+static void	writeall(int fd, const void *data, size_t length, off_t offset) {
+	if (pwrite(fd, data, length, offset) != (ssize_t)length) {
+		std::string	msg = stringprintf("cannot write archive: %s",
+			strerror(errno));
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+}
+
+/**
+ * \brief Open an archive
+ *
+ * An archive opened for writing is created if it does not exist, and
+ * the last block of each series is loaded so that appending continues
+ * where it stopped.
+ *
+ * \param filename	name of the data file, the index is filename.idx
+ * \param writable	whether to open the archive for appending
+ */
+tsarchive::tsarchive(const std::string& filename, bool writable)
+	: _filename(filename), _writable(writable), _indexfd(-1) {
+	_datafd = openfile(_filename, _writable);
+	try {
+		_indexfd = openfile(_filename + ".idx", _writable);
+		readindex();
+	} catch (...) {
+		close(_datafd);
+		if (_indexfd >= 0) {
+			close(_indexfd);
+		}
+		throw;
+	}
+	debug(LOG_DEBUG, DEBUG_LOG, 0, "archive %s: %lu blocks, %lu series",
+		_filename.c_str(), _index.size(), _current.size());
+}
+
+/**
+ * \brief Write pending blocks and close the archive
+ */
+tsarchive::~tsarchive() {
+	try {
+		flush();
+	} catch (const std::exception& x) {
+		debug(LOG_ERR, DEBUG_LOG, 0, "cannot flush archive: %s",
+			x.what());
+	}
+	close(_datafd);
+	close(_indexfd);
+}
+
+/**
+ * \brief Read the index and the last block of every series
+ */
+void	tsarchive::readindex() {
+	struct stat	sb;
+	if (fstat(_indexfd, &sb) < 0) {
+		throw std::runtime_error("cannot stat archive index");
+	}
+
+	// a new archive only needs the headers
+	if (sb.st_size == 0) {
+		if (!_writable) {
+			throw std::runtime_error("empty archive");
+		}
+		unsigned char	header[blocksize];
+		memset(header, 0, sizeof(header));
+		memcpy(header, magic, sizeof(magic));
+		writeall(_datafd, header, blocksize, 0);
+		writeall(_indexfd, magic, sizeof(magic), 0);
+		return;
+	}
+
+	// read the complete index, ignoring an incomplete last entry
+	std::vector<unsigned char>	data(sb.st_size);
+	if (pread(_indexfd, data.data(), data.size(), 0)
+		!= (ssize_t)data.size()) {
+		throw std::runtime_error("cannot read archive index");
+	}
+	if ((data.size() < sizeof(magic))
+		|| (0 != memcmp(data.data(), magic, sizeof(magic)))) {
+		std::string	msg = stringprintf("%s is not an archive",
+			_filename.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	size_t	n = (data.size() - sizeof(magic)) / entrysize;
+	_index.resize(n);
+	for (size_t i = 0; i < n; i++) {
+		const unsigned char	*p = data.data() + sizeof(magic)
+						+ i * entrysize;
+		blockinfo&	b = _index[i];
+		b.name = std::string((const char *)p,
+			strnlen((const char *)p, maxnamelength + 1));
+		b.count = get(p + 40, 2);
+		b.first = get(p + 48, 8);
+		b.last = get(p + 56, 8);
+		_current[b.name] = i;
+	}
+	if (!_writable) {
+		return;
+	}
+
+	// the block contents are authoritative for the last blocks
+	unsigned char	buffer[blocksize];
+	for (auto c = _current.begin(); c != _current.end(); c++) {
+		memset(buffer, 0, sizeof(buffer));
+		ssize_t	rc = pread(_datafd, buffer, blocksize,
+			(c->second + 1) * blocksize);
+		if (rc < 0) {
+			throw std::runtime_error("cannot read archive block");
+		}
+		gorilla_block	block(buffer);
+		_blocks[c->first] = block;
+		blockinfo&	b = _index[c->second];
+		b.count = block.count();
+		b.first = block.first();
+		b.last = block.last();
+	}
+}
+
+/**
+ * \brief Write the index entry of a block
+ *
+ * \param block	the block number
+ */
+void	tsarchive::writeindex(size_t block) {
+	const blockinfo&	b = _index[block];
+	unsigned char	entry[entrysize];
+	memset(entry, 0, sizeof(entry));
+	memcpy(entry, b.name.data(), b.name.size());
+	put(entry + 40, b.count, 2);
+	put(entry + 48, b.first, 8);
+	put(entry + 56, b.last, 8);
+	writeall(_indexfd, entry, entrysize, sizeof(magic) + block * entrysize);
+}
+
+/**
+ * \brief Start a new block for a series
+ *
+ * The block that is replaced never changes again. If it has not been
+ * written yet, its data is written now, because flush only has the
+ * current block of each series in memory. Its index entry stays dirty
+ * and is written by the next flush, after the data.
+ *
+ * \param name	the name of the series
+ */
+void	tsarchive::newblock(const std::string& name) {
+	auto	c = _current.find(name);
+	if ((c != _current.end()) && (_dirty.count(c->second) > 0)) {
+		writeall(_datafd, _blocks[name].data(), blocksize,
+			(c->second + 1) * blocksize);
+	}
+	blockinfo	b;
+	b.name = name;
+	b.count = 0;
+	b.first = 0;
+	b.last = 0;
+	_index.push_back(b);
+	_current[name] = _index.size() - 1;
+	_blocks[name] = gorilla_block();
+}
+
+/**
+ * \brief Append a point to a series
+ *
+ * The point is only written to the files by the next flush. A point
+ * that is older than the last point of the series starts a new block.
+ *
+ * \param name		the name of the series
+ * \param timekey	the time of the point
+ * \param value		the value of the point
+ */
+void	tsarchive::append(const std::string& name, int64_t timekey,
+		float value) {
+	if (!_writable) {
+		throw std::runtime_error("archive not writable");
+	}
+	if (name.size() > maxnamelength) {
+		std::string	msg = stringprintf("series name too long: %s",
+			name.c_str());
+		debug(LOG_ERR, DEBUG_LOG, 0, "%s", msg.c_str());
+		throw std::runtime_error(msg);
+	}
+	auto	c = _current.find(name);
+	if ((c == _current.end()) || ((_blocks[name].count() > 0)
+		&& (timekey < _blocks[name].last()))) {
+		newblock(name);
+	}
+	gorilla_block	*block = &_blocks[name];
+	if (!block->append(timekey, value)) {
+		newblock(name);
+		block = &_blocks[name];
+		block->append(timekey, value);
+	}
+	size_t	i = _current[name];
+	_index[i].count = block->count();
+	_index[i].first = block->first();
+	_index[i].last = block->last();
+	_dirty.insert(i);
+}
+
+/**
+ * \brief Write all modified blocks and their index entries
+ *
+ * Blocks are written before their index entries, so the index never
+ * refers to data that is not in the data file. Dirty blocks that are
+ * no longer current have been written by newblock already.
+ */
+void	tsarchive::flush() {
+	for (auto d = _dirty.begin(); d != _dirty.end(); d++) {
+		const blockinfo&	b = _index[*d];
+		if (_current[b.name] != *d) {
+			continue;
+		}
+		writeall(_datafd, _blocks[b.name].data(), blocksize,
+			(*d + 1) * blocksize);
+	}
+	for (auto d = _dirty.begin(); d != _dirty.end(); d++) {
+		writeindex(*d);
+	}
+	_dirty.clear();
+}
+
+/**
+ * \brief The names of all series in the archive
+ */
+std::vector<std::string>	tsarchive::names() const {
+	std::vector<std::string>	result;
+	for (auto c = _current.begin(); c != _current.end(); c++) {
+		result.push_back(c->first);
+	}
+	return result;
+}
+
+/**
+ * \brief Retrieve the points of a series in a time range
+ *
+ * \param name		the name of the series
+ * \param from		the first time key to include
+ * \param to		the last time key to include
+ */
+std::vector<tspoint>	tsarchive::points(const std::string& name,
+		int64_t from, int64_t to) {
+	std::vector<tspoint>	result;
+	unsigned char	buffer[blocksize];
+	for (size_t i = 0; i < _index.size(); i++) {
+		const blockinfo&	b = _index[i];
+		if ((b.name != name) || (b.count == 0) || (b.last < from)
+			|| (b.first > to)) {
+			continue;
+		}
+		std::vector<tspoint>	p;
+		if (_writable && (_current[name] == i)) {
+			p = _blocks[name].points();
+		} else {
+			if (pread(_datafd, buffer, blocksize, (i + 1) * blocksize)
+				!= (ssize_t)blocksize) {
+				throw std::runtime_error("cannot read block");
+			}
+			p = gorilla_block::decode(buffer);
+		}
+		for (auto j = p.begin(); j != p.end(); j++) {
+			if ((j->timekey >= from) && (j->timekey <= to)) {
+				result.push_back(*j);
+			}
+		}
+	}
+	return result;
+}
+
+} // namespace powermeter
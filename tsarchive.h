@@ -0,0 +1,62 @@
+//
+// tsarchive.h -- append only archive of compressed time series
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _tsarchive_h
+#define _tsarchive_h
+
+#include <gorilla.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+namespace powermeter {
+
+/**
+ * \brief Archive of the time series of all values of a station
+ *
+ * Every value name (sensor.field) is a series. The points of a series
+ * are stored in fixed size gorilla blocks in the data file, blocks of
+ * different series are interleaved in the order in which they were
+ * started. The index file has a 64 byte entry for each block with the
+ * series name, the number of points and the first and last time key,
+ * so a query only reads the blocks it needs. Only the last block of
+ * each series is ever rewritten, all other blocks are immutable.
+ */
+class tsarchive {
+public:
+	static const size_t	maxnamelength = 39;
+	struct blockinfo {
+		std::string	name;
+		unsigned short	count;
+		int64_t	first;
+		int64_t	last;
+	};
+private:
+	std::string	_filename;
+	bool	_writable;
+	int	_datafd;
+	int	_indexfd;
+	std::vector<blockinfo>	_index;
+	std::map<std::string, size_t>	_current;
+	std::map<std::string, gorilla_block>	_blocks;
+	std::set<size_t>	_dirty;
+	void	readindex();
+	void	writeindex(size_t block);
+	void	newblock(const std::string& name);
+public:
+	tsarchive(const std::string& filename, bool writable = false);
+	~tsarchive();
+	const std::vector<blockinfo>&	index() const { return _index; }
+	std::vector<std::string>	names() const;
+	void	append(const std::string& name, int64_t timekey, float value);
+	void	flush();
+	std::vector<tspoint>	points(const std::string& name,
+		int64_t from, int64_t to);
+};
+
+} // namespace powermeter
+
+#endif /* _tsarchive_h */
@@ -0,0 +1,36 @@
+//
+// tsarchive_sink.cpp
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#include <tsarchive_sink.h>
+#include <debug.h>
+
+namespace powermeter {
+
+/**
+ * \brief Open the archive named by tsarchivefile for appending
+ *
+ * \param config	the configuration
+ */
+tsarchive_sink::tsarchive_sink(const configuration& config)
+	: sink("tsarchive"),
+	  _archive(config.stringvalue("tsarchivefile", "powermeter.pts"),
+		true) {
+}
+
+/**
+ * \brief Append the values of a message and write the modified blocks
+ *
+ * \param m	the message to store
+ */
+void	tsarchive_sink::store(const message& m) {
+	int64_t	timekey = std::chrono::duration_cast<std::chrono::seconds>(
+		m.when().time_since_epoch()).count();
+	for (auto i = m.begin(); i != m.end(); i++) {
+		_archive.append(i->first, timekey, i->second);
+	}
+	_archive.flush();
+}
+
+} // namespace powermeter
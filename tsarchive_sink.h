@@ -0,0 +1,27 @@
+//
+// tsarchive_sink.h -- sink writing messages to a compressed archive
+//
+// (c) 2023 Prof Dr Andreas Müller
+//
+#ifndef _tsarchive_sink_h
+#define _tsarchive_sink_h
+
+#include <sink.h>
+#include <tsarchive.h>
+#include <configuration.h>
+
+namespace powermeter {
+
+/**
+ * \brief Sink appending every value of a message to its time series
+ */
+class tsarchive_sink : public sink {
+	tsarchive	_archive;
+public:
+	tsarchive_sink(const configuration& config);
+	virtual void	store(const message& m);
+};
+
+} // namespace powermeter
+
+#endif /* _tsarchive_sink_h */